@@ -0,0 +1,180 @@
+/*
+ * Copyright © 2013 Intel Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+/*
+ * Measures decoder throughput: each batch given on the command line is
+ * decoded repeatedly with the output thrown away, and the rate is reported
+ * in packets per second.
+ */
+
+#define _GNU_SOURCE
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <err.h>
+
+#include "config.h"
+#include "intel_bufmgr.h"
+#include "decode_util.h"
+
+#define HW_OFFSET 0x12300000
+
+struct packet_count {
+	unsigned long packets;
+	/** Bytes of the current record's size field seen so far */
+	unsigned int size_len;
+	uint8_t size[4];
+	/** Bytes left to skip to the next record */
+	size_t skip;
+};
+
+static void
+usage(void)
+{
+	fprintf(stderr, "usage:\n");
+	fprintf(stderr, "  decode_bench [-n iterations] <batch>...\n");
+	exit(1);
+}
+
+static void
+discard_output(void *closure, const char *data, size_t size)
+{
+}
+
+/*
+ * Counts the records of a binary decode, which may be split anywhere
+ * between calls.
+ */
+static void
+count_packets(void *closure, const char *data, size_t size)
+{
+	struct packet_count *count = closure;
+
+	while (size) {
+		uint32_t record_size;
+		size_t n;
+
+		if (count->skip) {
+			n = count->skip < size ? count->skip : size;
+			count->skip -= n;
+			data += n;
+			size -= n;
+			continue;
+		}
+
+		count->size[count->size_len++] = *data++;
+		size--;
+		if (count->size_len < sizeof(count->size))
+			continue;
+
+		memcpy(&record_size, count->size, sizeof(record_size));
+		if (record_size < sizeof(struct drm_intel_decode_record))
+			errx(1, "corrupt decode record");
+		count->skip = record_size - sizeof(count->size);
+		count->size_len = 0;
+		count->packets++;
+	}
+}
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void
+bench_batch(const char *filename, int iterations)
+{
+	struct drm_intel_decode *ctx;
+	struct packet_count count;
+	uint32_t devid;
+	void *batch;
+	size_t size;
+	double start, elapsed;
+	int i;
+
+	decode_read_file(filename, &batch, &size);
+
+	devid = decode_infer_devid(filename);
+	if (devid == 0)
+		errx(1, "couldn't guess chipset id from batch filename `%s'",
+		     filename);
+
+	ctx = drm_intel_decode_context_alloc(devid);
+	if (ctx == NULL)
+		errx(1, "couldn't create decode context");
+	drm_intel_decode_set_batch_pointer(ctx, batch, HW_OFFSET, size / 4);
+
+	memset(&count, 0, sizeof(count));
+	drm_intel_decode_set_output_format(ctx, DRM_INTEL_DECODE_FORMAT_BINARY);
+	drm_intel_decode_set_output_func(ctx, count_packets, &count);
+	drm_intel_decode(ctx);
+
+	drm_intel_decode_set_output_format(ctx, DRM_INTEL_DECODE_FORMAT_TEXT);
+	drm_intel_decode_set_output_func(ctx, discard_output, NULL);
+	start = now();
+	for (i = 0; i < iterations; i++)
+		drm_intel_decode(ctx);
+	elapsed = now() - start;
+
+	printf("%-32s %6lu packets %10.0f packets/s %8.1f MB/s\n",
+	       filename, count.packets,
+	       count.packets * iterations / elapsed,
+	       (double)size * iterations / elapsed / 1e6);
+
+	drm_intel_decode_context_free(ctx);
+	munmap(batch, size);
+}
+
+int
+main(int argc, char **argv)
+{
+	int iterations = 1000;
+	int c;
+
+	while ((c = getopt(argc, argv, "n:")) != -1) {
+		switch (c) {
+		case 'n':
+			iterations = atoi(optarg);
+			break;
+		default:
+			usage();
+		}
+	}
+
+	if (optind >= argc || iterations < 1)
+		usage();
+
+	for (; optind < argc; optind++)
+		bench_batch(argv[optind], iterations);
+
+	return 0;
+}
@@ -0,0 +1,97 @@
+/*
+ * Copyright © 2013 Intel Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#define _GNU_SOURCE
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <err.h>
+
+#include "config.h"
+#include "intel_chipset.h"
+#include "decode_util.h"
+
+static const struct {
+	const char *name;
+	uint16_t devid;
+} chipsets[] = {
+	{ "830",  0x3577},
+	{ "855",  0x3582},
+	{ "945",  0x2772},
+	{ "gen4", 0x2a02 },
+	{ "gm45", 0x2a42 },
+	{ "gen5", PCI_CHIP_ILD_G },
+	{ "gen6", PCI_CHIP_SANDYBRIDGE_GT2 },
+	{ "gen7", PCI_CHIP_IVYBRIDGE_GT2 },
+	{ NULL, 0 },
+};
+
+void
+decode_read_file(const char *filename, void **ptr, size_t *size)
+{
+	int fd, ret;
+	struct stat st;
+
+	fd = open(filename, O_RDONLY);
+	if (fd == -1)
+		errx(1, "couldn't open `%s'", filename);
+
+	ret = fstat(fd, &st);
+	if (ret)
+		errx(1, "couldn't stat `%s'", filename);
+
+	*size = st.st_size;
+	*ptr = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	if (*ptr == MAP_FAILED)
+		errx(1, "couldn't map `%s'", filename);
+
+	close(fd);
+}
+
+uint32_t
+decode_infer_devid(const char *filename)
+{
+	int i;
+
+	for (i = 0; chipsets[i].name != NULL; i++) {
+		if (strstr(filename, chipsets[i].name))
+			return chipsets[i].devid;
+	}
+
+	return 0;
+}
+
+void
+decode_print_chipsets(FILE *out)
+{
+	int i;
+
+	for (i = 0; chipsets[i].name != NULL; i++)
+		fprintf(out, "  %s\n", chipsets[i].name);
+}
@@ -0,0 +1,48 @@
+/*
+ * Copyright © 2013 Intel Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+/*
+ * Helpers shared by the decoder tools: test_decode, decode_bench and
+ * parallel_decode.
+ */
+
+#ifndef DECODE_UTIL_H
+#define DECODE_UTIL_H
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Maps the whole file read-only, exiting with an error on failure. */
+void decode_read_file(const char *filename, void **ptr, size_t *size);
+
+/*
+ * Guesses the PCI ID of a batch from a chipset name in its file name,
+ * returning 0 if there is none.
+ */
+uint32_t decode_infer_devid(const char *filename);
+
+/* Lists the chipset names decode_infer_devid() understands. */
+void decode_print_chipsets(FILE *out);
+
+#endif /* DECODE_UTIL_H */
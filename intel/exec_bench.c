@@ -0,0 +1,254 @@
+/*
+ * Copyright © 2013 Intel Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+/*
+ * Measures execbuffer throughput with several threads sharing a bufmgr,
+ * each submitting empty batches that reference a number of BOs in its own
+ * hardware context.  Each thread count is run twice: with every submission
+ * behind one application mutex, as the bufmgr lock used to force, and
+ * with the threads free to submit in parallel.  Needs an i915 device.
+ */
+
+#define _GNU_SOURCE
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
+#include <err.h>
+
+#include "config.h"
+#include "intel_bufmgr.h"
+#include "i915_drm.h"
+
+#define MI_BATCH_BUFFER_END	(0xA << 23)
+
+struct submitter {
+	pthread_t thread;
+	drm_intel_context *ctx;
+	drm_intel_bo *batch;
+	drm_intel_bo **targets;
+	int failed;
+};
+
+static drm_intel_bufmgr *bufmgr;
+static pthread_barrier_t barrier;
+static pthread_mutex_t serialize = PTHREAD_MUTEX_INITIALIZER;
+static bool serialized;
+static int submissions = 10000;
+static int num_targets = 16;
+
+static void
+usage(void)
+{
+	fprintf(stderr, "usage:\n");
+	fprintf(stderr, "  exec_bench [-d device] [-t threads] [-n submissions] "
+		"[-b bos]\n");
+	exit(1);
+}
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * An empty batch, with relocations to the targets after its end so that
+ * the kernel has a validation list to process without anything to run.
+ */
+static void
+submitter_init(struct submitter *s)
+{
+	uint32_t *cmd;
+	int i;
+
+	s->ctx = drm_intel_gem_context_create(bufmgr);
+	if (s->ctx == NULL)
+		errx(1, "couldn't create a hardware context");
+
+	s->batch = drm_intel_bo_alloc(bufmgr, "batch", 4096, 4096);
+	s->targets = calloc(num_targets, sizeof(*s->targets));
+	if (s->batch == NULL || s->targets == NULL ||
+	    drm_intel_bo_map(s->batch, 1))
+		errx(1, "couldn't set up the batch");
+
+	cmd = s->batch->virtual;
+	memset(cmd, 0, 4096);
+	cmd[0] = MI_BATCH_BUFFER_END;
+	drm_intel_bo_unmap(s->batch);
+
+	for (i = 0; i < num_targets; i++) {
+		s->targets[i] = drm_intel_bo_alloc(bufmgr, "target", 4096, 4096);
+		if (s->targets[i] == NULL ||
+		    drm_intel_bo_emit_reloc(s->batch, 64 + i * 8,
+					    s->targets[i], 0,
+					    I915_GEM_DOMAIN_RENDER, 0))
+			errx(1, "couldn't set up the batch's relocations");
+	}
+}
+
+static void
+submitter_fini(struct submitter *s)
+{
+	int i;
+
+	drm_intel_bo_wait_rendering(s->batch);
+	drm_intel_bo_unreference(s->batch);
+	for (i = 0; i < num_targets; i++)
+		drm_intel_bo_unreference(s->targets[i]);
+	free(s->targets);
+	drm_intel_gem_context_destroy(s->ctx);
+}
+
+static void *
+submitter_run(void *arg)
+{
+	struct submitter *s = arg;
+	int i, ret;
+
+	pthread_barrier_wait(&barrier);
+
+	for (i = 0; i < submissions; i++) {
+		if (serialized)
+			pthread_mutex_lock(&serialize);
+		ret = drm_intel_gem_bo_context_exec(s->batch, s->ctx, 8,
+						    I915_EXEC_RENDER);
+		if (serialized)
+			pthread_mutex_unlock(&serialize);
+		if (ret) {
+			s->failed = ret;
+			break;
+		}
+	}
+
+	pthread_barrier_wait(&barrier);
+
+	return NULL;
+}
+
+static double
+run(struct submitter *s, int threads)
+{
+	double start, elapsed;
+	int i;
+
+	if (pthread_barrier_init(&barrier, NULL, threads + 1))
+		errx(1, "couldn't create a barrier");
+
+	for (i = 0; i < threads; i++) {
+		submitter_init(&s[i]);
+		if (pthread_create(&s[i].thread, NULL, submitter_run, &s[i]))
+			errx(1, "couldn't create a thread");
+	}
+
+	pthread_barrier_wait(&barrier);
+	start = now();
+	pthread_barrier_wait(&barrier);
+	elapsed = now() - start;
+
+	for (i = 0; i < threads; i++) {
+		pthread_join(s[i].thread, NULL);
+		if (s[i].failed)
+			errx(1, "execbuffer failed: %s", strerror(-s[i].failed));
+		submitter_fini(&s[i]);
+	}
+	pthread_barrier_destroy(&barrier);
+
+	return (double)submissions * threads / elapsed;
+}
+
+int
+main(int argc, char **argv)
+{
+	const char *device = "/dev/dri/card0";
+	struct submitter *s;
+	int max_threads = 4;
+	int threads, fd, c;
+
+	while ((c = getopt(argc, argv, "d:t:n:b:")) != -1) {
+		switch (c) {
+		case 'd':
+			device = optarg;
+			break;
+		case 't':
+			max_threads = atoi(optarg);
+			break;
+		case 'n':
+			submissions = atoi(optarg);
+			break;
+		case 'b':
+			num_targets = atoi(optarg);
+			break;
+		default:
+			usage();
+		}
+	}
+
+	if (max_threads < 1 || submissions < 1 || num_targets < 0 ||
+	    num_targets > 400)
+		usage();
+
+	fd = open(device, O_RDWR);
+	if (fd < 0)
+		err(1, "couldn't open %s", device);
+
+	bufmgr = drm_intel_bufmgr_gem_init(fd, 4096);
+	if (bufmgr == NULL)
+		errx(1, "couldn't create a bufmgr on %s", device);
+	drm_intel_bufmgr_gem_enable_reuse(bufmgr);
+
+	s = calloc(max_threads, sizeof(*s));
+	if (s == NULL)
+		errx(1, "out of memory");
+
+	printf("%d submissions per thread, %d BOs each\n",
+	       submissions, num_targets + 1);
+
+	for (threads = 1; threads <= max_threads; threads *= 2) {
+		double locked, parallel;
+
+		serialized = true;
+		locked = run(s, threads);
+		serialized = false;
+		parallel = run(s, threads);
+
+		printf("%2d threads: serialized %9.0f execs/s   "
+		       "parallel %9.0f execs/s\n",
+		       threads, locked, parallel);
+	}
+
+	free(s);
+	drm_intel_bufmgr_destroy(bufmgr);
+	close(fd);
+
+	return 0;
+}
@@ -0,0 +1,426 @@
+/*
+ * Copyright © 2013 Intel Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+
+#include "intel_aub_writer.h"
+
+/* write(2) mode: chunks are filled and handed to the thread to write out. */
+#define AUB_CHUNK_SIZE		(1024 * 1024)
+#define AUB_CHUNKS		4
+
+/* mmap mode: one window is filled while the other is being replaced. */
+#define AUB_WINDOW_SIZE		(4 * 1024 * 1024)
+#define AUB_WINDOWS		2
+
+struct aub_chunk {
+	struct aub_chunk *next;
+	char *data;
+	size_t used;
+};
+
+struct drm_intel_aub_writer {
+	int fd;
+	unsigned int flags;
+	size_t chunk_size;
+
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	/** Filled chunks waiting for the writer thread, oldest first */
+	struct aub_chunk *queue;
+	/** Chunks ready to be filled, in file order in mmap mode */
+	struct aub_chunk *free_list;
+	bool done;
+
+	/** Chunk being filled */
+	struct aub_chunk *current;
+	/** Bytes written to the file so far */
+	off_t size;
+	/** File offset of the next window to map (writer thread only) */
+	off_t map_offset;
+	bool error;
+
+	/** Staging for reservations that don't fit the current chunk */
+	char *bounce;
+	size_t bounce_size;
+
+	int num_chunks;
+	struct aub_chunk chunks[];
+};
+
+static void
+aub_chunk_list_append(struct aub_chunk **list, struct aub_chunk *chunk)
+{
+	while (*list)
+		list = &(*list)->next;
+	chunk->next = NULL;
+	*list = chunk;
+}
+
+static struct aub_chunk *
+aub_chunk_list_pop(struct aub_chunk **list)
+{
+	struct aub_chunk *chunk = *list;
+
+	*list = chunk->next;
+	chunk->next = NULL;
+	return chunk;
+}
+
+/**
+ * Allocates the file's blocks for a window before it is mapped, so that a
+ * full filesystem fails here rather than with SIGBUS on a store to the map.
+ */
+static bool
+aub_writer_allocate(struct drm_intel_aub_writer *writer, off_t offset,
+		    size_t size)
+{
+	static const char zeroes[4096];
+	ssize_t ret;
+	int err;
+
+	err = posix_fallocate(writer->fd, offset, size);
+	if (err == 0)
+		return true;
+	if (err != EINVAL && err != EOPNOTSUPP)
+		return false;
+
+	/* Not supported here; write the blocks out instead. */
+	while (size) {
+		size_t len = size < sizeof(zeroes) ? size : sizeof(zeroes);
+
+		ret = pwrite(writer->fd, zeroes, len, offset);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return false;
+		}
+		offset += ret;
+		size -= ret;
+	}
+
+	return true;
+}
+
+static bool
+aub_writer_map_window(struct drm_intel_aub_writer *writer,
+		      struct aub_chunk *chunk)
+{
+	void *data;
+
+	chunk->data = NULL;
+	chunk->used = 0;
+
+	if (!aub_writer_allocate(writer, writer->map_offset,
+				 writer->chunk_size))
+		return false;
+
+	data = mmap(NULL, writer->chunk_size, PROT_READ | PROT_WRITE,
+		    MAP_SHARED, writer->fd, writer->map_offset);
+	if (data == MAP_FAILED)
+		return false;
+
+	chunk->data = data;
+	writer->map_offset += writer->chunk_size;
+	return true;
+}
+
+/* Called from the writer thread. */
+static void
+aub_writer_retire(struct drm_intel_aub_writer *writer, struct aub_chunk *chunk)
+{
+	size_t written = 0;
+	ssize_t ret;
+
+	if (chunk->data == NULL)
+		return;
+
+	if (writer->flags & DRM_INTEL_AUB_WRITER_MMAP) {
+		munmap(chunk->data, writer->chunk_size);
+		if (!aub_writer_map_window(writer, chunk))
+			writer->error = true;
+		return;
+	}
+
+	while (written < chunk->used) {
+		ret = write(writer->fd, chunk->data + written,
+			    chunk->used - written);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			writer->error = true;
+			break;
+		}
+		written += ret;
+	}
+	chunk->used = 0;
+}
+
+static void *
+aub_writer_thread(void *arg)
+{
+	struct drm_intel_aub_writer *writer = arg;
+	struct aub_chunk *chunk;
+
+	pthread_mutex_lock(&writer->lock);
+	for (;;) {
+		while (writer->queue == NULL && !writer->done)
+			pthread_cond_wait(&writer->cond, &writer->lock);
+		if (writer->queue == NULL)
+			break;
+
+		chunk = aub_chunk_list_pop(&writer->queue);
+		pthread_mutex_unlock(&writer->lock);
+
+		aub_writer_retire(writer, chunk);
+
+		pthread_mutex_lock(&writer->lock);
+		aub_chunk_list_append(&writer->free_list, chunk);
+		pthread_cond_broadcast(&writer->cond);
+	}
+	pthread_mutex_unlock(&writer->lock);
+
+	return NULL;
+}
+
+/* Hands the current chunk to the writer thread and waits for a free one. */
+static void
+aub_writer_next_chunk(struct drm_intel_aub_writer *writer)
+{
+	pthread_mutex_lock(&writer->lock);
+	aub_chunk_list_append(&writer->queue, writer->current);
+	pthread_cond_broadcast(&writer->cond);
+
+	while (writer->free_list == NULL)
+		pthread_cond_wait(&writer->cond, &writer->lock);
+	writer->current = aub_chunk_list_pop(&writer->free_list);
+	pthread_mutex_unlock(&writer->lock);
+}
+
+struct drm_intel_aub_writer *
+drm_intel_aub_writer_open(const char *filename, unsigned int flags)
+{
+	struct drm_intel_aub_writer *writer;
+	bool use_mmap = flags & DRM_INTEL_AUB_WRITER_MMAP;
+	int num_chunks = use_mmap ? AUB_WINDOWS : AUB_CHUNKS;
+	int i;
+
+	writer = calloc(1, sizeof(*writer) +
+			num_chunks * sizeof(writer->chunks[0]));
+	if (writer == NULL)
+		return NULL;
+
+	writer->fd = open(filename, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC,
+			  0666);
+	if (writer->fd < 0) {
+		free(writer);
+		return NULL;
+	}
+
+	writer->flags = flags;
+	writer->chunk_size = use_mmap ? AUB_WINDOW_SIZE : AUB_CHUNK_SIZE;
+	writer->num_chunks = num_chunks;
+
+	for (i = 0; i < num_chunks; i++) {
+		struct aub_chunk *chunk = &writer->chunks[i];
+
+		if (use_mmap)
+			aub_writer_map_window(writer, chunk);
+		else
+			chunk->data = malloc(writer->chunk_size);
+		if (chunk->data == NULL)
+			goto err;
+		aub_chunk_list_append(&writer->free_list, chunk);
+	}
+	writer->current = aub_chunk_list_pop(&writer->free_list);
+
+	pthread_mutex_init(&writer->lock, NULL);
+	pthread_cond_init(&writer->cond, NULL);
+	if (pthread_create(&writer->thread, NULL, aub_writer_thread, writer)) {
+		pthread_cond_destroy(&writer->cond);
+		pthread_mutex_destroy(&writer->lock);
+		goto err;
+	}
+
+	return writer;
+
+err:
+	for (i = 0; i < num_chunks; i++) {
+		if (writer->chunks[i].data == NULL)
+			continue;
+		if (use_mmap)
+			munmap(writer->chunks[i].data, writer->chunk_size);
+		else
+			free(writer->chunks[i].data);
+	}
+	close(writer->fd);
+	unlink(filename);
+	free(writer);
+	return NULL;
+}
+
+/**
+ * Writes out everything still pending and closes the file.
+ *
+ * Returns -EIO if any of the data couldn't be written.
+ */
+int
+drm_intel_aub_writer_close(struct drm_intel_aub_writer *writer)
+{
+	bool use_mmap = writer->flags & DRM_INTEL_AUB_WRITER_MMAP;
+	int i, ret;
+
+	pthread_mutex_lock(&writer->lock);
+	if (!use_mmap)
+		aub_chunk_list_append(&writer->queue, writer->current);
+	writer->done = true;
+	pthread_cond_broadcast(&writer->cond);
+	pthread_mutex_unlock(&writer->lock);
+
+	pthread_join(writer->thread, NULL);
+	pthread_cond_destroy(&writer->cond);
+	pthread_mutex_destroy(&writer->lock);
+
+	for (i = 0; i < writer->num_chunks; i++) {
+		if (writer->chunks[i].data == NULL)
+			continue;
+		if (use_mmap)
+			munmap(writer->chunks[i].data, writer->chunk_size);
+		else
+			free(writer->chunks[i].data);
+	}
+
+	/* Drop the unused tail of the last window. */
+	if (use_mmap && ftruncate(writer->fd, writer->size))
+		writer->error = true;
+
+	close(writer->fd);
+	ret = writer->error ? -EIO : 0;
+	free(writer->bounce);
+	free(writer);
+
+	return ret;
+}
+
+void
+drm_intel_aub_writer_write(struct drm_intel_aub_writer *writer,
+			   const void *data, size_t size)
+{
+	const char *src = data;
+
+	while (size) {
+		struct aub_chunk *chunk = writer->current;
+		size_t len = writer->chunk_size - chunk->used;
+
+		/* Failed to map a window; drop the rest of the capture. */
+		if (chunk->data == NULL)
+			return;
+
+		if (len > size)
+			len = size;
+
+		memcpy(chunk->data + chunk->used, src, len);
+		chunk->used += len;
+		writer->size += len;
+		src += len;
+		size -= len;
+
+		if (chunk->used == writer->chunk_size)
+			aub_writer_next_chunk(writer);
+	}
+}
+
+/**
+ * Returns @size bytes of space to build data in, which must then be
+ * passed to drm_intel_aub_writer_commit().
+ *
+ * The space is inside the current chunk whenever it fits, which lets
+ * callers read buffer contents straight into the file's staging memory.
+ */
+void *
+drm_intel_aub_writer_reserve(struct drm_intel_aub_writer *writer,
+			     size_t size)
+{
+	struct aub_chunk *chunk = writer->current;
+
+	if (chunk->data && writer->chunk_size - chunk->used >= size)
+		return chunk->data + chunk->used;
+
+	if (writer->bounce_size < size) {
+		char *bounce = realloc(writer->bounce, size);
+
+		if (bounce == NULL)
+			return NULL;
+		writer->bounce = bounce;
+		writer->bounce_size = size;
+	}
+
+	return writer->bounce;
+}
+
+void
+drm_intel_aub_writer_commit(struct drm_intel_aub_writer *writer,
+			    void *data, size_t size)
+{
+	struct aub_chunk *chunk = writer->current;
+
+	if (data == writer->bounce) {
+		drm_intel_aub_writer_write(writer, data, size);
+		return;
+	}
+
+	chunk->used += size;
+	writer->size += size;
+	if (chunk->used == writer->chunk_size)
+		aub_writer_next_chunk(writer);
+}
+
+/**
+ * Starts writing out what has been collected so far, without waiting for
+ * it to reach the file.
+ *
+ * In mmap mode the data is already in the page cache, so this does
+ * nothing.
+ */
+void
+drm_intel_aub_writer_flush(struct drm_intel_aub_writer *writer)
+{
+	if (writer->flags & DRM_INTEL_AUB_WRITER_MMAP)
+		return;
+
+	if (writer->current->used)
+		aub_writer_next_chunk(writer);
+}
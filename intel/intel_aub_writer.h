@@ -0,0 +1,59 @@
+/*
+ * Copyright © 2013 Intel Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+/**
+ * @file intel_aub_writer.h
+ *
+ * Private interface of the buffered AUB file writer.
+ *
+ * Data is collected in large chunks which a background thread writes out,
+ * so that capturing a frame doesn't stall on one small write per dword.
+ */
+
+#ifndef INTEL_AUB_WRITER_H
+#define INTEL_AUB_WRITER_H
+
+#include <stddef.h>
+
+struct drm_intel_aub_writer;
+
+/**
+ * Write the file through mmap'd windows rather than write(2).  One window
+ * is filled while the writer thread retires the previous one and maps the
+ * next, so the file is produced without any copy out of the chunks.
+ */
+#define DRM_INTEL_AUB_WRITER_MMAP	(1 << 0)
+
+struct drm_intel_aub_writer *
+drm_intel_aub_writer_open(const char *filename, unsigned int flags);
+int drm_intel_aub_writer_close(struct drm_intel_aub_writer *writer);
+
+void drm_intel_aub_writer_write(struct drm_intel_aub_writer *writer,
+				const void *data, size_t size);
+void *drm_intel_aub_writer_reserve(struct drm_intel_aub_writer *writer,
+				   size_t size);
+void drm_intel_aub_writer_commit(struct drm_intel_aub_writer *writer,
+				 void *data, size_t size);
+void drm_intel_aub_writer_flush(struct drm_intel_aub_writer *writer);
+
+#endif /* INTEL_AUB_WRITER_H */
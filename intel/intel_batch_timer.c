@@ -0,0 +1,430 @@
+/*
+ * Copyright © 2013 Intel Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include <xf86drm.h>
+#include "libdrm_lists.h"
+#include "intel_batch_timer.h"
+#include "i915_drm.h"
+
+#define MI_STORE_REGISTER_MEM	((0x24 << 23) | (3 - 2))
+#define MI_BATCH_BUFFER_END	(0x0a << 23)
+
+/* TIMESTAMP register of each ring, indexed by I915_EXEC_RING_MASK. */
+static const uint32_t ring_timestamp_reg[] = {
+	[I915_EXEC_DEFAULT]	= 0x02358,
+	[I915_EXEC_RENDER]	= 0x02358,
+	[I915_EXEC_BSD]		= 0x12358,
+	[I915_EXEC_BLT]		= 0x22358,
+	[I915_EXEC_VEBOX]	= 0x1a358,
+};
+
+#define NUM_RINGS	(sizeof(ring_timestamp_reg) / sizeof(ring_timestamp_reg[0]))
+
+/*
+ * Layout of a slot BO: for each ring, a 16 byte program storing the
+ * timestamp at the start of the batch, followed by one for the end.  The
+ * two timestamps land at STAMP_OFFSET.
+ */
+#define PROGRAM_SIZE	16
+#define STAMP_OFFSET	0x400
+#define SLOT_BO_SIZE	4096
+
+/** Timestamp ticks on gen6 and gen7 are 80ns. */
+#define TIMESTAMP_NS	80
+
+/** Batches that can be in flight with timing before new ones go untimed */
+#define TIMER_SLOTS	64
+/** Retired timings kept for drm_intel_bufmgr_gem_get_batch_timings() */
+#define TIMER_RESULTS	256
+
+struct drm_intel_batch_timer_slot {
+	drmMMListHead link;
+	drm_intel_bo *bo;
+	uint64_t seqno;
+	uint32_t ring;
+	uint32_t ctx_id;
+	/** False if the batch or its closing stamp failed to submit */
+	bool valid;
+};
+
+struct drm_intel_batch_timer {
+	const struct drm_intel_batch_timer_ops *ops;
+	void *data;
+	int fd;
+	FILE *log;
+	/** Held from the opening stamp to the closing one */
+	pthread_mutex_t lock;
+
+	drmMMListHead free;
+	/** Submitted slots, oldest first */
+	drmMMListHead pending;
+	uint64_t seqno;
+
+	/** Ring of retired timings */
+	drm_intel_batch_timing results[TIMER_RESULTS];
+	int results_head;
+	int results_count;
+
+	struct drm_intel_batch_timer_slot slots[TIMER_SLOTS];
+};
+
+/*
+ * The stamps are run and read back with plain ioctls rather than through
+ * the bufmgr, so that neither the upload ring nor the bufmgr's own
+ * execbuffer path can end up calling back into the timer.
+ */
+static int
+timer_init_slot(struct drm_intel_batch_timer *timer, drm_intel_bufmgr *bufmgr,
+		struct drm_intel_batch_timer_slot *slot)
+{
+	uint32_t programs[NUM_RINGS * 2][PROGRAM_SIZE / 4];
+	struct drm_i915_gem_pwrite pwrite;
+	unsigned int ring;
+
+	slot->bo = drm_intel_bo_alloc(bufmgr, "batch timer", SLOT_BO_SIZE,
+				      4096);
+	if (!slot->bo)
+		return -ENOMEM;
+
+	for (ring = 0; ring < NUM_RINGS; ring++) {
+		uint32_t *start = programs[ring * 2];
+		uint32_t *end = programs[ring * 2 + 1];
+
+		start[0] = MI_STORE_REGISTER_MEM;
+		start[1] = ring_timestamp_reg[ring];
+		start[2] = 0; /* relocated at submission */
+		start[3] = MI_BATCH_BUFFER_END;
+
+		memcpy(end, start, PROGRAM_SIZE);
+	}
+
+	memset(&pwrite, 0, sizeof(pwrite));
+	pwrite.handle = slot->bo->handle;
+	pwrite.size = sizeof(programs);
+	pwrite.data_ptr = (uintptr_t)programs;
+	if (drmIoctl(timer->fd, DRM_IOCTL_I915_GEM_PWRITE, &pwrite))
+		return -errno;
+
+	return 0;
+}
+
+/* Runs one of the slot's stamp programs on the given ring and context. */
+static int
+timer_gem_submit(void *data, struct drm_intel_batch_timer_slot *slot,
+		 unsigned int ring, uint32_t ctx_id, bool end)
+{
+	struct drm_intel_batch_timer *timer = data;
+	struct drm_i915_gem_relocation_entry reloc;
+	struct drm_i915_gem_exec_object2 obj;
+	struct drm_i915_gem_execbuffer2 execbuf;
+	uint32_t program = (ring * 2 + end) * PROGRAM_SIZE;
+
+	memset(&reloc, 0, sizeof(reloc));
+	reloc.offset = program + 8;
+	reloc.delta = STAMP_OFFSET + end * 4;
+	reloc.target_handle = slot->bo->handle;
+	/* The other programs in the BO are left unrelocated, so never let
+	 * the kernel skip this one.
+	 */
+	reloc.presumed_offset = -1;
+	reloc.read_domains = I915_GEM_DOMAIN_INSTRUCTION;
+	reloc.write_domain = I915_GEM_DOMAIN_INSTRUCTION;
+
+	memset(&obj, 0, sizeof(obj));
+	obj.handle = slot->bo->handle;
+	obj.relocation_count = 1;
+	obj.relocs_ptr = (uintptr_t)&reloc;
+
+	memset(&execbuf, 0, sizeof(execbuf));
+	execbuf.buffers_ptr = (uintptr_t)&obj;
+	execbuf.buffer_count = 1;
+	execbuf.batch_start_offset = program;
+	execbuf.batch_len = PROGRAM_SIZE;
+	execbuf.flags = ring;
+	i915_execbuffer2_set_context_id(execbuf, ctx_id);
+
+	if (drmIoctl(timer->fd, DRM_IOCTL_I915_GEM_EXECBUFFER2, &execbuf))
+		return -errno;
+
+	return 0;
+}
+
+static bool
+timer_gem_busy(void *data, struct drm_intel_batch_timer_slot *slot)
+{
+	struct drm_intel_batch_timer *timer = data;
+	struct drm_i915_gem_busy busy;
+
+	memset(&busy, 0, sizeof(busy));
+	busy.handle = slot->bo->handle;
+	if (drmIoctl(timer->fd, DRM_IOCTL_I915_GEM_BUSY, &busy))
+		return false;
+
+	return busy.busy != 0;
+}
+
+/* Reading the stamps also waits for the GPU to finish with them. */
+static int
+timer_gem_read(void *data, struct drm_intel_batch_timer_slot *slot,
+	       uint32_t stamps[2])
+{
+	struct drm_intel_batch_timer *timer = data;
+	struct drm_i915_gem_pread pread;
+
+	memset(&pread, 0, sizeof(pread));
+	pread.handle = slot->bo->handle;
+	pread.offset = STAMP_OFFSET;
+	pread.size = 2 * sizeof(stamps[0]);
+	pread.data_ptr = (uintptr_t)stamps;
+	if (drmIoctl(timer->fd, DRM_IOCTL_I915_GEM_PREAD, &pread))
+		return -errno;
+
+	return 0;
+}
+
+static const struct drm_intel_batch_timer_ops timer_gem_ops = {
+	.submit = timer_gem_submit,
+	.busy = timer_gem_busy,
+	.read = timer_gem_read,
+};
+
+static void
+timer_record(struct drm_intel_batch_timer *timer,
+	     struct drm_intel_batch_timer_slot *slot)
+{
+	drm_intel_batch_timing *timing;
+	uint32_t stamps[2];
+	int i;
+
+	if (timer->ops->read(timer->data, slot, stamps) || !slot->valid)
+		return;
+
+	if (timer->results_count == TIMER_RESULTS) {
+		/* Nobody is collecting; drop the oldest. */
+		timer->results_head = (timer->results_head + 1) % TIMER_RESULTS;
+		timer->results_count--;
+	}
+
+	i = (timer->results_head + timer->results_count) % TIMER_RESULTS;
+	timing = &timer->results[i];
+	timing->seqno = slot->seqno;
+	timing->ring = slot->ring;
+	timing->ctx_id = slot->ctx_id;
+	/* The register is 32 bits wide here, so let the difference wrap. */
+	timing->gpu_time_ns = (uint64_t)(uint32_t)(stamps[1] - stamps[0]) *
+		TIMESTAMP_NS;
+	timer->results_count++;
+
+	if (timer->log) {
+		fprintf(timer->log, "%" PRIu64 " ring %u ctx %u %" PRIu64 " ns\n",
+			timing->seqno, timing->ring, timing->ctx_id,
+			timing->gpu_time_ns);
+	}
+}
+
+/*
+ * Collects the timings of the slots whose closing stamp has executed.  If
+ * wait is set, blocks for all of them.
+ */
+static void
+timer_retire(struct drm_intel_batch_timer *timer, bool wait)
+{
+	while (!DRMLISTEMPTY(&timer->pending)) {
+		struct drm_intel_batch_timer_slot *slot =
+			DRMLISTENTRY(struct drm_intel_batch_timer_slot,
+				     timer->pending.next, link);
+
+		if (!wait && timer->ops->busy(timer->data, slot))
+			break;
+
+		timer_record(timer, slot);
+		DRMLISTDEL(&slot->link);
+		DRMLISTADDTAIL(&slot->link, &timer->free);
+	}
+}
+
+/**
+ * Creates a timer whose stamps are run by \p ops, without any BOs.
+ */
+struct drm_intel_batch_timer *
+drm_intel_batch_timer_create_with_ops(const struct drm_intel_batch_timer_ops *ops,
+				      void *data, FILE *log)
+{
+	struct drm_intel_batch_timer *timer;
+	int i;
+
+	timer = calloc(1, sizeof(*timer));
+	if (!timer)
+		return NULL;
+
+	timer->ops = ops;
+	timer->data = data;
+	timer->fd = -1;
+	timer->log = log;
+	pthread_mutex_init(&timer->lock, NULL);
+	DRMINITLISTHEAD(&timer->free);
+	DRMINITLISTHEAD(&timer->pending);
+
+	for (i = 0; i < TIMER_SLOTS; i++)
+		DRMLISTADDTAIL(&timer->slots[i].link, &timer->free);
+
+	return timer;
+}
+
+struct drm_intel_batch_timer *
+drm_intel_batch_timer_create(drm_intel_bufmgr *bufmgr, int fd, FILE *log)
+{
+	struct drm_intel_batch_timer *timer;
+	int i;
+
+	timer = drm_intel_batch_timer_create_with_ops(&timer_gem_ops, NULL, log);
+	if (!timer)
+		return NULL;
+
+	timer->data = timer;
+	timer->fd = fd;
+
+	for (i = 0; i < TIMER_SLOTS; i++) {
+		if (timer_init_slot(timer, bufmgr, &timer->slots[i])) {
+			timer->log = NULL;
+			drm_intel_batch_timer_destroy(timer);
+			return NULL;
+		}
+	}
+
+	return timer;
+}
+
+void
+drm_intel_batch_timer_destroy(struct drm_intel_batch_timer *timer)
+{
+	int i;
+
+	pthread_mutex_lock(&timer->lock);
+	timer_retire(timer, true);
+	pthread_mutex_unlock(&timer->lock);
+
+	for (i = 0; i < TIMER_SLOTS; i++) {
+		if (timer->slots[i].bo)
+			drm_intel_bo_unreference(timer->slots[i].bo);
+	}
+
+	if (timer->log)
+		fclose(timer->log);
+	pthread_mutex_destroy(&timer->lock);
+	free(timer);
+}
+
+/**
+ * Stores the starting timestamp for a batch about to be submitted on
+ * \p ring with context \p ctx_id.
+ *
+ * Returns with the timer locked, so that the caller's execbuffer follows
+ * the opening stamp with no other timed batch in between; it must submit
+ * straight away and then call drm_intel_batch_timer_end() whatever the
+ * outcome.  Returns NULL, and the batch simply goes untimed, if too many
+ * timed batches are still in flight.
+ */
+struct drm_intel_batch_timer_slot *
+drm_intel_batch_timer_begin(struct drm_intel_batch_timer *timer,
+			    unsigned int ring, uint32_t ctx_id)
+{
+	struct drm_intel_batch_timer_slot *slot;
+
+	pthread_mutex_lock(&timer->lock);
+	if (ring >= NUM_RINGS)
+		return NULL;
+
+	timer_retire(timer, false);
+	if (DRMLISTEMPTY(&timer->free))
+		return NULL;
+
+	slot = DRMLISTENTRY(struct drm_intel_batch_timer_slot,
+			    timer->free.next, link);
+	if (timer->ops->submit(timer->data, slot, ring, ctx_id, false))
+		return NULL;
+
+	DRMLISTDEL(&slot->link);
+	slot->ring = ring;
+	slot->ctx_id = ctx_id;
+
+	return slot;
+}
+
+/**
+ * Stores the closing timestamp after the batch has been submitted, and
+ * unlocks the timer.  If the batch wasn't submitted (\p submitted is
+ * false), the slot is just recycled once its opening stamp is done.
+ *
+ * \p slot is whatever drm_intel_batch_timer_begin() returned, NULL
+ * included.
+ */
+void
+drm_intel_batch_timer_end(struct drm_intel_batch_timer *timer,
+			  struct drm_intel_batch_timer_slot *slot,
+			  bool submitted)
+{
+	if (slot) {
+		slot->valid = submitted &&
+			timer->ops->submit(timer->data, slot, slot->ring,
+					   slot->ctx_id, true) == 0;
+		/* Numbered in the order the batches reached the kernel. */
+		if (slot->valid)
+			slot->seqno = ++timer->seqno;
+		DRMLISTADDTAIL(&slot->link, &timer->pending);
+	}
+	pthread_mutex_unlock(&timer->lock);
+}
+
+/**
+ * Copies out up to \p max of the oldest retired timings and forgets them.
+ * Returns the number copied.
+ */
+int
+drm_intel_batch_timer_get(struct drm_intel_batch_timer *timer,
+			  drm_intel_batch_timing *timings, int max)
+{
+	int n = 0;
+
+	pthread_mutex_lock(&timer->lock);
+	timer_retire(timer, false);
+
+	while (n < max && timer->results_count) {
+		timings[n++] = timer->results[timer->results_head];
+		timer->results_head = (timer->results_head + 1) % TIMER_RESULTS;
+		timer->results_count--;
+	}
+	pthread_mutex_unlock(&timer->lock);
+
+	return n;
+}
@@ -0,0 +1,80 @@
+/*
+ * Copyright © 2013 Intel Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+/**
+ * @file intel_batch_timer.h
+ *
+ * Private interface of the GPU batch timer.
+ *
+ * Each batch is bracketed by two tiny batches on the same ring and context
+ * that store the ring's TIMESTAMP register, so the driver's own batch is
+ * never touched.  The three are submitted back to back under the timer's
+ * lock.  Results are read back once the closing stamp has retired, which
+ * is checked for whenever another batch is submitted.
+ */
+
+#ifndef INTEL_BATCH_TIMER_H
+#define INTEL_BATCH_TIMER_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "intel_bufmgr.h"
+
+struct drm_intel_batch_timer;
+struct drm_intel_batch_timer_slot;
+
+/**
+ * How the timer drives the GPU.  drm_intel_batch_timer_create() uses
+ * ioctls on the DRM fd; tests substitute their own.
+ */
+struct drm_intel_batch_timer_ops {
+	/** Runs the slot's opening or closing stamp */
+	int (*submit)(void *data, struct drm_intel_batch_timer_slot *slot,
+		      unsigned int ring, uint32_t ctx_id, bool end);
+	/** Returns whether the slot's stamps may still be executing */
+	bool (*busy)(void *data, struct drm_intel_batch_timer_slot *slot);
+	/** Reads back both stamps, waiting for them if need be */
+	int (*read)(void *data, struct drm_intel_batch_timer_slot *slot,
+		    uint32_t stamps[2]);
+};
+
+struct drm_intel_batch_timer *
+drm_intel_batch_timer_create(drm_intel_bufmgr *bufmgr, int fd, FILE *log);
+struct drm_intel_batch_timer *
+drm_intel_batch_timer_create_with_ops(const struct drm_intel_batch_timer_ops *ops,
+				      void *data, FILE *log);
+void drm_intel_batch_timer_destroy(struct drm_intel_batch_timer *timer);
+
+struct drm_intel_batch_timer_slot *
+drm_intel_batch_timer_begin(struct drm_intel_batch_timer *timer,
+			    unsigned int ring, uint32_t ctx_id);
+void drm_intel_batch_timer_end(struct drm_intel_batch_timer *timer,
+			       struct drm_intel_batch_timer_slot *slot,
+			       bool submitted);
+
+int drm_intel_batch_timer_get(struct drm_intel_batch_timer *timer,
+			      drm_intel_batch_timing *timings, int max);
+
+#endif /* INTEL_BATCH_TIMER_H */
@@ -69,6 +69,18 @@ drm_intel_bo_alloc_tiled(drm_intel_bufmgr *bufmgr, const char *name,
 				      tiling_mode, pitch, flags);
 }
 
+drm_intel_bo *
+drm_intel_bo_alloc_userptr(drm_intel_bufmgr *bufmgr, const char *name,
+			   void *addr, uint32_t tiling_mode, uint32_t stride,
+			   unsigned long size, unsigned long flags)
+{
+	if (bufmgr->bo_alloc_userptr)
+		return bufmgr->bo_alloc_userptr(bufmgr, name, addr,
+						tiling_mode, stride, size,
+						flags);
+	return NULL;
+}
+
 void drm_intel_bo_reference(drm_intel_bo *bo)
 {
 	bo->bufmgr->bo_reference(bo);
@@ -232,6 +244,20 @@ int drm_intel_bo_get_tiling(drm_intel_bo *bo, uint32_t * tiling_mode,
 	return 0;
 }
 
+int drm_intel_bo_set_caching(drm_intel_bo *bo, uint32_t caching)
+{
+	if (bo->bufmgr->bo_set_caching)
+		return bo->bufmgr->bo_set_caching(bo, caching);
+	return -ENODEV;
+}
+
+int drm_intel_bo_get_caching(drm_intel_bo *bo, uint32_t *caching)
+{
+	if (bo->bufmgr->bo_get_caching)
+		return bo->bufmgr->bo_get_caching(bo, caching);
+	return -ENODEV;
+}
+
 int drm_intel_bo_disable_reuse(drm_intel_bo *bo)
 {
 	if (bo->bufmgr->bo_disable_reuse)
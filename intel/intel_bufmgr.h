@@ -99,6 +99,158 @@ typedef struct _drm_intel_aub_annotation {
 	uint32_t ending_offset;
 } drm_intel_aub_annotation;
 
+/**
+ * GPU execution time of one batch, from
+ * drm_intel_bufmgr_gem_get_batch_timings().
+ */
+typedef struct _drm_intel_batch_timing {
+	/** Order in which the batch reached the kernel, starting at 1 */
+	uint64_t seqno;
+	/** Ring the batch ran on, as the I915_EXEC_RING_MASK bits */
+	uint32_t ring;
+	/** Hardware context the batch ran in, or 0 */
+	uint32_t ctx_id;
+	/** Time between the GPU starting and finishing the batch */
+	uint64_t gpu_time_ns;
+} drm_intel_batch_timing;
+
+/**
+ * BO cache reuse for each requested tiling mode, from
+ * drm_intel_bufmgr_gem_get_cache_stats().
+ */
+typedef struct _drm_intel_bufmgr_gem_cache_stats {
+	struct {
+		/** Reused with the requested tiling and stride already set */
+		uint64_t hits;
+		/** Reused after changing the BO's tiling or stride */
+		uint64_t retiled;
+		/** Newly created because nothing suitable was cached */
+		uint64_t misses;
+	} tiling[3];	/* indexed by I915_TILING_* */
+} drm_intel_bufmgr_gem_cache_stats;
+
+/** Use of the GEM mapping cache, from drm_intel_bufmgr_gem_get_vma_stats() */
+typedef struct _drm_intel_bufmgr_gem_vma_stats {
+	/** Mappings recreated after the cache had evicted them */
+	uint64_t remaps;
+	/** Maps that found their mapping cached, and the page faults that
+	 * saved, counting every page of the BO
+	 */
+	uint64_t reuses;
+	uint64_t faults_avoided;
+	/** Mappings evicted to stay within the limit */
+	uint64_t evictions;
+	/** Size of all mappings currently held, in use or cached */
+	uint64_t bytes_mapped;
+	/** Mappings currently cached, and the limit in effect or -1 */
+	int cached;
+	int limit;
+} drm_intel_bufmgr_gem_vma_stats;
+
+/**
+ * Bytes written by drm_intel_bo_subdata() through each path, from
+ * drm_intel_bufmgr_gem_get_upload_stats().
+ */
+typedef struct _drm_intel_bufmgr_gem_upload_stats {
+	/** Staged and blitted into place by the GPU */
+	uint64_t ring_bytes;
+	/** Written by the kernel with pwrite */
+	uint64_t pwrite_bytes;
+	/** Copied into an existing CPU mapping */
+	uint64_t map_bytes;
+	/** Read by drm_intel_bo_get_subdata() through a snooped BO */
+	uint64_t readback_bytes;
+	/** Blit batches submitted */
+	uint64_t ring_flushes;
+	/** Times the ring was full and we waited for a blit to finish */
+	uint64_t ring_waits;
+	/** Blit batches that failed to submit, whose writes used pwrite */
+	uint64_t ring_errors;
+} drm_intel_bufmgr_gem_upload_stats;
+
+/**
+ * Use of the hardware context pool, from
+ * drm_intel_bufmgr_gem_get_context_stats().
+ */
+typedef struct _drm_intel_bufmgr_gem_context_stats {
+	/** Contexts created by the kernel */
+	uint64_t created;
+	/** Contexts handed out again from the pool */
+	uint64_t reused;
+	/** Destroyed contexts kept in the pool instead */
+	uint64_t recycled;
+	/** Destroyed contexts the reset hook refused, or that were banned */
+	uint64_t rejected;
+	/** Contexts destroyed in the kernel */
+	uint64_t destroyed;
+	/** Contexts currently pooled, and the pool size */
+	int pooled;
+	int limit;
+} drm_intel_bufmgr_gem_context_stats;
+
+typedef struct _drm_intel_reg_sampler drm_intel_reg_sampler;
+
+/**
+ * Header of a register sampler's ring, followed by num_slots samples of
+ * sample_size bytes each.  A sample is the CLOCK_MONOTONIC time it was
+ * taken at in nanoseconds, then one uint64_t per register.
+ *
+ * head and tail count samples written and consumed; sample n lives in slot
+ * n % num_slots.  Only the sampler writes head and only the consumer
+ * writes tail, so a consumer reads head, reads slots up to it and then
+ * stores the new tail, with read barriers in between.
+ */
+struct drm_intel_reg_sample_ring {
+	uint32_t num_regs;
+	uint32_t num_slots;
+	uint32_t sample_size;
+	uint32_t pad0;
+	volatile uint32_t head;
+	uint32_t pad1[15];
+	volatile uint32_t tail;
+	uint32_t pad2[15];
+};
+
+typedef struct _drm_intel_reg_sampler_stats {
+	/** Samples written to the ring */
+	uint64_t samples;
+	/** Samples skipped because the ring was full */
+	uint64_t dropped;
+	/** Periods that passed without a sample because the thread was late */
+	uint64_t missed_periods;
+	/** Register read ioctls issued, and how many of them failed */
+	uint64_t reads;
+	uint64_t read_errors;
+	/** Wall time spent taking samples */
+	uint64_t busy_ns;
+	/** CPU time used by the sampling thread */
+	uint64_t cpu_time_ns;
+} drm_intel_reg_sampler_stats;
+
+/**
+ * Block eviction policies for the fake bufmgr.
+ *
+ * LRU is the historical behaviour.  SIZE prefers a single victim that frees
+ * enough space for the incoming buffer over many small ones, and 2Q evicts
+ * buffers that have only been used once before ones that keep being reused.
+ */
+enum drm_intel_fake_evict_policy {
+	DRM_INTEL_FAKE_EVICT_LRU = 0,
+	DRM_INTEL_FAKE_EVICT_SIZE,
+	DRM_INTEL_FAKE_EVICT_2Q,
+};
+
+typedef struct _drm_intel_bufmgr_fake_stats {
+	/** Number of blocks and bytes thrown out of the aperture */
+	uint64_t evictions;
+	uint64_t evicted_bytes;
+	/** Total bytes copied from backing store into the aperture */
+	uint64_t upload_bytes;
+	/** Subset of the uploads caused by a previous eviction */
+	uint64_t reuploads;
+	uint64_t reupload_bytes;
+} drm_intel_bufmgr_fake_stats;
+
 #define BO_ALLOC_FOR_RENDER (1<<0)
 
 drm_intel_bo *drm_intel_bo_alloc(drm_intel_bufmgr *bufmgr, const char *name,
@@ -113,6 +265,11 @@ drm_intel_bo *drm_intel_bo_alloc_tiled(drm_intel_bufmgr *bufmgr,
 				       uint32_t *tiling_mode,
 				       unsigned long *pitch,
 				       unsigned long flags);
+drm_intel_bo *drm_intel_bo_alloc_userptr(drm_intel_bufmgr *bufmgr,
+					 const char *name,
+					 void *addr, uint32_t tiling_mode,
+					 uint32_t stride, unsigned long size,
+					 unsigned long flags);
 void drm_intel_bo_reference(drm_intel_bo *bo);
 void drm_intel_bo_unreference(drm_intel_bo *bo);
 int drm_intel_bo_map(drm_intel_bo *bo, int write_enable);
@@ -126,6 +283,18 @@ void drm_intel_bo_wait_rendering(drm_intel_bo *bo);
 
 void drm_intel_bufmgr_set_debug(drm_intel_bufmgr *bufmgr, int enable_debug);
 void drm_intel_bufmgr_destroy(drm_intel_bufmgr *bufmgr);
+/*
+ * With the GEM bufmgr and execbuffer2, threads sharing a bufmgr submit
+ * batches in parallel, and may share BOs between them, relocations and
+ * all.  What isn't allowed is drm_intel_bo_emit_reloc() on a BO that a
+ * batch another thread is submitting references, directly or through
+ * other relocations.
+ *
+ * The kernel may run overlapping submissions in either order, so after
+ * one, the relocations of the batch that finished submitting last are
+ * no longer trusted with I915_EXEC_NO_RELOC: the kernel checks them all
+ * again the next time that batch is submitted.
+ */
 int drm_intel_bo_exec(drm_intel_bo *bo, int used,
 		      struct drm_clip_rect *cliprects, int num_cliprects, int DR4);
 int drm_intel_bo_mrb_exec(drm_intel_bo *bo, int used,
@@ -146,6 +315,8 @@ int drm_intel_bo_set_tiling(drm_intel_bo *bo, uint32_t * tiling_mode,
 			    uint32_t stride);
 int drm_intel_bo_get_tiling(drm_intel_bo *bo, uint32_t * tiling_mode,
 			    uint32_t * swizzle_mode);
+int drm_intel_bo_set_caching(drm_intel_bo *bo, uint32_t caching);
+int drm_intel_bo_get_caching(drm_intel_bo *bo, uint32_t *caching);
 int drm_intel_bo_flink(drm_intel_bo *bo, uint32_t * name);
 int drm_intel_bo_busy(drm_intel_bo *bo);
 int drm_intel_bo_madvise(drm_intel_bo *bo, int madv);
@@ -160,11 +331,25 @@ drm_intel_bo *drm_intel_bo_gem_create_from_name(drm_intel_bufmgr *bufmgr,
 						const char *name,
 						unsigned int handle);
 void drm_intel_bufmgr_gem_enable_reuse(drm_intel_bufmgr *bufmgr);
+int drm_intel_bufmgr_gem_enable_cache_reaper(drm_intel_bufmgr *bufmgr,
+					     unsigned int max_age_ms);
+void drm_intel_bufmgr_gem_trim_cache(drm_intel_bufmgr *bufmgr);
 void drm_intel_bufmgr_gem_enable_fenced_relocs(drm_intel_bufmgr *bufmgr);
+void drm_intel_bufmgr_gem_enable_thread_cache(drm_intel_bufmgr *bufmgr);
+void drm_intel_bufmgr_gem_enable_slab_alloc(drm_intel_bufmgr *bufmgr);
+void drm_intel_bufmgr_gem_enable_no_reloc(drm_intel_bufmgr *bufmgr);
 void drm_intel_bufmgr_gem_set_vma_cache_size(drm_intel_bufmgr *bufmgr,
 					     int limit);
+void drm_intel_bufmgr_gem_get_vma_stats(drm_intel_bufmgr *bufmgr,
+					drm_intel_bufmgr_gem_vma_stats *stats);
 int drm_intel_gem_bo_map_unsynchronized(drm_intel_bo *bo);
 int drm_intel_gem_bo_map_gtt(drm_intel_bo *bo);
+int drm_intel_gem_bo_write_rect(drm_intel_bo *bo, uint32_t x, uint32_t y,
+				uint32_t width, uint32_t height,
+				const void *src, uint32_t src_pitch);
+int drm_intel_gem_bo_read_rect(drm_intel_bo *bo, uint32_t x, uint32_t y,
+			       uint32_t width, uint32_t height,
+			       void *dst, uint32_t dst_pitch);
 int drm_intel_gem_bo_unmap_gtt(drm_intel_bo *bo);
 
 int drm_intel_gem_bo_get_reloc_count(drm_intel_bo *bo);
@@ -175,6 +360,24 @@ void
 drm_intel_bufmgr_gem_set_aub_filename(drm_intel_bufmgr *bufmgr,
 				      const char *filename);
 void drm_intel_bufmgr_gem_set_aub_dump(drm_intel_bufmgr *bufmgr, int enable);
+void drm_intel_bufmgr_gem_set_aub_mmap(drm_intel_bufmgr *bufmgr, int enable);
+void drm_intel_bufmgr_gem_get_cache_stats(drm_intel_bufmgr *bufmgr,
+					  drm_intel_bufmgr_gem_cache_stats *stats);
+int drm_intel_bufmgr_gem_enable_batch_timing(drm_intel_bufmgr *bufmgr);
+int drm_intel_bufmgr_gem_enable_upload_ring(drm_intel_bufmgr *bufmgr);
+void drm_intel_bufmgr_gem_set_context_pool_size(drm_intel_bufmgr *bufmgr,
+						int limit);
+void drm_intel_bufmgr_gem_set_context_reset_hook(drm_intel_bufmgr *bufmgr,
+						 int (*reset)(drm_intel_context *ctx,
+							      void *data),
+						 void *data);
+void drm_intel_bufmgr_gem_get_context_stats(drm_intel_bufmgr *bufmgr,
+					    drm_intel_bufmgr_gem_context_stats *stats);
+void drm_intel_bufmgr_gem_get_upload_stats(drm_intel_bufmgr *bufmgr,
+					   drm_intel_bufmgr_gem_upload_stats *stats);
+int drm_intel_bufmgr_gem_get_batch_timings(drm_intel_bufmgr *bufmgr,
+					   drm_intel_batch_timing *timings,
+					   int max);
 void drm_intel_gem_bo_aub_dump_bmp(drm_intel_bo *bo,
 				   int x1, int y1, int width, int height,
 				   enum aub_dump_bmp_format format,
@@ -231,23 +434,139 @@ void drm_intel_bo_fake_disable_backing_store(drm_intel_bo *bo,
 
 void drm_intel_bufmgr_fake_contended_lock_take(drm_intel_bufmgr *bufmgr);
 void drm_intel_bufmgr_fake_evict_all(drm_intel_bufmgr *bufmgr);
+int drm_intel_bufmgr_fake_set_evict_policy(drm_intel_bufmgr *bufmgr,
+					   enum drm_intel_fake_evict_policy policy);
+void drm_intel_bufmgr_fake_get_stats(drm_intel_bufmgr *bufmgr,
+				     drm_intel_bufmgr_fake_stats *stats);
+void drm_intel_bufmgr_fake_reset_stats(drm_intel_bufmgr *bufmgr);
+
+/**
+ * When drm_intel_decode() hands its buffered text to the output.
+ */
+enum drm_intel_decode_flush_policy {
+	/** When the output buffer fills, and once decoding is done */
+	DRM_INTEL_DECODE_FLUSH_BATCH = 0,
+	/** After every packet */
+	DRM_INTEL_DECODE_FLUSH_PACKET,
+};
+
+/**
+ * Output formats for drm_intel_decode().
+ */
+enum drm_intel_decode_format {
+	/** Human-readable dump, one line per dword */
+	DRM_INTEL_DECODE_FORMAT_TEXT = 0,
+	/** struct drm_intel_decode_record per packet, in host byte order */
+	DRM_INTEL_DECODE_FORMAT_BINARY,
+	/** The same records as JSON, one object per line */
+	DRM_INTEL_DECODE_FORMAT_JSON,
+};
+
+/**
+ * Header of one packet in the DRM_INTEL_DECODE_FORMAT_BINARY stream.
+ *
+ * It is followed by num_fields struct drm_intel_decode_field, one for each
+ * dword the decoder looked at, and then num_addresses uint32_t holding the
+ * values of the fields that are GPU addresses or state offsets.
+ */
+struct drm_intel_decode_record {
+	/** Bytes in the record, including the arrays after it */
+	uint32_t size;
+	/** GPU address of the packet */
+	uint32_t offset;
+	/**
+	 * Opcode bits of the header: bits 28:23 for MI packets, 28:22 for
+	 * 2D and 31:16 for everything else.
+	 */
+	uint32_t opcode;
+	/** Command type from bits 31:29 of the header */
+	uint16_t type;
+	uint16_t gen;
+	/** Length of the packet in dwords */
+	uint32_t length;
+	uint32_t num_fields;
+	uint32_t num_addresses;
+};
+
+struct drm_intel_decode_field {
+	/** Dword within the packet */
+	uint32_t index;
+	uint32_t value;
+};
+
+/**
+ * How drm_intel_decode() looks for re-emitted state packets.
+ */
+enum drm_intel_decode_state_tracking {
+	DRM_INTEL_DECODE_STATE_OFF = 0,
+	/** Compare state packets within each batch */
+	DRM_INTEL_DECODE_STATE_PER_BATCH,
+	/** Carry the last state over from one batch to the next */
+	DRM_INTEL_DECODE_STATE_ACROSS_BATCHES,
+};
+
+typedef void (*drm_intel_decode_write_func)(void *closure,
+					    const char *data, size_t size);
 
 struct drm_intel_decode *drm_intel_decode_context_alloc(uint32_t devid);
 void drm_intel_decode_context_free(struct drm_intel_decode *ctx);
 void drm_intel_decode_set_batch_pointer(struct drm_intel_decode *ctx,
 					void *data, uint32_t hw_offset,
 					int count);
+void drm_intel_decode_set_ring_pointer(struct drm_intel_decode *ctx,
+				       void *data, uint32_t hw_offset,
+				       int count, uint32_t head, uint32_t tail);
 void drm_intel_decode_set_dump_past_end(struct drm_intel_decode *ctx,
 					int dump_past_end);
 void drm_intel_decode_set_head_tail(struct drm_intel_decode *ctx,
 				    uint32_t head, uint32_t tail);
 void drm_intel_decode_set_output_file(struct drm_intel_decode *ctx, FILE *out);
+void drm_intel_decode_set_output_func(struct drm_intel_decode *ctx,
+				      drm_intel_decode_write_func func,
+				      void *closure);
+void drm_intel_decode_set_output_format(struct drm_intel_decode *ctx,
+					enum drm_intel_decode_format format);
+void drm_intel_decode_set_state_tracking(struct drm_intel_decode *ctx,
+					 enum drm_intel_decode_state_tracking mode);
+void drm_intel_decode_clear_state_summary(struct drm_intel_decode *ctx);
+void drm_intel_decode_print_state_summary(struct drm_intel_decode *ctx,
+					  FILE *out);
+void drm_intel_decode_set_flush_policy(struct drm_intel_decode *ctx,
+				       enum drm_intel_decode_flush_policy policy);
 void drm_intel_decode(struct drm_intel_decode *ctx);
 
 int drm_intel_reg_read(drm_intel_bufmgr *bufmgr,
 		       uint32_t offset,
 		       uint64_t *result);
 
+drm_intel_reg_sampler *
+drm_intel_reg_sampler_create(drm_intel_bufmgr *bufmgr,
+			     const uint32_t *regs, int num_regs,
+			     uint64_t period_ns, int num_slots, int ring_fd);
+void drm_intel_reg_sampler_destroy(drm_intel_reg_sampler *sampler);
+struct drm_intel_reg_sample_ring *
+drm_intel_reg_sampler_get_ring(drm_intel_reg_sampler *sampler);
+int drm_intel_reg_sampler_get_fd(drm_intel_reg_sampler *sampler);
+int drm_intel_reg_sampler_read(drm_intel_reg_sampler *sampler,
+			       uint64_t *samples, int max_samples);
+void drm_intel_reg_sampler_get_stats(drm_intel_reg_sampler *sampler,
+				     drm_intel_reg_sampler_stats *stats);
+
+void drm_intel_memcpy_to_wc(void *dst, const void *src, size_t size);
+void drm_intel_memcpy_from_wc(void *dst, const void *src, size_t size);
+const char *drm_intel_wc_copy_get_impl(void);
+int drm_intel_wc_copy_set_impl(const char *name);
+
+int drm_intel_tiled_write_rect(void *dst, uint32_t tiling, uint32_t swizzle,
+			       uint32_t pitch, uint32_t x, uint32_t y,
+			       uint32_t width, uint32_t height,
+			       const void *src, uint32_t src_pitch);
+int drm_intel_tiled_read_rect(void *dst, uint32_t dst_pitch,
+			      const void *src, uint32_t tiling,
+			      uint32_t swizzle, uint32_t pitch,
+			      uint32_t x, uint32_t y,
+			      uint32_t width, uint32_t height);
+
 /** @{ Compatibility defines to keep old code building despite the symbol rename
  * from dri_* to drm_intel_*
  */
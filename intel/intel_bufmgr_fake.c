@@ -106,6 +106,11 @@ struct block {
 	 * and can't be freed until @fence is passed.
 	 */
 	unsigned fenced:1;
+	/**
+	 * Marks that the buffer was reused while resident, or was reloaded
+	 * shortly after being evicted.  Used by the 2Q eviction policy.
+	 */
+	unsigned referenced:1;
 
 	/** Fence cookie for the block. */
 	unsigned fence;		/* Split to read_fence, write_fence */
@@ -145,6 +150,19 @@ typedef struct _bufmgr_fake {
 
 	unsigned int last_fence;
 
+	/**
+	 * Eviction policy, picking the next block to throw out of the lru
+	 * list in order to make room for a buffer of the given size.
+	 */
+	struct block *(*evict_choose) (struct _bufmgr_fake *bufmgr_fake,
+				       unsigned int size);
+	drm_intel_bufmgr_fake_stats stats;
+	/**
+	 * Running total of bytes evicted, never reset.  Used to age the
+	 * evicted flag of buffers out of the aperture.
+	 */
+	uint64_t evict_clock;
+
 	unsigned fail:1;
 	unsigned need_fence:1;
 	int thrashing;
@@ -197,6 +215,10 @@ typedef struct _drm_intel_bo_fake {
 	 * has the card written to this buffer - we make need to copy it back
 	 */
 	unsigned card_dirty:1;
+	/** has the buffer been evicted since it was last uploaded */
+	unsigned evicted:1;
+	/** evict_clock of the bufmgr when the buffer was evicted */
+	uint64_t evicted_at;
 	unsigned int refcount;
 	/* Flags may consist of any of the DRM_BO flags, plus
 	 * DRM_BO_NO_BACKING_STORE and BM_NO_FENCE_SUBDATA, which are the
@@ -540,30 +562,158 @@ set_dirty(drm_intel_bo *bo)
 }
 
 static int
-evict_lru(drm_intel_bufmgr_fake *bufmgr_fake, unsigned int max_fence)
+block_evictable(struct block *block)
 {
-	struct block *block, *tmp;
+	drm_intel_bo_fake *bo_fake = (drm_intel_bo_fake *) block->bo;
 
-	DBG("%s\n", __FUNCTION__);
+	return !(bo_fake != NULL && (bo_fake->flags & BM_NO_FENCE_SUBDATA));
+}
 
-	DRMLISTFOREACHSAFE(block, tmp, &bufmgr_fake->lru) {
-		drm_intel_bo_fake *bo_fake = (drm_intel_bo_fake *) block->bo;
+/**
+ * Returns how much contiguous space freeing the block would give back,
+ * counting the free neighbours it would be merged with.
+ */
+static unsigned int
+block_evict_gain(struct block *block)
+{
+	struct mem_block *mem = block->mem;
+	unsigned int gain = mem->size;
+
+	if (mem->prev->free)
+		gain += mem->prev->size;
+	if (mem->next->free)
+		gain += mem->next->size;
+
+	return gain;
+}
+
+static struct block *
+evict_choose_lru(drm_intel_bufmgr_fake *bufmgr_fake, unsigned int size)
+{
+	struct block *block;
+
+	DRMLISTFOREACH(block, &bufmgr_fake->lru) {
+		if (block_evictable(block))
+			return block;
+	}
+
+	return NULL;
+}
+
+/**
+ * Picks the least recently used block whose eviction makes enough room for
+ * the new buffer, so that one large allocation doesn't flush out a whole
+ * run of small, hot buffers.  Failing that, the block giving back the most
+ * space is evicted.
+ */
+static struct block *
+evict_choose_size(drm_intel_bufmgr_fake *bufmgr_fake, unsigned int size)
+{
+	struct block *block, *largest = NULL;
+	unsigned int largest_gain = 0;
 
-		if (bo_fake != NULL && (bo_fake->flags & BM_NO_FENCE_SUBDATA))
+	DRMLISTFOREACH(block, &bufmgr_fake->lru) {
+		unsigned int gain;
+
+		if (!block_evictable(block))
 			continue;
 
-		if (block->fence && max_fence && !FENCE_LTE(block->fence,
-							    max_fence))
-			return 0;
+		gain = block_evict_gain(block);
+		if (gain >= size)
+			return block;
 
-		set_dirty(&bo_fake->bo);
-		bo_fake->block = NULL;
+		if (gain > largest_gain) {
+			largest = block;
+			largest_gain = gain;
+		}
+	}
 
-		free_block(bufmgr_fake, block, 0);
-		return 1;
+	return largest;
+}
+
+/**
+ * 2Q-style policy: blocks which have only been used once since they were
+ * loaded are evicted, oldest first, before any block that has been reused.
+ * Buffers reloaded after an eviction start out as reused, which plays the
+ * role of the ghost list in ARC.
+ */
+static struct block *
+evict_choose_2q(drm_intel_bufmgr_fake *bufmgr_fake, unsigned int size)
+{
+	struct block *block, *oldest = NULL;
+
+	DRMLISTFOREACH(block, &bufmgr_fake->lru) {
+		if (!block_evictable(block))
+			continue;
+
+		if (!block->referenced)
+			return block;
+
+		if (oldest == NULL)
+			oldest = block;
 	}
 
-	return 0;
+	return oldest;
+}
+
+static void
+evict_block(drm_intel_bufmgr_fake *bufmgr_fake, struct block *block)
+{
+	drm_intel_bo_fake *bo_fake = (drm_intel_bo_fake *) block->bo;
+
+	DBG("evict buf %d:%s, sz %d offset 0x%x\n", bo_fake->id,
+	    bo_fake->name, bo_fake->bo.size, block->mem->ofs);
+
+	bufmgr_fake->stats.evictions++;
+	bufmgr_fake->stats.evicted_bytes += bo_fake->bo.size;
+	bufmgr_fake->evict_clock += bo_fake->bo.size;
+
+	set_dirty(&bo_fake->bo);
+	bo_fake->block = NULL;
+	bo_fake->evicted = 1;
+	bo_fake->evicted_at = bufmgr_fake->evict_clock;
+
+	free_block(bufmgr_fake, block, 0);
+}
+
+/**
+ * Evicts one block from the lru list according to the current policy, to
+ * make room for a buffer of the given size.
+ */
+/**
+ * Returns whether a buffer was evicted recently enough for its reload to
+ * count as reuse.  Like the ghost list of ARC, which holds as many entries
+ * as the cache itself, the evicted flag only lasts until another aperture's
+ * worth of buffers has been evicted.
+ */
+static int
+evicted_recently(drm_intel_bufmgr_fake *bufmgr_fake,
+		 drm_intel_bo_fake *bo_fake)
+{
+	if (!bo_fake->evicted)
+		return 0;
+
+	if (bufmgr_fake->evict_clock - bo_fake->evicted_at >= bufmgr_fake->size) {
+		bo_fake->evicted = 0;
+		return 0;
+	}
+
+	return 1;
+}
+
+static int
+evict_policy(drm_intel_bufmgr_fake *bufmgr_fake, unsigned int size)
+{
+	struct block *block;
+
+	DBG("%s\n", __FUNCTION__);
+
+	block = bufmgr_fake->evict_choose(bufmgr_fake, size);
+	if (block == NULL)
+		return 0;
+
+	evict_block(bufmgr_fake, block);
+	return 1;
 }
 
 static int
@@ -574,15 +724,10 @@ evict_mru(drm_intel_bufmgr_fake *bufmgr_fake)
 	DBG("%s\n", __FUNCTION__);
 
 	DRMLISTFOREACHSAFEREVERSE(block, tmp, &bufmgr_fake->lru) {
-		drm_intel_bo_fake *bo_fake = (drm_intel_bo_fake *) block->bo;
-
-		if (bo_fake && (bo_fake->flags & BM_NO_FENCE_SUBDATA))
+		if (!block_evictable(block))
 			continue;
 
-		set_dirty(&bo_fake->bo);
-		bo_fake->block = NULL;
-
-		free_block(bufmgr_fake, block, 0);
+		evict_block(bufmgr_fake, block);
 		return 1;
 	}
 
@@ -675,7 +820,7 @@ evict_and_alloc_block(drm_intel_bo *bo)
 	 * recently used textures.  We'll probably be thrashing soon:
 	 */
 	if (!bufmgr_fake->thrashing) {
-		while (evict_lru(bufmgr_fake, 0))
+		while (evict_policy(bufmgr_fake, bo->size))
 			if (alloc_block(bo))
 				return 1;
 	}
@@ -1183,11 +1328,15 @@ static int
 	}
 
 	/* Allocate the card memory */
-	if (!bo_fake->block && !evict_and_alloc_block(bo)) {
+	if (bo_fake->block) {
+		bo_fake->block->referenced = 1;
+	} else if (!evict_and_alloc_block(bo)) {
 		bufmgr_fake->fail = 1;
 		DBG("Failed to validate buf %d:%s\n", bo_fake->id,
 		    bo_fake->name);
 		return -1;
+	} else if (evicted_recently(bufmgr_fake, bo_fake)) {
+		bo_fake->block->referenced = 1;
 	}
 
 	assert(bo_fake->block);
@@ -1217,8 +1366,15 @@ static int
 		else
 			memset(bo_fake->block->virtual, 0, bo->size);
 
+		bufmgr_fake->stats.upload_bytes += bo->size;
+		if (bo_fake->evicted) {
+			bufmgr_fake->stats.reuploads++;
+			bufmgr_fake->stats.reupload_bytes += bo->size;
+		}
+
 		bo_fake->dirty = 0;
 	}
+	bo_fake->evicted = 0;
 
 	bo_fake->block->fenced = 0;
 	bo_fake->block->on_hardware = 1;
@@ -1573,6 +1729,69 @@ void drm_intel_bufmgr_fake_evict_all(drm_intel_bufmgr *bufmgr)
 	pthread_mutex_unlock(&bufmgr_fake->lock);
 }
 
+/**
+ * Selects the policy used to pick buffers to evict from the aperture when
+ * it runs out of space.
+ */
+int
+drm_intel_bufmgr_fake_set_evict_policy(drm_intel_bufmgr *bufmgr,
+				       enum drm_intel_fake_evict_policy policy)
+{
+	drm_intel_bufmgr_fake *bufmgr_fake = (drm_intel_bufmgr_fake *) bufmgr;
+	struct block *(*choose) (drm_intel_bufmgr_fake *bufmgr_fake,
+				 unsigned int size);
+
+	switch (policy) {
+	case DRM_INTEL_FAKE_EVICT_LRU:
+		choose = evict_choose_lru;
+		break;
+	case DRM_INTEL_FAKE_EVICT_SIZE:
+		choose = evict_choose_size;
+		break;
+	case DRM_INTEL_FAKE_EVICT_2Q:
+		choose = evict_choose_2q;
+		break;
+	default:
+		return -EINVAL;
+	}
+
+	pthread_mutex_lock(&bufmgr_fake->lock);
+	bufmgr_fake->evict_choose = choose;
+	pthread_mutex_unlock(&bufmgr_fake->lock);
+
+	return 0;
+}
+
+/**
+ * Returns the eviction and upload counters accumulated since the bufmgr was
+ * created or the last drm_intel_bufmgr_fake_reset_stats() call.
+ *
+ * Both this and drm_intel_bufmgr_fake_reset_stats() may be called from the
+ * exec callback, making it possible to record per-batch traffic and compare
+ * eviction policies offline.  The callback runs with the bufmgr lock held,
+ * which is why that lock is recursive.
+ */
+void
+drm_intel_bufmgr_fake_get_stats(drm_intel_bufmgr *bufmgr,
+				drm_intel_bufmgr_fake_stats *stats)
+{
+	drm_intel_bufmgr_fake *bufmgr_fake = (drm_intel_bufmgr_fake *) bufmgr;
+
+	pthread_mutex_lock(&bufmgr_fake->lock);
+	*stats = bufmgr_fake->stats;
+	pthread_mutex_unlock(&bufmgr_fake->lock);
+}
+
+void
+drm_intel_bufmgr_fake_reset_stats(drm_intel_bufmgr *bufmgr)
+{
+	drm_intel_bufmgr_fake *bufmgr_fake = (drm_intel_bufmgr_fake *) bufmgr;
+
+	pthread_mutex_lock(&bufmgr_fake->lock);
+	memset(&bufmgr_fake->stats, 0, sizeof(bufmgr_fake->stats));
+	pthread_mutex_unlock(&bufmgr_fake->lock);
+}
+
 void drm_intel_bufmgr_fake_set_last_dispatch(drm_intel_bufmgr *bufmgr,
 					     volatile unsigned int
 					     *last_dispatch)
@@ -1590,10 +1809,17 @@ drm_intel_bufmgr *drm_intel_bufmgr_fake_init(int fd,
 					     *last_dispatch)
 {
 	drm_intel_bufmgr_fake *bufmgr_fake;
+	pthread_mutexattr_t attr;
+	int ret;
 
 	bufmgr_fake = calloc(1, sizeof(*bufmgr_fake));
 
-	if (pthread_mutex_init(&bufmgr_fake->lock, NULL) != 0) {
+	/* Recursive, so that the exec callback can read the statistics. */
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+	ret = pthread_mutex_init(&bufmgr_fake->lock, &attr);
+	pthread_mutexattr_destroy(&attr);
+	if (ret != 0) {
 		free(bufmgr_fake);
 		return NULL;
 	}
@@ -1607,6 +1833,7 @@ drm_intel_bufmgr *drm_intel_bufmgr_fake_init(int fd,
 	bufmgr_fake->virtual = low_virtual;
 	bufmgr_fake->size = size;
 	bufmgr_fake->heap = mmInit(low_offset, size);
+	bufmgr_fake->evict_choose = evict_choose_lru;
 
 	/* Hook in methods */
 	bufmgr_fake->bufmgr.bo_alloc = drm_intel_fake_bo_alloc;
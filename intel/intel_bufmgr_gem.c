@@ -44,9 +44,11 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <unistd.h>
 #include <assert.h>
 #include <pthread.h>
+#include <poll.h>
 #include <sys/ioctl.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
@@ -62,6 +64,9 @@
 #include "intel_bufmgr_priv.h"
 #include "intel_chipset.h"
 #include "intel_aub.h"
+#include "intel_aub_writer.h"
+#include "intel_batch_timer.h"
+#include "intel_upload.h"
 #include "string.h"
 
 #include "i915_drm.h"
@@ -85,11 +90,121 @@
 
 typedef struct _drm_intel_bo_gem drm_intel_bo_gem;
 
+/**
+ * Cached BOs are kept in one list per tiling mode, so that a BO can usually
+ * be reused without changing its tiling.  Within a list, the few BOs at the
+ * end we'd allocate from are searched for one with the right stride too.
+ *
+ * BOs whose caching level isn't the default go in a list of their own,
+ * which only serves allocations asking for that level.
+ */
+#define BUCKET_TILING_MODES (I915_TILING_Y + 1)
+#define BUCKET_CACHING BUCKET_TILING_MODES
+#define BUCKET_LISTS (BUCKET_CACHING + 1)
+#define BUCKET_STRIDE_SEARCH 8
+
+/* Private allocation flag for a snooped BO, on top of BO_ALLOC_FOR_RENDER */
+#define BO_ALLOC_SNOOPED (1 << 16)
+
+/* Reads of a busy BO that go through a snooped staging BO */
+#define READBACK_MIN_SIZE (64 * 1024)
+#define READBACK_MAX_SIZE (16 * 1024 * 1024)
+
 struct drm_intel_gem_bo_bucket {
-	drmMMListHead head;
+	drmMMListHead head[BUCKET_LISTS];
 	unsigned long size;
 };
 
+/**
+ * Number of freed BOs a thread keeps per bucket, and the largest bucket
+ * size handled by the per-thread caches.
+ */
+#define MAGAZINE_ROUNDS 8
+#define MAGAZINE_MAX_SIZE (64 * 1024)
+
+struct drm_intel_gem_bo_round {
+	drm_intel_bo_gem *bo[MAGAZINE_ROUNDS];
+	int count;
+};
+
+/**
+ * Per-thread cache of freed BOs for the small buckets, so that the common
+ * alloc/free pattern doesn't need to take the bufmgr lock.  BOs only move
+ * between a magazine and the shared buckets in batches.
+ */
+struct drm_intel_gem_magazine {
+	struct _drm_intel_bufmgr_gem *bufmgr_gem;
+	drmMMListHead link;
+	/**
+	 * Protects the rounds and stats, so that other threads can read the
+	 * stats and empty the rounds.  Nests inside the bufmgr lock.
+	 */
+	pthread_mutex_t lock;
+	/** Reuse counts for allocations served by this magazine */
+	drm_intel_bufmgr_gem_cache_stats stats;
+	struct drm_intel_gem_bo_round round[];
+};
+
+/**
+ * Small BOs can be carved out of larger GEM objects, see
+ * drm_intel_bufmgr_gem_enable_slab_alloc().  Chunk sizes are powers of two
+ * from SLAB_MIN_CHUNK to SLAB_MAX_CHUNK.
+ */
+#define SLAB_SIZE (32 * 1024)
+#define SLAB_MIN_CHUNK 64
+#define SLAB_MAX_CHUNK 2048
+#define SLAB_NUM_CLASSES 6
+#define SLAB_MAX_CHUNKS (SLAB_SIZE / SLAB_MIN_CHUNK)
+
+struct drm_intel_gem_slab {
+	/** Link in the list of slabs with free chunks of this size */
+	drmMMListHead link;
+	/** GEM object backing the chunks */
+	drm_intel_bo *bo;
+	unsigned int chunk_size;
+	int num_chunks;
+	int num_free;
+	uint32_t free_mask[SLAB_MAX_CHUNKS / 32];
+	/** Live sub-allocated BOs, indexed by chunk */
+	drm_intel_bo_gem *chunk[SLAB_MAX_CHUNKS];
+};
+
+struct drm_intel_aub_reloc {
+	uint32_t offset;
+	uint32_t value;
+	int index;
+};
+
+/**
+ * Validation list of one execbuffer, owned by the submitting thread while
+ * it's built and submitted, so that submissions don't share any list state
+ * and only take the bufmgr lock around the bookkeeping either side of the
+ * ioctl.  Kept on a free list in between.
+ */
+struct drm_intel_gem_exec {
+	drmMMListHead link;
+	struct drm_i915_gem_exec_object *objects;
+	struct drm_i915_gem_exec_object2 *objects2;
+	drm_intel_bo **bos;
+	int size;
+	int count;
+	/**
+	 * Open-addressed table of 1 + the index in @bos of each BO, probed
+	 * from its GEM handle, or 0 for free slots.
+	 */
+	int *lookup;
+	unsigned int lookup_mask;
+	/**
+	 * This submission's copy of its BOs' relocations, which the kernel
+	 * reads and updates during the unlocked ioctl while other
+	 * submissions may be using the BOs' own arrays.
+	 */
+	struct drm_i915_gem_relocation_entry *relocs;
+	int relocs_size;
+	/** bufmgr_gem->exec_seqno when the list was started */
+	uint64_t start_seqno;
+};
+
 typedef struct _drm_intel_bufmgr_gem {
 	drm_intel_bufmgr bufmgr;
 
@@ -99,20 +214,58 @@ typedef struct _drm_intel_bufmgr_gem {
 
 	pthread_mutex_t lock;
 
-	struct drm_i915_gem_exec_object *exec_objects;
-	struct drm_i915_gem_exec_object2 *exec2_objects;
-	drm_intel_bo **exec_bos;
-	int exec_size;
-	int exec_count;
+	/** Validation lists not in use, see struct drm_intel_gem_exec */
+	drmMMListHead exec_free;
 
 	/** Array of lists of cached gem objects of power-of-two sizes */
 	struct drm_intel_gem_bo_bucket cache_bucket[14 * 4];
 	int num_buckets;
 	time_t time;
+	/** Reuse counts, not including those of live magazines */
+	drm_intel_bufmgr_gem_cache_stats cache_stats;
+
+	/** Background freeing of cached BOs, see enable_cache_reaper */
+	pthread_t reaper;
+	unsigned int reaper_max_age_ms;
+	/** Pipe written to stop the reaper */
+	int reaper_stop[2];
+	/** PSI trigger or cgroup memory.events, or -1 */
+	int pressure_fd;
+
+	/** Per-thread BO caches, see drm_intel_bufmgr_gem_enable_thread_cache */
+	pthread_key_t magazine_key;
+	drmMMListHead magazines;
+	int num_magazine_buckets;
+
+	/** Slabs with free chunks, for each sub-allocation size class */
+	drmMMListHead slab_class[SLAB_NUM_CLASSES];
 
-	drmMMListHead named;
+	/** Last generation handed out for aperture accounting */
+	uint32_t aperture_gen;
+
+	/**
+	 * Serial number of the last execbuffer, and for each ring the most
+	 * recent execbuffer known to have completed.
+	 */
+	uint64_t exec_seqno;
+	uint64_t ring_retired[I915_EXEC_RING_MASK + 1];
+
+	/** BOs shared with other processes, by flink name and by handle */
+	void *name_table;
+	void *handle_table;
 	drmMMListHead vma_cache;
 	int vma_count, vma_open, vma_max;
+	/**
+	 * Limit on cached mappings that keeps the process within
+	 * vm.max_map_count, or -1 if unknown.  Recomputed every
+	 * VMA_BUDGET_INTERVAL new mappings.
+	 */
+	int vma_budget;
+	int max_map_count;
+	int vma_created;
+	/** Set when the budget is due to be recomputed, outside the lock */
+	bool vma_recount;
+	drm_intel_bufmgr_gem_vma_stats vma_stats;
 
 	uint64_t gtt_size;
 	int available_fences;
@@ -126,11 +279,45 @@ typedef struct _drm_intel_bufmgr_gem {
 	unsigned int bo_reuse : 1;
 	unsigned int no_exec : 1;
 	unsigned int has_vebox : 1;
+	unsigned int thread_cache : 1;
+	unsigned int slab_alloc : 1;
+	unsigned int has_exec_no_reloc : 1;
+	unsigned int has_exec_handle_lut : 1;
+	unsigned int no_reloc : 1;
+	unsigned int aub_mmap : 1;
+	/** The reaper thread was started and hasn't been joined */
+	unsigned int reaper_running : 1;
+	unsigned int no_userptr : 1;
 	bool fenced_relocs;
+	/**
+	 * The reaper looks after the cache.  Not a bitfield, as the reaper
+	 * clears it under the lock if it has to give up.
+	 */
+	bool cache_reaper;
 
 	char *aub_filename;
-	FILE *aub_file;
+	struct drm_intel_aub_writer *aub_writer;
 	uint32_t aub_offset;
+	/** Relocations of the BO being dumped, sorted by offset */
+	struct drm_intel_aub_reloc *aub_relocs;
+	int aub_reloc_count;
+	int aub_relocs_size;
+
+	/** GPU timing of every batch, if enabled */
+	struct drm_intel_batch_timer *batch_timer;
+
+	/** Staging ring for drm_intel_bo_subdata(), if enabled */
+	struct drm_intel_uploader *uploader;
+
+	/**
+	 * Destroyed hardware contexts kept for drm_intel_gem_context_create(),
+	 * most recently destroyed last.
+	 */
+	drm_intel_context **context_pool;
+	int context_pool_count, context_pool_max;
+	int (*context_reset)(drm_intel_context *ctx, void *data);
+	void *context_reset_data;
+	drm_intel_bufmgr_gem_context_stats context_stats;
 } drm_intel_bufmgr_gem;
 
 #define DRM_INTEL_RELOC_FENCE (1<<0)
@@ -151,13 +338,30 @@ struct _drm_intel_bo_gem {
 	 * Kenel-assigned global name for this object
 	 */
 	unsigned int global_name;
-	drmMMListHead name_list;
 
 	/**
-	 * Index of the buffer within the validation list while preparing a
-	 * batchbuffer execution.
+	 * Whether this BO is in the bufmgr's handle table, and its global
+	 * name (if any) in the name table, so that importing it again returns
+	 * this BO.
+	 */
+	bool shared;
+
+	/** Serial number and ring of the last execbuffer using this BO */
+	uint64_t exec_seqno;
+	int exec_ring;
+	/**
+	 * Whether an earlier execbuffer on another ring may still be using
+	 * this BO.  Rings retire independently, so until the BO is seen idle
+	 * exec_seqno then says nothing about whether it is.
 	 */
-	int validate_index;
+	bool exec_other_ring;
+	/**
+	 * Serial number of the last execbuffer known to have been submitted
+	 * no later than that one, and so to have retired when this BO is
+	 * idle.  Less than exec_seqno when another thread's execbuffer
+	 * overlapped it.
+	 */
+	uint64_t exec_retires;
 
 	/**
 	 * Current tiling mode
@@ -166,7 +370,14 @@ struct _drm_intel_bo_gem {
 	uint32_t swizzle_mode;
 	unsigned long stride;
 
+	/** I915_CACHEING_* level set on the BO */
+	uint32_t caching;
+
 	time_t free_time;
+	/** CLOCK_MONOTONIC time of the free in ms, with the cache reaper */
+	uint64_t free_ms;
+	/** Whether the BO was last marked I915_MADV_DONTNEED */
+	bool dontneed;
 
 	/** Array passed to the DRM containing relocation information. */
 	struct drm_i915_gem_relocation_entry *relocs;
@@ -180,17 +391,37 @@ struct _drm_intel_bo_gem {
 	void *mem_virtual;
 	/** GTT virtual address for the buffer, saved across map/unmap cycles */
 	void *gtt_virtual;
+	/** Application memory wrapped by a userptr BO */
+	void *user_virtual;
 	int map_count;
 	drmMMListHead vma_list;
+	/** Mappings recreated after the VMA cache evicted them */
+	unsigned int vma_remaps;
+	bool vma_evicted;
+
+	/** Uploader batch with a pending copy into this BO, or 0 */
+	uint64_t upload_id;
 
 	/** BO cache list */
 	drmMMListHead head;
 
 	/**
-	 * Boolean of whether this BO and its children have been included in
-	 * the current drm_intel_bufmgr_check_aperture_space() total.
+	 * Generation of the relocation tree rooted at this BO, which is
+	 * started by its first relocation.  Buffers are counted in the tree's
+	 * reloc_tree_size and reloc_tree_fences as relocations to them are
+	 * emitted, and marked with the generation so they are counted once.
 	 */
-	bool included_in_check_aperture;
+	uint32_t tree_gen;
+	/** Generation of the tree this BO was last counted in */
+	uint32_t tree_mark;
+	/** Whether this BO's fence was counted in that tree */
+	bool tree_fence_counted;
+
+	/**
+	 * Generation of the last drm_intel_gem_compute_batch_space() walk
+	 * that included this BO.
+	 */
+	uint32_t check_mark;
 
 	/**
 	 * Boolean of whether this buffer has been used as a relocation
@@ -209,11 +440,16 @@ struct _drm_intel_bo_gem {
 	 */
 	bool reusable;
 
+	/** Aperture space in bytes needed by this buffer alone */
+	int aperture_size;
+
 	/**
-	 * Size in bytes of this buffer and its relocation descendents.
+	 * Aperture space in bytes needed by this buffer and its relocation
+	 * descendents, each counted once.
 	 *
-	 * Used to avoid costly tree walking in
-	 * drm_intel_bufmgr_check_aperture in the common case.
+	 * Kept up to date by drm_intel_bo_emit_reloc() so that
+	 * drm_intel_bufmgr_check_aperture_space() doesn't need to walk the
+	 * tree in the common case.
 	 */
 	int reloc_tree_size;
 
@@ -230,6 +466,15 @@ struct _drm_intel_bo_gem {
 
 	drm_intel_aub_annotation *aub_annotations;
 	unsigned aub_annotation_count;
+
+	/**
+	 * For a BO sub-allocated from a slab, the slab and the offset of the
+	 * BO within the slab's GEM object, whose handle it shares.
+	 */
+	struct drm_intel_gem_slab *slab;
+	uint32_t slab_offset;
+	/** For the GEM object backing a slab, the slab */
+	struct drm_intel_gem_slab *slab_owner;
 };
 
 static unsigned int
@@ -242,6 +487,19 @@ static int
 drm_intel_gem_bo_get_tiling(drm_intel_bo *bo, uint32_t * tiling_mode,
 			    uint32_t * swizzle_mode);
 
+static void
+drm_intel_gem_context_pool_trim(drm_intel_bufmgr_gem *bufmgr_gem, int limit);
+
+static void drm_intel_gem_bo_close_vma(drm_intel_bufmgr_gem *bufmgr_gem,
+				       drm_intel_bo_gem *bo_gem);
+
+static void
+drm_intel_gem_bo_mark_mmaps_incoherent(drm_intel_bo *bo);
+
+static bool
+drm_intel_gem_bo_known_idle(drm_intel_bufmgr_gem *bufmgr_gem,
+			    drm_intel_bo_gem *bo_gem);
+
 static int
 drm_intel_gem_bo_set_tiling_internal(drm_intel_bo *bo,
 				     uint32_t tiling_mode,
@@ -254,6 +512,13 @@ static void drm_intel_gem_bo_unreference(drm_intel_bo *bo);
 
 static void drm_intel_gem_bo_free(drm_intel_bo *bo);
 
+static void drm_intel_gem_stop_cache_reaper(drm_intel_bufmgr_gem *bufmgr_gem);
+
+static int drm_intel_gem_bo_unmap(drm_intel_bo *bo);
+
+static void
+drm_intel_gem_cleanup_bo_cache(drm_intel_bufmgr_gem *bufmgr_gem, time_t time);
+
 static unsigned long
 drm_intel_gem_bo_tile_size(drm_intel_bufmgr_gem *bufmgr_gem, unsigned long size,
 			   uint32_t *tiling_mode)
@@ -336,6 +601,15 @@ drm_intel_gem_bo_tile_pitch(drm_intel_bufmgr_gem *bufmgr_gem,
 	return i;
 }
 
+static uint64_t
+drm_intel_gem_now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
 static struct drm_intel_gem_bo_bucket *
 drm_intel_gem_bo_bucket_for_size(drm_intel_bufmgr_gem *bufmgr_gem,
 				 unsigned long size)
@@ -354,12 +628,13 @@ drm_intel_gem_bo_bucket_for_size(drm_intel_bufmgr_gem *bufmgr_gem,
 }
 
 static void
-drm_intel_gem_dump_validation_list(drm_intel_bufmgr_gem *bufmgr_gem)
+drm_intel_gem_dump_validation_list(drm_intel_bufmgr_gem *bufmgr_gem,
+				   struct drm_intel_gem_exec *exec)
 {
 	int i, j;
 
-	for (i = 0; i < bufmgr_gem->exec_count; i++) {
-		drm_intel_bo *bo = bufmgr_gem->exec_bos[i];
+	for (i = 0; i < exec->count; i++) {
+		drm_intel_bo *bo = exec->bos[i];
 		drm_intel_bo_gem *bo_gem = (drm_intel_bo_gem *) bo;
 
 		if (bo_gem->relocs == NULL) {
@@ -394,6 +669,176 @@ drm_intel_gem_bo_reference(drm_intel_bo *bo)
 	atomic_inc(&bo_gem->refcount);
 }
 
+/**
+ * Returns the BO that owns the GEM object behind @bo, which is the slab's
+ * BO for sub-allocated buffers and @bo itself otherwise.
+ */
+static inline drm_intel_bo *
+drm_intel_gem_bo_backing(drm_intel_bo *bo)
+{
+	drm_intel_bo_gem *bo_gem = (drm_intel_bo_gem *) bo;
+
+	return bo_gem->slab ? bo_gem->slab->bo : bo;
+}
+
+/** Takes an empty validation list from the free list, or allocates one. */
+static struct drm_intel_gem_exec *
+drm_intel_gem_exec_get(drm_intel_bufmgr_gem *bufmgr_gem)
+{
+	struct drm_intel_gem_exec *exec = NULL;
+
+	pthread_mutex_lock(&bufmgr_gem->lock);
+	if (!DRMLISTEMPTY(&bufmgr_gem->exec_free)) {
+		exec = DRMLISTENTRY(struct drm_intel_gem_exec,
+				    bufmgr_gem->exec_free.next, link);
+		DRMLISTDEL(&exec->link);
+	}
+	pthread_mutex_unlock(&bufmgr_gem->lock);
+
+	if (exec == NULL)
+		exec = calloc(1, sizeof(*exec));
+
+	return exec;
+}
+
+/* Returns the ring execbuffer @flags select, with the default one named. */
+static int
+drm_intel_gem_exec_ring(unsigned int flags)
+{
+	int ring = flags & I915_EXEC_RING_MASK;
+
+	return ring == I915_EXEC_DEFAULT ? I915_EXEC_RENDER : ring;
+}
+
+/**
+ * Records the serial number @exec starts from, and stops its BOs being
+ * known idle until it's submitted and drm_intel_gem_mark_exec_bos() has
+ * numbered it.  Called with the lock held, before the ioctl.
+ */
+static void
+drm_intel_gem_exec_begin_locked(drm_intel_bufmgr_gem *bufmgr_gem,
+				struct drm_intel_gem_exec *exec,
+				unsigned int flags)
+{
+	int ring = drm_intel_gem_exec_ring(flags);
+	int i;
+
+	exec->start_seqno = bufmgr_gem->exec_seqno;
+	for (i = 0; i < exec->count; i++) {
+		drm_intel_bo_gem *bo_gem = (drm_intel_bo_gem *) exec->bos[i];
+
+		if (bo_gem->exec_ring != ring &&
+		    !drm_intel_gem_bo_known_idle(bufmgr_gem, bo_gem))
+			bo_gem->exec_other_ring = true;
+		bo_gem->exec_ring = ring;
+		bo_gem->exec_seqno = UINT64_MAX;
+	}
+}
+
+/* Empties @exec and puts it on the free list.  Called with the lock held. */
+static void
+drm_intel_gem_exec_put_locked(drm_intel_bufmgr_gem *bufmgr_gem,
+			      struct drm_intel_gem_exec *exec)
+{
+	exec->count = 0;
+	if (exec->lookup)
+		memset(exec->lookup, 0,
+		       (exec->lookup_mask + 1) * sizeof(exec->lookup[0]));
+
+	DRMLISTADD(&exec->link, &bufmgr_gem->exec_free);
+}
+
+static void
+drm_intel_gem_exec_free(struct drm_intel_gem_exec *exec)
+{
+	free(exec->objects);
+	free(exec->objects2);
+	free(exec->bos);
+	free(exec->lookup);
+	free(exec->relocs);
+	free(exec);
+}
+
+/* Returns the lookup slot that holds @bo, or the free one it would go in. */
+static int *
+drm_intel_gem_exec_slot(struct drm_intel_gem_exec *exec, drm_intel_bo *bo)
+{
+	drm_intel_bo_gem *bo_gem = (drm_intel_bo_gem *) bo;
+	unsigned int i = bo_gem->gem_handle;
+
+	/* Handles are small and dense, so they hash well as they are. */
+	for (;; i++) {
+		int *slot = &exec->lookup[i & exec->lookup_mask];
+
+		if (*slot == 0 || exec->bos[*slot - 1] == bo)
+			return slot;
+	}
+}
+
+/* Returns @bo's index in the validation list, or -1. */
+static int
+drm_intel_gem_exec_index(struct drm_intel_gem_exec *exec, drm_intel_bo *bo)
+{
+	return *drm_intel_gem_exec_slot(exec, bo) - 1;
+}
+
+/*
+ * Makes room for one more BO in the validation list, keeping the lookup
+ * table at most half full.  Returns false if out of memory.
+ */
+static bool
+drm_intel_gem_exec_reserve(struct drm_intel_gem_exec *exec)
+{
+	int i;
+
+	/* Both kinds of object array are kept the same size as @bos. */
+	if (exec->count == exec->size) {
+		int new_size = exec->size * 2;
+		void *objects, *objects2, *bos;
+
+		if (new_size == 0)
+			new_size = 16;
+
+		objects = realloc(exec->objects,
+				  sizeof(*exec->objects) * new_size);
+		if (objects)
+			exec->objects = objects;
+		objects2 = realloc(exec->objects2,
+				   sizeof(*exec->objects2) * new_size);
+		if (objects2)
+			exec->objects2 = objects2;
+		bos = realloc(exec->bos, sizeof(*exec->bos) * new_size);
+		if (bos)
+			exec->bos = bos;
+		if (objects == NULL || objects2 == NULL || bos == NULL)
+			return false;
+
+		exec->size = new_size;
+	}
+
+	if (exec->lookup == NULL ||
+	    (unsigned int)exec->count * 2 >= exec->lookup_mask + 1) {
+		unsigned int lookup_size = exec->lookup_mask + 1;
+		int *lookup;
+
+		while ((unsigned int)exec->count * 2 >= lookup_size ||
+		       lookup_size < 64)
+			lookup_size *= 2;
+
+		lookup = calloc(lookup_size, sizeof(*lookup));
+		if (lookup == NULL)
+			return false;
+
+		free(exec->lookup);
+		exec->lookup = lookup;
+		exec->lookup_mask = lookup_size - 1;
+		for (i = 0; i < exec->count; i++)
+			*drm_intel_gem_exec_slot(exec, exec->bos[i]) = i + 1;
+	}
+
+	return true;
+}
+
 /**
  * Adds the given buffer to the list of buffers to be validated (moved into the
  * appropriate memory type) with the next batch submission.
@@ -401,92 +846,74 @@ drm_intel_gem_bo_reference(drm_intel_bo *bo)
  * If a buffer is validated multiple times in a batch submission, it ends up
  * with the intersection of the memory type flags and the union of the
  * access flags.
+ *
+ * Returns false if out of memory.
  */
-static void
-drm_intel_add_validate_buffer(drm_intel_bo *bo)
+static bool
+drm_intel_add_validate_buffer(struct drm_intel_gem_exec *exec,
+			      drm_intel_bo *bo)
 {
-	drm_intel_bufmgr_gem *bufmgr_gem = (drm_intel_bufmgr_gem *) bo->bufmgr;
 	drm_intel_bo_gem *bo_gem = (drm_intel_bo_gem *) bo;
-	int index;
-
-	if (bo_gem->validate_index != -1)
-		return;
-
-	/* Extend the array of validation entries as necessary. */
-	if (bufmgr_gem->exec_count == bufmgr_gem->exec_size) {
-		int new_size = bufmgr_gem->exec_size * 2;
+	int index, *slot;
 
-		if (new_size == 0)
-			new_size = 5;
+	if (!drm_intel_gem_exec_reserve(exec))
+		return false;
 
-		bufmgr_gem->exec_objects =
-		    realloc(bufmgr_gem->exec_objects,
-			    sizeof(*bufmgr_gem->exec_objects) * new_size);
-		bufmgr_gem->exec_bos =
-		    realloc(bufmgr_gem->exec_bos,
-			    sizeof(*bufmgr_gem->exec_bos) * new_size);
-		bufmgr_gem->exec_size = new_size;
-	}
+	slot = drm_intel_gem_exec_slot(exec, bo);
+	if (*slot)
+		return true;
 
-	index = bufmgr_gem->exec_count;
-	bo_gem->validate_index = index;
+	index = exec->count;
+	*slot = index + 1;
 	/* Fill in array entry */
-	bufmgr_gem->exec_objects[index].handle = bo_gem->gem_handle;
-	bufmgr_gem->exec_objects[index].relocation_count = bo_gem->reloc_count;
-	bufmgr_gem->exec_objects[index].relocs_ptr = (uintptr_t) bo_gem->relocs;
-	bufmgr_gem->exec_objects[index].alignment = 0;
-	bufmgr_gem->exec_objects[index].offset = 0;
-	bufmgr_gem->exec_bos[index] = bo;
-	bufmgr_gem->exec_count++;
+	exec->objects[index].handle = bo_gem->gem_handle;
+	exec->objects[index].relocation_count = bo_gem->reloc_count;
+	exec->objects[index].relocs_ptr = (uintptr_t) bo_gem->relocs;
+	exec->objects[index].alignment = 0;
+	exec->objects[index].offset = 0;
+	exec->bos[index] = bo;
+	exec->count++;
+
+	return true;
 }
 
-static void
-drm_intel_add_validate_buffer2(drm_intel_bo *bo, int need_fence)
+static bool
+drm_intel_add_validate_buffer2(struct drm_intel_gem_exec *exec,
+			       drm_intel_bo *bo, int need_fence)
 {
-	drm_intel_bufmgr_gem *bufmgr_gem = (drm_intel_bufmgr_gem *)bo->bufmgr;
 	drm_intel_bo_gem *bo_gem = (drm_intel_bo_gem *)bo;
-	int index;
+	int index, *slot;
+
+	if (!drm_intel_gem_exec_reserve(exec))
+		return false;
 
-	if (bo_gem->validate_index != -1) {
+	slot = drm_intel_gem_exec_slot(exec, bo);
+	if (*slot) {
 		if (need_fence)
-			bufmgr_gem->exec2_objects[bo_gem->validate_index].flags |=
+			exec->objects2[*slot - 1].flags |=
 				EXEC_OBJECT_NEEDS_FENCE;
-		return;
-	}
-
-	/* Extend the array of validation entries as necessary. */
-	if (bufmgr_gem->exec_count == bufmgr_gem->exec_size) {
-		int new_size = bufmgr_gem->exec_size * 2;
-
-		if (new_size == 0)
-			new_size = 5;
-
-		bufmgr_gem->exec2_objects =
-			realloc(bufmgr_gem->exec2_objects,
-				sizeof(*bufmgr_gem->exec2_objects) * new_size);
-		bufmgr_gem->exec_bos =
-			realloc(bufmgr_gem->exec_bos,
-				sizeof(*bufmgr_gem->exec_bos) * new_size);
-		bufmgr_gem->exec_size = new_size;
+		return true;
 	}
 
-	index = bufmgr_gem->exec_count;
-	bo_gem->validate_index = index;
+	index = exec->count;
+	*slot = index + 1;
 	/* Fill in array entry */
-	bufmgr_gem->exec2_objects[index].handle = bo_gem->gem_handle;
-	bufmgr_gem->exec2_objects[index].relocation_count = bo_gem->reloc_count;
-	bufmgr_gem->exec2_objects[index].relocs_ptr = (uintptr_t)bo_gem->relocs;
-	bufmgr_gem->exec2_objects[index].alignment = 0;
-	bufmgr_gem->exec2_objects[index].offset = 0;
-	bufmgr_gem->exec_bos[index] = bo;
-	bufmgr_gem->exec2_objects[index].flags = 0;
-	bufmgr_gem->exec2_objects[index].rsvd1 = 0;
-	bufmgr_gem->exec2_objects[index].rsvd2 = 0;
+	exec->objects2[index].handle = bo_gem->gem_handle;
+	exec->objects2[index].relocation_count = bo_gem->reloc_count;
+	exec->objects2[index].relocs_ptr = (uintptr_t)bo_gem->relocs;
+	exec->objects2[index].alignment = 0;
+	exec->objects2[index].offset = 0;
+	exec->bos[index] = bo;
+	exec->objects2[index].flags = 0;
+	exec->objects2[index].rsvd1 = 0;
+	exec->objects2[index].rsvd2 = 0;
 	if (need_fence) {
-		bufmgr_gem->exec2_objects[index].flags |=
+		exec->objects2[index].flags |=
 			EXEC_OBJECT_NEEDS_FENCE;
 	}
-	bufmgr_gem->exec_count++;
+	exec->count++;
+
+	return true;
 }
 
 #define RELOC_BUF_SIZE(x) ((I915_RELOC_HEADER + x * I915_RELOC0_STRIDE) * \
@@ -525,9 +952,85 @@ drm_intel_bo_gem_set_in_aperture_size(drm_intel_bufmgr_gem *bufmgr_gem,
 		size = 2 * min_size;
 	}
 
+	bo_gem->aperture_size = size;
 	bo_gem->reloc_tree_size = size;
 }
 
+/**
+ * Returns a new generation for aperture accounting.  Called with the
+ * bufmgr lock held.
+ */
+static uint32_t
+drm_intel_gem_next_aperture_gen(drm_intel_bufmgr_gem *bufmgr_gem)
+{
+	/* Zero is never handed out, as it means "not counted" */
+	if (++bufmgr_gem->aperture_gen == 0)
+		bufmgr_gem->aperture_gen = 1;
+
+	return bufmgr_gem->aperture_gen;
+}
+
+/**
+ * Counts @bo_gem and its relocation descendents into the tree rooted at
+ * @root, skipping the buffers the tree already includes.
+ */
+static void
+drm_intel_gem_bo_account_tree(drm_intel_bo_gem *root, drm_intel_bo_gem *bo_gem)
+{
+	int i;
+
+	if (bo_gem->tree_mark != root->tree_gen) {
+		bo_gem->tree_mark = root->tree_gen;
+		bo_gem->tree_fence_counted = false;
+		root->reloc_tree_size += bo_gem->aperture_size;
+
+		for (i = 0; i < bo_gem->reloc_count; i++) {
+			drm_intel_bo_gem *target_bo_gem = (drm_intel_bo_gem *)
+				bo_gem->reloc_target_info[i].bo;
+
+			if (target_bo_gem != bo_gem)
+				drm_intel_gem_bo_account_tree(root,
+							      target_bo_gem);
+		}
+	}
+
+	/* Only buffers without relocations need fences, and for those
+	 * reloc_tree_fences says whether they do.
+	 */
+	if (bo_gem->reloc_count == 0 && bo_gem->reloc_tree_fences &&
+	    !bo_gem->tree_fence_counted) {
+		bo_gem->tree_fence_counted = true;
+		root->reloc_tree_fences++;
+	}
+}
+
+/**
+ * Starts a new relocation tree at @bo_gem and counts the relocations it
+ * already has.
+ */
+static void
+drm_intel_gem_bo_start_tree(drm_intel_bufmgr_gem *bufmgr_gem,
+			    drm_intel_bo_gem *bo_gem)
+{
+	int i;
+
+	pthread_mutex_lock(&bufmgr_gem->lock);
+	bo_gem->tree_gen = drm_intel_gem_next_aperture_gen(bufmgr_gem);
+	pthread_mutex_unlock(&bufmgr_gem->lock);
+
+	bo_gem->tree_mark = bo_gem->tree_gen;
+	bo_gem->reloc_tree_size = bo_gem->aperture_size;
+	bo_gem->reloc_tree_fences = 0;
+
+	for (i = 0; i < bo_gem->reloc_count; i++) {
+		drm_intel_bo_gem *target_bo_gem = (drm_intel_bo_gem *)
+			bo_gem->reloc_target_info[i].bo;
+
+		if (target_bo_gem != bo_gem)
+			drm_intel_gem_bo_account_tree(bo_gem, target_bo_gem);
+	}
+}
+
 static int
 drm_intel_setup_reloc_list(drm_intel_bo *bo)
 {
@@ -557,40 +1060,174 @@ drm_intel_setup_reloc_list(drm_intel_bo *bo)
 	return 0;
 }
 
+/**
+ * Returns whether the last execbuffer referencing @bo_gem is known to
+ * have completed, in which case it is idle and no GEM_BUSY round trip is
+ * needed.  Batches on a ring complete in order, so any BO observed idle
+ * retires all earlier submissions on its ring, though not on the others.
+ * BOs shared with other processes may be busy with work we didn't submit
+ * and are never known idle.
+ *
+ * Called with the bufmgr lock held.
+ */
+static bool
+drm_intel_gem_bo_known_idle(drm_intel_bufmgr_gem *bufmgr_gem,
+			    drm_intel_bo_gem *bo_gem)
+{
+	if (bo_gem->shared || bo_gem->exec_other_ring)
+		return false;
+
+	return bo_gem->exec_seqno <=
+		bufmgr_gem->ring_retired[bo_gem->exec_ring];
+}
+
+/* Records that @bo_gem was observed idle.  Called with the lock held. */
+static void
+drm_intel_gem_bo_mark_idle(drm_intel_bufmgr_gem *bufmgr_gem,
+			   drm_intel_bo_gem *bo_gem)
+{
+	uint64_t *retired = &bufmgr_gem->ring_retired[bo_gem->exec_ring];
+
+	if (bo_gem->exec_retires > *retired)
+		*retired = bo_gem->exec_retires;
+
+	/* Whatever that says about the rest of the ring, this BO is idle,
+	 * unless another thread is submitting it right now.
+	 */
+	if (bo_gem->exec_seqno != UINT64_MAX) {
+		bo_gem->exec_seqno = bo_gem->exec_retires;
+		bo_gem->exec_other_ring = false;
+	}
+}
+
+/**
+ * Records the execbuffer @exec was just submitted in.  Called with the
+ * lock held.
+ *
+ * Serial numbers are handed out here, after the ioctl, so they only follow
+ * the kernel's order for execbuffers that didn't overlap another thread's.
+ * If any were numbered while this one was in flight, this one may have
+ * reached the kernel before them, so seeing its BOs idle only retires the
+ * execbuffers numbered before it started.
+ */
+static void
+drm_intel_gem_mark_exec_bos(drm_intel_bufmgr_gem *bufmgr_gem,
+			    struct drm_intel_gem_exec *exec,
+			    unsigned int flags)
+{
+	int ring = drm_intel_gem_exec_ring(flags);
+	uint64_t retires;
+	int i;
+
+	bufmgr_gem->exec_seqno++;
+	retires = bufmgr_gem->exec_seqno;
+	if (exec->start_seqno + 1 != retires)
+		retires = exec->start_seqno;
+
+	for (i = 0; i < exec->count; i++) {
+		drm_intel_bo_gem *bo_gem = (drm_intel_bo_gem *) exec->bos[i];
+
+		/* Another thread began submitting it on another ring
+		 * while this execbuffer was in flight.
+		 */
+		if (bo_gem->exec_ring != ring)
+			bo_gem->exec_other_ring = true;
+		bo_gem->exec_seqno = bufmgr_gem->exec_seqno;
+		bo_gem->exec_retires = retires;
+		bo_gem->exec_ring = ring;
+	}
+}
+
+/**
+ * Returns whether @bo_gem is busy, asking the kernel only when that isn't
+ * known already.  Called with the bufmgr lock held.
+ */
 static int
-drm_intel_gem_bo_busy(drm_intel_bo *bo)
+drm_intel_gem_bo_busy_locked(drm_intel_bufmgr_gem *bufmgr_gem,
+			     drm_intel_bo_gem *bo_gem)
 {
-	drm_intel_bufmgr_gem *bufmgr_gem = (drm_intel_bufmgr_gem *) bo->bufmgr;
-	drm_intel_bo_gem *bo_gem = (drm_intel_bo_gem *) bo;
 	struct drm_i915_gem_busy busy;
 	int ret;
 
+	if (drm_intel_gem_bo_known_idle(bufmgr_gem, bo_gem))
+		return 0;
+
 	VG_CLEAR(busy);
 	busy.handle = bo_gem->gem_handle;
 
 	ret = drmIoctl(bufmgr_gem->fd, DRM_IOCTL_I915_GEM_BUSY, &busy);
+	if (ret == 0 && !busy.busy)
+		drm_intel_gem_bo_mark_idle(bufmgr_gem, bo_gem);
 
 	return (ret == 0 && busy.busy);
 }
 
+/**
+ * Submits the staged copies into @bo_gem, if any, before the CPU looks at
+ * it or hands it out.  Called without the bufmgr lock.
+ *
+ * Returns an error if staged copies were lost.
+ */
 static int
-drm_intel_gem_bo_madvise_internal(drm_intel_bufmgr_gem *bufmgr_gem,
-				  drm_intel_bo_gem *bo_gem, int state)
+drm_intel_gem_bo_flush_upload(drm_intel_bufmgr_gem *bufmgr_gem,
+			      drm_intel_bo_gem *bo_gem)
 {
-	struct drm_i915_gem_madvise madv;
+	uint64_t upload_id;
 
-	VG_CLEAR(madv);
-	madv.handle = bo_gem->gem_handle;
-	madv.madv = state;
-	madv.retained = 1;
-	drmIoctl(bufmgr_gem->fd, DRM_IOCTL_I915_GEM_MADVISE, &madv);
+	if (!bufmgr_gem->uploader)
+		return 0;
 
-	return madv.retained;
-}
+	pthread_mutex_lock(&bufmgr_gem->lock);
+	upload_id = bo_gem->upload_id;
+	bo_gem->upload_id = 0;
+	pthread_mutex_unlock(&bufmgr_gem->lock);
+
+	if (upload_id == 0)
+		return 0;
+
+	return drm_intel_uploader_flush(bufmgr_gem->uploader, upload_id);
+}
+
+static int
+drm_intel_gem_bo_busy(drm_intel_bo *bo)
+{
+	drm_intel_bufmgr_gem *bufmgr_gem = (drm_intel_bufmgr_gem *) bo->bufmgr;
+	drm_intel_bo_gem *bo_gem =
+		(drm_intel_bo_gem *) drm_intel_gem_bo_backing(bo);
+	int ret;
+
+	drm_intel_gem_bo_flush_upload(bufmgr_gem, bo_gem);
+
+	pthread_mutex_lock(&bufmgr_gem->lock);
+	ret = drm_intel_gem_bo_busy_locked(bufmgr_gem, bo_gem);
+	pthread_mutex_unlock(&bufmgr_gem->lock);
+
+	return ret;
+}
+
+static int
+drm_intel_gem_bo_madvise_internal(drm_intel_bufmgr_gem *bufmgr_gem,
+				  drm_intel_bo_gem *bo_gem, int state)
+{
+	struct drm_i915_gem_madvise madv;
+
+	VG_CLEAR(madv);
+	madv.handle = bo_gem->gem_handle;
+	madv.madv = state;
+	madv.retained = 1;
+	if (drmIoctl(bufmgr_gem->fd, DRM_IOCTL_I915_GEM_MADVISE, &madv) == 0)
+		bo_gem->dontneed = state == I915_MADV_DONTNEED;
+
+	return madv.retained;
+}
 
 static int
 drm_intel_gem_bo_madvise(drm_intel_bo *bo, int madv)
 {
+	/* The backing storage of a sub-allocated BO is shared. */
+	if (((drm_intel_bo_gem *) bo)->slab)
+		return 1;
+
 	return drm_intel_gem_bo_madvise_internal
 		((drm_intel_bufmgr_gem *) bo->bufmgr,
 		 (drm_intel_bo_gem *) bo,
@@ -602,18 +1239,476 @@ static void
 drm_intel_gem_bo_cache_purge_bucket(drm_intel_bufmgr_gem *bufmgr_gem,
 				    struct drm_intel_gem_bo_bucket *bucket)
 {
-	while (!DRMLISTEMPTY(&bucket->head)) {
-		drm_intel_bo_gem *bo_gem;
+	int i;
+
+	for (i = 0; i < BUCKET_LISTS; i++) {
+		while (!DRMLISTEMPTY(&bucket->head[i])) {
+			drm_intel_bo_gem *bo_gem;
 
-		bo_gem = DRMLISTENTRY(drm_intel_bo_gem,
-				      bucket->head.next, head);
-		if (drm_intel_gem_bo_madvise_internal
-		    (bufmgr_gem, bo_gem, I915_MADV_DONTNEED))
+			bo_gem = DRMLISTENTRY(drm_intel_bo_gem,
+					      bucket->head[i].next, head);
+			if (drm_intel_gem_bo_madvise_internal
+			    (bufmgr_gem, bo_gem, I915_MADV_DONTNEED))
+				break;
+
+			DRMLISTDEL(&bo_gem->head);
+			drm_intel_gem_bo_free(&bo_gem->bo);
+		}
+	}
+}
+
+static uint32_t
+drm_intel_gem_default_caching(drm_intel_bufmgr_gem *bufmgr_gem)
+{
+	return bufmgr_gem->has_llc ? I915_CACHEING_CACHED : I915_CACHEING_NONE;
+}
+
+static int
+drm_intel_gem_bo_set_caching_internal(drm_intel_bufmgr_gem *bufmgr_gem,
+				      drm_intel_bo_gem *bo_gem,
+				      uint32_t caching)
+{
+	struct drm_i915_gem_cacheing arg;
+
+	if (bo_gem->caching == caching)
+		return 0;
+
+	VG_CLEAR(arg);
+	arg.handle = bo_gem->gem_handle;
+	arg.cacheing = caching;
+	if (drmIoctl(bufmgr_gem->fd, DRM_IOCTL_I915_GEM_SET_CACHEING, &arg))
+		return -errno;
+
+	bo_gem->caching = caching;
+	return 0;
+}
+
+/** Adds a freed BO to the list for its tiling mode or caching level. */
+static void
+drm_intel_gem_bo_bucket_add(struct drm_intel_gem_bo_bucket *bucket,
+			    drm_intel_bo_gem *bo_gem)
+{
+	drm_intel_bufmgr_gem *bufmgr_gem =
+		(drm_intel_bufmgr_gem *) bo_gem->bo.bufmgr;
+	int list = bo_gem->tiling_mode;
+
+	if (bo_gem->caching != drm_intel_gem_default_caching(bufmgr_gem))
+		list = BUCKET_CACHING;
+
+	DRMLISTADDTAIL(&bo_gem->head, &bucket->head[list]);
+}
+
+/**
+ * Takes a BO out of the bucket for an allocation with the given tiling,
+ * or returns NULL if there is none suitable.  Called with the lock held.
+ *
+ * Render targets come from the most recently freed end of a list and
+ * anything else from the oldest end, and then only while idle, as before.
+ * A BO that already has the requested tiling and stride is preferred,
+ * then one with the same tiling, then the first usable one of another
+ * tiling mode.  Snooped allocations only take from the caching list.
+ */
+static drm_intel_bo_gem *
+drm_intel_gem_bo_bucket_take(drm_intel_bufmgr_gem *bufmgr_gem,
+			     struct drm_intel_gem_bo_bucket *bucket,
+			     bool for_render, bool snooped,
+			     uint32_t tiling_mode,
+			     unsigned long stride)
+{
+	drm_intel_bo_gem *bo_gem, *fallback = NULL;
+	drmMMListHead *list, *pos;
+	uint32_t first = snooped ? BUCKET_CACHING : tiling_mode;
+	int i, n;
+
+	if (first < BUCKET_LISTS) {
+		list = &bucket->head[first];
+		pos = for_render ? list->prev : list->next;
+		for (n = 0; pos != list && n < BUCKET_STRIDE_SEARCH; n++) {
+			bo_gem = DRMLISTENTRY(drm_intel_bo_gem, pos, head);
+			if (!for_render &&
+			    drm_intel_gem_bo_busy_locked(bufmgr_gem, bo_gem))
+				break;
+			if (bo_gem->stride == stride)
+				goto out;
+			if (fallback == NULL)
+				fallback = bo_gem;
+			pos = for_render ? pos->prev : pos->next;
+		}
+	}
+
+	for (i = 0; !snooped && fallback == NULL && i < BUCKET_TILING_MODES;
+	     i++) {
+		list = &bucket->head[i];
+		if ((uint32_t)i == tiling_mode || DRMLISTEMPTY(list))
+			continue;
+
+		if (for_render) {
+			fallback = DRMLISTENTRY(drm_intel_bo_gem,
+						list->prev, head);
+		} else {
+			bo_gem = DRMLISTENTRY(drm_intel_bo_gem,
+					      list->next, head);
+			if (!drm_intel_gem_bo_busy_locked(bufmgr_gem, bo_gem))
+				fallback = bo_gem;
+		}
+	}
+
+	bo_gem = fallback;
+	if (bo_gem == NULL)
+		return NULL;
+out:
+	DRMLISTDEL(&bo_gem->head);
+	return bo_gem;
+}
+
+/**
+ * Counts an allocation from a bucket: a hit if @bo_gem already had the
+ * requested tiling and stride, a retile if it didn't, or a miss if there
+ * was no BO to reuse.
+ */
+static void
+drm_intel_gem_count_cache_use(drm_intel_bufmgr_gem_cache_stats *stats,
+			      uint32_t tiling_mode, bool reused, bool retiled)
+{
+	if (tiling_mode >= BUCKET_TILING_MODES)
+		return;
+
+	if (!reused)
+		stats->tiling[tiling_mode].misses++;
+	else if (retiled)
+		stats->tiling[tiling_mode].retiled++;
+	else
+		stats->tiling[tiling_mode].hits++;
+}
+
+static bool
+drm_intel_gem_bo_needs_retile(drm_intel_bo_gem *bo_gem,
+			      uint32_t tiling_mode, unsigned long stride)
+{
+	return bo_gem->tiling_mode != tiling_mode || bo_gem->stride != stride;
+}
+
+/*
+ * Returns the calling thread's magazine, creating it if need be, or NULL
+ * if the bucket isn't handled by the thread caches.
+ */
+static struct drm_intel_gem_magazine *
+drm_intel_gem_bo_magazine(drm_intel_bufmgr_gem *bufmgr_gem,
+			  struct drm_intel_gem_bo_bucket *bucket)
+{
+	struct drm_intel_gem_magazine *mag;
+	int i = bucket - bufmgr_gem->cache_bucket;
+
+	if (!bufmgr_gem->thread_cache || !bufmgr_gem->bo_reuse ||
+	    i >= bufmgr_gem->num_magazine_buckets)
+		return NULL;
+
+	mag = pthread_getspecific(bufmgr_gem->magazine_key);
+	if (mag == NULL) {
+		mag = calloc(1, sizeof(*mag) +
+			     bufmgr_gem->num_magazine_buckets *
+			     sizeof(mag->round[0]));
+		if (mag == NULL)
+			return NULL;
+
+		if (pthread_setspecific(bufmgr_gem->magazine_key, mag)) {
+			free(mag);
+			return NULL;
+		}
+
+		mag->bufmgr_gem = bufmgr_gem;
+		pthread_mutex_init(&mag->lock, NULL);
+		pthread_mutex_lock(&bufmgr_gem->lock);
+		DRMLISTADDTAIL(&mag->link, &bufmgr_gem->magazines);
+		pthread_mutex_unlock(&bufmgr_gem->lock);
+	}
+
+	return mag;
+}
+
+/**
+ * Moves the oldest @count BOs of a magazine round back to the shared
+ * bucket.  Called with the bufmgr and magazine locks held.
+ */
+static void
+drm_intel_gem_bo_magazine_drain(struct drm_intel_gem_bo_bucket *bucket,
+				struct drm_intel_gem_bo_round *round,
+				int count)
+{
+	int i;
+
+	for (i = 0; i < count; i++)
+		drm_intel_gem_bo_bucket_add(bucket, round->bo[i]);
+
+	round->count -= count;
+	memmove(round->bo, round->bo + count,
+		round->count * sizeof(round->bo[0]));
+}
+
+/**
+ * Picks the BO of a magazine round to reuse, or returns -1 if there is
+ * none.  Uses the same preferences as drm_intel_gem_bo_bucket_take().
+ */
+static int
+drm_intel_gem_bo_magazine_pick(struct drm_intel_gem_bo_round *round,
+			       bool for_render,
+			       uint32_t tiling_mode,
+			       unsigned long stride)
+{
+	int i;
+
+	if (for_render) {
+		for (i = round->count - 1; i >= 0; i--) {
+			if (!drm_intel_gem_bo_needs_retile(round->bo[i],
+							   tiling_mode,
+							   stride))
+				return i;
+		}
+		return round->count - 1;
+	}
+
+	for (i = 0; i < round->count; i++) {
+		if (drm_intel_gem_bo_busy(&round->bo[i]->bo))
 			break;
+		if (!drm_intel_gem_bo_needs_retile(round->bo[i],
+						   tiling_mode, stride))
+			return i;
+	}
+	return i > 0 ? 0 : -1;
+}
 
-		DRMLISTDEL(&bo_gem->head);
+/**
+ * Gets a BO for the bucket from the calling thread's cache, refilling it
+ * from the shared bucket in a batch when empty.
+ *
+ * Returns -1 if the thread cache has nothing to offer, for instance
+ * because its oldest BO is still busy, and the shared cache should be
+ * tried before creating a new BO.  Otherwise returns 0, with @out set to
+ * the cached BO.
+ */
+static int
+drm_intel_gem_bo_magazine_get(drm_intel_bufmgr_gem *bufmgr_gem,
+			      struct drm_intel_gem_bo_bucket *bucket,
+			      bool for_render,
+			      uint32_t tiling_mode,
+			      unsigned long stride,
+			      drm_intel_bo_gem **out)
+{
+	struct drm_intel_gem_magazine *mag;
+	struct drm_intel_gem_bo_round *round;
+	drm_intel_bo_gem *bo_gem;
+	bool retiled;
+	int i;
+
+	mag = drm_intel_gem_bo_magazine(bufmgr_gem, bucket);
+	if (mag == NULL)
+		return -1;
+	round = &mag->round[bucket - bufmgr_gem->cache_bucket];
+
+	pthread_mutex_lock(&mag->lock);
+	if (round->count == 0) {
+		/* Refill with the requested tiling mode first. */
+		pthread_mutex_unlock(&mag->lock);
+		pthread_mutex_lock(&bufmgr_gem->lock);
+		pthread_mutex_lock(&mag->lock);
+		for (i = -1; i < BUCKET_TILING_MODES; i++) {
+			uint32_t mode = i < 0 ? tiling_mode : (uint32_t)i;
+			drmMMListHead *list;
+
+			if (mode >= BUCKET_TILING_MODES)
+				continue;
+			list = &bucket->head[mode];
+			while (round->count < MAGAZINE_ROUNDS / 2 &&
+			       !DRMLISTEMPTY(list)) {
+				bo_gem = DRMLISTENTRY(drm_intel_bo_gem,
+						      list->next, head);
+				DRMLISTDEL(&bo_gem->head);
+				round->bo[round->count++] = bo_gem;
+			}
+		}
+		pthread_mutex_unlock(&bufmgr_gem->lock);
+	}
+
+	while ((i = drm_intel_gem_bo_magazine_pick(round, for_render,
+						   tiling_mode, stride)) >= 0) {
+		bo_gem = round->bo[i];
+		round->count--;
+		memmove(round->bo + i, round->bo + i + 1,
+			(round->count - i) * sizeof(round->bo[0]));
+		pthread_mutex_unlock(&mag->lock);
+
+		retiled = drm_intel_gem_bo_needs_retile(bo_gem, tiling_mode,
+							stride);
+		if ((!bo_gem->dontneed ||
+		     drm_intel_gem_bo_madvise_internal(bufmgr_gem, bo_gem,
+						       I915_MADV_WILLNEED)) &&
+		    drm_intel_gem_bo_set_tiling_internal(&bo_gem->bo,
+							 tiling_mode,
+							 stride) == 0) {
+			pthread_mutex_lock(&mag->lock);
+			drm_intel_gem_count_cache_use(&mag->stats, tiling_mode,
+						      true, retiled);
+			pthread_mutex_unlock(&mag->lock);
+			*out = bo_gem;
+			return 0;
+		}
+
+		pthread_mutex_lock(&bufmgr_gem->lock);
 		drm_intel_gem_bo_free(&bo_gem->bo);
+		pthread_mutex_unlock(&bufmgr_gem->lock);
+		pthread_mutex_lock(&mag->lock);
+	}
+	pthread_mutex_unlock(&mag->lock);
+
+	return -1;
+}
+
+/*
+ * Returns how many of the oldest BOs of a round to move back to the shared
+ * bucket before adding another: those cached for as long as the shared
+ * cache keeps them, and at least half of a full round.
+ */
+static int
+drm_intel_gem_bo_magazine_expired(struct drm_intel_gem_bo_round *round,
+				  time_t time)
+{
+	int expired;
+
+	for (expired = 0; expired < round->count; expired++) {
+		if (time - round->bo[expired]->free_time <= 1)
+			break;
+	}
+
+	if (round->count == MAGAZINE_ROUNDS && expired < MAGAZINE_ROUNDS / 2)
+		expired = MAGAZINE_ROUNDS / 2;
+
+	return expired;
+}
+
+/**
+ * Releases the last reference to a BO into the calling thread's cache,
+ * without taking the bufmgr lock.
+ *
+ * Only BOs that need none of the shared bookkeeping done by
+ * drm_intel_gem_bo_unreference_final() qualify.  Returns false if the BO
+ * must take the usual path.
+ */
+static bool
+drm_intel_gem_bo_magazine_put(drm_intel_bufmgr_gem *bufmgr_gem,
+			      drm_intel_bo_gem *bo_gem, time_t time)
+{
+	struct drm_intel_gem_bo_bucket *bucket;
+	struct drm_intel_gem_magazine *mag;
+	struct drm_intel_gem_bo_round *round;
+	int expired;
+
+	if (!bo_gem->reusable || bo_gem->reloc_count ||
+	    bo_gem->map_count || bo_gem->global_name ||
+	    bo_gem->caching != drm_intel_gem_default_caching(bufmgr_gem))
+		return false;
+
+	bucket = drm_intel_gem_bo_bucket_for_size(bufmgr_gem, bo_gem->bo.size);
+	if (bucket == NULL)
+		return false;
+
+	mag = drm_intel_gem_bo_magazine(bufmgr_gem, bucket);
+	if (mag == NULL)
+		return false;
+	round = &mag->round[bucket - bufmgr_gem->cache_bucket];
+
+	if (!drm_intel_gem_bo_madvise_internal(bufmgr_gem, bo_gem,
+					       I915_MADV_DONTNEED))
+		return false;
+
+	DBG("bo_unreference final: %d (%s) to thread cache\n",
+	    bo_gem->gem_handle, bo_gem->name);
+
+	free(bo_gem->reloc_target_info);
+	bo_gem->reloc_target_info = NULL;
+	free(bo_gem->relocs);
+	bo_gem->relocs = NULL;
+	bo_gem->used_as_reloc_target = false;
+
+	bo_gem->free_time = time;
+	if (bufmgr_gem->cache_reaper)
+		bo_gem->free_ms = drm_intel_gem_now_ms();
+	bo_gem->name = NULL;
+
+	/* BOs that have sat in the magazine for as long as the shared cache
+	 * keeps them go back to it, to be aged and freed along with the rest.
+	 */
+	pthread_mutex_lock(&mag->lock);
+	expired = drm_intel_gem_bo_magazine_expired(round, time);
+	if (expired) {
+		pthread_mutex_unlock(&mag->lock);
+		pthread_mutex_lock(&bufmgr_gem->lock);
+		pthread_mutex_lock(&mag->lock);
+		/* The round may have been emptied in the meantime. */
+		expired = drm_intel_gem_bo_magazine_expired(round, time);
+		drm_intel_gem_bo_magazine_drain(bucket, round, expired);
+		drm_intel_gem_cleanup_bo_cache(bufmgr_gem, time);
+		pthread_mutex_unlock(&bufmgr_gem->lock);
 	}
+	round->bo[round->count++] = bo_gem;
+	pthread_mutex_unlock(&mag->lock);
+
+	return true;
+}
+
+/**
+ * Returns all the BOs of a magazine to the shared buckets.  Called with
+ * the bufmgr lock held.
+ */
+static void
+drm_intel_gem_magazine_empty(struct drm_intel_gem_magazine *mag)
+{
+	drm_intel_bufmgr_gem *bufmgr_gem = mag->bufmgr_gem;
+	int i;
+
+	pthread_mutex_lock(&mag->lock);
+	for (i = 0; i < bufmgr_gem->num_magazine_buckets; i++)
+		drm_intel_gem_bo_magazine_drain(&bufmgr_gem->cache_bucket[i],
+						&mag->round[i],
+						mag->round[i].count);
+	pthread_mutex_unlock(&mag->lock);
+}
+
+/**
+ * Returns all the BOs of a magazine to the shared buckets and forgets
+ * about it.  Called with the bufmgr lock held.
+ */
+static void
+drm_intel_gem_magazine_release(struct drm_intel_gem_magazine *mag)
+{
+	drm_intel_bufmgr_gem *bufmgr_gem = mag->bufmgr_gem;
+	int i;
+
+	drm_intel_gem_magazine_empty(mag);
+
+	for (i = 0; i < BUCKET_TILING_MODES; i++) {
+		bufmgr_gem->cache_stats.tiling[i].hits +=
+			mag->stats.tiling[i].hits;
+		bufmgr_gem->cache_stats.tiling[i].retiled +=
+			mag->stats.tiling[i].retiled;
+		bufmgr_gem->cache_stats.tiling[i].misses +=
+			mag->stats.tiling[i].misses;
+	}
+
+	DRMLISTDEL(&mag->link);
+	pthread_mutex_destroy(&mag->lock);
+	free(mag);
+}
+
+/* Thread exit destructor for the magazine key. */
+static void
+drm_intel_gem_magazine_destroy(void *data)
+{
+	struct drm_intel_gem_magazine *mag = data;
+	drm_intel_bufmgr_gem *bufmgr_gem = mag->bufmgr_gem;
+
+	pthread_mutex_lock(&bufmgr_gem->lock);
+	drm_intel_gem_magazine_release(mag);
+	pthread_mutex_unlock(&bufmgr_gem->lock);
 }
 
 static drm_intel_bo *
@@ -629,13 +1724,18 @@ drm_intel_gem_bo_alloc_internal(drm_intel_bufmgr *bufmgr,
 	unsigned int page_size = getpagesize();
 	int ret;
 	struct drm_intel_gem_bo_bucket *bucket;
-	bool alloc_from_cache;
+	bool alloc_from_cache, retiled;
 	unsigned long bo_size;
 	bool for_render = false;
+	bool snooped = false;
 
 	if (flags & BO_ALLOC_FOR_RENDER)
 		for_render = true;
 
+	/* With an LLC, every BO is already cached. */
+	if ((flags & BO_ALLOC_SNOOPED) && !bufmgr_gem->has_llc)
+		snooped = true;
+
 	/* Round the allocated size up to a power of two number of pages. */
 	bucket = drm_intel_gem_bo_bucket_for_size(bufmgr_gem, size);
 
@@ -650,38 +1750,43 @@ drm_intel_gem_bo_alloc_internal(drm_intel_bufmgr *bufmgr,
 		bo_size = bucket->size;
 	}
 
+	/* Try the calling thread's own cache first, which doesn't need the
+	 * bufmgr lock, then the shared one.
+	 */
+	if (bucket != NULL && !snooped &&
+	    drm_intel_gem_bo_magazine_get(bufmgr_gem, bucket, for_render,
+					  tiling_mode, stride, &bo_gem) == 0) {
+		alloc_from_cache = true;
+		goto skip_cache;
+	}
+
 	pthread_mutex_lock(&bufmgr_gem->lock);
 	/* Get a buffer out of the cache if available */
 retry:
 	alloc_from_cache = false;
-	if (bucket != NULL && !DRMLISTEMPTY(&bucket->head)) {
-		if (for_render) {
-			/* Allocate new render-target BOs from the tail (MRU)
-			 * of the list, as it will likely be hot in the GPU
-			 * cache and in the aperture for us.
-			 */
-			bo_gem = DRMLISTENTRY(drm_intel_bo_gem,
-					      bucket->head.prev, head);
-			DRMLISTDEL(&bo_gem->head);
-			alloc_from_cache = true;
-		} else {
-			/* For non-render-target BOs (where we're probably
-			 * going to map it first thing in order to fill it
-			 * with data), check if the last BO in the cache is
-			 * unbusy, and only reuse in that case. Otherwise,
-			 * allocating a new buffer is probably faster than
-			 * waiting for the GPU to finish.
-			 */
-			bo_gem = DRMLISTENTRY(drm_intel_bo_gem,
-					      bucket->head.next, head);
-			if (!drm_intel_gem_bo_busy(&bo_gem->bo)) {
-				alloc_from_cache = true;
-				DRMLISTDEL(&bo_gem->head);
-			}
-		}
+	retiled = false;
+	if (bucket != NULL) {
+		/* Allocate new render-target BOs from the tail (MRU) of the
+		 * list, as it will likely be hot in the GPU cache and in the
+		 * aperture for us.
+		 *
+		 * For non-render-target BOs (where we're probably going to
+		 * map it first thing in order to fill it with data), only
+		 * reuse the oldest BOs in the cache, and only while they're
+		 * unbusy.  Otherwise, allocating a new buffer is probably
+		 * faster than waiting for the GPU to finish.
+		 */
+		bo_gem = drm_intel_gem_bo_bucket_take(bufmgr_gem, bucket,
+						      for_render, snooped,
+						      tiling_mode, stride);
+		alloc_from_cache = bo_gem != NULL;
 
 		if (alloc_from_cache) {
-			if (!drm_intel_gem_bo_madvise_internal
+			/* BOs the reaper hasn't marked yet are still
+			 * WILLNEED.
+			 */
+			if (bo_gem->dontneed &&
+			    !drm_intel_gem_bo_madvise_internal
 			    (bufmgr_gem, bo_gem, I915_MADV_WILLNEED)) {
 				drm_intel_gem_bo_free(&bo_gem->bo);
 				drm_intel_gem_bo_cache_purge_bucket(bufmgr_gem,
@@ -689,6 +1794,9 @@ retry:
 				goto retry;
 			}
 
+			retiled = drm_intel_gem_bo_needs_retile(bo_gem,
+								tiling_mode,
+								stride);
 			if (drm_intel_gem_bo_set_tiling_internal(&bo_gem->bo,
 								 tiling_mode,
 								 stride)) {
@@ -696,9 +1804,16 @@ retry:
 				goto retry;
 			}
 		}
+
+		if (!snooped)
+			drm_intel_gem_count_cache_use(&bufmgr_gem->cache_stats,
+						      tiling_mode,
+						      alloc_from_cache,
+						      retiled);
 	}
 	pthread_mutex_unlock(&bufmgr_gem->lock);
 
+skip_cache:
 	if (!alloc_from_cache) {
 		struct drm_i915_gem_create create;
 
@@ -722,37 +1837,228 @@ retry:
 		}
 		bo_gem->bo.bufmgr = bufmgr;
 
-		bo_gem->tiling_mode = I915_TILING_NONE;
-		bo_gem->swizzle_mode = I915_BIT_6_SWIZZLE_NONE;
-		bo_gem->stride = 0;
+		bo_gem->tiling_mode = I915_TILING_NONE;
+		bo_gem->swizzle_mode = I915_BIT_6_SWIZZLE_NONE;
+		bo_gem->stride = 0;
+		bo_gem->caching = drm_intel_gem_default_caching(bufmgr_gem);
+
+		if (drm_intel_gem_bo_set_tiling_internal(&bo_gem->bo,
+							 tiling_mode,
+							 stride)) {
+		    drm_intel_gem_bo_free(&bo_gem->bo);
+		    return NULL;
+		}
+
+		DRMINITLISTHEAD(&bo_gem->vma_list);
+
+		if (snooped &&
+		    drm_intel_gem_bo_set_caching_internal(bufmgr_gem, bo_gem,
+							  I915_CACHEING_CACHED)) {
+			drm_intel_gem_bo_free(&bo_gem->bo);
+			return NULL;
+		}
+	}
+
+	bo_gem->name = name;
+	atomic_set(&bo_gem->refcount, 1);
+	bo_gem->reloc_tree_fences = 0;
+	bo_gem->used_as_reloc_target = false;
+	bo_gem->has_error = false;
+	bo_gem->reusable = true;
+	bo_gem->aub_annotations = NULL;
+	bo_gem->aub_annotation_count = 0;
+
+	drm_intel_bo_gem_set_in_aperture_size(bufmgr_gem, bo_gem);
+
+	DBG("bo_create: buf %d (%s) %ldb\n",
+	    bo_gem->gem_handle, bo_gem->name, size);
+
+	return &bo_gem->bo;
+}
+
+static int
+drm_intel_gem_slab_class(unsigned long size)
+{
+	unsigned int chunk_size = SLAB_MIN_CHUNK;
+	int i;
+
+	for (i = 0; chunk_size < size; i++)
+		chunk_size *= 2;
+
+	return i;
+}
+
+static struct drm_intel_gem_slab *
+drm_intel_gem_slab_create(drm_intel_bufmgr_gem *bufmgr_gem, int class)
+{
+	struct drm_intel_gem_slab *slab;
+	int i;
+
+	slab = calloc(1, sizeof(*slab));
+	if (slab == NULL)
+		return NULL;
+
+	slab->bo = drm_intel_gem_bo_alloc_internal(&bufmgr_gem->bufmgr,
+						   "slab", SLAB_SIZE, 0,
+						   I915_TILING_NONE, 0);
+	if (slab->bo == NULL) {
+		free(slab);
+		return NULL;
+	}
+
+	slab->chunk_size = SLAB_MIN_CHUNK << class;
+	slab->num_chunks = SLAB_SIZE / slab->chunk_size;
+	slab->num_free = slab->num_chunks;
+	for (i = 0; i < slab->num_chunks; i++)
+		slab->free_mask[i / 32] |= 1u << (i % 32);
+
+	((drm_intel_bo_gem *) slab->bo)->slab_owner = slab;
+
+	return slab;
+}
+
+/**
+ * Allocates a small BO as a chunk of a shared GEM object, saving the
+ * kernel object, the page of memory and the validation list entry a
+ * separate BO would cost.
+ */
+static drm_intel_bo *
+drm_intel_gem_slab_alloc(drm_intel_bufmgr_gem *bufmgr_gem, const char *name,
+			 unsigned long size)
+{
+	int class = drm_intel_gem_slab_class(size);
+	struct drm_intel_gem_slab *slab, *new_slab = NULL;
+	drm_intel_bo_gem *bo_gem;
+	int i;
+
+	bo_gem = calloc(1, sizeof(*bo_gem));
+	if (bo_gem == NULL)
+		return NULL;
+
+	pthread_mutex_lock(&bufmgr_gem->lock);
+	if (DRMLISTEMPTY(&bufmgr_gem->slab_class[class])) {
+		pthread_mutex_unlock(&bufmgr_gem->lock);
+		new_slab = drm_intel_gem_slab_create(bufmgr_gem, class);
+		if (new_slab == NULL) {
+			free(bo_gem);
+			return NULL;
+		}
+		pthread_mutex_lock(&bufmgr_gem->lock);
+		DRMLISTADD(&new_slab->link, &bufmgr_gem->slab_class[class]);
+	}
+
+	slab = DRMLISTENTRY(struct drm_intel_gem_slab,
+			    bufmgr_gem->slab_class[class].next, link);
+	for (i = 0; slab->free_mask[i] == 0; i++)
+		;
+	i = i * 32 + ffs(slab->free_mask[i]) - 1;
+	slab->free_mask[i / 32] &= ~(1u << (i % 32));
+	slab->chunk[i] = bo_gem;
+	if (--slab->num_free == 0)
+		DRMLISTDELINIT(&slab->link);
+	pthread_mutex_unlock(&bufmgr_gem->lock);
+
+	bo_gem->slab = slab;
+	bo_gem->slab_offset = i * slab->chunk_size;
+	bo_gem->gem_handle = ((drm_intel_bo_gem *) slab->bo)->gem_handle;
+	bo_gem->bo.handle = bo_gem->gem_handle;
+	bo_gem->bo.size = slab->chunk_size;
+	bo_gem->bo.offset = slab->bo->offset + bo_gem->slab_offset;
+	bo_gem->bo.bufmgr = &bufmgr_gem->bufmgr;
+	bo_gem->name = name;
+	atomic_set(&bo_gem->refcount, 1);
+	bo_gem->tiling_mode = I915_TILING_NONE;
+	bo_gem->swizzle_mode = I915_BIT_6_SWIZZLE_NONE;
+	bo_gem->reusable = false;
+	DRMINITLISTHEAD(&bo_gem->vma_list);
+
+	drm_intel_bo_gem_set_in_aperture_size(bufmgr_gem, bo_gem);
+
+	DBG("bo_create: buf %d+0x%x (%s) %ldb from slab\n",
+	    bo_gem->gem_handle, bo_gem->slab_offset, bo_gem->name, size);
+
+	return &bo_gem->bo;
+}
+
+/**
+ * Returns the chunk of a sub-allocated BO to its slab, releasing the slab
+ * once all of its chunks are free.  Called with the bufmgr lock held.
+ */
+static void
+drm_intel_gem_slab_free(drm_intel_bo_gem *bo_gem, time_t time)
+{
+	drm_intel_bufmgr_gem *bufmgr_gem =
+		(drm_intel_bufmgr_gem *) bo_gem->bo.bufmgr;
+	struct drm_intel_gem_slab *slab = bo_gem->slab;
+	int i = bo_gem->slab_offset / slab->chunk_size;
+
+	/* Drop the maps the chunk still holds on the slab's BO. */
+	if (bo_gem->map_count > 0) {
+		drm_intel_bo_gem *parent = (drm_intel_bo_gem *) slab->bo;
 
-		if (drm_intel_gem_bo_set_tiling_internal(&bo_gem->bo,
-							 tiling_mode,
-							 stride)) {
-		    drm_intel_gem_bo_free(&bo_gem->bo);
-		    return NULL;
+		DBG("bo freed with non-zero map-count %d\n", bo_gem->map_count);
+		parent->map_count -= bo_gem->map_count;
+		bo_gem->map_count = 0;
+		if (parent->map_count <= 0) {
+			parent->map_count = 0;
+			drm_intel_gem_bo_close_vma(bufmgr_gem, parent);
+			drm_intel_gem_bo_mark_mmaps_incoherent(slab->bo);
+			slab->bo->virtual = NULL;
 		}
+	}
 
-		DRMINITLISTHEAD(&bo_gem->name_list);
-		DRMINITLISTHEAD(&bo_gem->vma_list);
+	slab->free_mask[i / 32] |= 1u << (i % 32);
+	slab->chunk[i] = NULL;
+
+	if (++slab->num_free == slab->num_chunks) {
+		DRMLISTDEL(&slab->link);
+		((drm_intel_bo_gem *) slab->bo)->slab_owner = NULL;
+		drm_intel_gem_bo_unreference_locked_timed(slab->bo, time);
+		free(slab);
+	} else if (slab->num_free == 1) {
+		DRMLISTADD(&slab->link,
+			   &bufmgr_gem->slab_class[drm_intel_gem_slab_class
+						   (slab->chunk_size)]);
 	}
 
-	bo_gem->name = name;
-	atomic_set(&bo_gem->refcount, 1);
-	bo_gem->validate_index = -1;
-	bo_gem->reloc_tree_fences = 0;
-	bo_gem->used_as_reloc_target = false;
-	bo_gem->has_error = false;
-	bo_gem->reusable = true;
-	bo_gem->aub_annotations = NULL;
-	bo_gem->aub_annotation_count = 0;
+	free(bo_gem->aub_annotations);
+	free(bo_gem);
+}
 
-	drm_intel_bo_gem_set_in_aperture_size(bufmgr_gem, bo_gem);
+/* Refreshes the offsets of the BOs carved out of a slab that moved. */
+static void
+drm_intel_gem_slab_update_offsets(struct drm_intel_gem_slab *slab)
+{
+	int i;
 
-	DBG("bo_create: buf %d (%s) %ldb\n",
-	    bo_gem->gem_handle, bo_gem->name, size);
+	for (i = 0; i < slab->num_chunks; i++) {
+		if (slab->chunk[i])
+			slab->chunk[i]->bo.offset =
+				slab->bo->offset + slab->chunk[i]->slab_offset;
+	}
+}
 
-	return &bo_gem->bo;
+static void
+drm_intel_gem_slab_bo_mapped(drm_intel_bo *bo, void *base)
+{
+	drm_intel_bo_gem *bo_gem = (drm_intel_bo_gem *) bo;
+
+	bo_gem->map_count++;
+	bo->virtual = (char *) base + bo_gem->slab_offset;
+}
+
+static int
+drm_intel_gem_slab_bo_unmap(drm_intel_bo *bo)
+{
+	drm_intel_bo_gem *bo_gem = (drm_intel_bo_gem *) bo;
+
+	if (bo_gem->map_count <= 0)
+		return 0;
+
+	if (--bo_gem->map_count == 0)
+		bo->virtual = NULL;
+
+	return drm_intel_gem_bo_unmap(bo_gem->slab->bo);
 }
 
 static drm_intel_bo *
@@ -772,6 +2078,13 @@ drm_intel_gem_bo_alloc(drm_intel_bufmgr *bufmgr,
 		       unsigned long size,
 		       unsigned int alignment)
 {
+	drm_intel_bufmgr_gem *bufmgr_gem = (drm_intel_bufmgr_gem *) bufmgr;
+
+	if (bufmgr_gem->slab_alloc && size <= SLAB_MAX_CHUNK &&
+	    alignment <= SLAB_MAX_CHUNK)
+		return drm_intel_gem_slab_alloc(bufmgr_gem, name,
+						size > alignment ? size : alignment);
+
 	return drm_intel_gem_bo_alloc_internal(bufmgr, name, size, 0,
 					       I915_TILING_NONE, 0);
 }
@@ -828,6 +2141,172 @@ drm_intel_gem_bo_alloc_tiled(drm_intel_bufmgr *bufmgr, const char *name,
 					       tiling, stride);
 }
 
+static int
+drm_intel_gem_userptr(drm_intel_bufmgr_gem *bufmgr_gem, void *addr,
+		      unsigned long size, uint32_t flags, uint32_t *handle)
+{
+	struct drm_i915_gem_userptr userptr;
+
+	VG_CLEAR(userptr);
+	userptr.user_ptr = (uint64_t)(uintptr_t) addr;
+	userptr.user_size = size;
+	userptr.flags = flags;
+	if (drmIoctl(bufmgr_gem->fd, DRM_IOCTL_I915_GEM_USERPTR, &userptr))
+		return -errno;
+
+	*handle = userptr.handle;
+	return 0;
+}
+
+/**
+ * Wraps @size bytes of application memory at @addr in a BO, so that the
+ * GPU uses it in place rather than a copy of it.
+ *
+ * @addr and @size must be page aligned, and the memory must outlive the
+ * BO.  Only untiled userptr BOs are supported, and the BO can only be
+ * mapped with drm_intel_bo_map(), which returns @addr.  Userptr BOs are
+ * never put in the BO cache.
+ *
+ * @flags are I915_USERPTR_*.  If the kernel can't wrap user memory, a
+ * BO the GPU only reads (I915_USERPTR_READ_ONLY) is instead allocated as
+ * usual and filled with pwrite, so later changes to the memory aren't
+ * seen by the GPU.  Kernels that support userptr but not read-only ones
+ * get a writable one.  Without I915_USERPTR_READ_ONLY, NULL is returned.
+ */
+static drm_intel_bo *
+drm_intel_gem_bo_alloc_userptr(drm_intel_bufmgr *bufmgr, const char *name,
+			       void *addr, uint32_t tiling_mode,
+			       uint32_t stride, unsigned long size,
+			       unsigned long flags)
+{
+	drm_intel_bufmgr_gem *bufmgr_gem = (drm_intel_bufmgr_gem *) bufmgr;
+	unsigned long page_size = getpagesize();
+	bool read_only = flags & I915_USERPTR_READ_ONLY;
+	drm_intel_bo_gem *bo_gem;
+	drm_intel_bo *bo;
+	uint32_t handle = 0;
+	int ret = -ENODEV;
+
+	if (tiling_mode != I915_TILING_NONE || size == 0 ||
+	    ((uintptr_t)addr | size) & (page_size - 1))
+		return NULL;
+
+	if (!bufmgr_gem->no_userptr) {
+		ret = drm_intel_gem_userptr(bufmgr_gem, addr, size, flags,
+					    &handle);
+		if (ret && read_only)
+			ret = drm_intel_gem_userptr(bufmgr_gem, addr, size,
+						    flags & ~I915_USERPTR_READ_ONLY,
+						    &handle);
+		/* -EINVAL is a bad address or flags, not a missing
+		 * feature: that caller just gets NULL.
+		 */
+		if (ret == -ENOTTY || ret == -ENODEV) {
+			DBG("bo_alloc_userptr: no kernel support: %s\n",
+			    strerror(-ret));
+			bufmgr_gem->no_userptr = true;
+		}
+	}
+
+	if (ret) {
+		/* Anything else is a bad address. */
+		if (!bufmgr_gem->no_userptr || !read_only)
+			return NULL;
+
+		bo = drm_intel_gem_bo_alloc_internal(bufmgr, name, size, 0,
+						     I915_TILING_NONE, 0);
+		if (bo && drm_intel_bo_subdata(bo, 0, size, addr)) {
+			drm_intel_gem_bo_unreference(bo);
+			bo = NULL;
+		}
+		return bo;
+	}
+
+	bo_gem = calloc(1, sizeof(*bo_gem));
+	if (!bo_gem) {
+		struct drm_gem_close close_bo;
+
+		VG_CLEAR(close_bo);
+		close_bo.handle = handle;
+		drmIoctl(bufmgr_gem->fd, DRM_IOCTL_GEM_CLOSE, &close_bo);
+		return NULL;
+	}
+
+	bo_gem->bo.size = size;
+	bo_gem->bo.handle = handle;
+	bo_gem->bo.bufmgr = bufmgr;
+	bo_gem->gem_handle = handle;
+	bo_gem->user_virtual = addr;
+
+	atomic_set(&bo_gem->refcount, 1);
+
+	bo_gem->name = name;
+	bo_gem->reloc_tree_fences = 0;
+	bo_gem->used_as_reloc_target = false;
+	bo_gem->has_error = false;
+	bo_gem->reusable = false;
+	bo_gem->tiling_mode = I915_TILING_NONE;
+	bo_gem->swizzle_mode = I915_BIT_6_SWIZZLE_NONE;
+	bo_gem->stride = 0;
+	bo_gem->caching = I915_CACHEING_CACHED;
+
+	DRMINITLISTHEAD(&bo_gem->vma_list);
+	drm_intel_bo_gem_set_in_aperture_size(bufmgr_gem, bo_gem);
+
+	DBG("bo_create_userptr: buf %d (%s) %p %ldb\n",
+	    bo_gem->gem_handle, bo_gem->name, addr, size);
+
+	return &bo_gem->bo;
+}
+
+/**
+ * Adds @bo_gem to the tables used to find shared BOs when they are
+ * imported again.  Called with the bufmgr lock held.
+ */
+static void
+drm_intel_gem_bo_add_shared(drm_intel_bufmgr_gem *bufmgr_gem,
+			    drm_intel_bo_gem *bo_gem)
+{
+	if (!bo_gem->shared) {
+		drmHashInsert(bufmgr_gem->handle_table, bo_gem->gem_handle,
+			      bo_gem);
+		bo_gem->shared = true;
+	}
+	if (bo_gem->global_name)
+		drmHashInsert(bufmgr_gem->name_table, bo_gem->global_name,
+			      bo_gem);
+}
+
+static void
+drm_intel_gem_bo_remove_shared(drm_intel_bufmgr_gem *bufmgr_gem,
+			       drm_intel_bo_gem *bo_gem)
+{
+	if (!bo_gem->shared)
+		return;
+
+	drmHashDelete(bufmgr_gem->handle_table, bo_gem->gem_handle);
+	if (bo_gem->global_name)
+		drmHashDelete(bufmgr_gem->name_table, bo_gem->global_name);
+	bo_gem->shared = false;
+}
+
+/**
+ * Looks up a shared BO in @table and takes a reference to it.  Called
+ * with the bufmgr lock held, which keeps the final unreference of shared
+ * BOs from racing with the lookup.
+ */
+static drm_intel_bo_gem *
+drm_intel_gem_bo_lookup_shared(void *table, unsigned long key)
+{
+	void *value;
+
+	if (drmHashLookup(table, key, &value) != 0)
+		return NULL;
+
+	drm_intel_gem_bo_reference(&((drm_intel_bo_gem *) value)->bo);
+	return value;
+}
+
 /**
  * Returns a drm_intel_bo wrapping the given buffer object handle.
  *
@@ -844,27 +2323,15 @@ drm_intel_bo_gem_create_from_name(drm_intel_bufmgr *bufmgr,
 	int ret;
 	struct drm_gem_open open_arg;
 	struct drm_i915_gem_get_tiling get_tiling;
-	drmMMListHead *list;
 
-	/* At the moment most applications only have a few named bo.
-	 * For instance, in a DRI client only the render buffers passed
-	 * between X and the client are named. And since X returns the
-	 * alternating names for the front/back buffer a linear search
-	 * provides a sufficiently fast match.
+	/* The lock is held across the import so that two threads opening
+	 * the same name end up with the same BO.
 	 */
-	for (list = bufmgr_gem->named.next;
-	     list != &bufmgr_gem->named;
-	     list = list->next) {
-		bo_gem = DRMLISTENTRY(drm_intel_bo_gem, list, name_list);
-		if (bo_gem->global_name == handle) {
-			drm_intel_gem_bo_reference(&bo_gem->bo);
-			return &bo_gem->bo;
-		}
-	}
+	pthread_mutex_lock(&bufmgr_gem->lock);
 
-	bo_gem = calloc(1, sizeof(*bo_gem));
-	if (!bo_gem)
-		return NULL;
+	bo_gem = drm_intel_gem_bo_lookup_shared(bufmgr_gem->name_table, handle);
+	if (bo_gem)
+		goto out;
 
 	VG_CLEAR(open_arg);
 	open_arg.name = handle;
@@ -874,16 +2341,37 @@ drm_intel_bo_gem_create_from_name(drm_intel_bufmgr *bufmgr,
 	if (ret != 0) {
 		DBG("Couldn't reference %s handle 0x%08x: %s\n",
 		    name, handle, strerror(errno));
-		free(bo_gem);
-		return NULL;
+		goto out;
+	}
+
+	/* The object may already be known by its handle, if it was imported
+	 * through prime before.
+	 */
+	bo_gem = drm_intel_gem_bo_lookup_shared(bufmgr_gem->handle_table,
+						open_arg.handle);
+	if (bo_gem) {
+		bo_gem->global_name = handle;
+		drm_intel_gem_bo_add_shared(bufmgr_gem, bo_gem);
+		goto out;
+	}
+
+	bo_gem = calloc(1, sizeof(*bo_gem));
+	if (!bo_gem) {
+		struct drm_gem_close close;
+
+		VG_CLEAR(close);
+		close.handle = open_arg.handle;
+		drmIoctl(bufmgr_gem->fd, DRM_IOCTL_GEM_CLOSE, &close);
+		goto out;
 	}
+
+	DRMINITLISTHEAD(&bo_gem->vma_list);
 	bo_gem->bo.size = open_arg.size;
 	bo_gem->bo.offset = 0;
 	bo_gem->bo.virtual = NULL;
 	bo_gem->bo.bufmgr = bufmgr;
 	bo_gem->name = name;
 	atomic_set(&bo_gem->refcount, 1);
-	bo_gem->validate_index = -1;
 	bo_gem->gem_handle = open_arg.handle;
 	bo_gem->bo.handle = open_arg.handle;
 	bo_gem->global_name = handle;
@@ -895,39 +2383,56 @@ drm_intel_bo_gem_create_from_name(drm_intel_bufmgr *bufmgr,
 		       DRM_IOCTL_I915_GEM_GET_TILING,
 		       &get_tiling);
 	if (ret != 0) {
-		drm_intel_gem_bo_unreference(&bo_gem->bo);
-		return NULL;
+		drm_intel_gem_bo_free(&bo_gem->bo);
+		bo_gem = NULL;
+		goto out;
 	}
 	bo_gem->tiling_mode = get_tiling.tiling_mode;
 	bo_gem->swizzle_mode = get_tiling.swizzle_mode;
 	/* XXX stride is unknown */
 	drm_intel_bo_gem_set_in_aperture_size(bufmgr_gem, bo_gem);
 
-	DRMINITLISTHEAD(&bo_gem->vma_list);
-	DRMLISTADDTAIL(&bo_gem->name_list, &bufmgr_gem->named);
+	drm_intel_gem_bo_add_shared(bufmgr_gem, bo_gem);
 	DBG("bo_create_from_handle: %d (%s)\n", handle, bo_gem->name);
 
-	return &bo_gem->bo;
+out:
+	pthread_mutex_unlock(&bufmgr_gem->lock);
+	return bo_gem ? &bo_gem->bo : NULL;
 }
 
 static void
-drm_intel_gem_bo_free(drm_intel_bo *bo)
+drm_intel_gem_bo_unlink_vma(drm_intel_bufmgr_gem *bufmgr_gem,
+			    drm_intel_bo_gem *bo_gem)
+{
+	DRMLISTDELINIT(&bo_gem->vma_list);
+	if (bo_gem->mem_virtual) {
+		bufmgr_gem->vma_count--;
+		bufmgr_gem->vma_stats.bytes_mapped -= bo_gem->bo.size;
+	}
+	if (bo_gem->gtt_virtual) {
+		bufmgr_gem->vma_count--;
+		bufmgr_gem->vma_stats.bytes_mapped -= bo_gem->bo.size;
+	}
+}
+
+/**
+ * Releases a BO that is no longer on any of the bufmgr's lists, which
+ * doesn't need the bufmgr lock.
+ */
+static void
+drm_intel_gem_bo_release(drm_intel_bo *bo)
 {
 	drm_intel_bufmgr_gem *bufmgr_gem = (drm_intel_bufmgr_gem *) bo->bufmgr;
 	drm_intel_bo_gem *bo_gem = (drm_intel_bo_gem *) bo;
 	struct drm_gem_close close;
 	int ret;
 
-	DRMLISTDEL(&bo_gem->vma_list);
 	if (bo_gem->mem_virtual) {
 		VG(VALGRIND_FREELIKE_BLOCK(bo_gem->mem_virtual, 0));
 		munmap(bo_gem->mem_virtual, bo_gem->bo.size);
-		bufmgr_gem->vma_count--;
 	}
-	if (bo_gem->gtt_virtual) {
+	if (bo_gem->gtt_virtual)
 		munmap(bo_gem->gtt_virtual, bo_gem->bo.size);
-		bufmgr_gem->vma_count--;
-	}
 
 	/* Close this object */
 	VG_CLEAR(close);
@@ -941,6 +2446,14 @@ drm_intel_gem_bo_free(drm_intel_bo *bo)
 	free(bo);
 }
 
+static void
+drm_intel_gem_bo_free(drm_intel_bo *bo)
+{
+	drm_intel_gem_bo_unlink_vma((drm_intel_bufmgr_gem *) bo->bufmgr,
+				    (drm_intel_bo_gem *) bo);
+	drm_intel_gem_bo_release(bo);
+}
+
 static void
 drm_intel_gem_bo_mark_mmaps_incoherent(drm_intel_bo *bo)
 {
@@ -961,67 +2474,235 @@ drm_intel_gem_cleanup_bo_cache(drm_intel_bufmgr_gem *bufmgr_gem, time_t time)
 {
 	int i;
 
-	if (bufmgr_gem->time == time)
+	if (bufmgr_gem->time == time || bufmgr_gem->cache_reaper)
 		return;
 
 	for (i = 0; i < bufmgr_gem->num_buckets; i++) {
 		struct drm_intel_gem_bo_bucket *bucket =
 		    &bufmgr_gem->cache_bucket[i];
+		int j;
 
-		while (!DRMLISTEMPTY(&bucket->head)) {
-			drm_intel_bo_gem *bo_gem;
+		for (j = 0; j < BUCKET_LISTS; j++) {
+			while (!DRMLISTEMPTY(&bucket->head[j])) {
+				drm_intel_bo_gem *bo_gem;
 
-			bo_gem = DRMLISTENTRY(drm_intel_bo_gem,
-					      bucket->head.next, head);
-			if (time - bo_gem->free_time <= 1)
-				break;
+				bo_gem = DRMLISTENTRY(drm_intel_bo_gem,
+						      bucket->head[j].next,
+						      head);
+				if (time - bo_gem->free_time <= 1)
+					break;
 
-			DRMLISTDEL(&bo_gem->head);
+				DRMLISTDEL(&bo_gem->head);
 
-			drm_intel_gem_bo_free(&bo_gem->bo);
+				drm_intel_gem_bo_free(&bo_gem->bo);
+			}
 		}
 	}
 
 	bufmgr_gem->time = time;
 }
 
+/* Number of new mappings between checks of the vm.max_map_count budget */
+#define VMA_BUDGET_INTERVAL 1024
+/* Number of least recently used mappings considered for eviction */
+#define VMA_EVICT_SEARCH 16
+
+static int
+drm_intel_gem_read_max_map_count(void)
+{
+	FILE *file;
+	int max;
+
+	file = fopen("/proc/sys/vm/max_map_count", "r");
+	if (file == NULL)
+		return -1;
+	if (fscanf(file, "%d", &max) != 1)
+		max = -1;
+	fclose(file);
+
+	return max;
+}
+
+/* Returns the number of mappings in the process, or -1 if unknown. */
+static int
+drm_intel_gem_count_maps(void)
+{
+	char buf[4096];
+	ssize_t len, i;
+	int fd, maps = 0;
+
+	fd = open("/proc/self/maps", O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+	while ((len = read(fd, buf, sizeof(buf))) > 0) {
+		for (i = 0; i < len; i++)
+			maps += buf[i] == '\n';
+	}
+	close(fd);
+
+	return maps;
+}
+
+static void drm_intel_gem_bo_purge_vma_cache(drm_intel_bufmgr_gem *bufmgr_gem);
+
+/*
+ * Recomputes the budget for cached mappings: half of what
+ * vm.max_map_count leaves after the mappings of the rest of the process,
+ * so that it still has room to grow.
+ *
+ * Called without the lock: reading /proc/self/maps takes the kernel's
+ * mmap lock and walks every mapping, which other threads mapping BOs
+ * shouldn't have to wait for.  Only the result is published under it.
+ */
+static void
+drm_intel_gem_update_vma_budget(drm_intel_bufmgr_gem *bufmgr_gem)
+{
+	int maps = -1, foreign;
+
+	if (bufmgr_gem->max_map_count > 0)
+		maps = drm_intel_gem_count_maps();
+
+	pthread_mutex_lock(&bufmgr_gem->lock);
+	bufmgr_gem->vma_budget = -1;
+	if (maps >= 0) {
+		foreign = maps - bufmgr_gem->vma_count - bufmgr_gem->vma_open;
+		if (foreign < 0)
+			foreign = 0;
+		bufmgr_gem->vma_budget =
+			(bufmgr_gem->max_map_count - foreign) / 2;
+		if (bufmgr_gem->vma_budget < 0)
+			bufmgr_gem->vma_budget = 0;
+	}
+	drm_intel_gem_bo_purge_vma_cache(bufmgr_gem);
+	pthread_mutex_unlock(&bufmgr_gem->lock);
+}
+
+/*
+ * Returns whether the budget is due to be recomputed, claiming the
+ * recount for the caller to do once it drops the lock.  Called with the
+ * lock held.
+ */
+static bool
+drm_intel_gem_take_vma_recount(drm_intel_bufmgr_gem *bufmgr_gem)
+{
+	bool recount = bufmgr_gem->vma_recount;
+
+	bufmgr_gem->vma_recount = false;
+	return recount;
+}
+
+static int
+drm_intel_gem_vma_limit(drm_intel_bufmgr_gem *bufmgr_gem)
+{
+	int limit = bufmgr_gem->vma_max;
+
+	if (bufmgr_gem->vma_budget >= 0 &&
+	    (limit < 0 || limit > bufmgr_gem->vma_budget))
+		limit = bufmgr_gem->vma_budget;
+
+	return limit;
+}
+
+/*
+ * Picks the cached mapping to evict next.  Every mapping costs one entry
+ * against the limit whatever its size, but recreating a big one costs an
+ * mmap and a page fault per page touched, so among the least recently
+ * used few, the one that is cheapest to recreate goes first.  BOs that
+ * keep getting remapped count as more expensive.
+ */
+static drm_intel_bo_gem *
+drm_intel_gem_vma_victim(drm_intel_bufmgr_gem *bufmgr_gem)
+{
+	drm_intel_bo_gem *bo_gem, *victim = NULL;
+	uint64_t cost, victim_cost = 0;
+	int n = 0;
+
+	DRMLISTFOREACHENTRY(bo_gem, &bufmgr_gem->vma_cache, vma_list) {
+		cost = (uint64_t)(bo_gem->bo.size / 4096 + 1) *
+			(bo_gem->vma_remaps + 1);
+		if (victim == NULL || cost < victim_cost) {
+			victim = bo_gem;
+			victim_cost = cost;
+		}
+		if (++n == VMA_EVICT_SEARCH)
+			break;
+	}
+
+	return victim;
+}
+
 static void drm_intel_gem_bo_purge_vma_cache(drm_intel_bufmgr_gem *bufmgr_gem)
 {
 	int limit;
 
-	DBG("%s: cached=%d, open=%d, limit=%d\n", __FUNCTION__,
-	    bufmgr_gem->vma_count, bufmgr_gem->vma_open, bufmgr_gem->vma_max);
+	DBG("%s: cached=%d, open=%d, limit=%d, budget=%d\n", __FUNCTION__,
+	    bufmgr_gem->vma_count, bufmgr_gem->vma_open, bufmgr_gem->vma_max,
+	    bufmgr_gem->vma_budget);
 
-	if (bufmgr_gem->vma_max < 0)
+	limit = drm_intel_gem_vma_limit(bufmgr_gem);
+	if (limit < 0)
 		return;
 
 	/* We may need to evict a few entries in order to create new mmaps */
-	limit = bufmgr_gem->vma_max - 2*bufmgr_gem->vma_open;
+	limit -= 2*bufmgr_gem->vma_open;
 	if (limit < 0)
 		limit = 0;
 
 	while (bufmgr_gem->vma_count > limit) {
 		drm_intel_bo_gem *bo_gem;
 
-		bo_gem = DRMLISTENTRY(drm_intel_bo_gem,
-				      bufmgr_gem->vma_cache.next,
-				      vma_list);
+		bo_gem = drm_intel_gem_vma_victim(bufmgr_gem);
 		assert(bo_gem->map_count == 0);
-		DRMLISTDELINIT(&bo_gem->vma_list);
+		drm_intel_gem_bo_unlink_vma(bufmgr_gem, bo_gem);
 
 		if (bo_gem->mem_virtual) {
 			munmap(bo_gem->mem_virtual, bo_gem->bo.size);
 			bo_gem->mem_virtual = NULL;
-			bufmgr_gem->vma_count--;
+			bufmgr_gem->vma_stats.evictions++;
 		}
 		if (bo_gem->gtt_virtual) {
 			munmap(bo_gem->gtt_virtual, bo_gem->bo.size);
 			bo_gem->gtt_virtual = NULL;
-			bufmgr_gem->vma_count--;
+			bufmgr_gem->vma_stats.evictions++;
 		}
+		bo_gem->vma_evicted = true;
+	}
+}
+
+/* Accounts for a new mapping of @bo_gem.  Called with the lock held. */
+static void
+drm_intel_gem_bo_vma_created(drm_intel_bufmgr_gem *bufmgr_gem,
+			     drm_intel_bo_gem *bo_gem)
+{
+	bufmgr_gem->vma_stats.bytes_mapped += bo_gem->bo.size;
+
+	if (bo_gem->vma_evicted) {
+		bo_gem->vma_evicted = false;
+		bo_gem->vma_remaps++;
+		bufmgr_gem->vma_stats.remaps++;
+	}
+
+	if (++bufmgr_gem->vma_created >= VMA_BUDGET_INTERVAL) {
+		bufmgr_gem->vma_created = 0;
+		bufmgr_gem->vma_recount = true;
 	}
 }
 
+/*
+ * Accounts for a map that found its mapping still cached from an earlier
+ * one, which saves at most a page fault per page.
+ */
+static void
+drm_intel_gem_bo_vma_reused(drm_intel_bufmgr_gem *bufmgr_gem,
+			    drm_intel_bo_gem *bo_gem)
+{
+	if (bo_gem->map_count != 1)
+		return;
+
+	bufmgr_gem->vma_stats.reuses++;
+	bufmgr_gem->vma_stats.faults_avoided += bo_gem->bo.size / 4096;
+}
+
 static void drm_intel_gem_bo_close_vma(drm_intel_bufmgr_gem *bufmgr_gem,
 				       drm_intel_bo_gem *bo_gem)
 {
@@ -1054,6 +2735,13 @@ drm_intel_gem_bo_unreference_final(drm_intel_bo *bo, time_t time)
 	struct drm_intel_gem_bo_bucket *bucket;
 	int i;
 
+	if (bo_gem->slab) {
+		DBG("bo_unreference final: %d+0x%x (%s) to slab\n",
+		    bo_gem->gem_handle, bo_gem->slab_offset, bo_gem->name);
+		drm_intel_gem_slab_free(bo_gem, time);
+		return;
+	}
+
 	/* Unreference all the target buffers */
 	for (i = 0; i < bo_gem->reloc_count; i++) {
 		if (bo_gem->reloc_target_info[i].bo != bo) {
@@ -1082,23 +2770,29 @@ drm_intel_gem_bo_unreference_final(drm_intel_bo *bo, time_t time)
 	if (bo_gem->map_count) {
 		DBG("bo freed with non-zero map-count %d\n", bo_gem->map_count);
 		bo_gem->map_count = 0;
-		drm_intel_gem_bo_close_vma(bufmgr_gem, bo_gem);
+		/* Application memory never went through the VMA cache. */
+		if (!bo_gem->user_virtual)
+			drm_intel_gem_bo_close_vma(bufmgr_gem, bo_gem);
 		drm_intel_gem_bo_mark_mmaps_incoherent(bo);
 	}
 
-	DRMLISTDEL(&bo_gem->name_list);
+	drm_intel_gem_bo_remove_shared(bufmgr_gem, bo_gem);
 
 	bucket = drm_intel_gem_bo_bucket_for_size(bufmgr_gem, bo->size);
-	/* Put the buffer into our internal cache for reuse if we can. */
+	/* Put the buffer into our internal cache for reuse if we can.  With
+	 * the reaper running, marking it DONTNEED is left to the reaper.
+	 */
 	if (bufmgr_gem->bo_reuse && bo_gem->reusable && bucket != NULL &&
-	    drm_intel_gem_bo_madvise_internal(bufmgr_gem, bo_gem,
-					      I915_MADV_DONTNEED)) {
+	    (bufmgr_gem->cache_reaper ||
+	     drm_intel_gem_bo_madvise_internal(bufmgr_gem, bo_gem,
+					       I915_MADV_DONTNEED))) {
 		bo_gem->free_time = time;
+		if (bufmgr_gem->cache_reaper)
+			bo_gem->free_ms = drm_intel_gem_now_ms();
 
 		bo_gem->name = NULL;
-		bo_gem->validate_index = -1;
 
-		DRMLISTADDTAIL(&bo_gem->head, &bucket->head);
+		drm_intel_gem_bo_bucket_add(bucket, bo_gem);
 	} else {
 		drm_intel_gem_bo_free(bo);
 	}
@@ -1117,20 +2811,40 @@ static void drm_intel_gem_bo_unreference_locked_timed(drm_intel_bo *bo,
 static void drm_intel_gem_bo_unreference(drm_intel_bo *bo)
 {
 	drm_intel_bo_gem *bo_gem = (drm_intel_bo_gem *) bo;
+	drm_intel_bufmgr_gem *bufmgr_gem = (drm_intel_bufmgr_gem *) bo->bufmgr;
+	struct timespec time;
+
+	assert(atomic_read(&bo_gem->refcount) > 0);
+
+	/* Not the last reference: dropped without further ado. */
+	if (!atomic_add_unless(&bo_gem->refcount, -1, 1))
+		return;
+
+	clock_gettime(CLOCK_MONOTONIC, &time);
 
-	assert(atomic_read(&bo_gem->refcount) > 0);
-	if (atomic_dec_and_test(&bo_gem->refcount)) {
-		drm_intel_bufmgr_gem *bufmgr_gem =
-		    (drm_intel_bufmgr_gem *) bo->bufmgr;
-		struct timespec time;
+	/* Shared BOs can be looked up and referenced again under the lock,
+	 * so their last reference must be dropped under it too.
+	 */
+	if (!bo_gem->shared) {
+		if (!atomic_dec_and_test(&bo_gem->refcount))
+			return;
 
-		clock_gettime(CLOCK_MONOTONIC, &time);
+		if (drm_intel_gem_bo_magazine_put(bufmgr_gem, bo_gem,
+						  time.tv_sec))
+			return;
 
 		pthread_mutex_lock(&bufmgr_gem->lock);
-		drm_intel_gem_bo_unreference_final(bo, time.tv_sec);
-		drm_intel_gem_cleanup_bo_cache(bufmgr_gem, time.tv_sec);
-		pthread_mutex_unlock(&bufmgr_gem->lock);
+	} else {
+		pthread_mutex_lock(&bufmgr_gem->lock);
+		if (!atomic_dec_and_test(&bo_gem->refcount)) {
+			pthread_mutex_unlock(&bufmgr_gem->lock);
+			return;
+		}
 	}
+
+	drm_intel_gem_bo_unreference_final(bo, time.tv_sec);
+	drm_intel_gem_cleanup_bo_cache(bufmgr_gem, time.tv_sec);
+	pthread_mutex_unlock(&bufmgr_gem->lock);
 }
 
 static int drm_intel_gem_bo_map(drm_intel_bo *bo, int write_enable)
@@ -1138,10 +2852,32 @@ static int drm_intel_gem_bo_map(drm_intel_bo *bo, int write_enable)
 	drm_intel_bufmgr_gem *bufmgr_gem = (drm_intel_bufmgr_gem *) bo->bufmgr;
 	drm_intel_bo_gem *bo_gem = (drm_intel_bo_gem *) bo;
 	struct drm_i915_gem_set_domain set_domain;
+	bool recount;
 	int ret;
 
+	ret = drm_intel_gem_bo_flush_upload(bufmgr_gem, bo_gem);
+	if (ret)
+		return ret;
+
+	if (bo_gem->slab) {
+		drm_intel_bo *parent = bo_gem->slab->bo;
+
+		ret = drm_intel_gem_bo_map(parent, write_enable);
+		if (ret == 0)
+			drm_intel_gem_slab_bo_mapped(bo, ((drm_intel_bo_gem *)
+							  parent)->mem_virtual);
+		return ret;
+	}
+
 	pthread_mutex_lock(&bufmgr_gem->lock);
 
+	if (bo_gem->user_virtual) {
+		/* Already mapped: it's the application's memory. */
+		bo_gem->map_count++;
+		bo->virtual = bo_gem->user_virtual;
+		goto set_domain;
+	}
+
 	if (bo_gem->map_count++ == 0)
 		drm_intel_gem_bo_open_vma(bufmgr_gem, bo_gem);
 
@@ -1170,11 +2906,15 @@ static int drm_intel_gem_bo_map(drm_intel_bo *bo, int write_enable)
 		}
 		VG(VALGRIND_MALLOCLIKE_BLOCK(mmap_arg.addr_ptr, mmap_arg.size, 0, 1));
 		bo_gem->mem_virtual = (void *)(uintptr_t) mmap_arg.addr_ptr;
+		drm_intel_gem_bo_vma_created(bufmgr_gem, bo_gem);
+	} else {
+		drm_intel_gem_bo_vma_reused(bufmgr_gem, bo_gem);
 	}
 	DBG("bo_map: %d (%s) -> %p\n", bo_gem->gem_handle, bo_gem->name,
 	    bo_gem->mem_virtual);
 	bo->virtual = bo_gem->mem_virtual;
 
+set_domain:
 	VG_CLEAR(set_domain);
 	set_domain.handle = bo_gem->gem_handle;
 	set_domain.read_domains = I915_GEM_DOMAIN_CPU;
@@ -1189,15 +2929,22 @@ static int drm_intel_gem_bo_map(drm_intel_bo *bo, int write_enable)
 		DBG("%s:%d: Error setting to CPU domain %d: %s\n",
 		    __FILE__, __LINE__, bo_gem->gem_handle,
 		    strerror(errno));
+	} else if (write_enable) {
+		/* Moving to the write domain waited for all rendering. */
+		drm_intel_gem_bo_mark_idle(bufmgr_gem, bo_gem);
 	}
 
 	if (write_enable)
 		bo_gem->mapped_cpu_write = true;
 
 	drm_intel_gem_bo_mark_mmaps_incoherent(bo);
-	VG(VALGRIND_MAKE_MEM_DEFINED(bo_gem->mem_virtual, bo->size));
+	VG(VALGRIND_MAKE_MEM_DEFINED(bo->virtual, bo->size));
+	recount = drm_intel_gem_take_vma_recount(bufmgr_gem);
 	pthread_mutex_unlock(&bufmgr_gem->lock);
 
+	if (recount)
+		drm_intel_gem_update_vma_budget(bufmgr_gem);
+
 	return 0;
 }
 
@@ -1251,6 +2998,9 @@ map_gtt(drm_intel_bo *bo)
 				drm_intel_gem_bo_close_vma(bufmgr_gem, bo_gem);
 			return ret;
 		}
+		drm_intel_gem_bo_vma_created(bufmgr_gem, bo_gem);
+	} else {
+		drm_intel_gem_bo_vma_reused(bufmgr_gem, bo_gem);
 	}
 
 	bo->virtual = bo_gem->gtt_virtual;
@@ -1266,8 +3016,27 @@ int drm_intel_gem_bo_map_gtt(drm_intel_bo *bo)
 	drm_intel_bufmgr_gem *bufmgr_gem = (drm_intel_bufmgr_gem *) bo->bufmgr;
 	drm_intel_bo_gem *bo_gem = (drm_intel_bo_gem *) bo;
 	struct drm_i915_gem_set_domain set_domain;
+	bool recount;
 	int ret;
 
+	/* Application memory is only ever mapped where it already is. */
+	if (bo_gem->user_virtual)
+		return -EINVAL;
+
+	ret = drm_intel_gem_bo_flush_upload(bufmgr_gem, bo_gem);
+	if (ret)
+		return ret;
+
+	if (bo_gem->slab) {
+		drm_intel_bo *parent = bo_gem->slab->bo;
+
+		ret = drm_intel_gem_bo_map_gtt(parent);
+		if (ret == 0)
+			drm_intel_gem_slab_bo_mapped(bo, ((drm_intel_bo_gem *)
+							  parent)->gtt_virtual);
+		return ret;
+	}
+
 	pthread_mutex_lock(&bufmgr_gem->lock);
 
 	ret = map_gtt(bo);
@@ -1296,12 +3065,18 @@ int drm_intel_gem_bo_map_gtt(drm_intel_bo *bo)
 		DBG("%s:%d: Error setting domain %d: %s\n",
 		    __FILE__, __LINE__, bo_gem->gem_handle,
 		    strerror(errno));
+	} else {
+		drm_intel_gem_bo_mark_idle(bufmgr_gem, bo_gem);
 	}
 
 	drm_intel_gem_bo_mark_mmaps_incoherent(bo);
 	VG(VALGRIND_MAKE_MEM_DEFINED(bo_gem->gtt_virtual, bo->size));
+	recount = drm_intel_gem_take_vma_recount(bufmgr_gem);
 	pthread_mutex_unlock(&bufmgr_gem->lock);
 
+	if (recount)
+		drm_intel_gem_update_vma_budget(bufmgr_gem);
+
 	return 0;
 }
 
@@ -1323,6 +3098,7 @@ int drm_intel_gem_bo_map_unsynchronized(drm_intel_bo *bo)
 {
 	drm_intel_bufmgr_gem *bufmgr_gem = (drm_intel_bufmgr_gem *) bo->bufmgr;
 	drm_intel_bo_gem *bo_gem = (drm_intel_bo_gem *) bo;
+	bool recount;
 	int ret;
 
 	/* If the CPU cache isn't coherent with the GTT, then use a
@@ -1332,9 +3108,23 @@ int drm_intel_gem_bo_map_unsynchronized(drm_intel_bo *bo)
 	 * we would potentially corrupt the buffer even when the user
 	 * does reasonable things.
 	 */
-	if (!bufmgr_gem->has_llc)
+	if (!bufmgr_gem->has_llc || bo_gem->user_virtual)
 		return drm_intel_gem_bo_map_gtt(bo);
 
+	ret = drm_intel_gem_bo_flush_upload(bufmgr_gem, bo_gem);
+	if (ret)
+		return ret;
+
+	if (bo_gem->slab) {
+		drm_intel_bo *parent = bo_gem->slab->bo;
+
+		ret = drm_intel_gem_bo_map_unsynchronized(parent);
+		if (ret == 0)
+			drm_intel_gem_slab_bo_mapped(bo, ((drm_intel_bo_gem *)
+							  parent)->gtt_virtual);
+		return ret;
+	}
+
 	pthread_mutex_lock(&bufmgr_gem->lock);
 
 	ret = map_gtt(bo);
@@ -1343,8 +3133,12 @@ int drm_intel_gem_bo_map_unsynchronized(drm_intel_bo *bo)
 		VG(VALGRIND_MAKE_MEM_DEFINED(bo_gem->gtt_virtual, bo->size));
 	}
 
+	recount = drm_intel_gem_take_vma_recount(bufmgr_gem);
 	pthread_mutex_unlock(&bufmgr_gem->lock);
 
+	if (recount)
+		drm_intel_gem_update_vma_budget(bufmgr_gem);
+
 	return ret;
 }
 
@@ -1357,6 +3151,9 @@ static int drm_intel_gem_bo_unmap(drm_intel_bo *bo)
 	if (bo == NULL)
 		return 0;
 
+	if (bo_gem->slab)
+		return drm_intel_gem_slab_bo_unmap(bo);
+
 	pthread_mutex_lock(&bufmgr_gem->lock);
 
 	if (bo_gem->map_count <= 0) {
@@ -1391,7 +3188,8 @@ static int drm_intel_gem_bo_unmap(drm_intel_bo *bo)
 	 * limits and cause later failures.
 	 */
 	if (--bo_gem->map_count == 0) {
-		drm_intel_gem_bo_close_vma(bufmgr_gem, bo_gem);
+		if (!bo_gem->user_virtual)
+			drm_intel_gem_bo_close_vma(bufmgr_gem, bo_gem);
 		drm_intel_gem_bo_mark_mmaps_incoherent(bo);
 		bo->virtual = NULL;
 	}
@@ -1411,12 +3209,61 @@ drm_intel_gem_bo_subdata(drm_intel_bo *bo, unsigned long offset,
 {
 	drm_intel_bufmgr_gem *bufmgr_gem = (drm_intel_bufmgr_gem *) bo->bufmgr;
 	drm_intel_bo_gem *bo_gem = (drm_intel_bo_gem *) bo;
+	struct drm_intel_uploader *up = bufmgr_gem->uploader;
 	struct drm_i915_gem_pwrite pwrite;
+	bool idle = true;
+	void *virtual = NULL;
+	uint64_t upload_id;
 	int ret;
 
+	/* The uploader's own batches are written with plain pwrites. */
+	if (up && drm_intel_uploader_submitting(up, bo))
+		up = NULL;
+
+	if (up) {
+		pthread_mutex_lock(&bufmgr_gem->lock);
+		/* A staged copy still to land must stay ordered before
+		 * this write, so keep using the ring for it.
+		 */
+		idle = bo_gem->upload_id == 0 &&
+			drm_intel_gem_bo_known_idle(bufmgr_gem, bo_gem);
+		/* Like pwrite, the copy must land linearly in the BO's pages,
+		 * which a GTT mapping of a tiled BO would swizzle.
+		 */
+		if (bufmgr_gem->has_llc && bo_gem->map_count &&
+		    (bo->virtual != bo_gem->gtt_virtual ||
+		     bo_gem->tiling_mode == I915_TILING_NONE))
+			virtual = bo->virtual;
+		pthread_mutex_unlock(&bufmgr_gem->lock);
+
+		/* Writing to a BO the GPU may still be using would wait
+		 * for it, so have the GPU do the write after it's done.
+		 */
+		if (!idle && !bo_gem->slab &&
+		    drm_intel_uploader_copy(up, bo, offset, size, data,
+					    &upload_id) == 0) {
+			pthread_mutex_lock(&bufmgr_gem->lock);
+			bo_gem->upload_id = upload_id;
+			pthread_mutex_unlock(&bufmgr_gem->lock);
+			return 0;
+		}
+
+		ret = drm_intel_gem_bo_flush_upload(bufmgr_gem, bo_gem);
+		if (ret)
+			return ret;
+
+		/* It's already mapped for the CPU: just copy. */
+		if (idle && virtual) {
+			memcpy((char *)virtual + offset, data, size);
+			drm_intel_uploader_count(up, DRM_INTEL_UPLOAD_MAP,
+						 size);
+			return 0;
+		}
+	}
+
 	VG_CLEAR(pwrite);
 	pwrite.handle = bo_gem->gem_handle;
-	pwrite.offset = offset;
+	pwrite.offset = bo_gem->slab_offset + offset;
 	pwrite.size = size;
 	pwrite.data_ptr = (uint64_t) (uintptr_t) data;
 	ret = drmIoctl(bufmgr_gem->fd,
@@ -1427,6 +3274,8 @@ drm_intel_gem_bo_subdata(drm_intel_bo *bo, unsigned long offset,
 		DBG("%s:%d: Error writing data to buffer %d: (%d %d) %s .\n",
 		    __FILE__, __LINE__, bo_gem->gem_handle, (int)offset,
 		    (int)size, strerror(errno));
+	} else if (up) {
+		drm_intel_uploader_count(up, DRM_INTEL_UPLOAD_PWRITE, size);
 	}
 
 	return ret;
@@ -1457,6 +3306,38 @@ drm_intel_gem_get_pipe_from_crtc_id(drm_intel_bufmgr *bufmgr, int crtc_id)
 	return get_pipe_from_crtc_id.pipe;
 }
 
+/*
+ * Reads part of @bo by blitting it into a snooped BO, which the CPU can
+ * then read from its caches rather than having the kernel flush them.
+ */
+static int
+drm_intel_gem_bo_readback(drm_intel_bufmgr_gem *bufmgr_gem,
+			  drm_intel_bo *bo, unsigned long offset,
+			  unsigned long size, void *data)
+{
+	drm_intel_bo *staging;
+	int ret;
+
+	staging = drm_intel_gem_bo_alloc_internal(&bufmgr_gem->bufmgr,
+						  "readback", size,
+						  BO_ALLOC_SNOOPED,
+						  I915_TILING_NONE, 0);
+	if (staging == NULL)
+		return -ENOMEM;
+
+	ret = drm_intel_uploader_read(bufmgr_gem->uploader, bo, offset, size,
+				      staging);
+	if (ret == 0)
+		ret = drm_intel_gem_bo_map(staging, 0);
+	if (ret == 0) {
+		memcpy(data, staging->virtual, size);
+		drm_intel_gem_bo_unmap(staging);
+	}
+
+	drm_intel_gem_bo_unreference(staging);
+	return ret;
+}
+
 static int
 drm_intel_gem_bo_get_subdata(drm_intel_bo *bo, unsigned long offset,
 			     unsigned long size, void *data)
@@ -1464,11 +3345,34 @@ drm_intel_gem_bo_get_subdata(drm_intel_bo *bo, unsigned long offset,
 	drm_intel_bufmgr_gem *bufmgr_gem = (drm_intel_bufmgr_gem *) bo->bufmgr;
 	drm_intel_bo_gem *bo_gem = (drm_intel_bo_gem *) bo;
 	struct drm_i915_gem_pread pread;
+	bool idle;
 	int ret;
 
+	ret = drm_intel_gem_bo_flush_upload(bufmgr_gem, bo_gem);
+	if (ret)
+		return ret;
+
+	/* Without an LLC, pread of a BO the GPU is still writing waits and
+	 * then flushes it out of the CPU caches.  Have the GPU copy it into
+	 * a snooped BO instead.
+	 */
+	if (bufmgr_gem->uploader && !bufmgr_gem->has_llc && !bo_gem->slab &&
+	    ((offset | size) & 3) == 0 &&
+	    size >= READBACK_MIN_SIZE && size <= READBACK_MAX_SIZE) {
+		pthread_mutex_lock(&bufmgr_gem->lock);
+		idle = drm_intel_gem_bo_known_idle(bufmgr_gem, bo_gem);
+		pthread_mutex_unlock(&bufmgr_gem->lock);
+
+		/* If the blit couldn't be submitted, pread it after all. */
+		if (!idle &&
+		    drm_intel_gem_bo_readback(bufmgr_gem, bo, offset, size,
+					      data) == 0)
+			return 0;
+	}
+
 	VG_CLEAR(pread);
 	pread.handle = bo_gem->gem_handle;
-	pread.offset = offset;
+	pread.offset = bo_gem->slab_offset + offset;
 	pread.size = size;
 	pread.data_ptr = (uint64_t) (uintptr_t) data;
 	ret = drmIoctl(bufmgr_gem->fd,
@@ -1522,6 +3426,10 @@ int drm_intel_gem_bo_wait(drm_intel_bo *bo, int64_t timeout_ns)
 	struct drm_i915_gem_wait wait;
 	int ret;
 
+	ret = drm_intel_gem_bo_flush_upload(bufmgr_gem, bo_gem);
+	if (ret)
+		return ret;
+
 	if (!bufmgr_gem->has_wait_timeout) {
 		DBG("%s:%d: Timed wait is not supported. Falling back to "
 		    "infinite wait\n", __FILE__, __LINE__);
@@ -1540,6 +3448,11 @@ int drm_intel_gem_bo_wait(drm_intel_bo *bo, int64_t timeout_ns)
 	if (ret == -1)
 		return -errno;
 
+	pthread_mutex_lock(&bufmgr_gem->lock);
+	drm_intel_gem_bo_mark_idle(bufmgr_gem, (drm_intel_bo_gem *)
+				   drm_intel_gem_bo_backing(bo));
+	pthread_mutex_unlock(&bufmgr_gem->lock);
+
 	return ret;
 }
 
@@ -1558,6 +3471,8 @@ drm_intel_gem_bo_start_gtt_access(drm_intel_bo *bo, int write_enable)
 	struct drm_i915_gem_set_domain set_domain;
 	int ret;
 
+	drm_intel_gem_bo_flush_upload(bufmgr_gem, bo_gem);
+
 	VG_CLEAR(set_domain);
 	set_domain.handle = bo_gem->gem_handle;
 	set_domain.read_domains = I915_GEM_DOMAIN_GTT;
@@ -1570,6 +3485,11 @@ drm_intel_gem_bo_start_gtt_access(drm_intel_bo *bo, int write_enable)
 		    __FILE__, __LINE__, bo_gem->gem_handle,
 		    set_domain.read_domains, set_domain.write_domain,
 		    strerror(errno));
+	} else if (write_enable) {
+		pthread_mutex_lock(&bufmgr_gem->lock);
+		drm_intel_gem_bo_mark_idle(bufmgr_gem, (drm_intel_bo_gem *)
+					   drm_intel_gem_bo_backing(bo));
+		pthread_mutex_unlock(&bufmgr_gem->lock);
 	}
 }
 
@@ -1579,25 +3499,62 @@ drm_intel_bufmgr_gem_destroy(drm_intel_bufmgr *bufmgr)
 	drm_intel_bufmgr_gem *bufmgr_gem = (drm_intel_bufmgr_gem *) bufmgr;
 	int i;
 
-	free(bufmgr_gem->exec2_objects);
-	free(bufmgr_gem->exec_objects);
-	free(bufmgr_gem->exec_bos);
+	/* Flushes what's still staged, so needs the exec arrays. */
+	if (bufmgr_gem->uploader)
+		drm_intel_uploader_destroy(bufmgr_gem->uploader);
+
+	while (!DRMLISTEMPTY(&bufmgr_gem->exec_free)) {
+		struct drm_intel_gem_exec *exec =
+			DRMLISTENTRY(struct drm_intel_gem_exec,
+				     bufmgr_gem->exec_free.next, link);
+
+		DRMLISTDEL(&exec->link);
+		drm_intel_gem_exec_free(exec);
+	}
+	if (bufmgr_gem->aub_writer)
+		drm_intel_aub_writer_close(bufmgr_gem->aub_writer);
+	free(bufmgr_gem->aub_relocs);
 	free(bufmgr_gem->aub_filename);
 
+	if (bufmgr_gem->batch_timer)
+		drm_intel_batch_timer_destroy(bufmgr_gem->batch_timer);
+
+	if (bufmgr_gem->reaper_running)
+		drm_intel_gem_stop_cache_reaper(bufmgr_gem);
+
+	drm_intel_gem_context_pool_trim(bufmgr_gem, 0);
+	free(bufmgr_gem->context_pool);
+
+	if (bufmgr_gem->thread_cache) {
+		pthread_key_delete(bufmgr_gem->magazine_key);
+		while (!DRMLISTEMPTY(&bufmgr_gem->magazines))
+			drm_intel_gem_magazine_release
+				(DRMLISTENTRY(struct drm_intel_gem_magazine,
+					      bufmgr_gem->magazines.next,
+					      link));
+	}
+
 	pthread_mutex_destroy(&bufmgr_gem->lock);
 
+	drmHashDestroy(bufmgr_gem->name_table);
+	drmHashDestroy(bufmgr_gem->handle_table);
+
 	/* Free any cached buffer objects we were going to reuse */
 	for (i = 0; i < bufmgr_gem->num_buckets; i++) {
 		struct drm_intel_gem_bo_bucket *bucket =
 		    &bufmgr_gem->cache_bucket[i];
 		drm_intel_bo_gem *bo_gem;
+		int j;
 
-		while (!DRMLISTEMPTY(&bucket->head)) {
-			bo_gem = DRMLISTENTRY(drm_intel_bo_gem,
-					      bucket->head.next, head);
-			DRMLISTDEL(&bo_gem->head);
+		for (j = 0; j < BUCKET_LISTS; j++) {
+			while (!DRMLISTEMPTY(&bucket->head[j])) {
+				bo_gem = DRMLISTENTRY(drm_intel_bo_gem,
+						      bucket->head[j].next,
+						      head);
+				DRMLISTDEL(&bo_gem->head);
 
-			drm_intel_gem_bo_free(&bo_gem->bo);
+				drm_intel_gem_bo_free(&bo_gem->bo);
+			}
 		}
 	}
 
@@ -1632,6 +3589,12 @@ do_bo_emit_reloc(drm_intel_bo *bo, uint32_t offset,
 		return -ENOMEM;
 	}
 
+	/* Sub-allocated BOs can't hold relocations, as they would have to be
+	 * applied to the shared GEM object.
+	 */
+	if (bo_gem->slab)
+		return -EINVAL;
+
 	/* We never use HW fences for rendering on 965+ */
 	if (bufmgr_gem->gen >= 4)
 		need_fence = false;
@@ -1655,24 +3618,29 @@ do_bo_emit_reloc(drm_intel_bo *bo, uint32_t offset,
 	 * already been accounted for.
 	 */
 	assert(!bo_gem->used_as_reloc_target);
-	if (target_bo_gem != bo_gem) {
-		target_bo_gem->used_as_reloc_target = true;
-		bo_gem->reloc_tree_size += target_bo_gem->reloc_tree_size;
-	}
+	if (bo_gem->reloc_count == 0)
+		drm_intel_gem_bo_start_tree(bufmgr_gem, bo_gem);
+
 	/* An object needing a fence is a tiled buffer, so it won't have
 	 * relocs to other buffers.
 	 */
 	if (need_fence)
 		target_bo_gem->reloc_tree_fences = 1;
-	bo_gem->reloc_tree_fences += target_bo_gem->reloc_tree_fences;
+	if (target_bo_gem != bo_gem) {
+		target_bo_gem->used_as_reloc_target = true;
+		drm_intel_gem_bo_account_tree(bo_gem, target_bo_gem);
+	}
 
+	/* Relocations to a sub-allocated BO point into the slab's object. */
 	bo_gem->relocs[bo_gem->reloc_count].offset = offset;
-	bo_gem->relocs[bo_gem->reloc_count].delta = target_offset;
+	bo_gem->relocs[bo_gem->reloc_count].delta =
+	    target_bo_gem->slab_offset + target_offset;
 	bo_gem->relocs[bo_gem->reloc_count].target_handle =
 	    target_bo_gem->gem_handle;
 	bo_gem->relocs[bo_gem->reloc_count].read_domains = read_domains;
 	bo_gem->relocs[bo_gem->reloc_count].write_domain = write_domain;
-	bo_gem->relocs[bo_gem->reloc_count].presumed_offset = target_bo->offset;
+	bo_gem->relocs[bo_gem->reloc_count].presumed_offset =
+	    target_bo->offset - target_bo_gem->slab_offset;
 
 	bo_gem->reloc_target_info[bo_gem->reloc_count].bo = target_bo;
 	if (target_bo != bo)
@@ -1734,6 +3702,7 @@ drm_intel_gem_bo_get_reloc_count(drm_intel_bo *bo)
 void
 drm_intel_gem_bo_clear_relocs(drm_intel_bo *bo, int start)
 {
+	drm_intel_bufmgr_gem *bufmgr_gem = (drm_intel_bufmgr_gem *) bo->bufmgr;
 	drm_intel_bo_gem *bo_gem = (drm_intel_bo_gem *) bo;
 	int i;
 	struct timespec time;
@@ -1745,12 +3714,14 @@ drm_intel_gem_bo_clear_relocs(drm_intel_bo *bo, int start)
 	for (i = start; i < bo_gem->reloc_count; i++) {
 		drm_intel_bo_gem *target_bo_gem = (drm_intel_bo_gem *) bo_gem->reloc_target_info[i].bo;
 		if (&target_bo_gem->bo != bo) {
-			bo_gem->reloc_tree_fences -= target_bo_gem->reloc_tree_fences;
 			drm_intel_gem_bo_unreference_locked_timed(&target_bo_gem->bo,
 								  time.tv_sec);
 		}
 	}
 	bo_gem->reloc_count = start;
+
+	/* Recount the remaining tree under a new generation. */
+	drm_intel_gem_bo_start_tree(bufmgr_gem, bo_gem);
 }
 
 /**
@@ -1758,14 +3729,15 @@ drm_intel_gem_bo_clear_relocs(drm_intel_bo *bo, int start)
  * validations to be performed and update the relocation buffers with
  * index values into the validation list.
  */
-static void
-drm_intel_gem_bo_process_reloc(drm_intel_bo *bo)
+static bool
+drm_intel_gem_bo_process_reloc(struct drm_intel_gem_exec *exec,
+			       drm_intel_bo *bo)
 {
 	drm_intel_bo_gem *bo_gem = (drm_intel_bo_gem *) bo;
 	int i;
 
 	if (bo_gem->relocs == NULL)
-		return;
+		return true;
 
 	for (i = 0; i < bo_gem->reloc_count; i++) {
 		drm_intel_bo *target_bo = bo_gem->reloc_target_info[i].bo;
@@ -1776,21 +3748,27 @@ drm_intel_gem_bo_process_reloc(drm_intel_bo *bo)
 		drm_intel_gem_bo_mark_mmaps_incoherent(bo);
 
 		/* Continue walking the tree depth-first. */
-		drm_intel_gem_bo_process_reloc(target_bo);
+		if (!drm_intel_gem_bo_process_reloc(exec, target_bo))
+			return false;
 
 		/* Add the target to the validate list */
-		drm_intel_add_validate_buffer(target_bo);
+		if (!drm_intel_add_validate_buffer(exec,
+						   drm_intel_gem_bo_backing(target_bo)))
+			return false;
 	}
+
+	return true;
 }
 
-static void
-drm_intel_gem_bo_process_reloc2(drm_intel_bo *bo)
+static bool
+drm_intel_gem_bo_process_reloc2(struct drm_intel_gem_exec *exec,
+				drm_intel_bo *bo)
 {
 	drm_intel_bo_gem *bo_gem = (drm_intel_bo_gem *)bo;
 	int i;
 
 	if (bo_gem->relocs == NULL)
-		return;
+		return true;
 
 	for (i = 0; i < bo_gem->reloc_count; i++) {
 		drm_intel_bo *target_bo = bo_gem->reloc_target_info[i].bo;
@@ -1802,52 +3780,177 @@ drm_intel_gem_bo_process_reloc2(drm_intel_bo *bo)
 		drm_intel_gem_bo_mark_mmaps_incoherent(bo);
 
 		/* Continue walking the tree depth-first. */
-		drm_intel_gem_bo_process_reloc2(target_bo);
+		if (!drm_intel_gem_bo_process_reloc2(exec, target_bo))
+			return false;
 
 		need_fence = (bo_gem->reloc_target_info[i].flags &
 			      DRM_INTEL_RELOC_FENCE);
 
 		/* Add the target to the validate list */
-		drm_intel_add_validate_buffer2(target_bo, need_fence);
+		if (!drm_intel_add_validate_buffer2(exec,
+						    drm_intel_gem_bo_backing(target_bo),
+						    need_fence))
+			return false;
 	}
+
+	return true;
 }
 
 
 static void
-drm_intel_update_buffer_offsets(drm_intel_bufmgr_gem *bufmgr_gem)
+drm_intel_update_buffer_offsets(drm_intel_bufmgr_gem *bufmgr_gem,
+				struct drm_intel_gem_exec *exec)
 {
 	int i;
 
-	for (i = 0; i < bufmgr_gem->exec_count; i++) {
-		drm_intel_bo *bo = bufmgr_gem->exec_bos[i];
+	for (i = 0; i < exec->count; i++) {
+		drm_intel_bo *bo = exec->bos[i];
 		drm_intel_bo_gem *bo_gem = (drm_intel_bo_gem *) bo;
 
 		/* Update the buffer offset */
-		if (bufmgr_gem->exec_objects[i].offset != bo->offset) {
+		if (exec->objects[i].offset != bo->offset) {
 			DBG("BO %d (%s) migrated: 0x%08lx -> 0x%08llx\n",
 			    bo_gem->gem_handle, bo_gem->name, bo->offset,
-			    (unsigned long long)bufmgr_gem->exec_objects[i].
-			    offset);
-			bo->offset = bufmgr_gem->exec_objects[i].offset;
+			    (unsigned long long)exec->objects[i].offset);
+			bo->offset = exec->objects[i].offset;
+			if (bo_gem->slab_owner)
+				drm_intel_gem_slab_update_offsets(bo_gem->slab_owner);
+		}
+	}
+}
+
+/**
+ * Copies the BOs' relocations into @exec for the kernel to use.  With
+ * @no_reloc, also prepares the validation list for a relocation-free
+ * execbuffer: each object is submitted at the offset it was last seen at,
+ * objects written through a relocation are flagged, and with handle-LUT
+ * support the copied relocation targets are turned into validation list
+ * indices.
+ *
+ * Sets @valid to whether every relocation's presumed offset (the address
+ * the driver wrote into the batch at emit time) still matches its target,
+ * in which case the kernel may skip relocation processing altogether.
+ *
+ * Called with the lock held, which keeps the offsets and presumed offsets
+ * still while they're read.  Returns false if out of memory.
+ */
+static bool
+drm_intel_gem_exec_copy_relocs(drm_intel_bufmgr_gem *bufmgr_gem,
+			       struct drm_intel_gem_exec *exec,
+			       bool no_reloc, bool *valid)
+{
+	struct drm_i915_gem_relocation_entry *relocs;
+	int i, j, count = 0;
+
+	*valid = true;
+
+	for (i = 0; i < exec->count; i++)
+		count += exec->objects2[i].relocation_count;
+	if (count > exec->relocs_size) {
+		relocs = realloc(exec->relocs, count * sizeof(*relocs));
+		if (relocs == NULL)
+			return false;
+		exec->relocs = relocs;
+		exec->relocs_size = count;
+	}
+
+	relocs = exec->relocs;
+	for (i = 0; i < exec->count; i++) {
+		drm_intel_bo *bo = exec->bos[i];
+		drm_intel_bo_gem *bo_gem = (drm_intel_bo_gem *)bo;
+		int reloc_count = exec->objects2[i].relocation_count;
+
+		if (no_reloc)
+			exec->objects2[i].offset = bo->offset;
+
+		if (reloc_count == 0)
+			continue;
+
+		memcpy(relocs, bo_gem->relocs, reloc_count * sizeof(*relocs));
+		exec->objects2[i].relocs_ptr = (uintptr_t)relocs;
+
+		for (j = 0; no_reloc && j < reloc_count; j++) {
+			struct drm_i915_gem_relocation_entry *reloc =
+				&relocs[j];
+			drm_intel_bo *target_bo =
+				drm_intel_gem_bo_backing(bo_gem->reloc_target_info[j].bo);
+			int target_index =
+				drm_intel_gem_exec_index(exec, target_bo);
+
+			if (bufmgr_gem->has_exec_handle_lut)
+				reloc->target_handle = target_index;
+			if (reloc->presumed_offset != target_bo->offset)
+				*valid = false;
+			if (reloc->write_domain)
+				exec->objects2[target_index].flags |=
+					EXEC_OBJECT_WRITE;
 		}
+
+		relocs += reloc_count;
+	}
+
+	return true;
+}
+
+/*
+ * Copies the presumed offsets the kernel left in @exec's relocations back
+ * to the BOs, where they have to match the addresses it wrote into their
+ * contents.  Called with the lock held, after the ioctl.
+ */
+static void
+drm_intel_gem_exec_update_relocs(struct drm_intel_gem_exec *exec)
+{
+	int i, j;
+
+	for (i = 0; i < exec->count; i++) {
+		drm_intel_bo_gem *bo_gem = (drm_intel_bo_gem *)exec->bos[i];
+		struct drm_i915_gem_relocation_entry *relocs =
+			(void *)(uintptr_t)exec->objects2[i].relocs_ptr;
+		int reloc_count = exec->objects2[i].relocation_count;
+
+		for (j = 0; j < reloc_count; j++)
+			bo_gem->relocs[j].presumed_offset =
+				relocs[j].presumed_offset;
+	}
+}
+
+/*
+ * Forgets the presumed offsets of @exec's relocations, so that the kernel
+ * rewrites them all the next time round rather than trust them under
+ * I915_EXEC_NO_RELOC.  Called with the lock held, after the ioctl.
+ */
+static void
+drm_intel_gem_exec_invalidate_relocs(struct drm_intel_gem_exec *exec)
+{
+	int i, j;
+
+	for (i = 0; i < exec->count; i++) {
+		drm_intel_bo_gem *bo_gem = (drm_intel_bo_gem *)exec->bos[i];
+		int reloc_count = exec->objects2[i].relocation_count;
+
+		for (j = 0; j < reloc_count; j++)
+			bo_gem->relocs[j].presumed_offset = -1;
 	}
 }
 
 static void
-drm_intel_update_buffer_offsets2 (drm_intel_bufmgr_gem *bufmgr_gem)
+drm_intel_update_buffer_offsets2 (drm_intel_bufmgr_gem *bufmgr_gem,
+				  struct drm_intel_gem_exec *exec)
 {
 	int i;
 
-	for (i = 0; i < bufmgr_gem->exec_count; i++) {
-		drm_intel_bo *bo = bufmgr_gem->exec_bos[i];
+	for (i = 0; i < exec->count; i++) {
+		drm_intel_bo *bo = exec->bos[i];
 		drm_intel_bo_gem *bo_gem = (drm_intel_bo_gem *)bo;
 
 		/* Update the buffer offset */
-		if (bufmgr_gem->exec2_objects[i].offset != bo->offset) {
+		if (exec->objects2[i].offset != bo->offset) {
 			DBG("BO %d (%s) migrated: 0x%08lx -> 0x%08llx\n",
 			    bo_gem->gem_handle, bo_gem->name, bo->offset,
-			    (unsigned long long)bufmgr_gem->exec2_objects[i].offset);
-			bo->offset = bufmgr_gem->exec2_objects[i].offset;
+			    (unsigned long long)exec->objects2[i].offset);
+			bo->offset = exec->objects2[i].offset;
+			if (bo_gem->slab_owner)
+				drm_intel_gem_slab_update_offsets(bo_gem->slab_owner);
 		}
 	}
 }
@@ -1855,64 +3958,118 @@ drm_intel_update_buffer_offsets2 (drm_intel_bufmgr_gem *bufmgr_gem)
 static void
 aub_out(drm_intel_bufmgr_gem *bufmgr_gem, uint32_t data)
 {
-	fwrite(&data, 1, 4, bufmgr_gem->aub_file);
+	drm_intel_aub_writer_write(bufmgr_gem->aub_writer, &data, 4);
 }
 
 static void
 aub_out_data(drm_intel_bufmgr_gem *bufmgr_gem, void *data, size_t size)
 {
-	fwrite(data, 1, size, bufmgr_gem->aub_file);
+	drm_intel_aub_writer_write(bufmgr_gem->aub_writer, data, size);
 }
 
-static void
-aub_write_bo_data(drm_intel_bo *bo, uint32_t offset, uint32_t size)
+static int
+aub_reloc_compare(const void *a, const void *b)
+{
+	const struct drm_intel_aub_reloc *ra = a, *rb = b;
+
+	if (ra->offset != rb->offset)
+		return ra->offset < rb->offset ? -1 : 1;
+	return ra->index - rb->index;
+}
+
+/**
+ * Builds the table of relocated values for the BO about to be dumped,
+ * sorted by offset so that its blocks can be patched in a single pass.
+ */
+/**
+ * Collects the BO's relocations, sorted by offset, for patching into its
+ * dumped contents.  Returns false if there wasn't the memory for it.
+ */
+static bool
+aub_sort_relocs(drm_intel_bo *bo)
 {
 	drm_intel_bufmgr_gem *bufmgr_gem = (drm_intel_bufmgr_gem *) bo->bufmgr;
 	drm_intel_bo_gem *bo_gem = (drm_intel_bo_gem *) bo;
-	uint32_t *data;
-	unsigned int i;
+	int r;
 
-	data = malloc(bo->size);
-	drm_intel_bo_get_subdata(bo, offset, size, data);
+	bufmgr_gem->aub_reloc_count = 0;
 
-	/* Easy mode: write out bo with no relocations */
-	if (!bo_gem->reloc_count) {
-		aub_out_data(bufmgr_gem, data, size);
-		free(data);
-		return;
+	if (bo_gem->reloc_count > bufmgr_gem->aub_relocs_size) {
+		struct drm_intel_aub_reloc *relocs;
+
+		relocs = realloc(bufmgr_gem->aub_relocs,
+				 bo_gem->reloc_count * sizeof(*relocs));
+		if (relocs == NULL)
+			return false;
+		bufmgr_gem->aub_relocs = relocs;
+		bufmgr_gem->aub_relocs_size = bo_gem->reloc_count;
+	}
+
+	for (r = 0; r < bo_gem->reloc_count; r++) {
+		struct drm_intel_aub_reloc *aub_reloc = &bufmgr_gem->aub_relocs[r];
+		drm_intel_bo_gem *target_gem = (drm_intel_bo_gem *)
+			drm_intel_gem_bo_backing(bo_gem->reloc_target_info[r].bo);
+
+		aub_reloc->offset = bo_gem->relocs[r].offset;
+		aub_reloc->value = bo_gem->relocs[r].delta + target_gem->aub_offset;
+		aub_reloc->index = r;
 	}
+	bufmgr_gem->aub_reloc_count = bo_gem->reloc_count;
 
-	/* Otherwise, handle the relocations while writing. */
-	for (i = 0; i < size / 4; i++) {
-		int r;
-		for (r = 0; r < bo_gem->reloc_count; r++) {
-			struct drm_i915_gem_relocation_entry *reloc;
-			drm_intel_reloc_target *info;
+	qsort(bufmgr_gem->aub_relocs, bufmgr_gem->aub_reloc_count,
+	      sizeof(*bufmgr_gem->aub_relocs), aub_reloc_compare);
 
-			reloc = &bo_gem->relocs[r];
-			info = &bo_gem->reloc_target_info[r];
+	return true;
+}
+
+static void
+aub_write_bo_data(drm_intel_bo *bo, uint32_t offset, uint32_t size)
+{
+	drm_intel_bufmgr_gem *bufmgr_gem = (drm_intel_bufmgr_gem *) bo->bufmgr;
+	struct drm_intel_aub_reloc *relocs = bufmgr_gem->aub_relocs;
+	int count = bufmgr_gem->aub_reloc_count;
+	int lo = 0, hi = count, r;
+	char *data;
+
+	/* Read the data straight into the file's staging memory. */
+	data = drm_intel_aub_writer_reserve(bufmgr_gem->aub_writer, size);
+	if (data == NULL)
+		return;
+	drm_intel_bo_get_subdata(bo, offset, size, data);
 
-			if (reloc->offset == offset + i * 4) {
-				drm_intel_bo_gem *target_gem;
-				uint32_t val;
+	/* Find the first relocation overlapping this block... */
+	while (lo < hi) {
+		int mid = (lo + hi) / 2;
 
-				target_gem = (drm_intel_bo_gem *)info->bo;
+		if (relocs[mid].offset + 4 <= offset)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
 
-				val = reloc->delta;
-				val += target_gem->aub_offset;
+	/* ...and patch the block's relocations in one pass.  When several
+	 * relocations share an offset, the first one emitted wins.  Blocks
+	 * end at annotation boundaries, which needn't be aligned, so only
+	 * the part of a relocation inside this block is written here.
+	 */
+	for (r = lo; r < count && relocs[r].offset < offset + size; r++) {
+		uint32_t reloc_offset = relocs[r].offset;
+		uint32_t start = reloc_offset, end = reloc_offset + 4;
 
-				aub_out(bufmgr_gem, val);
-				data[i] = val;
-				break;
-			}
-		}
-		if (r == bo_gem->reloc_count) {
-			/* no relocation, just the data */
-			aub_out(bufmgr_gem, data[i]);
-		}
+		if ((reloc_offset & 3) ||
+		    (r > 0 && reloc_offset == relocs[r - 1].offset))
+			continue;
+
+		if (start < offset)
+			start = offset;
+		if (end > offset + size)
+			end = offset + size;
+		memcpy(data + start - offset,
+		       (char *) &relocs[r].value + start - reloc_offset,
+		       end - start);
 	}
 
-	free(data);
+	drm_intel_aub_writer_commit(bufmgr_gem->aub_writer, data, size);
 }
 
 static void
@@ -1976,7 +4133,7 @@ aub_write_large_trace_block(drm_intel_bo *bo, uint32_t type, uint32_t subtype,
 	}
 }
 
-static void
+static bool
 aub_write_bo(drm_intel_bo *bo)
 {
 	drm_intel_bo_gem *bo_gem = (drm_intel_bo_gem *) bo;
@@ -1984,6 +4141,8 @@ aub_write_bo(drm_intel_bo *bo)
 	unsigned i;
 
 	aub_bo_get_address(bo);
+	if (!aub_sort_relocs(bo))
+		return false;
 
 	/* Write out each annotated section separately. */
 	for (i = 0; i < bo_gem->aub_annotation_count; ++i) {
@@ -2006,6 +4165,8 @@ aub_write_bo(drm_intel_bo *bo)
 		aub_write_large_trace_block(bo, AUB_TRACE_TYPE_NOTYPE, 0,
 					    offset, bo->size - offset);
 	}
+
+	return true;
 }
 
 /*
@@ -2074,7 +4235,7 @@ drm_intel_gem_bo_aub_dump_bmp(drm_intel_bo *bo,
 		return;
 	}
 
-	if (!bufmgr_gem->aub_file)
+	if (!bufmgr_gem->aub_writer)
 		return;
 
 	aub_out(bufmgr_gem, CMD_AUB_DUMP_BMP | 4);
@@ -2091,14 +4252,15 @@ drm_intel_gem_bo_aub_dump_bmp(drm_intel_bo *bo,
 }
 
 static void
-aub_exec(drm_intel_bo *bo, int ring_flag, int used)
+aub_exec(struct drm_intel_gem_exec *exec, drm_intel_bo *bo, int ring_flag,
+	 int used)
 {
 	drm_intel_bufmgr_gem *bufmgr_gem = (drm_intel_bufmgr_gem *) bo->bufmgr;
 	drm_intel_bo_gem *bo_gem = (drm_intel_bo_gem *) bo;
 	int i;
 	bool batch_buffer_needs_annotations;
 
-	if (!bufmgr_gem->aub_file)
+	if (!bufmgr_gem->aub_writer)
 		return;
 
 	/* If batch buffer is not annotated, annotate it the best we
@@ -2114,18 +4276,29 @@ aub_exec(drm_intel_bo *bo, int ring_flag, int used)
 	}
 
 	/* Write out all buffers to AUB memory */
-	for (i = 0; i < bufmgr_gem->exec_count; i++) {
-		aub_write_bo(bufmgr_gem->exec_bos[i]);
+	for (i = 0; i < exec->count; i++) {
+		if (!aub_write_bo(exec->bos[i]))
+			break;
 	}
 
 	/* Remove any annotations we added */
 	if (batch_buffer_needs_annotations)
 		drm_intel_bufmgr_gem_set_aub_annotations(bo, NULL, 0);
 
+	/* A buffer dumped without its relocations applied would send the
+	 * simulator off to the wrong addresses, so stop the trace instead.
+	 */
+	if (i < exec->count) {
+		fprintf(stderr, "Out of memory for AUB relocations, "
+			"disabling AUB dumping\n");
+		drm_intel_bufmgr_gem_set_aub_dump(&bufmgr_gem->bufmgr, 0);
+		return;
+	}
+
 	/* Dump ring buffer */
 	aub_build_dump_ringbuffer(bufmgr_gem, bo_gem->aub_offset, ring_flag);
 
-	fflush(bufmgr_gem->aub_file);
+	drm_intel_aub_writer_flush(bufmgr_gem->aub_writer);
 
 	/*
 	 * One frame has been dumped. So reset the aub_offset for the next frame.
@@ -2142,23 +4315,39 @@ drm_intel_gem_bo_exec(drm_intel_bo *bo, int used,
 	drm_intel_bufmgr_gem *bufmgr_gem = (drm_intel_bufmgr_gem *) bo->bufmgr;
 	drm_intel_bo_gem *bo_gem = (drm_intel_bo_gem *) bo;
 	struct drm_i915_gem_execbuffer execbuf;
-	int ret, i;
+	struct drm_intel_gem_exec *exec;
+	int ret;
 
 	if (bo_gem->has_error)
 		return -ENOMEM;
 
+	if (bo_gem->slab)
+		return -EINVAL;
+
+	exec = drm_intel_gem_exec_get(bufmgr_gem);
+	if (exec == NULL)
+		return -ENOMEM;
+
+	/* Kernels without execbuffer2 are too old to gain from unlocked
+	 * submission, so this one stays serialized.
+	 */
 	pthread_mutex_lock(&bufmgr_gem->lock);
 	/* Update indices and set up the validate list. */
-	drm_intel_gem_bo_process_reloc(bo);
+	if (!drm_intel_gem_bo_process_reloc(exec, bo) ||
+	    /* Add the batch buffer to the validation list.  There are no
+	     * relocations pointing to it.
+	     */
+	    !drm_intel_add_validate_buffer(exec, bo)) {
+		drm_intel_gem_exec_put_locked(bufmgr_gem, exec);
+		pthread_mutex_unlock(&bufmgr_gem->lock);
+		return -ENOMEM;
+	}
 
-	/* Add the batch buffer to the validation list.  There are no
-	 * relocations pointing to it.
-	 */
-	drm_intel_add_validate_buffer(bo);
+	drm_intel_gem_exec_begin_locked(bufmgr_gem, exec, I915_EXEC_RENDER);
 
 	VG_CLEAR(execbuf);
-	execbuf.buffers_ptr = (uintptr_t) bufmgr_gem->exec_objects;
-	execbuf.buffer_count = bufmgr_gem->exec_count;
+	execbuf.buffers_ptr = (uintptr_t) exec->objects;
+	execbuf.buffer_count = exec->count;
 	execbuf.batch_start_offset = 0;
 	execbuf.batch_len = used;
 	execbuf.cliprects_ptr = (uintptr_t) cliprects;
@@ -2174,29 +4363,18 @@ drm_intel_gem_bo_exec(drm_intel_bo *bo, int used,
 		if (errno == ENOSPC) {
 			DBG("Execbuffer fails to pin. "
 			    "Estimate: %u. Actual: %u. Available: %u\n",
-			    drm_intel_gem_estimate_batch_space(bufmgr_gem->exec_bos,
-							       bufmgr_gem->
-							       exec_count),
-			    drm_intel_gem_compute_batch_space(bufmgr_gem->exec_bos,
-							      bufmgr_gem->
-							      exec_count),
+			    drm_intel_gem_estimate_batch_space(&bo, 1),
+			    drm_intel_gem_compute_batch_space(&bo, 1),
 			    (unsigned int)bufmgr_gem->gtt_size);
 		}
 	}
-	drm_intel_update_buffer_offsets(bufmgr_gem);
+	drm_intel_update_buffer_offsets(bufmgr_gem, exec);
+	drm_intel_gem_mark_exec_bos(bufmgr_gem, exec, I915_EXEC_RENDER);
 
 	if (bufmgr_gem->bufmgr.debug)
-		drm_intel_gem_dump_validation_list(bufmgr_gem);
-
-	for (i = 0; i < bufmgr_gem->exec_count; i++) {
-		drm_intel_bo *bo = bufmgr_gem->exec_bos[i];
-		drm_intel_bo_gem *bo_gem = (drm_intel_bo_gem *) bo;
+		drm_intel_gem_dump_validation_list(bufmgr_gem, exec);
 
-		/* Disconnect the buffer from the validate list */
-		bo_gem->validate_index = -1;
-		bufmgr_gem->exec_bos[i] = NULL;
-	}
-	bufmgr_gem->exec_count = 0;
+	drm_intel_gem_exec_put_locked(bufmgr_gem, exec);
 	pthread_mutex_unlock(&bufmgr_gem->lock);
 
 	return ret;
@@ -2209,8 +4387,13 @@ do_exec2(drm_intel_bo *bo, int used, drm_intel_context *ctx,
 {
 	drm_intel_bufmgr_gem *bufmgr_gem = (drm_intel_bufmgr_gem *)bo->bufmgr;
 	struct drm_i915_gem_execbuffer2 execbuf;
+	struct drm_intel_batch_timer_slot *timing = NULL;
+	struct drm_intel_gem_exec *exec;
+	bool valid;
 	int ret = 0;
-	int i;
+
+	if (((drm_intel_bo_gem *) bo)->slab)
+		return -EINVAL;
 
 	switch (flags & 0x7) {
 	default:
@@ -2232,18 +4415,41 @@ do_exec2(drm_intel_bo *bo, int used, drm_intel_context *ctx,
 		break;
 	}
 
-	pthread_mutex_lock(&bufmgr_gem->lock);
-	/* Update indices and set up the validate list. */
-	drm_intel_gem_bo_process_reloc2(bo);
+	/* Staged copies must land before anything that reads them. */
+	if (bufmgr_gem->uploader &&
+	    !drm_intel_uploader_submitting(bufmgr_gem->uploader, bo)) {
+		ret = drm_intel_uploader_flush(bufmgr_gem->uploader, 0);
+		if (ret)
+			return ret;
+	}
 
-	/* Add the batch buffer to the validation list.  There are no relocations
-	 * pointing to it.
+	/*
+	 * The validation list is private to this submission, so it's built
+	 * and submitted without the lock, and execbuffers in different
+	 * contexts run in parallel.  The kernel reads and updates a copy of
+	 * the relocations made under the lock, not the BOs' own arrays,
+	 * which other submissions may be using.  The BOs' relocation trees
+	 * must not be changed meanwhile, as ever.
 	 */
-	drm_intel_add_validate_buffer2(bo, 0);
+	exec = drm_intel_gem_exec_get(bufmgr_gem);
+	if (exec == NULL)
+		return -ENOMEM;
+
+	/* Update indices and set up the validate list. */
+	if (!drm_intel_gem_bo_process_reloc2(exec, bo) ||
+	    /* Add the batch buffer to the validation list.  There are no
+	     * relocations pointing to it.
+	     */
+	    !drm_intel_add_validate_buffer2(exec, bo, 0)) {
+		pthread_mutex_lock(&bufmgr_gem->lock);
+		drm_intel_gem_exec_put_locked(bufmgr_gem, exec);
+		pthread_mutex_unlock(&bufmgr_gem->lock);
+		return -ENOMEM;
+	}
 
 	VG_CLEAR(execbuf);
-	execbuf.buffers_ptr = (uintptr_t)bufmgr_gem->exec2_objects;
-	execbuf.buffer_count = bufmgr_gem->exec_count;
+	execbuf.buffers_ptr = (uintptr_t)exec->objects2;
+	execbuf.buffer_count = exec->count;
 	execbuf.batch_start_offset = 0;
 	execbuf.batch_len = used;
 	execbuf.cliprects_ptr = (uintptr_t)cliprects;
@@ -2257,41 +4463,78 @@ do_exec2(drm_intel_bo *bo, int used, drm_intel_context *ctx,
 		i915_execbuffer2_set_context_id(execbuf, ctx->ctx_id);
 	execbuf.rsvd2 = 0;
 
-	aub_exec(bo, flags, used);
+	pthread_mutex_lock(&bufmgr_gem->lock);
+	if (!drm_intel_gem_exec_copy_relocs(bufmgr_gem, exec,
+					    bufmgr_gem->no_reloc, &valid)) {
+		drm_intel_gem_exec_put_locked(bufmgr_gem, exec);
+		pthread_mutex_unlock(&bufmgr_gem->lock);
+		return -ENOMEM;
+	}
+	if (bufmgr_gem->no_reloc) {
+		if (valid)
+			execbuf.flags |= I915_EXEC_NO_RELOC;
+		if (bufmgr_gem->has_exec_handle_lut)
+			execbuf.flags |= I915_EXEC_HANDLE_LUT;
+	}
+	drm_intel_gem_exec_begin_locked(bufmgr_gem, exec, flags);
+	aub_exec(exec, bo, flags, used);
+	pthread_mutex_unlock(&bufmgr_gem->lock);
 
 	if (bufmgr_gem->no_exec)
 		goto skip_execution;
 
+	/* The timestamps go in right around the batch on its ring, under the
+	 * timer's lock.
+	 */
+	if (bufmgr_gem->batch_timer) {
+		timing = drm_intel_batch_timer_begin(bufmgr_gem->batch_timer,
+						     flags & I915_EXEC_RING_MASK,
+						     ctx ? ctx->ctx_id : 0);
+	}
+
 	ret = drmIoctl(bufmgr_gem->fd,
 		       DRM_IOCTL_I915_GEM_EXECBUFFER2,
 		       &execbuf);
-	if (ret != 0) {
+	if (ret != 0)
 		ret = -errno;
-		if (ret == -ENOSPC) {
-			DBG("Execbuffer fails to pin. "
-			    "Estimate: %u. Actual: %u. Available: %u\n",
-			    drm_intel_gem_estimate_batch_space(bufmgr_gem->exec_bos,
-							       bufmgr_gem->exec_count),
-			    drm_intel_gem_compute_batch_space(bufmgr_gem->exec_bos,
-							      bufmgr_gem->exec_count),
-			    (unsigned int) bufmgr_gem->gtt_size);
+
+	if (bufmgr_gem->batch_timer)
+		drm_intel_batch_timer_end(bufmgr_gem->batch_timer, timing,
+					  ret == 0);
+
+	/* Hung or wedged; whatever ran next in it would fail too. */
+	if (ret == -EIO && ctx)
+		ctx->banned = true;
+
+skip_execution:
+	pthread_mutex_lock(&bufmgr_gem->lock);
+	if (ret == -ENOSPC) {
+		DBG("Execbuffer fails to pin. "
+		    "Estimate: %u. Actual: %u. Available: %u\n",
+		    drm_intel_gem_estimate_batch_space(&bo, 1),
+		    drm_intel_gem_compute_batch_space(&bo, 1),
+		    (unsigned int) bufmgr_gem->gtt_size);
+	}
+	/* If another execbuffer was numbered while this one was in flight,
+	 * the kernel may have run the two in either order, and what it wrote
+	 * into shared BOs needn't match the offsets it returned to this one.
+	 * Only the other one's offsets are kept, and the relocations are
+	 * left for the kernel to check in full.
+	 */
+	if (!bufmgr_gem->no_exec) {
+		if (exec->start_seqno == bufmgr_gem->exec_seqno) {
+			drm_intel_update_buffer_offsets2(bufmgr_gem, exec);
+			drm_intel_gem_exec_update_relocs(exec);
+		} else {
+			drm_intel_gem_exec_invalidate_relocs(exec);
 		}
 	}
-	drm_intel_update_buffer_offsets2(bufmgr_gem);
+	drm_intel_gem_mark_exec_bos(bufmgr_gem, exec, flags);
 
-skip_execution:
 	if (bufmgr_gem->bufmgr.debug)
-		drm_intel_gem_dump_validation_list(bufmgr_gem);
-
-	for (i = 0; i < bufmgr_gem->exec_count; i++) {
-		drm_intel_bo *bo = bufmgr_gem->exec_bos[i];
-		drm_intel_bo_gem *bo_gem = (drm_intel_bo_gem *)bo;
+		drm_intel_gem_dump_validation_list(bufmgr_gem, exec);
 
-		/* Disconnect the buffer from the validate list */
-		bo_gem->validate_index = -1;
-		bufmgr_gem->exec_bos[i] = NULL;
-	}
-	bufmgr_gem->exec_count = 0;
+	drm_intel_gem_exec_put_locked(bufmgr_gem, exec);
 	pthread_mutex_unlock(&bufmgr_gem->lock);
 
 	return ret;
@@ -2330,6 +4573,9 @@ drm_intel_gem_bo_pin(drm_intel_bo *bo, uint32_t alignment)
 	struct drm_i915_gem_pin pin;
 	int ret;
 
+	if (bo_gem->slab)
+		return -EINVAL;
+
 	VG_CLEAR(pin);
 	pin.handle = bo_gem->gem_handle;
 	pin.alignment = alignment;
@@ -2352,6 +4598,9 @@ drm_intel_gem_bo_unpin(drm_intel_bo *bo)
 	struct drm_i915_gem_unpin unpin;
 	int ret;
 
+	if (bo_gem->slab)
+		return -EINVAL;
+
 	VG_CLEAR(unpin);
 	unpin.handle = bo_gem->gem_handle;
 
@@ -2414,6 +4663,11 @@ drm_intel_gem_bo_set_tiling(drm_intel_bo *bo, uint32_t * tiling_mode,
 	if (*tiling_mode == I915_TILING_NONE)
 		stride = 0;
 
+	if (bo_gem->slab || bo_gem->user_virtual) {
+		*tiling_mode = I915_TILING_NONE;
+		return -EINVAL;
+	}
+
 	ret = drm_intel_gem_bo_set_tiling_internal(bo, *tiling_mode, stride);
 	if (ret == 0)
 		drm_intel_bo_gem_set_in_aperture_size(bufmgr_gem, bo_gem);
@@ -2433,6 +4687,133 @@ drm_intel_gem_bo_get_tiling(drm_intel_bo *bo, uint32_t * tiling_mode,
 	return 0;
 }
 
+/**
+ * Sets whether the GPU snoops the CPU caches for @bo, as one of
+ * I915_CACHEING_*.
+ *
+ * A snooped BO can be read and written through a cached CPU mapping
+ * without clflushes, at some cost to GPU access.  With an LLC, BOs are
+ * cached by default.  BOs with a non-default level are only reused for
+ * allocations of the same level.
+ */
+static int
+drm_intel_gem_bo_set_caching(drm_intel_bo *bo, uint32_t caching)
+{
+	drm_intel_bufmgr_gem *bufmgr_gem = (drm_intel_bufmgr_gem *) bo->bufmgr;
+	drm_intel_bo_gem *bo_gem = (drm_intel_bo_gem *) bo;
+
+	/* Shares its pages with the rest of the slab. */
+	if (bo_gem->slab)
+		return -EINVAL;
+
+	return drm_intel_gem_bo_set_caching_internal(bufmgr_gem, bo_gem,
+						     caching);
+}
+
+static int
+drm_intel_gem_bo_get_caching(drm_intel_bo *bo, uint32_t *caching)
+{
+	drm_intel_bufmgr_gem *bufmgr_gem = (drm_intel_bufmgr_gem *) bo->bufmgr;
+	drm_intel_bo_gem *bo_gem = (drm_intel_bo_gem *) bo;
+	struct drm_i915_gem_cacheing arg;
+
+	/* Imported BOs may have been set up by someone else. */
+	VG_CLEAR(arg);
+	arg.handle = bo_gem->gem_handle;
+	if (drmIoctl(bufmgr_gem->fd, DRM_IOCTL_I915_GEM_GET_CACHEING, &arg))
+		return -errno;
+
+	bo_gem->caching = arg.cacheing;
+	*caching = arg.cacheing;
+	return 0;
+}
+
+/*
+ * Checks that a rectangle can be copied through the CPU mapping of @bo
+ * with its tiling, stride and swizzling.
+ */
+static int
+drm_intel_gem_bo_check_rect(drm_intel_bo *bo, uint32_t x, uint32_t y,
+			    uint32_t width, uint32_t height)
+{
+	drm_intel_bufmgr_gem *bufmgr_gem = (drm_intel_bufmgr_gem *) bo->bufmgr;
+	drm_intel_bo_gem *bo_gem = (drm_intel_bo_gem *) bo;
+	unsigned long rows;
+
+	/* Through a GTT mapping, the fence already (de)tiles. */
+	if (bo->virtual == NULL || bo->virtual == bo_gem->gtt_virtual)
+		return -EINVAL;
+
+	/* Older tile layouts differ. */
+	if (bufmgr_gem->gen < 4 && bo_gem->tiling_mode != I915_TILING_NONE)
+		return -ENODEV;
+
+	if (bo_gem->stride == 0 || (unsigned long)x + width > bo_gem->stride)
+		return -EINVAL;
+
+	rows = (unsigned long)y + height;
+	if (bo_gem->tiling_mode == I915_TILING_X)
+		rows = ALIGN(rows, 8);
+	else if (bo_gem->tiling_mode == I915_TILING_Y)
+		rows = ALIGN(rows, 32);
+	if (height && rows * bo_gem->stride > bo->size)
+		return -EINVAL;
+
+	return 0;
+}
+
+/**
+ * Copies a @width bytes by @height rows rectangle from @src, with rows
+ * @src_pitch bytes apart, to byte @x of row @y of @bo, tiling it as the
+ * BO's tiling mode, stride and bit 6 swizzling require.
+ *
+ * The BO must be mapped with drm_intel_bo_map().
+ *
+ * Returns -EINVAL if it isn't, if the BO has no known stride or the
+ * rectangle doesn't fit, and -ENODEV if the layout can't be handled on
+ * the CPU.
+ */
+int
+drm_intel_gem_bo_write_rect(drm_intel_bo *bo, uint32_t x, uint32_t y,
+			    uint32_t width, uint32_t height,
+			    const void *src, uint32_t src_pitch)
+{
+	drm_intel_bo_gem *bo_gem = (drm_intel_bo_gem *) bo;
+	int ret;
+
+	ret = drm_intel_gem_bo_check_rect(bo, x, y, width, height);
+	if (ret)
+		return ret;
+
+	return drm_intel_tiled_write_rect(bo->virtual, bo_gem->tiling_mode,
+					  bo_gem->swizzle_mode,
+					  bo_gem->stride, x, y, width, height,
+					  src, src_pitch);
+}
+
+/**
+ * Copies a @width bytes by @height rows rectangle at byte @x of row @y of
+ * @bo to @dst, with rows @dst_pitch bytes apart, untiling it.  The reverse
+ * of drm_intel_gem_bo_write_rect().
+ */
+int
+drm_intel_gem_bo_read_rect(drm_intel_bo *bo, uint32_t x, uint32_t y,
+			   uint32_t width, uint32_t height,
+			   void *dst, uint32_t dst_pitch)
+{
+	drm_intel_bo_gem *bo_gem = (drm_intel_bo_gem *) bo;
+	int ret;
+
+	ret = drm_intel_gem_bo_check_rect(bo, x, y, width, height);
+	if (ret)
+		return ret;
+
+	return drm_intel_tiled_read_rect(dst, dst_pitch, bo->virtual,
+					 bo_gem->tiling_mode,
+					 bo_gem->swizzle_mode,
+					 bo_gem->stride, x, y, width, height);
+}
+
 drm_intel_bo *
 drm_intel_bo_gem_create_from_prime(drm_intel_bufmgr *bufmgr, int prime_fd, int size)
 {
@@ -2442,15 +4823,30 @@ drm_intel_bo_gem_create_from_prime(drm_intel_bufmgr *bufmgr, int prime_fd, int s
 	drm_intel_bo_gem *bo_gem;
 	struct drm_i915_gem_get_tiling get_tiling;
 
+	pthread_mutex_lock(&bufmgr_gem->lock);
 	ret = drmPrimeFDToHandle(bufmgr_gem->fd, prime_fd, &handle);
 	if (ret) {
-	  fprintf(stderr,"ret is %d %d\n", ret, errno);
+		DBG("create_from_prime: failed to obtain handle from fd: %s\n",
+		    strerror(errno));
+		pthread_mutex_unlock(&bufmgr_gem->lock);
 		return NULL;
 	}
 
+	/* The kernel hands out the same handle for an object that this fd
+	 * already has, in which case we return the existing BO.
+	 */
+	bo_gem = drm_intel_gem_bo_lookup_shared(bufmgr_gem->handle_table,
+						handle);
+	if (bo_gem) {
+		pthread_mutex_unlock(&bufmgr_gem->lock);
+		return &bo_gem->bo;
+	}
+
 	bo_gem = calloc(1, sizeof(*bo_gem));
-	if (!bo_gem)
+	if (!bo_gem) {
+		pthread_mutex_unlock(&bufmgr_gem->lock);
 		return NULL;
+	}
 
 	bo_gem->bo.size = size;
 	bo_gem->bo.handle = handle;
@@ -2461,13 +4857,11 @@ drm_intel_bo_gem_create_from_prime(drm_intel_bufmgr *bufmgr, int prime_fd, int s
 	atomic_set(&bo_gem->refcount, 1);
 
 	bo_gem->name = "prime";
-	bo_gem->validate_index = -1;
 	bo_gem->reloc_tree_fences = 0;
 	bo_gem->used_as_reloc_target = false;
 	bo_gem->has_error = false;
 	bo_gem->reusable = false;
 
-	DRMINITLISTHEAD(&bo_gem->name_list);
 	DRMINITLISTHEAD(&bo_gem->vma_list);
 
 	VG_CLEAR(get_tiling);
@@ -2476,7 +4870,8 @@ drm_intel_bo_gem_create_from_prime(drm_intel_bufmgr *bufmgr, int prime_fd, int s
 		       DRM_IOCTL_I915_GEM_GET_TILING,
 		       &get_tiling);
 	if (ret != 0) {
-		drm_intel_gem_bo_unreference(&bo_gem->bo);
+		drm_intel_gem_bo_free(&bo_gem->bo);
+		pthread_mutex_unlock(&bufmgr_gem->lock);
 		return NULL;
 	}
 	bo_gem->tiling_mode = get_tiling.tiling_mode;
@@ -2484,6 +4879,9 @@ drm_intel_bo_gem_create_from_prime(drm_intel_bufmgr *bufmgr, int prime_fd, int s
 	/* XXX stride is unknown */
 	drm_intel_bo_gem_set_in_aperture_size(bufmgr_gem, bo_gem);
 
+	drm_intel_gem_bo_add_shared(bufmgr_gem, bo_gem);
+	pthread_mutex_unlock(&bufmgr_gem->lock);
+
 	return &bo_gem->bo;
 }
 
@@ -2493,11 +4891,17 @@ drm_intel_bo_gem_export_to_prime(drm_intel_bo *bo, int *prime_fd)
 	drm_intel_bufmgr_gem *bufmgr_gem = (drm_intel_bufmgr_gem *) bo->bufmgr;
 	drm_intel_bo_gem *bo_gem = (drm_intel_bo_gem *) bo;
 
+	if (bo_gem->slab)
+		return -EINVAL;
+
 	if (drmPrimeHandleToFD(bufmgr_gem->fd, bo_gem->gem_handle,
 			       DRM_CLOEXEC, prime_fd) != 0)
 		return -errno;
 
+	pthread_mutex_lock(&bufmgr_gem->lock);
 	bo_gem->reusable = false;
+	drm_intel_gem_bo_add_shared(bufmgr_gem, bo_gem);
+	pthread_mutex_unlock(&bufmgr_gem->lock);
 
 	return 0;
 }
@@ -2509,6 +4913,14 @@ drm_intel_gem_bo_flink(drm_intel_bo *bo, uint32_t * name)
 	drm_intel_bo_gem *bo_gem = (drm_intel_bo_gem *) bo;
 	int ret;
 
+	if (bo_gem->slab)
+		return -EINVAL;
+
+	/* Other processes can't see our pending copies. */
+	ret = drm_intel_gem_bo_flush_upload(bufmgr_gem, bo_gem);
+	if (ret)
+		return ret;
+
 	if (!bo_gem->global_name) {
 		struct drm_gem_flink flink;
 
@@ -2519,29 +4931,422 @@ drm_intel_gem_bo_flink(drm_intel_bo *bo, uint32_t * name)
 		if (ret != 0)
 			return -errno;
 
+		pthread_mutex_lock(&bufmgr_gem->lock);
 		bo_gem->global_name = flink.name;
 		bo_gem->reusable = false;
+		drm_intel_gem_bo_add_shared(bufmgr_gem, bo_gem);
+		pthread_mutex_unlock(&bufmgr_gem->lock);
+	}
+
+	*name = bo_gem->global_name;
+	return 0;
+}
+
+/**
+ * Enables unlimited caching of buffer objects for reuse.
+ *
+ * This is potentially very memory expensive, as the cache at each bucket
+ * size is only bounded by how many buffers of that size we've managed to have
+ * in flight at once.
+ */
+void
+drm_intel_bufmgr_gem_enable_reuse(drm_intel_bufmgr *bufmgr)
+{
+	drm_intel_bufmgr_gem *bufmgr_gem = (drm_intel_bufmgr_gem *) bufmgr;
+
+	bufmgr_gem->bo_reuse = true;
+}
+
+/*
+ * Frees the cached BOs of one bucket list that have been there longer than
+ * the reaper's limit, or all of them under memory pressure, and marks the
+ * rest DONTNEED.
+ *
+ * The list is only locked to take BOs off it: the madvise calls happen
+ * with the BOs on a private list, out of reach of allocations, and the
+ * kernel objects are closed after the lock is dropped.
+ */
+static void
+drm_intel_gem_reap_list(drm_intel_bufmgr_gem *bufmgr_gem,
+			drmMMListHead *list, uint64_t now, bool shrink)
+{
+	drmMMListHead expired, pending, purged;
+	drm_intel_bo_gem *bo_gem, *next, *pos;
+
+	DRMINITLISTHEAD(&expired);
+	DRMINITLISTHEAD(&pending);
+	DRMINITLISTHEAD(&purged);
+
+	pthread_mutex_lock(&bufmgr_gem->lock);
+	while (!DRMLISTEMPTY(list)) {
+		bo_gem = DRMLISTENTRY(drm_intel_bo_gem, list->next, head);
+		if (!shrink &&
+		    now - bo_gem->free_ms < bufmgr_gem->reaper_max_age_ms)
+			break;
+
+		DRMLISTDEL(&bo_gem->head);
+		drm_intel_gem_bo_unlink_vma(bufmgr_gem, bo_gem);
+		DRMLISTADDTAIL(&bo_gem->head, &expired);
+	}
+	DRMLISTFOREACHENTRYSAFE(bo_gem, next, list, head) {
+		if (!bo_gem->dontneed) {
+			DRMLISTDEL(&bo_gem->head);
+			DRMLISTADDTAIL(&bo_gem->head, &pending);
+		}
+	}
+	pthread_mutex_unlock(&bufmgr_gem->lock);
+
+	if (!DRMLISTEMPTY(&pending)) {
+		DRMLISTFOREACHENTRYSAFE(bo_gem, next, &pending, head) {
+			if (!drm_intel_gem_bo_madvise_internal(bufmgr_gem,
+							       bo_gem,
+							       I915_MADV_DONTNEED)) {
+				DRMLISTDEL(&bo_gem->head);
+				DRMLISTADDTAIL(&bo_gem->head, &purged);
+			}
+		}
+
+		/* Put them back in order of freeing, so that the oldest
+		 * stay at the head of the list.
+		 */
+		pthread_mutex_lock(&bufmgr_gem->lock);
+		DRMLISTFOREACHENTRYSAFE(bo_gem, next, &purged, head) {
+			DRMLISTDEL(&bo_gem->head);
+			drm_intel_gem_bo_unlink_vma(bufmgr_gem, bo_gem);
+			DRMLISTADDTAIL(&bo_gem->head, &expired);
+		}
+		DRMLISTFOREACHENTRYSAFE(bo_gem, next, &pending, head) {
+			DRMLISTDEL(&bo_gem->head);
+			pos = DRMLISTENTRY(drm_intel_bo_gem, list->prev, head);
+			while (&pos->head != list &&
+			       pos->free_ms > bo_gem->free_ms)
+				pos = DRMLISTENTRY(drm_intel_bo_gem,
+						   pos->head.prev, head);
+			DRMLISTADD(&bo_gem->head, &pos->head);
+		}
+		pthread_mutex_unlock(&bufmgr_gem->lock);
+	}
+
+	DRMLISTFOREACHENTRYSAFE(bo_gem, next, &expired, head)
+		drm_intel_gem_bo_release(&bo_gem->bo);
+}
+
+/*
+ * One pass of the reaper over the cache.  With @shrink, everything cached
+ * is freed, the per-thread caches included.
+ */
+static void
+drm_intel_gem_reap_cache(drm_intel_bufmgr_gem *bufmgr_gem, bool shrink)
+{
+	struct drm_intel_gem_magazine *mag;
+	uint64_t now = drm_intel_gem_now_ms();
+	int i, j;
+
+	if (shrink) {
+		pthread_mutex_lock(&bufmgr_gem->lock);
+		DRMLISTFOREACHENTRY(mag, &bufmgr_gem->magazines, link)
+			drm_intel_gem_magazine_empty(mag);
+		pthread_mutex_unlock(&bufmgr_gem->lock);
+	}
+
+	for (i = 0; i < bufmgr_gem->num_buckets; i++) {
+		struct drm_intel_gem_bo_bucket *bucket =
+		    &bufmgr_gem->cache_bucket[i];
+
+		for (j = 0; j < BUCKET_LISTS; j++)
+			drm_intel_gem_reap_list(bufmgr_gem, &bucket->head[j],
+						now, shrink);
+	}
+}
+
+/*
+ * Opens something that polls with POLLPRI when the system or our cgroup
+ * is short of memory: a PSI trigger for 150ms of stalls in a 2s window,
+ * or failing that the cgroup v2 memory.events file, which changes whenever
+ * the cgroup hits its low, high or max limits.
+ */
+static int
+drm_intel_gem_open_pressure_fd(void)
+{
+	static const char trigger[] = "some 150000 2000000";
+	char line[512], path[600];
+	FILE *file;
+	int fd;
+
+	fd = open("/proc/pressure/memory", O_RDWR | O_NONBLOCK | O_CLOEXEC);
+	if (fd >= 0) {
+		if (write(fd, trigger, sizeof(trigger)) == sizeof(trigger))
+			return fd;
+		close(fd);
+	}
+
+	file = fopen("/proc/self/cgroup", "r");
+	if (file == NULL)
+		return -1;
+
+	fd = -1;
+	while (fgets(line, sizeof(line), file)) {
+		if (strncmp(line, "0::", 3) != 0)
+			continue;
+
+		line[strcspn(line, "\n")] = '\0';
+		snprintf(path, sizeof(path), "/sys/fs/cgroup%s/memory.events",
+			 line + 3);
+		fd = open(path, O_RDONLY | O_CLOEXEC);
+		break;
+	}
+	fclose(file);
+
+	return fd;
+}
+
+static void *
+drm_intel_gem_reaper_thread(void *arg)
+{
+	drm_intel_bufmgr_gem *bufmgr_gem = arg;
+	unsigned int period_ms = bufmgr_gem->reaper_max_age_ms / 4;
+	struct pollfd pfd[2];
+	char buf[256];
+
+	if (period_ms < 10)
+		period_ms = 10;
+	if (period_ms > 1000)
+		period_ms = 1000;
+
+	for (;;) {
+		bool shrink = false;
+
+		pfd[0].fd = bufmgr_gem->reaper_stop[0];
+		pfd[0].events = POLLIN;
+		pfd[1].fd = bufmgr_gem->pressure_fd;
+		pfd[1].events = POLLPRI;
+		pfd[0].revents = pfd[1].revents = 0;
+
+		if (poll(pfd, bufmgr_gem->pressure_fd >= 0 ? 2 : 1,
+			 period_ms) < 0 && errno != EINTR) {
+			/* Hand the aging back to the threads freeing BOs
+			 * rather than leave the cache to grow.
+			 */
+			DBG("cache reaper stopping: %s\n", strerror(errno));
+			pthread_mutex_lock(&bufmgr_gem->lock);
+			bufmgr_gem->cache_reaper = false;
+			pthread_mutex_unlock(&bufmgr_gem->lock);
+			break;
+		}
+		if (pfd[0].revents)
+			break;
+
+		if (pfd[1].revents & (POLLPRI | POLLERR)) {
+			DBG("memory pressure, emptying the BO cache\n");
+			shrink = true;
+			/* memory.events only notifies again once re-read. */
+			if (lseek(bufmgr_gem->pressure_fd, 0, SEEK_SET) < 0 ||
+			    read(bufmgr_gem->pressure_fd, buf, sizeof(buf)) < 0) {
+				close(bufmgr_gem->pressure_fd);
+				bufmgr_gem->pressure_fd = -1;
+			}
+		}
+
+		drm_intel_gem_reap_cache(bufmgr_gem, shrink);
+	}
+
+	return NULL;
+}
+
+static void
+drm_intel_gem_stop_cache_reaper(drm_intel_bufmgr_gem *bufmgr_gem)
+{
+	char c = 0;
+
+	if (write(bufmgr_gem->reaper_stop[1], &c, 1) == 1)
+		pthread_join(bufmgr_gem->reaper, NULL);
+
+	close(bufmgr_gem->reaper_stop[0]);
+	close(bufmgr_gem->reaper_stop[1]);
+	if (bufmgr_gem->pressure_fd >= 0)
+		close(bufmgr_gem->pressure_fd);
+	bufmgr_gem->cache_reaper = false;
+	bufmgr_gem->reaper_running = false;
+}
+
+/**
+ * Moves the upkeep of the BO cache to a background thread.
+ *
+ * Normally freed BOs are marked purgeable as they are freed, and those
+ * cached for more than a second or two are closed by whichever thread
+ * happens to free the next BO, under the bufmgr lock.  With the reaper,
+ * freeing a BO just puts it in the cache, and every quarter of
+ * \p max_age_ms the reaper marks the newly cached BOs purgeable in one
+ * go and closes those cached for longer than \p max_age_ms.  A BO that is
+ * reused before the reaper gets to it needs no madvise at all.
+ *
+ * Where the kernel supports it, the reaper also watches for memory
+ * pressure on the system or the process' cgroup, and empties the cache
+ * when there is some, per-thread caches included.  Otherwise BOs in the
+ * per-thread caches are still aged as they are freed.
+ *
+ * Should the reaper fail to wait for its next pass, it hands the cache
+ * back to the threads freeing BOs and exits.
+ *
+ * Returns 0 on success or a negative errno.
+ */
+int
+drm_intel_bufmgr_gem_enable_cache_reaper(drm_intel_bufmgr *bufmgr,
+					 unsigned int max_age_ms)
+{
+	drm_intel_bufmgr_gem *bufmgr_gem = (drm_intel_bufmgr_gem *) bufmgr;
+	drm_intel_bo_gem *bo_gem;
+	uint64_t now;
+	int i, j, ret;
+
+	if (bufmgr_gem->cache_reaper)
+		return 0;
+
+	/* Clean up after a reaper that gave up. */
+	if (bufmgr_gem->reaper_running)
+		drm_intel_gem_stop_cache_reaper(bufmgr_gem);
+
+	if (pipe(bufmgr_gem->reaper_stop))
+		return -errno;
+
+	bufmgr_gem->reaper_max_age_ms = max_age_ms;
+	bufmgr_gem->pressure_fd = drm_intel_gem_open_pressure_fd();
+
+	/* BOs cached before now were never stamped; count their age from
+	 * here rather than reaping them all on the first pass.
+	 */
+	now = drm_intel_gem_now_ms();
+	pthread_mutex_lock(&bufmgr_gem->lock);
+	for (i = 0; i < bufmgr_gem->num_buckets; i++) {
+		struct drm_intel_gem_bo_bucket *bucket =
+		    &bufmgr_gem->cache_bucket[i];
+
+		for (j = 0; j < BUCKET_LISTS; j++)
+			DRMLISTFOREACHENTRY(bo_gem, &bucket->head[j], head)
+				bo_gem->free_ms = now;
+	}
+	bufmgr_gem->cache_reaper = true;
+	pthread_mutex_unlock(&bufmgr_gem->lock);
+
+	ret = pthread_create(&bufmgr_gem->reaper, NULL,
+			     drm_intel_gem_reaper_thread, bufmgr_gem);
+	if (ret) {
+		pthread_mutex_lock(&bufmgr_gem->lock);
+		bufmgr_gem->cache_reaper = false;
+		pthread_mutex_unlock(&bufmgr_gem->lock);
+		close(bufmgr_gem->reaper_stop[0]);
+		close(bufmgr_gem->reaper_stop[1]);
+		if (bufmgr_gem->pressure_fd >= 0)
+			close(bufmgr_gem->pressure_fd);
+		return -ret;
+	}
+	bufmgr_gem->reaper_running = true;
+
+	return 0;
+}
+
+/**
+ * Frees every BO in the cache, those in the per-thread caches included.
+ *
+ * The cache reaper does this by itself when it notices memory pressure;
+ * this is for drivers that hear about it some other way.
+ */
+void
+drm_intel_bufmgr_gem_trim_cache(drm_intel_bufmgr *bufmgr)
+{
+	drm_intel_gem_reap_cache((drm_intel_bufmgr_gem *)bufmgr, true);
+}
+
+/**
+ * Enables per-thread caches of recently freed small buffers.
+ *
+ * With buffer reuse enabled, each thread then keeps a few freed BOs of each
+ * small size bucket to itself, and only exchanges them with the shared cache
+ * in batches.  This avoids contending on the bufmgr lock for every
+ * allocation and release when many threads allocate small BOs.
+ */
+void
+drm_intel_bufmgr_gem_enable_thread_cache(drm_intel_bufmgr *bufmgr)
+{
+	drm_intel_bufmgr_gem *bufmgr_gem = (drm_intel_bufmgr_gem *) bufmgr;
+
+	if (bufmgr_gem->thread_cache)
+		return;
+
+	if (pthread_key_create(&bufmgr_gem->magazine_key,
+			       drm_intel_gem_magazine_destroy))
+		return;
+
+	bufmgr_gem->thread_cache = true;
+}
+
+/**
+ * Reports how often allocations were served from the BO cache, for each
+ * requested tiling mode.  Hits needed no SET_TILING ioctl at all, retiles
+ * reused a BO after changing its tiling or stride.
+ */
+void
+drm_intel_bufmgr_gem_get_cache_stats(drm_intel_bufmgr *bufmgr,
+				     drm_intel_bufmgr_gem_cache_stats *stats)
+{
+	drm_intel_bufmgr_gem *bufmgr_gem = (drm_intel_bufmgr_gem *)bufmgr;
+	struct drm_intel_gem_magazine *mag;
+	int i;
 
-		DRMLISTADDTAIL(&bo_gem->name_list, &bufmgr_gem->named);
+	pthread_mutex_lock(&bufmgr_gem->lock);
+	*stats = bufmgr_gem->cache_stats;
+	DRMLISTFOREACHENTRY(mag, &bufmgr_gem->magazines, link) {
+		pthread_mutex_lock(&mag->lock);
+		for (i = 0; i < BUCKET_TILING_MODES; i++) {
+			stats->tiling[i].hits += mag->stats.tiling[i].hits;
+			stats->tiling[i].retiled +=
+				mag->stats.tiling[i].retiled;
+			stats->tiling[i].misses += mag->stats.tiling[i].misses;
+		}
+		pthread_mutex_unlock(&mag->lock);
 	}
+	pthread_mutex_unlock(&bufmgr_gem->lock);
+}
 
-	*name = bo_gem->global_name;
-	return 0;
+/**
+ * Enables sub-allocation of small buffers.
+ *
+ * Once enabled, drm_intel_bo_alloc() requests of up to 2KiB are served from
+ * chunks of larger, shared GEM objects.  This saves the kernel object and
+ * the page of memory each small buffer would otherwise need, and shrinks
+ * the validation lists for batches referencing many of them.
+ *
+ * Sub-allocated buffers can't be tiled, pinned, named or exported, and
+ * can't hold relocations themselves, so this is meant for data-only
+ * buffers such as constants.  Synchronization happens at the granularity
+ * of the shared object: mapping a sub-allocated buffer waits for any
+ * rendering using its neighbours, unless mapped unsynchronized.
+ */
+void
+drm_intel_bufmgr_gem_enable_slab_alloc(drm_intel_bufmgr *bufmgr)
+{
+	drm_intel_bufmgr_gem *bufmgr_gem = (drm_intel_bufmgr_gem *) bufmgr;
+
+	bufmgr_gem->slab_alloc = true;
 }
 
 /**
- * Enables unlimited caching of buffer objects for reuse.
+ * Enables relocation-free execbuffers, if the kernel supports them.
  *
- * This is potentially very memory expensive, as the cache at each bucket
- * size is only bounded by how many buffers of that size we've managed to have
- * in flight at once.
+ * Buffers are submitted at the offsets they were last seen at, and when
+ * every relocation's presumed offset still matches, the kernel is told it
+ * may skip relocation processing.  This relies on the driver writing the
+ * target's current offset plus delta into the batch for every relocation
+ * it emits, as drm_intel_bo_emit_reloc() callers conventionally do.
  */
 void
-drm_intel_bufmgr_gem_enable_reuse(drm_intel_bufmgr *bufmgr)
+drm_intel_bufmgr_gem_enable_no_reloc(drm_intel_bufmgr *bufmgr)
 {
 	drm_intel_bufmgr_gem *bufmgr_gem = (drm_intel_bufmgr_gem *) bufmgr;
 
-	bufmgr_gem->bo_reuse = true;
+	if (bufmgr_gem->has_exec_no_reloc &&
+	    bufmgr_gem->bufmgr.bo_exec == drm_intel_gem_bo_exec2)
+		bufmgr_gem->no_reloc = true;
 }
 
 /**
@@ -2562,40 +5367,54 @@ drm_intel_bufmgr_gem_enable_fenced_relocs(drm_intel_bufmgr *bufmgr)
 
 /**
  * Return the additional aperture space required by the tree of buffer objects
- * rooted at bo.
+ * rooted at bo, skipping those already counted in walk generation gen.
  */
 static int
-drm_intel_gem_bo_get_aperture_space(drm_intel_bo *bo)
+drm_intel_gem_bo_get_aperture_space(drm_intel_bo *bo, uint32_t gen)
 {
 	drm_intel_bo_gem *bo_gem = (drm_intel_bo_gem *) bo;
 	int i;
 	int total = 0;
 
-	if (bo == NULL || bo_gem->included_in_check_aperture)
+	if (bo == NULL || bo_gem->check_mark == gen)
 		return 0;
 
-	total += bo->size;
-	bo_gem->included_in_check_aperture = true;
+	total += bo_gem->aperture_size;
+	bo_gem->check_mark = gen;
 
 	for (i = 0; i < bo_gem->reloc_count; i++)
 		total +=
 		    drm_intel_gem_bo_get_aperture_space(bo_gem->
-							reloc_target_info[i].bo);
+							reloc_target_info[i].bo,
+							gen);
 
 	return total;
 }
 
+/**
+ * Returns whether @bo_gem is already counted in the relocation tree rooted
+ * at @root_gem.
+ */
+static bool
+drm_intel_gem_bo_in_tree(drm_intel_bo_gem *root_gem, drm_intel_bo_gem *bo_gem)
+{
+	return root_gem->reloc_count != 0 && root_gem->tree_gen != 0 &&
+		bo_gem->tree_mark == root_gem->tree_gen;
+}
+
 /**
  * Count the number of buffers in this list that need a fence reg
  *
  * If the count is greater than the number of available regs, we'll have
  * to ask the caller to resubmit a batch with fewer tiled buffers.
  *
- * This function over-counts if the same buffer is used multiple times.
+ * Buffers already counted in the tree of the first one are skipped; other
+ * buffers used multiple times are over-counted.
  */
 static unsigned int
 drm_intel_gem_total_fences(drm_intel_bo ** bo_array, int count)
 {
+	drm_intel_bo_gem *root_gem = (drm_intel_bo_gem *) bo_array[0];
 	int i;
 	unsigned int total = 0;
 
@@ -2605,45 +5424,37 @@ drm_intel_gem_total_fences(drm_intel_bo ** bo_array, int count)
 		if (bo_gem == NULL)
 			continue;
 
+		if (i > 0 && drm_intel_gem_bo_in_tree(root_gem, bo_gem) &&
+		    (bo_gem->tree_fence_counted || bo_gem->reloc_count))
+			continue;
+
 		total += bo_gem->reloc_tree_fences;
 	}
 	return total;
 }
 
-/**
- * Clear the flag set by drm_intel_gem_bo_get_aperture_space() so we're ready
- * for the next drm_intel_bufmgr_check_aperture_space() call.
- */
-static void
-drm_intel_gem_bo_clear_aperture_space_flag(drm_intel_bo *bo)
-{
-	drm_intel_bo_gem *bo_gem = (drm_intel_bo_gem *) bo;
-	int i;
-
-	if (bo == NULL || !bo_gem->included_in_check_aperture)
-		return;
-
-	bo_gem->included_in_check_aperture = false;
-
-	for (i = 0; i < bo_gem->reloc_count; i++)
-		drm_intel_gem_bo_clear_aperture_space_flag(bo_gem->
-							   reloc_target_info[i].bo);
-}
-
 /**
  * Return a conservative estimate for the amount of aperture required
- * for a collection of buffers. This may double-count some buffers.
+ * for a collection of buffers.  Buffers already counted in the tree of
+ * the first one are skipped, others may be double-counted.
  */
 static unsigned int
 drm_intel_gem_estimate_batch_space(drm_intel_bo **bo_array, int count)
 {
+	drm_intel_bo_gem *root_gem = (drm_intel_bo_gem *) bo_array[0];
 	int i;
 	unsigned int total = 0;
 
 	for (i = 0; i < count; i++) {
 		drm_intel_bo_gem *bo_gem = (drm_intel_bo_gem *) bo_array[i];
-		if (bo_gem != NULL)
-			total += bo_gem->reloc_tree_size;
+
+		if (bo_gem == NULL)
+			continue;
+
+		if (i > 0 && drm_intel_gem_bo_in_tree(root_gem, bo_gem))
+			continue;
+
+		total += bo_gem->reloc_tree_size;
 	}
 	return total;
 }
@@ -2652,33 +5463,21 @@ drm_intel_gem_estimate_batch_space(drm_intel_bo **bo_array, int count)
  * Return the amount of aperture needed for a collection of buffers.
  * This avoids double counting any buffers, at the cost of looking
  * at every buffer in the set.
+ *
+ * Called with the bufmgr lock held.
  */
 static unsigned int
 drm_intel_gem_compute_batch_space(drm_intel_bo **bo_array, int count)
 {
+	drm_intel_bufmgr_gem *bufmgr_gem =
+	    (drm_intel_bufmgr_gem *) bo_array[0]->bufmgr;
+	uint32_t gen = drm_intel_gem_next_aperture_gen(bufmgr_gem);
 	int i;
 	unsigned int total = 0;
 
-	for (i = 0; i < count; i++) {
-		total += drm_intel_gem_bo_get_aperture_space(bo_array[i]);
-		/* For the first buffer object in the array, we get an
-		 * accurate count back for its reloc_tree size (since nothing
-		 * had been flagged as being counted yet).  We can save that
-		 * value out as a more conservative reloc_tree_size that
-		 * avoids double-counting target buffers.  Since the first
-		 * buffer happens to usually be the batch buffer in our
-		 * callers, this can pull us back from doing the tree
-		 * walk on every new batch emit.
-		 */
-		if (i == 0) {
-			drm_intel_bo_gem *bo_gem =
-			    (drm_intel_bo_gem *) bo_array[i];
-			bo_gem->reloc_tree_size = total;
-		}
-	}
-
 	for (i = 0; i < count; i++)
-		drm_intel_gem_bo_clear_aperture_space_flag(bo_array[i]);
+		total += drm_intel_gem_bo_get_aperture_space(bo_array[i], gen);
+
 	return total;
 }
 
@@ -2716,8 +5515,11 @@ drm_intel_gem_check_aperture_space(drm_intel_bo **bo_array, int count)
 
 	total = drm_intel_gem_estimate_batch_space(bo_array, count);
 
-	if (total > threshold)
+	if (total > threshold) {
+		pthread_mutex_lock(&bufmgr_gem->lock);
 		total = drm_intel_gem_compute_batch_space(bo_array, count);
+		pthread_mutex_unlock(&bufmgr_gem->lock);
+	}
 
 	if (total > threshold) {
 		DBG("check_space: overflowed available aperture, "
@@ -2788,12 +5590,17 @@ static void
 add_bucket(drm_intel_bufmgr_gem *bufmgr_gem, int size)
 {
 	unsigned int i = bufmgr_gem->num_buckets;
+	int j;
 
 	assert(i < ARRAY_SIZE(bufmgr_gem->cache_bucket));
 
-	DRMINITLISTHEAD(&bufmgr_gem->cache_bucket[i].head);
+	for (j = 0; j < BUCKET_LISTS; j++)
+		DRMINITLISTHEAD(&bufmgr_gem->cache_bucket[i].head[j]);
 	bufmgr_gem->cache_bucket[i].size = size;
 	bufmgr_gem->num_buckets++;
+
+	if (size <= MAGAZINE_MAX_SIZE)
+		bufmgr_gem->num_magazine_buckets = bufmgr_gem->num_buckets;
 }
 
 static void
@@ -2823,14 +5630,94 @@ init_cache_buckets(drm_intel_bufmgr_gem *bufmgr_gem)
 	}
 }
 
+/**
+ * Limits the number of mappings kept cached for BOs that aren't mapped.
+ *
+ * Whatever the limit, the cache also keeps within half of what
+ * vm.max_map_count leaves to the process, and evicts cheaply recreated
+ * mappings before expensive ones.  A negative limit leaves only that.
+ */
 void
 drm_intel_bufmgr_gem_set_vma_cache_size(drm_intel_bufmgr *bufmgr, int limit)
 {
 	drm_intel_bufmgr_gem *bufmgr_gem = (drm_intel_bufmgr_gem *)bufmgr;
 
+	pthread_mutex_lock(&bufmgr_gem->lock);
 	bufmgr_gem->vma_max = limit;
 
 	drm_intel_gem_bo_purge_vma_cache(bufmgr_gem);
+	pthread_mutex_unlock(&bufmgr_gem->lock);
+}
+
+/** Reports on the use of the mapping cache since the bufmgr was created. */
+void
+drm_intel_bufmgr_gem_get_vma_stats(drm_intel_bufmgr *bufmgr,
+				   drm_intel_bufmgr_gem_vma_stats *stats)
+{
+	drm_intel_bufmgr_gem *bufmgr_gem = (drm_intel_bufmgr_gem *)bufmgr;
+
+	pthread_mutex_lock(&bufmgr_gem->lock);
+	*stats = bufmgr_gem->vma_stats;
+	stats->cached = bufmgr_gem->vma_count;
+	stats->limit = drm_intel_gem_vma_limit(bufmgr_gem);
+	pthread_mutex_unlock(&bufmgr_gem->lock);
+}
+
+/**
+ * Routes drm_intel_bo_subdata() to whichever way of writing avoids a
+ * stall.
+ *
+ * Writes to a BO the GPU may still be using are copied into a staging
+ * ring and blitted into place on the BLT ring ahead of the next batch,
+ * instead of waiting in pwrite for the GPU to finish with the BO.  Writes
+ * to an idle BO that's already mapped on an LLC platform are copied
+ * directly, unless it is tiled and mapped through the GTT, and everything
+ * else still uses pwrite.  Mapping, reading or
+ * waiting on a BO submits any blits still pending for it first.
+ *
+ * Without an LLC, reads of 64KiB or more from a busy BO with
+ * drm_intel_bo_get_subdata() are blitted into a snooped staging BO the
+ * other way, and copied out of the CPU caches from there.
+ *
+ * Only writes of up to 64KiB with dword-aligned offset and size go
+ * through the ring.  If a blit batch fails to execute, its writes are
+ * redone with pwrite; should that fail too, the error is returned by the
+ * next map, read, wait, flink or execbuffer.
+ *
+ * Returns -ENODEV before gen6 or without a BLT ring.
+ */
+int
+drm_intel_bufmgr_gem_enable_upload_ring(drm_intel_bufmgr *bufmgr)
+{
+	drm_intel_bufmgr_gem *bufmgr_gem = (drm_intel_bufmgr_gem *)bufmgr;
+
+	if (bufmgr_gem->uploader)
+		return 0;
+
+	if (bufmgr_gem->gen < 6 || !bufmgr_gem->has_blt ||
+	    bufmgr_gem->no_exec)
+		return -ENODEV;
+
+	bufmgr_gem->uploader = drm_intel_uploader_create(bufmgr);
+	if (!bufmgr_gem->uploader)
+		return -ENOMEM;
+
+	return 0;
+}
+
+/** Reports how drm_intel_bo_subdata() has written since enabling the ring. */
+void
+drm_intel_bufmgr_gem_get_upload_stats(drm_intel_bufmgr *bufmgr,
+				      drm_intel_bufmgr_gem_upload_stats *stats)
+{
+	drm_intel_bufmgr_gem *bufmgr_gem = (drm_intel_bufmgr_gem *)bufmgr;
+
+	if (!bufmgr_gem->uploader) {
+		memset(stats, 0, sizeof(*stats));
+		return;
+	}
+
+	drm_intel_uploader_get_stats(bufmgr_gem->uploader, stats);
 }
 
 /**
@@ -2890,6 +5777,102 @@ drm_intel_bufmgr_gem_set_aub_filename(drm_intel_bufmgr *bufmgr,
 		bufmgr_gem->aub_filename = strdup(filename);
 }
 
+/**
+ * Selects writing the AUB file through mmap'd, double-buffered windows
+ * instead of write(2) from a staging buffer.
+ *
+ * This function has to be called before drm_intel_bufmgr_gem_set_aub_dump()
+ * for it to have any effect.
+ */
+void
+drm_intel_bufmgr_gem_set_aub_mmap(drm_intel_bufmgr *bufmgr, int enable)
+{
+	drm_intel_bufmgr_gem *bufmgr_gem = (drm_intel_bufmgr_gem *)bufmgr;
+
+	bufmgr_gem->aub_mmap = !!enable;
+}
+
+static int
+drm_intel_gem_enable_batch_timing(drm_intel_bufmgr_gem *bufmgr_gem,
+				  const char *log_filename)
+{
+	FILE *log = NULL;
+
+	if (bufmgr_gem->batch_timer)
+		return 0;
+
+	/* Needs the per-ring TIMESTAMP registers and execbuffer2. */
+	if (bufmgr_gem->gen < 6 || bufmgr_gem->no_exec)
+		return -ENODEV;
+
+	if (log_filename) {
+		log = fopen(log_filename, "w");
+		if (!log)
+			return -errno;
+	}
+
+	bufmgr_gem->batch_timer =
+		drm_intel_batch_timer_create(&bufmgr_gem->bufmgr,
+					     bufmgr_gem->fd, log);
+	if (!bufmgr_gem->batch_timer) {
+		if (log)
+			fclose(log);
+		return -ENOMEM;
+	}
+
+	return 0;
+}
+
+/**
+ * Enables measuring how long each batch spends executing on the GPU.
+ *
+ * Every batch submitted through this bufmgr is preceded and followed by a
+ * small batch on the same ring and context that stores the ring's
+ * TIMESTAMP register.  Once both have retired, the difference is queued
+ * for drm_intel_bufmgr_gem_get_batch_timings().  The driver's batches
+ * themselves are not modified, but each costs two more execbuffer ioctls,
+ * and the bufmgr's timed submissions are serialized.
+ *
+ * The interval is what the ring spent between the two stamps.  If the
+ * ring was idle, that includes the kernel's handling of the batch's own
+ * execbuffer after the opening stamp has already run.  Batches submitted
+ * to the same ring by other processes, or by other bufmgrs, may land
+ * between the stamps and be counted too.
+ *
+ * Timing can also be enabled without changing the driver by setting
+ * INTEL_BATCH_TIMING to the name of a file.  A line is then written to
+ * the file for each batch as it retires.
+ *
+ * Returns -ENODEV before gen6.
+ */
+int
+drm_intel_bufmgr_gem_enable_batch_timing(drm_intel_bufmgr *bufmgr)
+{
+	drm_intel_bufmgr_gem *bufmgr_gem = (drm_intel_bufmgr_gem *)bufmgr;
+
+	return drm_intel_gem_enable_batch_timing(bufmgr_gem, NULL);
+}
+
+/**
+ * Copies out up to \p max of the oldest batch timings that have retired
+ * since the last call, and returns how many there were.
+ *
+ * Only the most recent 256 are kept if they are not collected.
+ */
+int
+drm_intel_bufmgr_gem_get_batch_timings(drm_intel_bufmgr *bufmgr,
+				       drm_intel_batch_timing *timings,
+				       int max)
+{
+	drm_intel_bufmgr_gem *bufmgr_gem = (drm_intel_bufmgr_gem *)bufmgr;
+
+	if (!bufmgr_gem->batch_timer)
+		return 0;
+
+	return drm_intel_batch_timer_get(bufmgr_gem->batch_timer,
+					 timings, max);
+}
+
 /**
  * Sets up AUB dumping.
  *
@@ -2897,6 +5880,9 @@ drm_intel_bufmgr_gem_set_aub_filename(drm_intel_bufmgr *bufmgr,
  * Packets are emitted in a format somewhat like GPU command packets.
  * You can set up a GTT and upload your objects into the referenced
  * space, then send off batchbuffers and get BMPs out the other end.
+ *
+ * The file is written by a background thread, and is only complete once
+ * dumping is disabled again or the bufmgr is destroyed.
  */
 void
 drm_intel_bufmgr_gem_set_aub_dump(drm_intel_bufmgr *bufmgr, int enable)
@@ -2908,9 +5894,10 @@ drm_intel_bufmgr_gem_set_aub_dump(drm_intel_bufmgr *bufmgr, int enable)
 	const char *filename;
 
 	if (!enable) {
-		if (bufmgr_gem->aub_file) {
-			fclose(bufmgr_gem->aub_file);
-			bufmgr_gem->aub_file = NULL;
+		if (bufmgr_gem->aub_writer) {
+			if (drm_intel_aub_writer_close(bufmgr_gem->aub_writer))
+				DBG("Failed to write AUB file\n");
+			bufmgr_gem->aub_writer = NULL;
 		}
 		return;
 	}
@@ -2922,8 +5909,11 @@ drm_intel_bufmgr_gem_set_aub_dump(drm_intel_bufmgr *bufmgr, int enable)
 		filename = bufmgr_gem->aub_filename;
 	else
 		filename = "intel.aub";
-	bufmgr_gem->aub_file = fopen(filename, "w+");
-	if (!bufmgr_gem->aub_file)
+	bufmgr_gem->aub_writer =
+		drm_intel_aub_writer_open(filename,
+					  bufmgr_gem->aub_mmap ?
+					  DRM_INTEL_AUB_WRITER_MMAP : 0);
+	if (!bufmgr_gem->aub_writer)
 		return;
 
 	/* Start allocating objects from just after the GTT. */
@@ -2952,14 +5942,68 @@ drm_intel_bufmgr_gem_set_aub_dump(drm_intel_bufmgr *bufmgr, int enable)
 	}
 }
 
+static void
+drm_intel_gem_context_free(drm_intel_bufmgr_gem *bufmgr_gem,
+			   drm_intel_context *ctx)
+{
+	struct drm_i915_gem_context_destroy destroy;
+	int ret;
+
+	VG_CLEAR(destroy);
+	destroy.ctx_id = ctx->ctx_id;
+	ret = drmIoctl(bufmgr_gem->fd, DRM_IOCTL_I915_GEM_CONTEXT_DESTROY,
+		       &destroy);
+	if (ret != 0)
+		fprintf(stderr, "DRM_IOCTL_I915_GEM_CONTEXT_DESTROY failed: %s\n",
+			strerror(errno));
+
+	free(ctx);
+}
+
+/* Destroys pooled contexts, oldest first, until at most @limit are left. */
+static void
+drm_intel_gem_context_pool_trim(drm_intel_bufmgr_gem *bufmgr_gem, int limit)
+{
+	int i, excess = bufmgr_gem->context_pool_count - limit;
+
+	if (excess <= 0)
+		return;
+
+	for (i = 0; i < excess; i++)
+		drm_intel_gem_context_free(bufmgr_gem,
+					   bufmgr_gem->context_pool[i]);
+	memmove(bufmgr_gem->context_pool,
+		bufmgr_gem->context_pool + excess,
+		limit * sizeof(bufmgr_gem->context_pool[0]));
+
+	bufmgr_gem->context_pool_count = limit;
+	bufmgr_gem->context_stats.destroyed += excess;
+}
+
+/**
+ * Creates a hardware context, or reuses one from the pool, if
+ * drm_intel_bufmgr_gem_set_context_pool_size() set one up.
+ */
 drm_intel_context *
 drm_intel_gem_context_create(drm_intel_bufmgr *bufmgr)
 {
 	drm_intel_bufmgr_gem *bufmgr_gem = (drm_intel_bufmgr_gem *)bufmgr;
 	struct drm_i915_gem_context_create create;
+	struct drm_i915_gem_context_destroy destroy;
 	drm_intel_context *context = NULL;
 	int ret;
 
+	pthread_mutex_lock(&bufmgr_gem->lock);
+	/* The most recently used is the likeliest to be resident. */
+	if (bufmgr_gem->context_pool_count) {
+		context = bufmgr_gem->context_pool
+			[--bufmgr_gem->context_pool_count];
+		bufmgr_gem->context_stats.reused++;
+	}
+	pthread_mutex_unlock(&bufmgr_gem->lock);
+	if (context)
+		return context;
+
 	VG_CLEAR(create);
 	ret = drmIoctl(bufmgr_gem->fd, DRM_IOCTL_I915_GEM_CONTEXT_CREATE, &create);
 	if (ret != 0) {
@@ -2969,33 +6013,139 @@ drm_intel_gem_context_create(drm_intel_bufmgr *bufmgr)
 	}
 
 	context = calloc(1, sizeof(*context));
+	if (!context) {
+		VG_CLEAR(destroy);
+		destroy.ctx_id = create.ctx_id;
+		drmIoctl(bufmgr_gem->fd, DRM_IOCTL_I915_GEM_CONTEXT_DESTROY,
+			 &destroy);
+		return NULL;
+	}
 	context->ctx_id = create.ctx_id;
 	context->bufmgr = bufmgr;
 
+	pthread_mutex_lock(&bufmgr_gem->lock);
+	bufmgr_gem->context_stats.created++;
+	pthread_mutex_unlock(&bufmgr_gem->lock);
+
 	return context;
 }
 
+/**
+ * Destroys a hardware context, or keeps it for reuse if there's room in
+ * the pool, it hasn't been banned and the reset hook accepts it.
+ */
 void
 drm_intel_gem_context_destroy(drm_intel_context *ctx)
 {
 	drm_intel_bufmgr_gem *bufmgr_gem;
-	struct drm_i915_gem_context_destroy destroy;
-	int ret;
+	int (*reset)(drm_intel_context *ctx, void *data);
+	void *reset_data;
+	bool pooled;
 
 	if (ctx == NULL)
 		return;
 
-	VG_CLEAR(destroy);
-
 	bufmgr_gem = (drm_intel_bufmgr_gem *)ctx->bufmgr;
-	destroy.ctx_id = ctx->ctx_id;
-	ret = drmIoctl(bufmgr_gem->fd, DRM_IOCTL_I915_GEM_CONTEXT_DESTROY,
-		       &destroy);
-	if (ret != 0)
-		fprintf(stderr, "DRM_IOCTL_I915_GEM_CONTEXT_DESTROY failed: %s\n",
-			strerror(errno));
 
-	free(ctx);
+	pthread_mutex_lock(&bufmgr_gem->lock);
+	pooled = bufmgr_gem->context_pool_max > 0;
+	reset = bufmgr_gem->context_reset;
+	reset_data = bufmgr_gem->context_reset_data;
+	pthread_mutex_unlock(&bufmgr_gem->lock);
+
+	if (pooled) {
+		bool keep = !ctx->banned;
+
+		/* Called unlocked, since it may well submit a batch. */
+		if (keep && reset)
+			keep = reset(ctx, reset_data) == 0;
+
+		pthread_mutex_lock(&bufmgr_gem->lock);
+		if (!keep) {
+			bufmgr_gem->context_stats.rejected++;
+		} else if (bufmgr_gem->context_pool_count <
+			   bufmgr_gem->context_pool_max) {
+			bufmgr_gem->context_pool
+				[bufmgr_gem->context_pool_count++] = ctx;
+			bufmgr_gem->context_stats.recycled++;
+			pthread_mutex_unlock(&bufmgr_gem->lock);
+			return;
+		}
+		pthread_mutex_unlock(&bufmgr_gem->lock);
+	}
+
+	drm_intel_gem_context_free(bufmgr_gem, ctx);
+
+	pthread_mutex_lock(&bufmgr_gem->lock);
+	bufmgr_gem->context_stats.destroyed++;
+	pthread_mutex_unlock(&bufmgr_gem->lock);
+}
+
+/**
+ * Keeps up to @limit destroyed hardware contexts for
+ * drm_intel_gem_context_create() to hand out again, saving the kernel
+ * setting up a new one.  0, the default, destroys them as before.
+ *
+ * A reused context keeps whatever state the last batch in it left, so
+ * callers that depend on it should set a reset hook.
+ */
+void
+drm_intel_bufmgr_gem_set_context_pool_size(drm_intel_bufmgr *bufmgr,
+					   int limit)
+{
+	drm_intel_bufmgr_gem *bufmgr_gem = (drm_intel_bufmgr_gem *)bufmgr;
+	drm_intel_context **pool;
+
+	if (limit < 0)
+		limit = 0;
+
+	pthread_mutex_lock(&bufmgr_gem->lock);
+	drm_intel_gem_context_pool_trim(bufmgr_gem, limit);
+
+	pool = realloc(bufmgr_gem->context_pool,
+		       limit * sizeof(bufmgr_gem->context_pool[0]));
+	if (pool != NULL || limit == 0) {
+		bufmgr_gem->context_pool = pool;
+		bufmgr_gem->context_pool_max = limit;
+	} else if (bufmgr_gem->context_pool_max > limit) {
+		/* Can't shrink the array, but can use less of it. */
+		bufmgr_gem->context_pool_max = limit;
+	}
+	pthread_mutex_unlock(&bufmgr_gem->lock);
+}
+
+/**
+ * Sets a function called on each hardware context before it goes back in
+ * the pool, to return it to a known state, for example by submitting a
+ * batch that clears what the last user set up.  The context is destroyed
+ * instead if @reset returns nonzero.  NULL removes the hook.
+ */
+void
+drm_intel_bufmgr_gem_set_context_reset_hook(drm_intel_bufmgr *bufmgr,
+					    int (*reset)(drm_intel_context *ctx,
+							 void *data),
+					    void *data)
+{
+	drm_intel_bufmgr_gem *bufmgr_gem = (drm_intel_bufmgr_gem *)bufmgr;
+
+	pthread_mutex_lock(&bufmgr_gem->lock);
+	bufmgr_gem->context_reset = reset;
+	bufmgr_gem->context_reset_data = data;
+	pthread_mutex_unlock(&bufmgr_gem->lock);
+}
+
+/** Reports on the use of the context pool since the bufmgr was created. */
+void
+drm_intel_bufmgr_gem_get_context_stats(drm_intel_bufmgr *bufmgr,
+				       drm_intel_bufmgr_gem_context_stats *stats)
+{
+	drm_intel_bufmgr_gem *bufmgr_gem = (drm_intel_bufmgr_gem *)bufmgr;
+
+	pthread_mutex_lock(&bufmgr_gem->lock);
+	*stats = bufmgr_gem->context_stats;
+	stats->pooled = bufmgr_gem->context_pool_count;
+	stats->limit = bufmgr_gem->context_pool_max;
+	pthread_mutex_unlock(&bufmgr_gem->lock);
 }
 
 int
@@ -3070,7 +6220,7 @@ drm_intel_bufmgr_gem_init(int fd, int batch_size)
 	drm_intel_bufmgr_gem *bufmgr_gem;
 	struct drm_i915_gem_get_aperture aperture;
 	drm_i915_getparam_t gp;
-	int ret, tmp;
+	int ret, tmp, i;
 	bool exec2 = false;
 
 	bufmgr_gem = calloc(1, sizeof(*bufmgr_gem));
@@ -3167,6 +6317,14 @@ drm_intel_bufmgr_gem_init(int fd, int batch_size)
 	ret = drmIoctl(bufmgr_gem->fd, DRM_IOCTL_I915_GETPARAM, &gp);
 	bufmgr_gem->has_vebox = (ret == 0) & (*gp.value > 0);
 
+	gp.param = I915_PARAM_HAS_EXEC_NO_RELOC;
+	ret = drmIoctl(bufmgr_gem->fd, DRM_IOCTL_I915_GETPARAM, &gp);
+	bufmgr_gem->has_exec_no_reloc = (ret == 0) & (*gp.value > 0);
+
+	gp.param = I915_PARAM_HAS_EXEC_HANDLE_LUT;
+	ret = drmIoctl(bufmgr_gem->fd, DRM_IOCTL_I915_GETPARAM, &gp);
+	bufmgr_gem->has_exec_handle_lut = (ret == 0) & (*gp.value > 0);
+
 	if (bufmgr_gem->gen < 4) {
 		gp.param = I915_PARAM_NUM_FENCES_AVAIL;
 		gp.value = &bufmgr_gem->available_fences;
@@ -3205,6 +6363,7 @@ drm_intel_bufmgr_gem_init(int fd, int batch_size)
 	bufmgr_gem->bufmgr.bo_alloc_for_render =
 	    drm_intel_gem_bo_alloc_for_render;
 	bufmgr_gem->bufmgr.bo_alloc_tiled = drm_intel_gem_bo_alloc_tiled;
+	bufmgr_gem->bufmgr.bo_alloc_userptr = drm_intel_gem_bo_alloc_userptr;
 	bufmgr_gem->bufmgr.bo_reference = drm_intel_gem_bo_reference;
 	bufmgr_gem->bufmgr.bo_unreference = drm_intel_gem_bo_unreference;
 	bufmgr_gem->bufmgr.bo_map = drm_intel_gem_bo_map;
@@ -3218,6 +6377,8 @@ drm_intel_bufmgr_gem_init(int fd, int batch_size)
 	bufmgr_gem->bufmgr.bo_unpin = drm_intel_gem_bo_unpin;
 	bufmgr_gem->bufmgr.bo_get_tiling = drm_intel_gem_bo_get_tiling;
 	bufmgr_gem->bufmgr.bo_set_tiling = drm_intel_gem_bo_set_tiling;
+	bufmgr_gem->bufmgr.bo_set_caching = drm_intel_gem_bo_set_caching;
+	bufmgr_gem->bufmgr.bo_get_caching = drm_intel_gem_bo_get_caching;
 	bufmgr_gem->bufmgr.bo_flink = drm_intel_gem_bo_flink;
 	/* Use the new one if available */
 	if (exec2) {
@@ -3237,11 +6398,26 @@ drm_intel_bufmgr_gem_init(int fd, int batch_size)
 	    drm_intel_gem_get_pipe_from_crtc_id;
 	bufmgr_gem->bufmgr.bo_references = drm_intel_gem_bo_references;
 
-	DRMINITLISTHEAD(&bufmgr_gem->named);
+	bufmgr_gem->name_table = drmHashCreate();
+	bufmgr_gem->handle_table = drmHashCreate();
+	DRMINITLISTHEAD(&bufmgr_gem->magazines);
+	DRMINITLISTHEAD(&bufmgr_gem->exec_free);
+	for (i = 0; i < SLAB_NUM_CLASSES; i++)
+		DRMINITLISTHEAD(&bufmgr_gem->slab_class[i]);
 	init_cache_buckets(bufmgr_gem);
 
 	DRMINITLISTHEAD(&bufmgr_gem->vma_cache);
 	bufmgr_gem->vma_max = -1; /* unlimited by default */
+	bufmgr_gem->max_map_count = drm_intel_gem_read_max_map_count();
+	drm_intel_gem_update_vma_budget(bufmgr_gem);
+
+	if (geteuid() == getuid()) {
+		const char *timing_log = getenv("INTEL_BATCH_TIMING");
+
+		if (timing_log)
+			drm_intel_gem_enable_batch_timing(bufmgr_gem,
+							  timing_log);
+	}
 
 	return &bufmgr_gem->bufmgr;
 }
@@ -83,6 +83,17 @@ struct _drm_intel_bufmgr {
 					 unsigned long *pitch,
 					 unsigned long flags);
 
+	/**
+	 * Wraps @size bytes of page-aligned memory at @addr in a buffer
+	 * object, without copying it.
+	 */
+	drm_intel_bo *(*bo_alloc_userptr) (drm_intel_bufmgr *bufmgr,
+					   const char *name,
+					   void *addr, uint32_t tiling_mode,
+					   uint32_t stride,
+					   unsigned long size,
+					   unsigned long flags);
+
 	/** Takes a reference on a buffer object */
 	void (*bo_reference) (drm_intel_bo *bo);
 
@@ -214,6 +225,16 @@ struct _drm_intel_bufmgr {
 	int (*bo_get_tiling) (drm_intel_bo *bo, uint32_t * tiling_mode,
 			      uint32_t * swizzle_mode);
 
+	/**
+	 * Set or query whether the GPU snoops the CPU caches for the
+	 * buffer, as one of I915_CACHEING_*.
+	 *
+	 * \param bo Buffer to set or get the caching level of
+	 * \param caching Caching level
+	 */
+	int (*bo_set_caching) (drm_intel_bo *bo, uint32_t caching);
+	int (*bo_get_caching) (drm_intel_bo *bo, uint32_t *caching);
+
 	/**
 	 * Create a visible name for a buffer which can be used by other apps
 	 *
@@ -283,6 +304,8 @@ struct _drm_intel_bufmgr {
 struct _drm_intel_context {
 	unsigned int ctx_id;
 	struct _drm_intel_bufmgr *bufmgr;
+	/** Set when a submission fails with -EIO, so it isn't pooled */
+	unsigned int banned : 1;
 };
 
 #define ALIGN(value, alignment)	((value + alignment - 1) & ~(alignment - 1))
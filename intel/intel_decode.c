@@ -32,11 +32,52 @@
 #include "intel_chipset.h"
 #include "intel_bufmgr.h"
 
+/**
+ * Size of the output buffer.  Text is collected here and only handed to the
+ * output file or callback once this fills up, or as the flush policy says.
+ */
+#define DECODE_OUT_SIZE		(64 * 1024)
+
+/**
+ * Dwords of readable data the decoder is guaranteed past the start of a
+ * packet, so that statically sized packets don't need length checks.  Near
+ * the end of the input the remaining data is copied into a small window
+ * padded with obviously undefined data; everywhere else the input is
+ * decoded in place.
+ */
+#define DECODE_WINDOW_DWORDS	1024
+
+/** Number of gen4+ state packet opcodes, indexed by bits 28:16 of the header */
+#define DECODE_STATE_OPCODES	0x1a00
+
+/** Last contents and counters for one state packet opcode. */
+struct decode_state_entry {
+	uint32_t *last;
+	/** Dwords in last, or 0 when the last value isn't known */
+	uint32_t last_len;
+	uint32_t last_size;
+
+	uint32_t opcode;
+	uint64_t packets, redundant_packets;
+	uint64_t dwords, redundant_dwords;
+};
+
 /* Struct for tracking drm_intel_decode state. */
 struct drm_intel_decode {
 	/** stdio file where the output should land.  Defaults to stdout. */
 	FILE *out;
 
+	/** Optional callback replacing \c out. */
+	drm_intel_decode_write_func write_func;
+	void *write_closure;
+
+	enum drm_intel_decode_flush_policy flush_policy;
+	enum drm_intel_decode_format format;
+
+	/** Bytes of pending output in out_buf. */
+	size_t out_used;
+	char out_buf[DECODE_OUT_SIZE];
+
 	/** PCI device ID. */
 	uint32_t devid;
 
@@ -60,6 +101,21 @@ struct drm_intel_decode {
 	/** Number of DWORDs of batchbuffer data. */
 	uint32_t base_count;
 
+	/** @{
+	 * Ring mode: base_data is a ring of base_count dwords, and the
+	 * dwords from ring_head up to ring_tail (both byte offsets) are
+	 * decoded, wrapping around the end.
+	 */
+	bool ring;
+	uint32_t ring_head, ring_tail;
+	/** @} */
+
+	/**
+	 * Copy of the last few packets of a segment, followed by either the
+	 * start of the next segment or the padding.
+	 */
+	uint32_t window[3 * DECODE_WINDOW_DWORDS];
+
 	/** @{
 	 * GPU head and tail pointers, which will be noted in the dump, or ~0.
 	 */
@@ -75,24 +131,318 @@ struct drm_intel_decode {
 	bool dump_past_end;
 
 	bool overflowed;
-};
 
-static FILE *out;
-static uint32_t saved_s2 = 0, saved_s4 = 0;
-static char saved_s2_set = 0, saved_s4_set = 0;
-static uint32_t head_offset = 0xffffffff;	/* undefined */
-static uint32_t tail_offset = 0xffffffff;	/* undefined */
+	/** @{
+	 * i915 vertex format state (S2, S4) from the last
+	 * 3DSTATE_LOAD_STATE_IMMEDIATE_1, used to decode inline vertices.
+	 */
+	uint32_t saved_s2, saved_s4;
+	bool saved_s2_set, saved_s4_set;
+	/** @} */
+
+	/** @{
+	 * Opcode lookup tables for this generation, built from the
+	 * opcode lists when the context is created and indexed directly
+	 * by the opcode bits of the packet header.
+	 */
+	const struct opcode_mi *mi_table[64];
+	const struct opcode_2d *blt_table[128];
+	/** 3D packets on gen4+, indexed by bits 28:16 of the header */
+	const struct opcode_3d_965 **table_3d_965;
+	/** @} */
+
+	/** Decoder for 3D packets on this generation */
+	int (*decode_3d_func)(struct drm_intel_decode *ctx);
+
+	enum drm_intel_decode_state_tracking state_tracking;
+	/** Redundant state statistics, allocated as opcodes show up */
+	struct decode_state_entry **state_table;
+
+	/** @{
+	 * Fields of the packet being decoded, for the record formats.
+	 */
+	struct drm_intel_decode_field *fields;
+	uint8_t *field_is_address;
+	uint32_t num_fields, fields_size;
+	/** @} */
+};
 
 #ifndef ARRAY_SIZE
 #define ARRAY_SIZE(A) (sizeof(A)/sizeof(A[0]))
 #endif
 
 #define BUFFER_FAIL(_count, _len, _name) do {			\
-    fprintf(out, "Buffer size too small in %s (%d < %d)\n",	\
-	    (_name), (_count), (_len));				\
+    decode_printf(ctx, "Buffer size too small in %s (%d < %d)\n",	\
+		  (_name), (_count), (_len));			\
     return _count;						\
 } while (0)
 
+static void
+decode_write(struct drm_intel_decode *ctx, const char *data, size_t size)
+{
+	if (size == 0)
+		return;
+
+	if (ctx->write_func)
+		ctx->write_func(ctx->write_closure, data, size);
+	else
+		fwrite(data, 1, size, ctx->out);
+}
+
+static void
+decode_flush(struct drm_intel_decode *ctx)
+{
+	decode_write(ctx, ctx->out_buf, ctx->out_used);
+	ctx->out_used = 0;
+
+	if (!ctx->write_func)
+		fflush(ctx->out);
+}
+
+static void
+decode_vprintf(struct drm_intel_decode *ctx, const char *fmt, va_list va)
+	__attribute__((format(__printf__, 2, 0)));
+
+static void
+decode_vprintf(struct drm_intel_decode *ctx, const char *fmt, va_list va)
+{
+	size_t space = DECODE_OUT_SIZE - ctx->out_used;
+	va_list copy;
+	char *tmp;
+	int len;
+
+	/* Only the packets themselves make it into the record formats. */
+	if (ctx->format != DRM_INTEL_DECODE_FORMAT_TEXT)
+		return;
+
+	va_copy(copy, va);
+	len = vsnprintf(ctx->out_buf + ctx->out_used, space, fmt, copy);
+	va_end(copy);
+	if (len < 0)
+		return;
+
+	if ((size_t)len < space) {
+		ctx->out_used += len;
+		return;
+	}
+
+	/* Didn't fit: push out what we have and try again. */
+	decode_write(ctx, ctx->out_buf, ctx->out_used);
+	ctx->out_used = 0;
+
+	if ((size_t)len < DECODE_OUT_SIZE) {
+		ctx->out_used = vsnprintf(ctx->out_buf, DECODE_OUT_SIZE,
+					  fmt, va);
+		return;
+	}
+
+	tmp = malloc(len + 1);
+	if (tmp == NULL)
+		return;
+	vsnprintf(tmp, len + 1, fmt, va);
+	decode_write(ctx, tmp, len);
+	free(tmp);
+}
+
+static void
+decode_printf(struct drm_intel_decode *ctx, const char *fmt, ...)
+	__attribute__((format(__printf__, 2, 3)));
+
+static void
+decode_printf(struct drm_intel_decode *ctx, const char *fmt, ...)
+{
+	va_list va;
+
+	va_start(va, fmt);
+	decode_vprintf(ctx, fmt, va);
+	va_end(va);
+}
+
+/* Appends raw bytes to the output buffer. */
+static void
+decode_emit(struct drm_intel_decode *ctx, const void *data, size_t size)
+{
+	if (DECODE_OUT_SIZE - ctx->out_used < size) {
+		decode_write(ctx, ctx->out_buf, ctx->out_used);
+		ctx->out_used = 0;
+		if (size > DECODE_OUT_SIZE) {
+			decode_write(ctx, data, size);
+			return;
+		}
+	}
+
+	memcpy(ctx->out_buf + ctx->out_used, data, size);
+	ctx->out_used += size;
+}
+
+static char *
+json_put_uint(char *p, uint32_t v)
+{
+	char tmp[10];
+	int n = 0;
+
+	do {
+		tmp[n++] = '0' + v % 10;
+		v /= 10;
+	} while (v);
+
+	while (n)
+		*p++ = tmp[--n];
+	return p;
+}
+
+static char *
+json_put_str(char *p, const char *str)
+{
+	size_t len = strlen(str);
+
+	memcpy(p, str, len);
+	return p + len;
+}
+
+/* Worst case size of one "[index,value]," in the JSON field list. */
+#define JSON_FIELD_MAX	24
+
+static void
+decode_emit_json(struct drm_intel_decode *ctx,
+		 struct drm_intel_decode_record *rec)
+{
+	char buf[256 + JSON_FIELD_MAX];
+	char *p = buf;
+	uint32_t i;
+	bool first;
+
+	p = json_put_str(p, "{\"offset\":");
+	p = json_put_uint(p, rec->offset);
+	p = json_put_str(p, ",\"type\":");
+	p = json_put_uint(p, rec->type);
+	p = json_put_str(p, ",\"opcode\":");
+	p = json_put_uint(p, rec->opcode);
+	p = json_put_str(p, ",\"gen\":");
+	p = json_put_uint(p, rec->gen);
+	p = json_put_str(p, ",\"length\":");
+	p = json_put_uint(p, rec->length);
+	p = json_put_str(p, ",\"fields\":[");
+
+	for (i = 0; i < rec->num_fields; i++) {
+		if (p - buf > 256) {
+			decode_emit(ctx, buf, p - buf);
+			p = buf;
+		}
+		if (i)
+			*p++ = ',';
+		*p++ = '[';
+		p = json_put_uint(p, ctx->fields[i].index);
+		*p++ = ',';
+		p = json_put_uint(p, ctx->fields[i].value);
+		*p++ = ']';
+	}
+	p = json_put_str(p, "],\"addresses\":[");
+
+	first = true;
+	for (i = 0; i < rec->num_fields; i++) {
+		if (!ctx->field_is_address[i])
+			continue;
+		if (p - buf > 256) {
+			decode_emit(ctx, buf, p - buf);
+			p = buf;
+		}
+		if (!first)
+			*p++ = ',';
+		p = json_put_uint(p, ctx->fields[i].value);
+		first = false;
+	}
+	p = json_put_str(p, "]}\n");
+
+	decode_emit(ctx, buf, p - buf);
+}
+
+static void
+decode_emit_binary(struct drm_intel_decode *ctx,
+		   struct drm_intel_decode_record *rec)
+{
+	uint32_t i;
+
+	decode_emit(ctx, rec, sizeof(*rec));
+	decode_emit(ctx, ctx->fields, rec->num_fields * sizeof(ctx->fields[0]));
+	for (i = 0; i < rec->num_fields; i++) {
+		if (ctx->field_is_address[i])
+			decode_emit(ctx, &ctx->fields[i].value,
+				    sizeof(ctx->fields[i].value));
+	}
+}
+
+/**
+ * Writes out the record for the packet of \p length dwords at the
+ * current position, built from the fields instr_out() collected.
+ */
+static void
+decode_emit_record(struct drm_intel_decode *ctx, uint32_t length)
+{
+	struct drm_intel_decode_record rec;
+	uint32_t header = ctx->data[0];
+	uint32_t i;
+
+	memset(&rec, 0, sizeof(rec));
+	rec.offset = ctx->hw_offset;
+	rec.type = header >> 29;
+	switch (rec.type) {
+	case 0x0:
+		rec.opcode = (header & 0x1f800000) >> 23;
+		break;
+	case 0x2:
+		rec.opcode = (header & 0x1fc00000) >> 22;
+		break;
+	default:
+		rec.opcode = header >> 16;
+		break;
+	}
+	rec.gen = ctx->gen;
+	rec.length = length;
+	rec.num_fields = ctx->num_fields;
+	for (i = 0; i < ctx->num_fields; i++)
+		rec.num_addresses += ctx->field_is_address[i];
+	rec.size = sizeof(rec) +
+		rec.num_fields * sizeof(struct drm_intel_decode_field) +
+		rec.num_addresses * sizeof(uint32_t);
+
+	if (ctx->format == DRM_INTEL_DECODE_FORMAT_JSON)
+		decode_emit_json(ctx, &rec);
+	else
+		decode_emit_binary(ctx, &rec);
+
+	ctx->num_fields = 0;
+}
+
+/* Notes a decoded dword for the record formats, skipping the text. */
+static void
+decode_add_field(struct drm_intel_decode *ctx, unsigned int index,
+		 bool is_address)
+{
+	if (ctx->num_fields == ctx->fields_size) {
+		uint32_t size = ctx->fields_size ? ctx->fields_size * 2 : 64;
+		struct drm_intel_decode_field *fields;
+		uint8_t *is_address;
+
+		fields = realloc(ctx->fields, size * sizeof(*fields));
+		if (fields == NULL)
+			return;
+		ctx->fields = fields;
+
+		is_address = realloc(ctx->field_is_address, size);
+		if (is_address == NULL)
+			return;
+		ctx->field_is_address = is_address;
+
+		ctx->fields_size = size;
+	}
+
+	ctx->fields[ctx->num_fields].index = index;
+	ctx->fields[ctx->num_fields].value = ctx->data[index];
+	ctx->field_is_address[ctx->num_fields] = is_address;
+	ctx->num_fields++;
+}
+
 static float int_as_float(uint32_t intval)
 {
 	union intfloat {
@@ -105,36 +455,69 @@ static float int_as_float(uint32_t intval)
 }
 
 static void
-instr_out(struct drm_intel_decode *ctx, unsigned int index,
-	  const char *fmt, ...) __attribute__((format(__printf__, 3, 4)));
+instr_vout(struct drm_intel_decode *ctx, unsigned int index, bool is_address,
+	   const char *fmt, va_list va) __attribute__((format(__printf__, 4, 0)));
 
 static void
-instr_out(struct drm_intel_decode *ctx, unsigned int index,
-	  const char *fmt, ...)
+instr_vout(struct drm_intel_decode *ctx, unsigned int index, bool is_address,
+	   const char *fmt, va_list va)
 {
-	va_list va;
 	const char *parseinfo;
 	uint32_t offset = ctx->hw_offset + index * 4;
 
 	if (index > ctx->count) {
 		if (!ctx->overflowed) {
-			fprintf(out, "ERROR: Decode attempted to continue beyond end of batchbuffer\n");
+			decode_printf(ctx, "ERROR: Decode attempted to continue beyond end of batchbuffer\n");
 			ctx->overflowed = true;
 		}
 		return;
 	}
 
-	if (offset == head_offset)
+	if (ctx->format != DRM_INTEL_DECODE_FORMAT_TEXT) {
+		decode_add_field(ctx, index, is_address);
+		return;
+	}
+
+	if (offset == ctx->head)
 		parseinfo = "HEAD";
-	else if (offset == tail_offset)
+	else if (offset == ctx->tail)
 		parseinfo = "TAIL";
 	else
 		parseinfo = "    ";
 
-	fprintf(out, "0x%08x: %s 0x%08x: %s", offset, parseinfo,
-		ctx->data[index], index == 0 ? "" : "   ");
+	decode_printf(ctx, "0x%08x: %s 0x%08x: %s", offset, parseinfo,
+		      ctx->data[index], index == 0 ? "" : "   ");
+	decode_vprintf(ctx, fmt, va);
+}
+
+static void
+instr_out(struct drm_intel_decode *ctx, unsigned int index,
+	  const char *fmt, ...) __attribute__((format(__printf__, 3, 4)));
+
+static void
+instr_out(struct drm_intel_decode *ctx, unsigned int index,
+	  const char *fmt, ...)
+{
+	va_list va;
+
+	va_start(va, fmt);
+	instr_vout(ctx, index, false, fmt, va);
+	va_end(va);
+}
+
+/* Like instr_out(), for a dword holding a graphics address. */
+static void
+instr_out_addr(struct drm_intel_decode *ctx, unsigned int index,
+	       const char *fmt, ...) __attribute__((format(__printf__, 3, 4)));
+
+static void
+instr_out_addr(struct drm_intel_decode *ctx, unsigned int index,
+	       const char *fmt, ...)
+{
+	va_list va;
+
 	va_start(va, fmt);
-	vfprintf(out, fmt, va);
+	instr_vout(ctx, index, true, fmt, va);
 	va_end(va);
 }
 
@@ -146,10 +529,10 @@ decode_MI_SET_CONTEXT(struct drm_intel_decode *ctx)
 		return 1;
 
 	instr_out(ctx, 0, "MI_SET_CONTEXT\n");
-	instr_out(ctx, 1, "gtt offset = 0x%x%s%s\n",
-		  data & ~0xfff,
-		  data & (1<<1)? ", Force Restore": "",
-		  data & (1<<0)? ", Restore Inhibit": "");
+	instr_out_addr(ctx, 1, "gtt offset = 0x%x%s%s\n",
+		       data & ~0xfff,
+		       data & (1<<1)? ", Force Restore": "",
+		       data & (1<<0)? ", Restore Inhibit": "");
 
 	return 2;
 }
@@ -222,63 +605,62 @@ decode_MI_WAIT_FOR_EVENT(struct drm_intel_decode *ctx)
 	return 1;
 }
 
+struct opcode_mi {
+	uint32_t opcode;
+	int len_mask;
+	unsigned int min_len;
+	unsigned int max_len;
+	const char *name;
+	int (*func)(struct drm_intel_decode *ctx);
+};
+
+static const struct opcode_mi opcodes_mi[] = {
+	{ 0x08, 0, 1, 1, "MI_ARB_ON_OFF" },
+	{ 0x0a, 0, 1, 1, "MI_BATCH_BUFFER_END" },
+	{ 0x30, 0x3f, 3, 3, "MI_BATCH_BUFFER" },
+	{ 0x31, 0x3f, 2, 2, "MI_BATCH_BUFFER_START" },
+	{ 0x14, 0x3f, 3, 3, "MI_DISPLAY_BUFFER_INFO" },
+	{ 0x04, 0, 1, 1, "MI_FLUSH" },
+	{ 0x22, 0x1f, 3, 3, "MI_LOAD_REGISTER_IMM" },
+	{ 0x13, 0x3f, 2, 2, "MI_LOAD_SCAN_LINES_EXCL" },
+	{ 0x12, 0x3f, 2, 2, "MI_LOAD_SCAN_LINES_INCL" },
+	{ 0x00, 0, 1, 1, "MI_NOOP" },
+	{ 0x11, 0x3f, 2, 2, "MI_OVERLAY_FLIP" },
+	{ 0x07, 0, 1, 1, "MI_REPORT_HEAD" },
+	{ 0x18, 0x3f, 2, 2, "MI_SET_CONTEXT", decode_MI_SET_CONTEXT },
+	{ 0x20, 0x3f, 3, 4, "MI_STORE_DATA_IMM" },
+	{ 0x21, 0x3f, 3, 4, "MI_STORE_DATA_INDEX" },
+	{ 0x24, 0x3f, 3, 3, "MI_STORE_REGISTER_MEM" },
+	{ 0x02, 0, 1, 1, "MI_USER_INTERRUPT" },
+	{ 0x03, 0, 1, 1, "MI_WAIT_FOR_EVENT", decode_MI_WAIT_FOR_EVENT },
+	{ 0x16, 0x7f, 3, 3, "MI_SEMAPHORE_MBOX" },
+	{ 0x26, 0x1f, 3, 4, "MI_FLUSH_DW" },
+	{ 0x0b, 0, 1, 1, "MI_SUSPEND_FLUSH"},
+};
+
 static int
 decode_mi(struct drm_intel_decode *ctx)
 {
-	unsigned int opcode, len = -1;
+	unsigned int len = -1;
 	const char *post_sync_op = "";
 	uint32_t *data = ctx->data;
 
-	struct {
-		uint32_t opcode;
-		int len_mask;
-		unsigned int min_len;
-		unsigned int max_len;
-		const char *name;
-		int (*func)(struct drm_intel_decode *ctx);
-	} opcodes_mi[] = {
-		{ 0x08, 0, 1, 1, "MI_ARB_ON_OFF" },
-		{ 0x0a, 0, 1, 1, "MI_BATCH_BUFFER_END" },
-		{ 0x30, 0x3f, 3, 3, "MI_BATCH_BUFFER" },
-		{ 0x31, 0x3f, 2, 2, "MI_BATCH_BUFFER_START" },
-		{ 0x14, 0x3f, 3, 3, "MI_DISPLAY_BUFFER_INFO" },
-		{ 0x04, 0, 1, 1, "MI_FLUSH" },
-		{ 0x22, 0x1f, 3, 3, "MI_LOAD_REGISTER_IMM" },
-		{ 0x13, 0x3f, 2, 2, "MI_LOAD_SCAN_LINES_EXCL" },
-		{ 0x12, 0x3f, 2, 2, "MI_LOAD_SCAN_LINES_INCL" },
-		{ 0x00, 0, 1, 1, "MI_NOOP" },
-		{ 0x11, 0x3f, 2, 2, "MI_OVERLAY_FLIP" },
-		{ 0x07, 0, 1, 1, "MI_REPORT_HEAD" },
-		{ 0x18, 0x3f, 2, 2, "MI_SET_CONTEXT", decode_MI_SET_CONTEXT },
-		{ 0x20, 0x3f, 3, 4, "MI_STORE_DATA_IMM" },
-		{ 0x21, 0x3f, 3, 4, "MI_STORE_DATA_INDEX" },
-		{ 0x24, 0x3f, 3, 3, "MI_STORE_REGISTER_MEM" },
-		{ 0x02, 0, 1, 1, "MI_USER_INTERRUPT" },
-		{ 0x03, 0, 1, 1, "MI_WAIT_FOR_EVENT", decode_MI_WAIT_FOR_EVENT },
-		{ 0x16, 0x7f, 3, 3, "MI_SEMAPHORE_MBOX" },
-		{ 0x26, 0x1f, 3, 4, "MI_FLUSH_DW" },
-		{ 0x0b, 0, 1, 1, "MI_SUSPEND_FLUSH"},
-	}, *opcode_mi = NULL;
+	const struct opcode_mi *opcode_mi;
 
 	/* check instruction length */
-	for (opcode = 0; opcode < sizeof(opcodes_mi) / sizeof(opcodes_mi[0]);
-	     opcode++) {
-		if ((data[0] & 0x1f800000) >> 23 == opcodes_mi[opcode].opcode) {
-			len = 1;
-			if (opcodes_mi[opcode].max_len > 1) {
-				len =
-				    (data[0] & opcodes_mi[opcode].len_mask) + 2;
-				if (len < opcodes_mi[opcode].min_len
-				    || len > opcodes_mi[opcode].max_len) {
-					fprintf(out,
-						"Bad length (%d) in %s, [%d, %d]\n",
-						len, opcodes_mi[opcode].name,
-						opcodes_mi[opcode].min_len,
-						opcodes_mi[opcode].max_len);
-				}
+	opcode_mi = ctx->mi_table[(data[0] & 0x1f800000) >> 23];
+	if (opcode_mi) {
+		len = 1;
+		if (opcode_mi->max_len > 1) {
+			len = (data[0] & opcode_mi->len_mask) + 2;
+			if (len < opcode_mi->min_len ||
+			    len > opcode_mi->max_len) {
+				decode_printf(ctx,
+					      "Bad length (%d) in %s, [%d, %d]\n",
+					      len, opcode_mi->name,
+					      opcode_mi->min_len,
+					      opcode_mi->max_len);
 			}
-			opcode_mi = &opcodes_mi[opcode];
-			break;
 		}
 	}
 
@@ -297,7 +679,7 @@ decode_mi(struct drm_intel_decode *ctx)
 			  data[0] & (1 << 18) ? " use compare reg" : "",
 			  (data[0] & (0x3 << 16)) >> 16);
 		instr_out(ctx, 1, "value\n");
-		instr_out(ctx, 2, "address\n");
+		instr_out_addr(ctx, 2, "address\n");
 		return len;
 	case 0x21:
 		instr_out(ctx, 0, "MI_STORE_DATA_INDEX%s\n",
@@ -344,26 +726,22 @@ decode_mi(struct drm_intel_decode *ctx)
 		if (data[0] & (1 << 21))
 			instr_out(ctx, 1, "hws index\n");
 		else
-			instr_out(ctx, 1, "address\n");
+			instr_out_addr(ctx, 1, "address\n");
 		instr_out(ctx, 2, "dword\n");
 		if (len == 4)
 			instr_out(ctx, 3, "upper dword\n");
 		return len;
 	}
 
-	for (opcode = 0; opcode < sizeof(opcodes_mi) / sizeof(opcodes_mi[0]);
-	     opcode++) {
-		if ((data[0] & 0x1f800000) >> 23 == opcodes_mi[opcode].opcode) {
-			unsigned int i;
-
-			instr_out(ctx, 0, "%s\n",
-				  opcodes_mi[opcode].name);
-			for (i = 1; i < len; i++) {
-				instr_out(ctx, i, "dword %d\n", i);
-			}
+	if (opcode_mi) {
+		unsigned int i;
 
-			return len;
+		instr_out(ctx, 0, "%s\n", opcode_mi->name);
+		for (i = 1; i < len; i++) {
+			instr_out(ctx, i, "dword %d\n", i);
 		}
+
+		return len;
 	}
 
 	instr_out(ctx, 0, "MI UNKNOWN\n");
@@ -414,44 +792,48 @@ decode_2d_br01(struct drm_intel_decode *ctx)
 
 }
 
+struct opcode_2d {
+	uint32_t opcode;
+	unsigned int min_len;
+	unsigned int max_len;
+	const char *name;
+};
+
+static const struct opcode_2d opcodes_2d[] = {
+	{ 0x40, 5, 5, "COLOR_BLT" },
+	{ 0x43, 6, 6, "SRC_COPY_BLT" },
+	{ 0x01, 8, 8, "XY_SETUP_BLT" },
+	{ 0x11, 9, 9, "XY_SETUP_MONO_PATTERN_SL_BLT" },
+	{ 0x03, 3, 3, "XY_SETUP_CLIP_BLT" },
+	{ 0x24, 2, 2, "XY_PIXEL_BLT" },
+	{ 0x25, 3, 3, "XY_SCANLINES_BLT" },
+	{ 0x26, 4, 4, "Y_TEXT_BLT" },
+	{ 0x31, 5, 134, "XY_TEXT_IMMEDIATE_BLT" },
+	{ 0x50, 6, 6, "XY_COLOR_BLT" },
+	{ 0x51, 6, 6, "XY_PAT_BLT" },
+	{ 0x76, 8, 8, "XY_PAT_CHROMA_BLT" },
+	{ 0x72, 7, 135, "XY_PAT_BLT_IMMEDIATE" },
+	{ 0x77, 9, 137, "XY_PAT_CHROMA_BLT_IMMEDIATE" },
+	{ 0x52, 9, 9, "XY_MONO_PAT_BLT" },
+	{ 0x59, 7, 7, "XY_MONO_PAT_FIXED_BLT" },
+	{ 0x53, 8, 8, "XY_SRC_COPY_BLT" },
+	{ 0x54, 8, 8, "XY_MONO_SRC_COPY_BLT" },
+	{ 0x71, 9, 137, "XY_MONO_SRC_COPY_IMMEDIATE_BLT" },
+	{ 0x55, 9, 9, "XY_FULL_BLT" },
+	{ 0x55, 9, 137, "XY_FULL_IMMEDIATE_PATTERN_BLT" },
+	{ 0x56, 9, 9, "XY_FULL_MONO_SRC_BLT" },
+	{ 0x75, 10, 138, "XY_FULL_MONO_SRC_IMMEDIATE_PATTERN_BLT" },
+	{ 0x57, 12, 12, "XY_FULL_MONO_PATTERN_BLT" },
+	{ 0x58, 12, 12, "XY_FULL_MONO_PATTERN_MONO_SRC_BLT"},
+};
+
 static int
 decode_2d(struct drm_intel_decode *ctx)
 {
-	unsigned int opcode, len;
+	unsigned int len;
 	uint32_t *data = ctx->data;
 
-	struct {
-		uint32_t opcode;
-		unsigned int min_len;
-		unsigned int max_len;
-		const char *name;
-	} opcodes_2d[] = {
-		{ 0x40, 5, 5, "COLOR_BLT" },
-		{ 0x43, 6, 6, "SRC_COPY_BLT" },
-		{ 0x01, 8, 8, "XY_SETUP_BLT" },
-		{ 0x11, 9, 9, "XY_SETUP_MONO_PATTERN_SL_BLT" },
-		{ 0x03, 3, 3, "XY_SETUP_CLIP_BLT" },
-		{ 0x24, 2, 2, "XY_PIXEL_BLT" },
-		{ 0x25, 3, 3, "XY_SCANLINES_BLT" },
-		{ 0x26, 4, 4, "Y_TEXT_BLT" },
-		{ 0x31, 5, 134, "XY_TEXT_IMMEDIATE_BLT" },
-		{ 0x50, 6, 6, "XY_COLOR_BLT" },
-		{ 0x51, 6, 6, "XY_PAT_BLT" },
-		{ 0x76, 8, 8, "XY_PAT_CHROMA_BLT" },
-		{ 0x72, 7, 135, "XY_PAT_BLT_IMMEDIATE" },
-		{ 0x77, 9, 137, "XY_PAT_CHROMA_BLT_IMMEDIATE" },
-		{ 0x52, 9, 9, "XY_MONO_PAT_BLT" },
-		{ 0x59, 7, 7, "XY_MONO_PAT_FIXED_BLT" },
-		{ 0x53, 8, 8, "XY_SRC_COPY_BLT" },
-		{ 0x54, 8, 8, "XY_MONO_SRC_COPY_BLT" },
-		{ 0x71, 9, 137, "XY_MONO_SRC_COPY_IMMEDIATE_BLT" },
-		{ 0x55, 9, 9, "XY_FULL_BLT" },
-		{ 0x55, 9, 137, "XY_FULL_IMMEDIATE_PATTERN_BLT" },
-		{ 0x56, 9, 9, "XY_FULL_MONO_SRC_BLT" },
-		{ 0x75, 10, 138, "XY_FULL_MONO_SRC_IMMEDIATE_PATTERN_BLT" },
-		{ 0x57, 12, 12, "XY_FULL_MONO_PATTERN_BLT" },
-		{ 0x58, 12, 12, "XY_FULL_MONO_PATTERN_MONO_SRC_BLT"},
-	};
+	const struct opcode_2d *opcode_2d;
 
 	switch ((data[0] & 0x1fc00000) >> 22) {
 	case 0x25:
@@ -462,7 +844,7 @@ decode_2d(struct drm_intel_decode *ctx)
 
 		len = (data[0] & 0x000000ff) + 2;
 		if (len != 3)
-			fprintf(out, "Bad count in XY_SCANLINES_BLT\n");
+			decode_printf(ctx, "Bad count in XY_SCANLINES_BLT\n");
 
 		instr_out(ctx, 1, "dest (%d,%d)\n",
 			  data[1] & 0xffff, data[1] >> 16);
@@ -474,25 +856,25 @@ decode_2d(struct drm_intel_decode *ctx)
 
 		len = (data[0] & 0x000000ff) + 2;
 		if (len != 8)
-			fprintf(out, "Bad count in XY_SETUP_BLT\n");
+			decode_printf(ctx, "Bad count in XY_SETUP_BLT\n");
 
 		decode_2d_br01(ctx);
 		instr_out(ctx, 2, "cliprect (%d,%d)\n",
 			  data[2] & 0xffff, data[2] >> 16);
 		instr_out(ctx, 3, "cliprect (%d,%d)\n",
 			  data[3] & 0xffff, data[3] >> 16);
-		instr_out(ctx, 4, "setup dst offset 0x%08x\n",
-			  data[4]);
+		instr_out_addr(ctx, 4, "setup dst offset 0x%08x\n",
+			       data[4]);
 		instr_out(ctx, 5, "setup background color\n");
 		instr_out(ctx, 6, "setup foreground color\n");
-		instr_out(ctx, 7, "color pattern offset\n");
+		instr_out_addr(ctx, 7, "color pattern offset\n");
 		return len;
 	case 0x03:
 		decode_2d_br00(ctx, "XY_SETUP_CLIP_BLT");
 
 		len = (data[0] & 0x000000ff) + 2;
 		if (len != 3)
-			fprintf(out, "Bad count in XY_SETUP_CLIP_BLT\n");
+			decode_printf(ctx, "Bad count in XY_SETUP_CLIP_BLT\n");
 
 		instr_out(ctx, 1, "cliprect (%d,%d)\n",
 			  data[1] & 0xffff, data[2] >> 16);
@@ -504,16 +886,16 @@ decode_2d(struct drm_intel_decode *ctx)
 
 		len = (data[0] & 0x000000ff) + 2;
 		if (len != 9)
-			fprintf(out,
-				"Bad count in XY_SETUP_MONO_PATTERN_SL_BLT\n");
+			decode_printf(ctx,
+				      "Bad count in XY_SETUP_MONO_PATTERN_SL_BLT\n");
 
 		decode_2d_br01(ctx);
 		instr_out(ctx, 2, "cliprect (%d,%d)\n",
 			  data[2] & 0xffff, data[2] >> 16);
 		instr_out(ctx, 3, "cliprect (%d,%d)\n",
 			  data[3] & 0xffff, data[3] >> 16);
-		instr_out(ctx, 4, "setup dst offset 0x%08x\n",
-			  data[4]);
+		instr_out_addr(ctx, 4, "setup dst offset 0x%08x\n",
+			       data[4]);
 		instr_out(ctx, 5, "setup background color\n");
 		instr_out(ctx, 6, "setup foreground color\n");
 		instr_out(ctx, 7, "mono pattern dw0\n");
@@ -524,14 +906,14 @@ decode_2d(struct drm_intel_decode *ctx)
 
 		len = (data[0] & 0x000000ff) + 2;
 		if (len != 6)
-			fprintf(out, "Bad count in XY_COLOR_BLT\n");
+			decode_printf(ctx, "Bad count in XY_COLOR_BLT\n");
 
 		decode_2d_br01(ctx);
 		instr_out(ctx, 2, "(%d,%d)\n",
 			  data[2] & 0xffff, data[2] >> 16);
 		instr_out(ctx, 3, "(%d,%d)\n",
 			  data[3] & 0xffff, data[3] >> 16);
-		instr_out(ctx, 4, "offset 0x%08x\n", data[4]);
+		instr_out_addr(ctx, 4, "offset 0x%08x\n", data[4]);
 		instr_out(ctx, 5, "color\n");
 		return len;
 	case 0x53:
@@ -539,45 +921,42 @@ decode_2d(struct drm_intel_decode *ctx)
 
 		len = (data[0] & 0x000000ff) + 2;
 		if (len != 8)
-			fprintf(out, "Bad count in XY_SRC_COPY_BLT\n");
+			decode_printf(ctx, "Bad count in XY_SRC_COPY_BLT\n");
 
 		decode_2d_br01(ctx);
 		instr_out(ctx, 2, "dst (%d,%d)\n",
 			  data[2] & 0xffff, data[2] >> 16);
 		instr_out(ctx, 3, "dst (%d,%d)\n",
 			  data[3] & 0xffff, data[3] >> 16);
-		instr_out(ctx, 4, "dst offset 0x%08x\n", data[4]);
+		instr_out_addr(ctx, 4, "dst offset 0x%08x\n", data[4]);
 		instr_out(ctx, 5, "src (%d,%d)\n",
 			  data[5] & 0xffff, data[5] >> 16);
 		instr_out(ctx, 6, "src pitch %d\n",
 			  (short)(data[6] & 0xffff));
-		instr_out(ctx, 7, "src offset 0x%08x\n", data[7]);
+		instr_out_addr(ctx, 7, "src offset 0x%08x\n", data[7]);
 		return len;
 	}
 
-	for (opcode = 0; opcode < sizeof(opcodes_2d) / sizeof(opcodes_2d[0]);
-	     opcode++) {
-		if ((data[0] & 0x1fc00000) >> 22 == opcodes_2d[opcode].opcode) {
-			unsigned int i;
-
-			len = 1;
-			instr_out(ctx, 0, "%s\n",
-				  opcodes_2d[opcode].name);
-			if (opcodes_2d[opcode].max_len > 1) {
-				len = (data[0] & 0x000000ff) + 2;
-				if (len < opcodes_2d[opcode].min_len ||
-				    len > opcodes_2d[opcode].max_len) {
-					fprintf(out, "Bad count in %s\n",
-						opcodes_2d[opcode].name);
-				}
-			}
-
-			for (i = 1; i < len; i++) {
-				instr_out(ctx, i, "dword %d\n", i);
+	opcode_2d = ctx->blt_table[(data[0] & 0x1fc00000) >> 22];
+	if (opcode_2d) {
+		unsigned int i;
+
+		len = 1;
+		instr_out(ctx, 0, "%s\n", opcode_2d->name);
+		if (opcode_2d->max_len > 1) {
+			len = (data[0] & 0x000000ff) + 2;
+			if (len < opcode_2d->min_len ||
+			    len > opcode_2d->max_len) {
+				decode_printf(ctx, "Bad count in %s\n",
+					      opcode_2d->name);
 			}
+		}
 
-			return len;
+		for (i = 1; i < len; i++) {
+			instr_out(ctx, i, "dword %d\n", i);
 		}
+
+		return len;
 	}
 
 	instr_out(ctx, 0, "2D UNKNOWN\n");
@@ -619,9 +998,10 @@ decode_3d_1c(struct drm_intel_decode *ctx)
 
 /** Sets the string dstname to describe the destination of the PS instruction */
 static void
-i915_get_instruction_dst(uint32_t *data, int i, char *dstname, int do_mask)
+i915_get_instruction_dst(struct drm_intel_decode *ctx, int i, char *dstname,
+			 int do_mask)
 {
-	uint32_t a0 = data[i];
+	uint32_t a0 = ctx->data[i];
 	int dst_nr = (a0 >> 14) & 0xf;
 	char dstmask[8];
 	const char *sat;
@@ -656,22 +1036,22 @@ i915_get_instruction_dst(uint32_t *data, int i, char *dstname, int do_mask)
 	switch ((a0 >> 19) & 0x7) {
 	case 0:
 		if (dst_nr > 15)
-			fprintf(out, "bad destination reg R%d\n", dst_nr);
+			decode_printf(ctx, "bad destination reg R%d\n", dst_nr);
 		sprintf(dstname, "R%d%s%s", dst_nr, dstmask, sat);
 		break;
 	case 4:
 		if (dst_nr > 0)
-			fprintf(out, "bad destination reg oC%d\n", dst_nr);
+			decode_printf(ctx, "bad destination reg oC%d\n", dst_nr);
 		sprintf(dstname, "oC%s%s", dstmask, sat);
 		break;
 	case 5:
 		if (dst_nr > 0)
-			fprintf(out, "bad destination reg oD%d\n", dst_nr);
+			decode_printf(ctx, "bad destination reg oD%d\n", dst_nr);
 		sprintf(dstname, "oD%s%s", dstmask, sat);
 		break;
 	case 6:
 		if (dst_nr > 3)
-			fprintf(out, "bad destination reg U%d\n", dst_nr);
+			decode_printf(ctx, "bad destination reg U%d\n", dst_nr);
 		sprintf(dstname, "U%d%s%s", dst_nr, dstmask, sat);
 		break;
 	default:
@@ -702,13 +1082,14 @@ i915_get_channel_swizzle(uint32_t select)
 }
 
 static void
-i915_get_instruction_src_name(uint32_t src_type, uint32_t src_nr, char *name)
+i915_get_instruction_src_name(struct drm_intel_decode *ctx, uint32_t src_type,
+			      uint32_t src_nr, char *name)
 {
 	switch (src_type) {
 	case 0:
 		sprintf(name, "R%d", src_nr);
 		if (src_nr > 15)
-			fprintf(out, "bad src reg %s\n", name);
+			decode_printf(ctx, "bad src reg %s\n", name);
 		break;
 	case 1:
 		if (src_nr < 8)
@@ -720,41 +1101,42 @@ i915_get_instruction_src_name(uint32_t src_type, uint32_t src_nr, char *name)
 		else if (src_nr == 10)
 			sprintf(name, "FOG");
 		else {
-			fprintf(out, "bad src reg T%d\n", src_nr);
+			decode_printf(ctx, "bad src reg T%d\n", src_nr);
 			sprintf(name, "RESERVED");
 		}
 		break;
 	case 2:
 		sprintf(name, "C%d", src_nr);
 		if (src_nr > 31)
-			fprintf(out, "bad src reg %s\n", name);
+			decode_printf(ctx, "bad src reg %s\n", name);
 		break;
 	case 4:
 		sprintf(name, "oC");
 		if (src_nr > 0)
-			fprintf(out, "bad src reg oC%d\n", src_nr);
+			decode_printf(ctx, "bad src reg oC%d\n", src_nr);
 		break;
 	case 5:
 		sprintf(name, "oD");
 		if (src_nr > 0)
-			fprintf(out, "bad src reg oD%d\n", src_nr);
+			decode_printf(ctx, "bad src reg oD%d\n", src_nr);
 		break;
 	case 6:
 		sprintf(name, "U%d", src_nr);
 		if (src_nr > 3)
-			fprintf(out, "bad src reg %s\n", name);
+			decode_printf(ctx, "bad src reg %s\n", name);
 		break;
 	default:
-		fprintf(out, "bad src reg type %d\n", src_type);
+		decode_printf(ctx, "bad src reg type %d\n", src_type);
 		sprintf(name, "RESERVED");
 		break;
 	}
 }
 
-static void i915_get_instruction_src0(uint32_t *data, int i, char *srcname)
+static void i915_get_instruction_src0(struct drm_intel_decode *ctx, int i,
+				      char *srcname)
 {
-	uint32_t a0 = data[i];
-	uint32_t a1 = data[i + 1];
+	uint32_t a0 = ctx->data[i];
+	uint32_t a1 = ctx->data[i + 1];
 	int src_nr = (a0 >> 2) & 0x1f;
 	const char *swizzle_x = i915_get_channel_swizzle((a1 >> 28) & 0xf);
 	const char *swizzle_y = i915_get_channel_swizzle((a1 >> 24) & 0xf);
@@ -762,17 +1144,18 @@ static void i915_get_instruction_src0(uint32_t *data, int i, char *srcname)
 	const char *swizzle_w = i915_get_channel_swizzle((a1 >> 16) & 0xf);
 	char swizzle[100];
 
-	i915_get_instruction_src_name((a0 >> 7) & 0x7, src_nr, srcname);
+	i915_get_instruction_src_name(ctx, (a0 >> 7) & 0x7, src_nr, srcname);
 	sprintf(swizzle, ".%s%s%s%s", swizzle_x, swizzle_y, swizzle_z,
 		swizzle_w);
 	if (strcmp(swizzle, ".xyzw") != 0)
 		strcat(srcname, swizzle);
 }
 
-static void i915_get_instruction_src1(uint32_t *data, int i, char *srcname)
+static void i915_get_instruction_src1(struct drm_intel_decode *ctx, int i,
+				      char *srcname)
 {
-	uint32_t a1 = data[i + 1];
-	uint32_t a2 = data[i + 2];
+	uint32_t a1 = ctx->data[i + 1];
+	uint32_t a2 = ctx->data[i + 2];
 	int src_nr = (a1 >> 8) & 0x1f;
 	const char *swizzle_x = i915_get_channel_swizzle((a1 >> 4) & 0xf);
 	const char *swizzle_y = i915_get_channel_swizzle((a1 >> 0) & 0xf);
@@ -780,16 +1163,17 @@ static void i915_get_instruction_src1(uint32_t *data, int i, char *srcname)
 	const char *swizzle_w = i915_get_channel_swizzle((a2 >> 24) & 0xf);
 	char swizzle[100];
 
-	i915_get_instruction_src_name((a1 >> 13) & 0x7, src_nr, srcname);
+	i915_get_instruction_src_name(ctx, (a1 >> 13) & 0x7, src_nr, srcname);
 	sprintf(swizzle, ".%s%s%s%s", swizzle_x, swizzle_y, swizzle_z,
 		swizzle_w);
 	if (strcmp(swizzle, ".xyzw") != 0)
 		strcat(srcname, swizzle);
 }
 
-static void i915_get_instruction_src2(uint32_t *data, int i, char *srcname)
+static void i915_get_instruction_src2(struct drm_intel_decode *ctx, int i,
+				      char *srcname)
 {
-	uint32_t a2 = data[i + 2];
+	uint32_t a2 = ctx->data[i + 2];
 	int src_nr = (a2 >> 16) & 0x1f;
 	const char *swizzle_x = i915_get_channel_swizzle((a2 >> 12) & 0xf);
 	const char *swizzle_y = i915_get_channel_swizzle((a2 >> 8) & 0xf);
@@ -797,7 +1181,7 @@ static void i915_get_instruction_src2(uint32_t *data, int i, char *srcname)
 	const char *swizzle_w = i915_get_channel_swizzle((a2 >> 0) & 0xf);
 	char swizzle[100];
 
-	i915_get_instruction_src_name((a2 >> 21) & 0x7, src_nr, srcname);
+	i915_get_instruction_src_name(ctx, (a2 >> 21) & 0x7, src_nr, srcname);
 	sprintf(swizzle, ".%s%s%s%s", swizzle_x, swizzle_y, swizzle_z,
 		swizzle_w);
 	if (strcmp(swizzle, ".xyzw") != 0)
@@ -805,13 +1189,14 @@ static void i915_get_instruction_src2(uint32_t *data, int i, char *srcname)
 }
 
 static void
-i915_get_instruction_addr(uint32_t src_type, uint32_t src_nr, char *name)
+i915_get_instruction_addr(struct drm_intel_decode *ctx, uint32_t src_type,
+			  uint32_t src_nr, char *name)
 {
 	switch (src_type) {
 	case 0:
 		sprintf(name, "R%d", src_nr);
 		if (src_nr > 15)
-			fprintf(out, "bad src reg %s\n", name);
+			decode_printf(ctx, "bad src reg %s\n", name);
 		break;
 	case 1:
 		if (src_nr < 8)
@@ -823,22 +1208,22 @@ i915_get_instruction_addr(uint32_t src_type, uint32_t src_nr, char *name)
 		else if (src_nr == 10)
 			sprintf(name, "FOG");
 		else {
-			fprintf(out, "bad src reg T%d\n", src_nr);
+			decode_printf(ctx, "bad src reg T%d\n", src_nr);
 			sprintf(name, "RESERVED");
 		}
 		break;
 	case 4:
 		sprintf(name, "oC");
 		if (src_nr > 0)
-			fprintf(out, "bad src reg oC%d\n", src_nr);
+			decode_printf(ctx, "bad src reg oC%d\n", src_nr);
 		break;
 	case 5:
 		sprintf(name, "oD");
 		if (src_nr > 0)
-			fprintf(out, "bad src reg oD%d\n", src_nr);
+			decode_printf(ctx, "bad src reg oD%d\n", src_nr);
 		break;
 	default:
-		fprintf(out, "bad src reg type %d\n", src_type);
+		decode_printf(ctx, "bad src reg type %d\n", src_type);
 		sprintf(name, "RESERVED");
 		break;
 	}
@@ -850,8 +1235,8 @@ i915_decode_alu1(struct drm_intel_decode *ctx,
 {
 	char dst[100], src0[100];
 
-	i915_get_instruction_dst(ctx->data, i, dst, 1);
-	i915_get_instruction_src0(ctx->data, i, src0);
+	i915_get_instruction_dst(ctx, i, dst, 1);
+	i915_get_instruction_src0(ctx, i, src0);
 
 	instr_out(ctx, i++, "%s: %s %s, %s\n", instr_prefix,
 		  op_name, dst, src0);
@@ -865,9 +1250,9 @@ i915_decode_alu2(struct drm_intel_decode *ctx,
 {
 	char dst[100], src0[100], src1[100];
 
-	i915_get_instruction_dst(ctx->data, i, dst, 1);
-	i915_get_instruction_src0(ctx->data, i, src0);
-	i915_get_instruction_src1(ctx->data, i, src1);
+	i915_get_instruction_dst(ctx, i, dst, 1);
+	i915_get_instruction_src0(ctx, i, src0);
+	i915_get_instruction_src1(ctx, i, src1);
 
 	instr_out(ctx, i++, "%s: %s %s, %s, %s\n", instr_prefix,
 		  op_name, dst, src0, src1);
@@ -881,10 +1266,10 @@ i915_decode_alu3(struct drm_intel_decode *ctx,
 {
 	char dst[100], src0[100], src1[100], src2[100];
 
-	i915_get_instruction_dst(ctx->data, i, dst, 1);
-	i915_get_instruction_src0(ctx->data, i, src0);
-	i915_get_instruction_src1(ctx->data, i, src1);
-	i915_get_instruction_src2(ctx->data, i, src2);
+	i915_get_instruction_dst(ctx, i, dst, 1);
+	i915_get_instruction_src0(ctx, i, src0);
+	i915_get_instruction_src1(ctx, i, src1);
+	i915_get_instruction_src2(ctx, i, src2);
 
 	instr_out(ctx, i++, "%s: %s %s, %s, %s, %s\n", instr_prefix,
 		  op_name, dst, src0, src1, src2);
@@ -902,8 +1287,8 @@ i915_decode_tex(struct drm_intel_decode *ctx, int i,
 	char addr_name[100];
 	int sampler_nr;
 
-	i915_get_instruction_dst(ctx->data, i, dst_name, 0);
-	i915_get_instruction_addr((t1 >> 24) & 0x7,
+	i915_get_instruction_dst(ctx, i, dst_name, 0);
+	i915_get_instruction_addr(ctx, (t1 >> 24) & 0x7,
 				  (t1 >> 17) & 0xf, addr_name);
 	sampler_nr = t0 & 0xf;
 
@@ -929,31 +1314,31 @@ i915_decode_dcl(struct drm_intel_decode *ctx, int i, char *instr_prefix)
 	case 1:
 		sprintf(dcl_mask, ".%s%s%s%s", dcl_x, dcl_y, dcl_z, dcl_w);
 		if (strcmp(dcl_mask, ".") == 0)
-			fprintf(out, "bad (empty) dcl mask\n");
+			decode_printf(ctx, "bad (empty) dcl mask\n");
 
 		if (dcl_nr > 10)
-			fprintf(out, "bad T%d dcl register number\n", dcl_nr);
+			decode_printf(ctx, "bad T%d dcl register number\n", dcl_nr);
 		if (dcl_nr < 8) {
 			if (strcmp(dcl_mask, ".x") != 0 &&
 			    strcmp(dcl_mask, ".xy") != 0 &&
 			    strcmp(dcl_mask, ".xz") != 0 &&
 			    strcmp(dcl_mask, ".w") != 0 &&
 			    strcmp(dcl_mask, ".xyzw") != 0) {
-				fprintf(out, "bad T%d.%s dcl mask\n", dcl_nr,
-					dcl_mask);
+				decode_printf(ctx, "bad T%d.%s dcl mask\n", dcl_nr,
+					      dcl_mask);
 			}
 			instr_out(ctx, i++, "%s: DCL T%d%s\n",
 				  instr_prefix, dcl_nr, dcl_mask);
 		} else {
 			if (strcmp(dcl_mask, ".xz") == 0)
-				fprintf(out, "errataed bad dcl mask %s\n",
-					dcl_mask);
+				decode_printf(ctx, "errataed bad dcl mask %s\n",
+					      dcl_mask);
 			else if (strcmp(dcl_mask, ".xw") == 0)
-				fprintf(out, "errataed bad dcl mask %s\n",
-					dcl_mask);
+				decode_printf(ctx, "errataed bad dcl mask %s\n",
+					      dcl_mask);
 			else if (strcmp(dcl_mask, ".xzw") == 0)
-				fprintf(out, "errataed bad dcl mask %s\n",
-					dcl_mask);
+				decode_printf(ctx, "errataed bad dcl mask %s\n",
+					      dcl_mask);
 
 			if (dcl_nr == 8) {
 				instr_out(ctx, i++,
@@ -988,7 +1373,7 @@ i915_decode_dcl(struct drm_intel_decode *ctx, int i, char *instr_prefix)
 			break;
 		}
 		if (dcl_nr > 15)
-			fprintf(out, "bad S%d dcl register number\n", dcl_nr);
+			decode_printf(ctx, "bad S%d dcl register number\n", dcl_nr);
 		instr_out(ctx, i++, "%s: DCL S%d %s\n",
 			  instr_prefix, dcl_nr, sampletype);
 		instr_out(ctx, i++, "%s\n", instr_prefix);
@@ -1333,7 +1718,7 @@ decode_3d_1d(struct drm_intel_decode *ctx)
 			instr_out(ctx, i++, "PSC.1\n");
 		}
 		if (len != i) {
-			fprintf(out, "Bad count in 3DSTATE_LOAD_INDIRECT\n");
+			decode_printf(ctx, "Bad count in 3DSTATE_LOAD_INDIRECT\n");
 			return len;
 		}
 		return len;
@@ -1349,22 +1734,22 @@ decode_3d_1d(struct drm_intel_decode *ctx)
 					int tex_num;
 
 					if (word == 2) {
-						saved_s2_set = 1;
-						saved_s2 = data[i];
+						ctx->saved_s2_set = true;
+						ctx->saved_s2 = data[i];
 					}
 					if (word == 4) {
-						saved_s4_set = 1;
-						saved_s4 = data[i];
+						ctx->saved_s4_set = true;
+						ctx->saved_s4 = data[i];
 					}
 
 					switch (word) {
 					case 0:
-						instr_out(ctx, i,
-							  "S0: vbo offset: 0x%08x%s\n",
-							  data[i] & (~1),
-							  data[i] & 1 ?
-							  ", auto cache invalidate disabled"
-							  : "");
+						instr_out_addr(ctx, i,
+							       "S0: vbo offset: 0x%08x%s\n",
+							       data[i] & (~1),
+							       data[i] & 1 ?
+							       ", auto cache invalidate disabled"
+							       : "");
 						break;
 					case 1:
 						instr_out(ctx, i,
@@ -1383,43 +1768,43 @@ decode_3d_1d(struct drm_intel_decode *ctx)
 								 tex_num *
 								 4) & 0xf) {
 							case 0:
-								fprintf(out,
-									"%i=2D ",
-									tex_num);
+								decode_printf(ctx,
+									      "%i=2D ",
+									      tex_num);
 								break;
 							case 1:
-								fprintf(out,
-									"%i=3D ",
-									tex_num);
+								decode_printf(ctx,
+									      "%i=3D ",
+									      tex_num);
 								break;
 							case 2:
-								fprintf(out,
-									"%i=4D ",
-									tex_num);
+								decode_printf(ctx,
+									      "%i=4D ",
+									      tex_num);
 								break;
 							case 3:
-								fprintf(out,
-									"%i=1D ",
-									tex_num);
+								decode_printf(ctx,
+									      "%i=1D ",
+									      tex_num);
 								break;
 							case 4:
-								fprintf(out,
-									"%i=2D_16 ",
-									tex_num);
+								decode_printf(ctx,
+									      "%i=2D_16 ",
+									      tex_num);
 								break;
 							case 5:
-								fprintf(out,
-									"%i=4D_16 ",
-									tex_num);
+								decode_printf(ctx,
+									      "%i=4D_16 ",
+									      tex_num);
 								break;
 							case 0xf:
-								fprintf(out,
-									"%i=NP ",
-									tex_num);
+								decode_printf(ctx,
+									      "%i=NP ",
+									      tex_num);
 								break;
 							}
 						}
-						fprintf(out, "\n");
+						decode_printf(ctx, "\n");
 
 						break;
 					case 3:
@@ -1720,8 +2105,8 @@ decode_3d_1d(struct drm_intel_decode *ctx)
 			}
 		}
 		if (len != i) {
-			fprintf(out,
-				"Bad count in 3DSTATE_LOAD_STATE_IMMEDIATE_1\n");
+			decode_printf(ctx,
+				      "Bad count in 3DSTATE_LOAD_STATE_IMMEDIATE_1\n");
 		}
 		return len;
 	case 0x03:
@@ -1740,12 +2125,12 @@ decode_3d_1d(struct drm_intel_decode *ctx)
 					instr_out(ctx, i++,
 						  "TB%dA\n", word - 7);
 				} else if (word >= 11 && word <= 14) {
-					instr_out(ctx, i,
-						  "TM%dS0: offset=0x%08x, %s\n",
-						  word - 11,
-						  data[i] & 0xfffffffe,
-						  data[i] & 1 ? "use fence" :
-						  "");
+					instr_out_addr(ctx, i,
+						       "TM%dS0: offset=0x%08x, %s\n",
+						       word - 11,
+						       data[i] & 0xfffffffe,
+						       data[i] & 1 ? "use fence" :
+						       "");
 					i++;
 					instr_out(ctx, i,
 						  "TM%dS1: height=%i, width=%i, %s\n",
@@ -1770,8 +2155,8 @@ decode_3d_1d(struct drm_intel_decode *ctx)
 			}
 		}
 		if (len != i) {
-			fprintf(out,
-				"Bad count in 3DSTATE_LOAD_STATE_IMMEDIATE_2\n");
+			decode_printf(ctx,
+				      "Bad count in 3DSTATE_LOAD_STATE_IMMEDIATE_2\n");
 		}
 		return len;
 	case 0x00:
@@ -1972,7 +2357,7 @@ decode_3d_1d(struct drm_intel_decode *ctx)
 			}
 		}
 		if (len != i) {
-			fprintf(out, "Bad count in 3DSTATE_MAP_STATE\n");
+			decode_printf(ctx, "Bad count in 3DSTATE_MAP_STATE\n");
 			return len;
 		}
 		return len;
@@ -1999,16 +2384,16 @@ decode_3d_1d(struct drm_intel_decode *ctx)
 			}
 		}
 		if (len != i) {
-			fprintf(out,
-				"Bad count in 3DSTATE_PIXEL_SHADER_CONSTANTS\n");
+			decode_printf(ctx,
+				      "Bad count in 3DSTATE_PIXEL_SHADER_CONSTANTS\n");
 		}
 		return len;
 	case 0x05:
 		instr_out(ctx, 0, "3DSTATE_PIXEL_SHADER_PROGRAM\n");
 		len = (data[0] & 0x000000ff) + 2;
 		if ((len - 1) % 3 != 0 || len > 370) {
-			fprintf(out,
-				"Bad count in 3DSTATE_PIXEL_SHADER_PROGRAM\n");
+			decode_printf(ctx,
+				      "Bad count in 3DSTATE_PIXEL_SHADER_PROGRAM\n");
 		}
 		i = 1;
 		for (instr = 0; instr < (len - 1) / 3; instr++) {
@@ -2085,15 +2470,15 @@ decode_3d_1d(struct drm_intel_decode *ctx)
 			}
 		}
 		if (len != i) {
-			fprintf(out, "Bad count in 3DSTATE_SAMPLER_STATE\n");
+			decode_printf(ctx, "Bad count in 3DSTATE_SAMPLER_STATE\n");
 		}
 		return len;
 	case 0x85:
 		len = (data[0] & 0x0000000f) + 2;
 
 		if (len != 2)
-			fprintf(out,
-				"Bad count in 3DSTATE_DEST_BUFFER_VARIABLES\n");
+			decode_printf(ctx,
+				      "Bad count in 3DSTATE_DEST_BUFFER_VARIABLES\n");
 
 		instr_out(ctx, 0,
 			  "3DSTATE_DEST_BUFFER_VARIABLES\n");
@@ -2162,8 +2547,8 @@ decode_3d_1d(struct drm_intel_decode *ctx)
 
 			len = (data[0] & 0x0000000f) + 2;
 			if (len != 3)
-				fprintf(out,
-					"Bad count in 3DSTATE_BUFFER_INFO\n");
+				decode_printf(ctx,
+					      "Bad count in 3DSTATE_BUFFER_INFO\n");
 
 			switch ((data[1] >> 24) & 0x7) {
 			case 0x3:
@@ -2188,15 +2573,15 @@ decode_3d_1d(struct drm_intel_decode *ctx)
 				  "%s, tiling = %s, pitch=%d\n", name, tiling,
 				  data[1] & 0xffff);
 
-			instr_out(ctx, 2, "address\n");
+			instr_out_addr(ctx, 2, "address\n");
 			return len;
 		}
 	case 0x81:
 		len = (data[0] & 0x0000000f) + 2;
 
 		if (len != 3)
-			fprintf(out,
-				"Bad count in 3DSTATE_SCISSOR_RECTANGLE\n");
+			decode_printf(ctx,
+				      "Bad count in 3DSTATE_SCISSOR_RECTANGLE\n");
 
 		instr_out(ctx, 0, "3DSTATE_SCISSOR_RECTANGLE\n");
 		instr_out(ctx, 1, "(%d,%d)\n",
@@ -2209,8 +2594,8 @@ decode_3d_1d(struct drm_intel_decode *ctx)
 		len = (data[0] & 0x0000000f) + 2;
 
 		if (len != 5)
-			fprintf(out,
-				"Bad count in 3DSTATE_DRAWING_RECTANGLE\n");
+			decode_printf(ctx,
+				      "Bad count in 3DSTATE_DRAWING_RECTANGLE\n");
 
 		instr_out(ctx, 0, "3DSTATE_DRAWING_RECTANGLE\n");
 		instr_out(ctx, 1, "%s\n",
@@ -2227,7 +2612,7 @@ decode_3d_1d(struct drm_intel_decode *ctx)
 		len = (data[0] & 0x0000000f) + 2;
 
 		if (len != 7)
-			fprintf(out, "Bad count in 3DSTATE_CLEAR_PARAMETERS\n");
+			decode_printf(ctx, "Bad count in 3DSTATE_CLEAR_PARAMETERS\n");
 
 		instr_out(ctx, 0, "3DSTATE_CLEAR_PARAMETERS\n");
 		instr_out(ctx, 1, "prim_type=%s, clear=%s%s%s\n",
@@ -2258,8 +2643,8 @@ decode_3d_1d(struct drm_intel_decode *ctx)
 				len = (data[0] & 0x0000ffff) + 2;
 				if (len < opcode_3d_1d->min_len ||
 				    len > opcode_3d_1d->max_len) {
-					fprintf(out, "Bad count in %s\n",
-						opcode_3d_1d->name);
+					decode_printf(ctx, "Bad count in %s\n",
+						      opcode_3d_1d->name);
 				}
 			}
 
@@ -2284,8 +2669,8 @@ decode_3d_primitive(struct drm_intel_decode *ctx)
 	char immediate = (data[0] & (1 << 23)) == 0;
 	unsigned int len, i, j, ret;
 	const char *primtype;
-	int original_s2 = saved_s2;
-	int original_s4 = saved_s4;
+	int original_s2 = ctx->saved_s2;
+	int original_s4 = ctx->saved_s4;
 
 	switch ((data[0] >> 18) & 0xf) {
 	case 0x0:
@@ -2320,8 +2705,8 @@ decode_3d_primitive(struct drm_intel_decode *ctx)
 		break;
 	case 0xa:
 		primtype = "CLEAR_RECT";
-		saved_s4 = 3 << 6;
-		saved_s2 = ~0;
+		ctx->saved_s4 = 3 << 6;
+		ctx->saved_s2 = ~0;
 		break;
 	default:
 		primtype = "unknown";
@@ -2335,8 +2720,8 @@ decode_3d_primitive(struct drm_intel_decode *ctx)
 			  primtype);
 		if (count < len)
 			BUFFER_FAIL(count, len, "3DPRIMITIVE inline");
-		if (!saved_s2_set || !saved_s4_set) {
-			fprintf(out, "unknown vertex format\n");
+		if (!ctx->saved_s2_set || !ctx->saved_s4_set) {
+			decode_printf(ctx, "unknown vertex format\n");
 			for (i = 1; i < len; i++) {
 				instr_out(ctx, i,
 					  "           vertex data (%f float)\n",
@@ -2351,13 +2736,13 @@ decode_3d_primitive(struct drm_intel_decode *ctx)
     if (i < len)							\
 	instr_out(ctx, i, " V%d."fmt"\n", vertex, __VA_ARGS__); \
     else								\
-	fprintf(out, " missing data in V%d\n", vertex);			\
+	decode_printf(ctx, " missing data in V%d\n", vertex);			\
     i++;								\
 } while (0)
 
 				VERTEX_OUT("X = %f", int_as_float(data[i]));
 				VERTEX_OUT("Y = %f", int_as_float(data[i]));
-				switch (saved_s4 >> 6 & 0x7) {
+				switch (ctx->saved_s4 >> 6 & 0x7) {
 				case 0x1:
 					VERTEX_OUT("Z = %f",
 						   int_as_float(data[i]));
@@ -2375,10 +2760,10 @@ decode_3d_primitive(struct drm_intel_decode *ctx)
 						   int_as_float(data[i]));
 					break;
 				default:
-					fprintf(out, "bad S4 position mask\n");
+					decode_printf(ctx, "bad S4 position mask\n");
 				}
 
-				if (saved_s4 & (1 << 10)) {
+				if (ctx->saved_s4 & (1 << 10)) {
 					VERTEX_OUT
 					    ("color = (A=0x%02x, R=0x%02x, G=0x%02x, "
 					     "B=0x%02x)", data[i] >> 24,
@@ -2386,7 +2771,7 @@ decode_3d_primitive(struct drm_intel_decode *ctx)
 					     (data[i] >> 8) & 0xff,
 					     data[i] & 0xff);
 				}
-				if (saved_s4 & (1 << 11)) {
+				if (ctx->saved_s4 & (1 << 11)) {
 					VERTEX_OUT
 					    ("spec = (A=0x%02x, R=0x%02x, G=0x%02x, "
 					     "B=0x%02x)", data[i] >> 24,
@@ -2394,11 +2779,11 @@ decode_3d_primitive(struct drm_intel_decode *ctx)
 					     (data[i] >> 8) & 0xff,
 					     data[i] & 0xff);
 				}
-				if (saved_s4 & (1 << 12))
+				if (ctx->saved_s4 & (1 << 12))
 					VERTEX_OUT("width = 0x%08x)", data[i]);
 
 				for (tc = 0; tc <= 7; tc++) {
-					switch ((saved_s2 >> (tc * 4)) & 0xf) {
+					switch ((ctx->saved_s2 >> (tc * 4)) & 0xf) {
 					case 0x0:
 						VERTEX_OUT("T%d.X = %f", tc,
 							   int_as_float(data
@@ -2453,9 +2838,9 @@ decode_3d_primitive(struct drm_intel_decode *ctx)
 					case 0xf:
 						break;
 					default:
-						fprintf(out,
-							"bad S2.T%d format\n",
-							tc);
+						decode_printf(ctx,
+							      "bad S2.T%d format\n",
+							      tc);
 					}
 				}
 				vertex++;
@@ -2498,8 +2883,8 @@ decode_3d_primitive(struct drm_intel_decode *ctx)
 							  data[i] >> 16);
 					}
 				}
-				fprintf(out,
-					"3DPRIMITIVE: no terminator found in index buffer\n");
+				decode_printf(ctx,
+					      "3DPRIMITIVE: no terminator found in index buffer\n");
 				ret = count;
 				goto out;
 			} else {
@@ -2531,8 +2916,8 @@ decode_3d_primitive(struct drm_intel_decode *ctx)
 	}
 
 out:
-	saved_s2 = original_s2;
-	saved_s4 = original_s4;
+	ctx->saved_s2 = original_s2;
+	ctx->saved_s4 = original_s4;
 	return ret;
 }
 
@@ -2581,8 +2966,8 @@ decode_3d(struct drm_intel_decode *ctx)
 				len = (data[0] & 0xff) + 2;
 				if (len < opcode_3d->min_len ||
 				    len > opcode_3d->max_len) {
-					fprintf(out, "Bad count in %s\n",
-						opcode_3d->name);
+					decode_printf(ctx, "Bad count in %s\n",
+						      opcode_3d->name);
 				}
 			}
 
@@ -2723,7 +3108,7 @@ i965_decode_urb_fence(struct drm_intel_decode *ctx, int len)
 	uint32_t *data = ctx->data;
 
 	if (len != 3)
-		fprintf(out, "Bad count in URB_FENCE\n");
+		decode_printf(ctx, "Bad count in URB_FENCE\n");
 
 	vs_fence = data[1] & 0x3ff;
 	gs_fence = (data[1] >> 10) & 0x3ff;
@@ -2746,13 +3131,13 @@ i965_decode_urb_fence(struct drm_intel_decode *ctx, int len)
 		  "sf fence: %d, vfe_fence: %d, cs_fence: %d\n",
 		  sf_fence, vfe_fence, cs_fence);
 	if (gs_fence < vs_fence)
-		fprintf(out, "gs fence < vs fence!\n");
+		decode_printf(ctx, "gs fence < vs fence!\n");
 	if (clip_fence < gs_fence)
-		fprintf(out, "clip fence < gs fence!\n");
+		decode_printf(ctx, "clip fence < gs fence!\n");
 	if (sf_fence < clip_fence)
-		fprintf(out, "sf fence < clip fence!\n");
+		decode_printf(ctx, "sf fence < clip fence!\n");
 	if (cs_fence < sf_fence)
-		fprintf(out, "cs fence < sf fence!\n");
+		decode_printf(ctx, "cs fence < sf fence!\n");
 
 	return len;
 }
@@ -2762,9 +3147,9 @@ state_base_out(struct drm_intel_decode *ctx, unsigned int index,
 	       const char *name)
 {
 	if (ctx->data[index] & 1) {
-		instr_out(ctx, index,
-			  "%s state base address 0x%08x\n", name,
-			  ctx->data[index] & ~1);
+		instr_out_addr(ctx, index,
+			       "%s state base address 0x%08x\n", name,
+			       ctx->data[index] & ~1);
 	} else {
 		instr_out(ctx, index, "%s state base not updated\n",
 			  name);
@@ -2794,7 +3179,7 @@ static int
 gen7_3DSTATE_VIEWPORT_STATE_POINTERS_CC(struct drm_intel_decode *ctx)
 {
 	instr_out(ctx, 0, "3DSTATE_VIEWPORT_STATE_POINTERS_CC\n");
-	instr_out(ctx, 1, "pointer to CC viewport\n");
+	instr_out_addr(ctx, 1, "pointer to CC viewport\n");
 
 	return 2;
 }
@@ -2803,7 +3188,7 @@ static int
 gen7_3DSTATE_VIEWPORT_STATE_POINTERS_SF_CLIP(struct drm_intel_decode *ctx)
 {
 	instr_out(ctx, 0, "3DSTATE_VIEWPORT_STATE_POINTERS_SF_CLIP\n");
-	instr_out(ctx, 1, "pointer to SF_CLIP viewport\n");
+	instr_out_addr(ctx, 1, "pointer to SF_CLIP viewport\n");
 
 	return 2;
 }
@@ -2812,9 +3197,9 @@ static int
 gen7_3DSTATE_BLEND_STATE_POINTERS(struct drm_intel_decode *ctx)
 {
 	instr_out(ctx, 0, "3DSTATE_BLEND_STATE_POINTERS\n");
-	instr_out(ctx, 1, "pointer to BLEND_STATE at 0x%08x (%s)\n",
-		  ctx->data[1] & ~1,
-		  (ctx->data[1] & 1) ? "changed" : "unchanged");
+	instr_out_addr(ctx, 1, "pointer to BLEND_STATE at 0x%08x (%s)\n",
+		       ctx->data[1] & ~1,
+		       (ctx->data[1] & 1) ? "changed" : "unchanged");
 
 	return 2;
 }
@@ -2823,10 +3208,10 @@ static int
 gen7_3DSTATE_DEPTH_STENCIL_STATE_POINTERS(struct drm_intel_decode *ctx)
 {
 	instr_out(ctx, 0, "3DSTATE_DEPTH_STENCIL_STATE_POINTERS\n");
-	instr_out(ctx, 1,
-		  "pointer to DEPTH_STENCIL_STATE at 0x%08x (%s)\n",
-		  ctx->data[1] & ~1,
-		  (ctx->data[1] & 1) ? "changed" : "unchanged");
+	instr_out_addr(ctx, 1,
+		       "pointer to DEPTH_STENCIL_STATE at 0x%08x (%s)\n",
+		       ctx->data[1] & ~1,
+		       (ctx->data[1] & 1) ? "changed" : "unchanged");
 
 	return 2;
 }
@@ -2837,7 +3222,7 @@ gen7_3DSTATE_HIER_DEPTH_BUFFER(struct drm_intel_decode *ctx)
 	instr_out(ctx, 0, "3DSTATE_HIER_DEPTH_BUFFER\n");
 	instr_out(ctx, 1, "pitch %db\n",
 		  (ctx->data[1] & 0x1ffff) + 1);
-	instr_out(ctx, 2, "pointer to HiZ buffer\n");
+	instr_out_addr(ctx, 2, "pointer to HiZ buffer\n");
 
 	return 3;
 }
@@ -2858,10 +3243,10 @@ static int
 gen7_3DSTATE_CC_STATE_POINTERS(struct drm_intel_decode *ctx)
 {
 	instr_out(ctx, 0, "3DSTATE_CC_STATE_POINTERS\n");
-	instr_out(ctx, 1, "pointer to COLOR_CALC_STATE at 0x%08x "
-		  "(%s)\n",
-		  ctx->data[1] & ~1,
-		  (ctx->data[1] & 1) ? "changed" : "unchanged");
+	instr_out_addr(ctx, 1, "pointer to COLOR_CALC_STATE at 0x%08x "
+		       "(%s)\n",
+		       ctx->data[1] & ~1,
+		       (ctx->data[1] & 1) ? "changed" : "unchanged");
 
 	return 2;
 }
@@ -2919,10 +3304,10 @@ gen7_3DSTATE_CONSTANT(struct drm_intel_decode *ctx, const char *unit)
 	instr_out(ctx, 0, "3DSTATE_CONSTANT_%s\n", unit);
 	instr_out(ctx, 1, "len 0 = %d, len 1 = %d\n", rlen[0], rlen[1]);
 	instr_out(ctx, 2, "len 2 = %d, len 3 = %d\n", rlen[2], rlen[3]);
-	instr_out(ctx, 3, "pointer to constbuf 0\n");
-	instr_out(ctx, 4, "pointer to constbuf 1\n");
-	instr_out(ctx, 5, "pointer to constbuf 2\n");
-	instr_out(ctx, 6, "pointer to constbuf 3\n");
+	instr_out_addr(ctx, 3, "pointer to constbuf 0\n");
+	instr_out_addr(ctx, 4, "pointer to constbuf 1\n");
+	instr_out_addr(ctx, 5, "pointer to constbuf 2\n");
+	instr_out_addr(ctx, 6, "pointer to constbuf 3\n");
 
 	return 7;
 }
@@ -2962,7 +3347,7 @@ static int
 gen6_3DSTATE_WM(struct drm_intel_decode *ctx)
 {
 	instr_out(ctx, 0, "3DSTATE_WM\n");
-	instr_out(ctx, 1, "kernel start pointer 0\n");
+	instr_out_addr(ctx, 1, "kernel start pointer 0\n");
 	instr_out(ctx, 2,
 		  "SPF=%d, VME=%d, Sampler Count %d, "
 		  "Binding table count %d\n",
@@ -2970,7 +3355,7 @@ gen6_3DSTATE_WM(struct drm_intel_decode *ctx)
 		  (ctx->data[2] >> 30) & 1,
 		  (ctx->data[2] >> 27) & 7,
 		  (ctx->data[2] >> 18) & 0xff);
-	instr_out(ctx, 3, "scratch offset\n");
+	instr_out_addr(ctx, 3, "scratch offset\n");
 	instr_out(ctx, 4,
 		  "Depth Clear %d, Depth Resolve %d, HiZ Resolve %d, "
 		  "Dispatch GRF start[0] %d, start[1] %d, start[2] %d\n",
@@ -3005,8 +3390,8 @@ gen6_3DSTATE_WM(struct drm_intel_decode *ctx)
 		  (ctx->data[6] & (1 << 9)) != 0,
 		  (ctx->data[6] >> 1) & 3,
 		  (ctx->data[6] & 1));
-	instr_out(ctx, 7, "kernel start pointer 1\n");
-	instr_out(ctx, 8, "kernel start pointer 2\n");
+	instr_out_addr(ctx, 7, "kernel start pointer 1\n");
+	instr_out_addr(ctx, 8, "kernel start pointer 2\n");
 
 	return 9;
 }
@@ -3128,6 +3513,107 @@ gen7_3DPRIMITIVE(struct drm_intel_decode *ctx)
 	return 7;
 }
 
+struct opcode_3d_965 {
+	uint32_t opcode;
+	uint32_t len_mask;
+	int unsigned min_len;
+	int unsigned max_len;
+	const char *name;
+	int gen;
+	int (*func)(struct drm_intel_decode *ctx);
+};
+
+static const struct opcode_3d_965 opcodes_3d_965[] = {
+	{ 0x6000, 0x00ff, 3, 3, "URB_FENCE" },
+	{ 0x6001, 0xffff, 2, 2, "CS_URB_STATE" },
+	{ 0x6002, 0x00ff, 2, 2, "CONSTANT_BUFFER" },
+	{ 0x6101, 0xffff, 6, 10, "STATE_BASE_ADDRESS" },
+	{ 0x6102, 0xffff, 2, 2, "STATE_SIP" },
+	{ 0x6104, 0xffff, 1, 1, "3DSTATE_PIPELINE_SELECT" },
+	{ 0x680b, 0xffff, 1, 1, "3DSTATE_VF_STATISTICS" },
+	{ 0x6904, 0xffff, 1, 1, "3DSTATE_PIPELINE_SELECT" },
+	{ 0x7800, 0xffff, 7, 7, "3DSTATE_PIPELINED_POINTERS" },
+	{ 0x7801, 0x00ff, 4, 6, "3DSTATE_BINDING_TABLE_POINTERS" },
+	{ 0x7802, 0x00ff, 4, 4, "3DSTATE_SAMPLER_STATE_POINTERS" },
+	{ 0x7805, 0x00ff, 7, 7, "3DSTATE_DEPTH_BUFFER", 7 },
+	{ 0x7805, 0x00ff, 3, 3, "3DSTATE_URB" },
+	{ 0x7804, 0x00ff, 3, 3, "3DSTATE_CLEAR_PARAMS" },
+	{ 0x7806, 0x00ff, 3, 3, "3DSTATE_STENCIL_BUFFER" },
+	{ 0x790f, 0x00ff, 3, 3, "3DSTATE_HIER_DEPTH_BUFFER", 6 },
+	{ 0x7807, 0x00ff, 3, 3, "3DSTATE_HIER_DEPTH_BUFFER", 7, gen7_3DSTATE_HIER_DEPTH_BUFFER },
+	{ 0x7808, 0x00ff, 5, 257, "3DSTATE_VERTEX_BUFFERS" },
+	{ 0x7809, 0x00ff, 3, 256, "3DSTATE_VERTEX_ELEMENTS" },
+	{ 0x780a, 0x00ff, 3, 3, "3DSTATE_INDEX_BUFFER" },
+	{ 0x780b, 0xffff, 1, 1, "3DSTATE_VF_STATISTICS" },
+	{ 0x780d, 0x00ff, 4, 4, "3DSTATE_VIEWPORT_STATE_POINTERS" },
+	{ 0x780e, 0xffff, 4, 4, "3DSTATE_CC_STATE_POINTERS", 6, gen6_3DSTATE_CC_STATE_POINTERS },
+	{ 0x780e, 0x00ff, 2, 2, "3DSTATE_CC_STATE_POINTERS", 7, gen7_3DSTATE_CC_STATE_POINTERS },
+	{ 0x780f, 0x00ff, 2, 2, "3DSTATE_SCISSOR_POINTERS" },
+	{ 0x7810, 0x00ff, 6, 6, "3DSTATE_VS" },
+	{ 0x7811, 0x00ff, 7, 7, "3DSTATE_GS" },
+	{ 0x7812, 0x00ff, 4, 4, "3DSTATE_CLIP" },
+	{ 0x7813, 0x00ff, 20, 20, "3DSTATE_SF", 6 },
+	{ 0x7813, 0x00ff, 7, 7, "3DSTATE_SF", 7 },
+	{ 0x7814, 0x00ff, 3, 3, "3DSTATE_WM", 7, gen7_3DSTATE_WM },
+	{ 0x7814, 0x00ff, 9, 9, "3DSTATE_WM", 6, gen6_3DSTATE_WM },
+	{ 0x7815, 0x00ff, 5, 5, "3DSTATE_CONSTANT_VS_STATE", 6 },
+	{ 0x7815, 0x00ff, 7, 7, "3DSTATE_CONSTANT_VS", 7, gen7_3DSTATE_CONSTANT_VS },
+	{ 0x7816, 0x00ff, 5, 5, "3DSTATE_CONSTANT_GS_STATE", 6 },
+	{ 0x7816, 0x00ff, 7, 7, "3DSTATE_CONSTANT_GS", 7, gen7_3DSTATE_CONSTANT_GS },
+	{ 0x7817, 0x00ff, 5, 5, "3DSTATE_CONSTANT_PS_STATE", 6 },
+	{ 0x7817, 0x00ff, 7, 7, "3DSTATE_CONSTANT_PS", 7, gen7_3DSTATE_CONSTANT_PS },
+	{ 0x7818, 0xffff, 2, 2, "3DSTATE_SAMPLE_MASK" },
+	{ 0x7819, 0x00ff, 7, 7, "3DSTATE_CONSTANT_HS", 7, gen7_3DSTATE_CONSTANT_HS },
+	{ 0x781a, 0x00ff, 7, 7, "3DSTATE_CONSTANT_DS", 7, gen7_3DSTATE_CONSTANT_DS },
+	{ 0x781b, 0x00ff, 7, 7, "3DSTATE_HS" },
+	{ 0x781c, 0x00ff, 4, 4, "3DSTATE_TE" },
+	{ 0x781d, 0x00ff, 6, 6, "3DSTATE_DS" },
+	{ 0x781e, 0x00ff, 3, 3, "3DSTATE_STREAMOUT" },
+	{ 0x781f, 0x00ff, 14, 14, "3DSTATE_SBE" },
+	{ 0x7820, 0x00ff, 8, 8, "3DSTATE_PS" },
+	{ 0x7821, 0x00ff, 2, 2, "3DSTATE_VIEWPORT_STATE_POINTERS_SF_CLIP", 7, gen7_3DSTATE_VIEWPORT_STATE_POINTERS_SF_CLIP },
+	{ 0x7823, 0x00ff, 2, 2, "3DSTATE_VIEWPORT_STATE_POINTERS_CC", 7, gen7_3DSTATE_VIEWPORT_STATE_POINTERS_CC },
+	{ 0x7824, 0x00ff, 2, 2, "3DSTATE_BLEND_STATE_POINTERS", 7, gen7_3DSTATE_BLEND_STATE_POINTERS },
+	{ 0x7825, 0x00ff, 2, 2, "3DSTATE_DEPTH_STENCIL_STATE_POINTERS", 7, gen7_3DSTATE_DEPTH_STENCIL_STATE_POINTERS },
+	{ 0x7826, 0x00ff, 2, 2, "3DSTATE_BINDING_TABLE_POINTERS_VS" },
+	{ 0x7827, 0x00ff, 2, 2, "3DSTATE_BINDING_TABLE_POINTERS_HS" },
+	{ 0x7828, 0x00ff, 2, 2, "3DSTATE_BINDING_TABLE_POINTERS_DS" },
+	{ 0x7829, 0x00ff, 2, 2, "3DSTATE_BINDING_TABLE_POINTERS_GS" },
+	{ 0x782a, 0x00ff, 2, 2, "3DSTATE_BINDING_TABLE_POINTERS_PS" },
+	{ 0x782b, 0x00ff, 2, 2, "3DSTATE_SAMPLER_STATE_POINTERS_VS" },
+	{ 0x782c, 0x00ff, 2, 2, "3DSTATE_SAMPLER_STATE_POINTERS_HS" },
+	{ 0x782d, 0x00ff, 2, 2, "3DSTATE_SAMPLER_STATE_POINTERS_DS" },
+	{ 0x782e, 0x00ff, 2, 2, "3DSTATE_SAMPLER_STATE_POINTERS_GS" },
+	{ 0x782f, 0x00ff, 2, 2, "3DSTATE_SAMPLER_STATE_POINTERS_PS" },
+	{ 0x7830, 0x00ff, 2, 2, "3DSTATE_URB_VS", 7, gen7_3DSTATE_URB_VS },
+	{ 0x7831, 0x00ff, 2, 2, "3DSTATE_URB_HS", 7, gen7_3DSTATE_URB_HS },
+	{ 0x7832, 0x00ff, 2, 2, "3DSTATE_URB_DS", 7, gen7_3DSTATE_URB_DS },
+	{ 0x7833, 0x00ff, 2, 2, "3DSTATE_URB_GS", 7, gen7_3DSTATE_URB_GS },
+	{ 0x7900, 0xffff, 4, 4, "3DSTATE_DRAWING_RECTANGLE" },
+	{ 0x7901, 0xffff, 5, 5, "3DSTATE_CONSTANT_COLOR" },
+	{ 0x7905, 0xffff, 5, 7, "3DSTATE_DEPTH_BUFFER" },
+	{ 0x7906, 0xffff, 2, 2, "3DSTATE_POLY_STIPPLE_OFFSET" },
+	{ 0x7907, 0xffff, 33, 33, "3DSTATE_POLY_STIPPLE_PATTERN" },
+	{ 0x7908, 0xffff, 3, 3, "3DSTATE_LINE_STIPPLE" },
+	{ 0x7909, 0xffff, 2, 2, "3DSTATE_GLOBAL_DEPTH_OFFSET_CLAMP" },
+	{ 0x7909, 0xffff, 2, 2, "3DSTATE_CLEAR_PARAMS" },
+	{ 0x790a, 0xffff, 3, 3, "3DSTATE_AA_LINE_PARAMETERS" },
+	{ 0x790b, 0xffff, 4, 4, "3DSTATE_GS_SVB_INDEX" },
+	{ 0x790d, 0xffff, 3, 3, "3DSTATE_MULTISAMPLE", 6 },
+	{ 0x790d, 0xffff, 4, 4, "3DSTATE_MULTISAMPLE", 7 },
+	{ 0x7910, 0x00ff, 2, 2, "3DSTATE_CLEAR_PARAMS" },
+	{ 0x7912, 0x00ff, 2, 2, "3DSTATE_PUSH_CONSTANT_ALLOC_VS" },
+	{ 0x7913, 0x00ff, 2, 2, "3DSTATE_PUSH_CONSTANT_ALLOC_HS" },
+	{ 0x7914, 0x00ff, 2, 2, "3DSTATE_PUSH_CONSTANT_ALLOC_DS" },
+	{ 0x7915, 0x00ff, 2, 2, "3DSTATE_PUSH_CONSTANT_ALLOC_GS" },
+	{ 0x7916, 0x00ff, 2, 2, "3DSTATE_PUSH_CONSTANT_ALLOC_PS" },
+	{ 0x7917, 0x00ff, 2, 2+128*2, "3DSTATE_SO_DECL_LIST" },
+	{ 0x7918, 0x00ff, 4, 4, "3DSTATE_SO_BUFFER" },
+	{ 0x7a00, 0x00ff, 4, 6, "PIPE_CONTROL" },
+	{ 0x7b00, 0x00ff, 7, 7, "3DPRIMITIVE", 7, gen7_3DPRIMITIVE },
+	{ 0x7b00, 0x00ff, 6, 6, "3DPRIMITIVE", 0, gen4_3DPRIMITIVE },
+};
+
 static int
 decode_3d_965(struct drm_intel_decode *ctx)
 {
@@ -3138,118 +3624,10 @@ decode_3d_965(struct drm_intel_decode *ctx)
 	uint32_t *data = ctx->data;
 	uint32_t devid = ctx->devid;
 
-	struct {
-		uint32_t opcode;
-		uint32_t len_mask;
-		int unsigned min_len;
-		int unsigned max_len;
-		const char *name;
-		int gen;
-		int (*func)(struct drm_intel_decode *ctx);
-	} opcodes_3d[] = {
-		{ 0x6000, 0x00ff, 3, 3, "URB_FENCE" },
-		{ 0x6001, 0xffff, 2, 2, "CS_URB_STATE" },
-		{ 0x6002, 0x00ff, 2, 2, "CONSTANT_BUFFER" },
-		{ 0x6101, 0xffff, 6, 10, "STATE_BASE_ADDRESS" },
-		{ 0x6102, 0xffff, 2, 2, "STATE_SIP" },
-		{ 0x6104, 0xffff, 1, 1, "3DSTATE_PIPELINE_SELECT" },
-		{ 0x680b, 0xffff, 1, 1, "3DSTATE_VF_STATISTICS" },
-		{ 0x6904, 0xffff, 1, 1, "3DSTATE_PIPELINE_SELECT" },
-		{ 0x7800, 0xffff, 7, 7, "3DSTATE_PIPELINED_POINTERS" },
-		{ 0x7801, 0x00ff, 4, 6, "3DSTATE_BINDING_TABLE_POINTERS" },
-		{ 0x7802, 0x00ff, 4, 4, "3DSTATE_SAMPLER_STATE_POINTERS" },
-		{ 0x7805, 0x00ff, 7, 7, "3DSTATE_DEPTH_BUFFER", 7 },
-		{ 0x7805, 0x00ff, 3, 3, "3DSTATE_URB" },
-		{ 0x7804, 0x00ff, 3, 3, "3DSTATE_CLEAR_PARAMS" },
-		{ 0x7806, 0x00ff, 3, 3, "3DSTATE_STENCIL_BUFFER" },
-		{ 0x790f, 0x00ff, 3, 3, "3DSTATE_HIER_DEPTH_BUFFER", 6 },
-		{ 0x7807, 0x00ff, 3, 3, "3DSTATE_HIER_DEPTH_BUFFER", 7, gen7_3DSTATE_HIER_DEPTH_BUFFER },
-		{ 0x7808, 0x00ff, 5, 257, "3DSTATE_VERTEX_BUFFERS" },
-		{ 0x7809, 0x00ff, 3, 256, "3DSTATE_VERTEX_ELEMENTS" },
-		{ 0x780a, 0x00ff, 3, 3, "3DSTATE_INDEX_BUFFER" },
-		{ 0x780b, 0xffff, 1, 1, "3DSTATE_VF_STATISTICS" },
-		{ 0x780d, 0x00ff, 4, 4, "3DSTATE_VIEWPORT_STATE_POINTERS" },
-		{ 0x780e, 0xffff, 4, 4, NULL, 6, gen6_3DSTATE_CC_STATE_POINTERS },
-		{ 0x780e, 0x00ff, 2, 2, NULL, 7, gen7_3DSTATE_CC_STATE_POINTERS },
-		{ 0x780f, 0x00ff, 2, 2, "3DSTATE_SCISSOR_POINTERS" },
-		{ 0x7810, 0x00ff, 6, 6, "3DSTATE_VS" },
-		{ 0x7811, 0x00ff, 7, 7, "3DSTATE_GS" },
-		{ 0x7812, 0x00ff, 4, 4, "3DSTATE_CLIP" },
-		{ 0x7813, 0x00ff, 20, 20, "3DSTATE_SF", 6 },
-		{ 0x7813, 0x00ff, 7, 7, "3DSTATE_SF", 7 },
-		{ 0x7814, 0x00ff, 3, 3, "3DSTATE_WM", 7, gen7_3DSTATE_WM },
-		{ 0x7814, 0x00ff, 9, 9, "3DSTATE_WM", 6, gen6_3DSTATE_WM },
-		{ 0x7815, 0x00ff, 5, 5, "3DSTATE_CONSTANT_VS_STATE", 6 },
-		{ 0x7815, 0x00ff, 7, 7, "3DSTATE_CONSTANT_VS", 7, gen7_3DSTATE_CONSTANT_VS },
-		{ 0x7816, 0x00ff, 5, 5, "3DSTATE_CONSTANT_GS_STATE", 6 },
-		{ 0x7816, 0x00ff, 7, 7, "3DSTATE_CONSTANT_GS", 7, gen7_3DSTATE_CONSTANT_GS },
-		{ 0x7817, 0x00ff, 5, 5, "3DSTATE_CONSTANT_PS_STATE", 6 },
-		{ 0x7817, 0x00ff, 7, 7, "3DSTATE_CONSTANT_PS", 7, gen7_3DSTATE_CONSTANT_PS },
-		{ 0x7818, 0xffff, 2, 2, "3DSTATE_SAMPLE_MASK" },
-		{ 0x7819, 0x00ff, 7, 7, "3DSTATE_CONSTANT_HS", 7, gen7_3DSTATE_CONSTANT_HS },
-		{ 0x781a, 0x00ff, 7, 7, "3DSTATE_CONSTANT_DS", 7, gen7_3DSTATE_CONSTANT_DS },
-		{ 0x781b, 0x00ff, 7, 7, "3DSTATE_HS" },
-		{ 0x781c, 0x00ff, 4, 4, "3DSTATE_TE" },
-		{ 0x781d, 0x00ff, 6, 6, "3DSTATE_DS" },
-		{ 0x781e, 0x00ff, 3, 3, "3DSTATE_STREAMOUT" },
-		{ 0x781f, 0x00ff, 14, 14, "3DSTATE_SBE" },
-		{ 0x7820, 0x00ff, 8, 8, "3DSTATE_PS" },
-		{ 0x7821, 0x00ff, 2, 2, NULL, 7, gen7_3DSTATE_VIEWPORT_STATE_POINTERS_SF_CLIP },
-		{ 0x7823, 0x00ff, 2, 2, NULL, 7, gen7_3DSTATE_VIEWPORT_STATE_POINTERS_CC },
-		{ 0x7824, 0x00ff, 2, 2, NULL, 7, gen7_3DSTATE_BLEND_STATE_POINTERS },
-		{ 0x7825, 0x00ff, 2, 2, NULL, 7, gen7_3DSTATE_DEPTH_STENCIL_STATE_POINTERS },
-		{ 0x7826, 0x00ff, 2, 2, "3DSTATE_BINDING_TABLE_POINTERS_VS" },
-		{ 0x7827, 0x00ff, 2, 2, "3DSTATE_BINDING_TABLE_POINTERS_HS" },
-		{ 0x7828, 0x00ff, 2, 2, "3DSTATE_BINDING_TABLE_POINTERS_DS" },
-		{ 0x7829, 0x00ff, 2, 2, "3DSTATE_BINDING_TABLE_POINTERS_GS" },
-		{ 0x782a, 0x00ff, 2, 2, "3DSTATE_BINDING_TABLE_POINTERS_PS" },
-		{ 0x782b, 0x00ff, 2, 2, "3DSTATE_SAMPLER_STATE_POINTERS_VS" },
-		{ 0x782c, 0x00ff, 2, 2, "3DSTATE_SAMPLER_STATE_POINTERS_HS" },
-		{ 0x782d, 0x00ff, 2, 2, "3DSTATE_SAMPLER_STATE_POINTERS_DS" },
-		{ 0x782e, 0x00ff, 2, 2, "3DSTATE_SAMPLER_STATE_POINTERS_GS" },
-		{ 0x782f, 0x00ff, 2, 2, "3DSTATE_SAMPLER_STATE_POINTERS_PS" },
-		{ 0x7830, 0x00ff, 2, 2, NULL, 7, gen7_3DSTATE_URB_VS },
-		{ 0x7831, 0x00ff, 2, 2, NULL, 7, gen7_3DSTATE_URB_HS },
-		{ 0x7832, 0x00ff, 2, 2, NULL, 7, gen7_3DSTATE_URB_DS },
-		{ 0x7833, 0x00ff, 2, 2, NULL, 7, gen7_3DSTATE_URB_GS },
-		{ 0x7900, 0xffff, 4, 4, "3DSTATE_DRAWING_RECTANGLE" },
-		{ 0x7901, 0xffff, 5, 5, "3DSTATE_CONSTANT_COLOR" },
-		{ 0x7905, 0xffff, 5, 7, "3DSTATE_DEPTH_BUFFER" },
-		{ 0x7906, 0xffff, 2, 2, "3DSTATE_POLY_STIPPLE_OFFSET" },
-		{ 0x7907, 0xffff, 33, 33, "3DSTATE_POLY_STIPPLE_PATTERN" },
-		{ 0x7908, 0xffff, 3, 3, "3DSTATE_LINE_STIPPLE" },
-		{ 0x7909, 0xffff, 2, 2, "3DSTATE_GLOBAL_DEPTH_OFFSET_CLAMP" },
-		{ 0x7909, 0xffff, 2, 2, "3DSTATE_CLEAR_PARAMS" },
-		{ 0x790a, 0xffff, 3, 3, "3DSTATE_AA_LINE_PARAMETERS" },
-		{ 0x790b, 0xffff, 4, 4, "3DSTATE_GS_SVB_INDEX" },
-		{ 0x790d, 0xffff, 3, 3, "3DSTATE_MULTISAMPLE", 6 },
-		{ 0x790d, 0xffff, 4, 4, "3DSTATE_MULTISAMPLE", 7 },
-		{ 0x7910, 0x00ff, 2, 2, "3DSTATE_CLEAR_PARAMS" },
-		{ 0x7912, 0x00ff, 2, 2, "3DSTATE_PUSH_CONSTANT_ALLOC_VS" },
-		{ 0x7913, 0x00ff, 2, 2, "3DSTATE_PUSH_CONSTANT_ALLOC_HS" },
-		{ 0x7914, 0x00ff, 2, 2, "3DSTATE_PUSH_CONSTANT_ALLOC_DS" },
-		{ 0x7915, 0x00ff, 2, 2, "3DSTATE_PUSH_CONSTANT_ALLOC_GS" },
-		{ 0x7916, 0x00ff, 2, 2, "3DSTATE_PUSH_CONSTANT_ALLOC_PS" },
-		{ 0x7917, 0x00ff, 2, 2+128*2, "3DSTATE_SO_DECL_LIST" },
-		{ 0x7918, 0x00ff, 4, 4, "3DSTATE_SO_BUFFER" },
-		{ 0x7a00, 0x00ff, 4, 6, "PIPE_CONTROL" },
-		{ 0x7b00, 0x00ff, 7, 7, NULL, 7, gen7_3DPRIMITIVE },
-		{ 0x7b00, 0x00ff, 6, 6, NULL, 0, gen4_3DPRIMITIVE },
-	}, *opcode_3d = NULL;
+	const struct opcode_3d_965 *opcode_3d;
 
 	opcode = (data[0] & 0xffff0000) >> 16;
-
-	for (i = 0; i < ARRAY_SIZE(opcodes_3d); i++) {
-		if (opcode != opcodes_3d[i].opcode)
-			continue;
-
-		/* If it's marked as not our gen, skip. */
-		if (opcodes_3d[i].gen && opcodes_3d[i].gen != ctx->gen)
-			continue;
-
-		opcode_3d = &opcodes_3d[i];
-		break;
-	}
+	opcode_3d = ctx->table_3d_965[opcode & 0x1fff];
 
 	if (opcode_3d) {
 		if (opcode_3d->max_len == 1)
@@ -3259,9 +3637,9 @@ decode_3d_965(struct drm_intel_decode *ctx)
 
 		if (len < opcode_3d->min_len ||
 		    len > opcode_3d->max_len) {
-			fprintf(out, "Bad length %d in %s, expected %d-%d\n",
-				len, opcode_3d->name,
-				opcode_3d->min_len, opcode_3d->max_len);
+			decode_printf(ctx, "Bad length %d in %s, expected %d-%d\n",
+				      len, opcode_3d->name,
+				      opcode_3d->min_len, opcode_3d->max_len);
 		}
 	} else {
 		len = (data[0] & 0x0000ffff) + 2;
@@ -3280,9 +3658,9 @@ decode_3d_965(struct drm_intel_decode *ctx)
 	case 0x6002:
 		instr_out(ctx, 0, "CONSTANT_BUFFER: %s\n",
 			  (data[0] >> 8) & 1 ? "valid" : "invalid");
-		instr_out(ctx, 1,
-			  "offset: 0x%08x, length: %d bytes\n", data[1] & ~0x3f,
-			  ((data[1] & 0x3f) + 1) * 64);
+		instr_out_addr(ctx, 1,
+			       "offset: 0x%08x, length: %d bytes\n", data[1] & ~0x3f,
+			       ((data[1] & 0x3f) + 1) * 64);
 		return len;
 	case 0x6101:
 		i = 0;
@@ -3296,7 +3674,7 @@ decode_3d_965(struct drm_intel_decode *ctx)
 		else
 			sba_len = 6;
 		if (len != sba_len)
-			fprintf(out, "Bad count in STATE_BASE_ADDRESS\n");
+			decode_printf(ctx, "Bad count in STATE_BASE_ADDRESS\n");
 
 		state_base_out(ctx, i++, "general");
 		state_base_out(ctx, i++, "surface");
@@ -3325,8 +3703,8 @@ decode_3d_965(struct drm_intel_decode *ctx)
 		return len;
 	case 0x7801:
 		if (len != 6 && len != 4)
-			fprintf(out,
-				"Bad count in 3DSTATE_BINDING_TABLE_POINTERS\n");
+			decode_printf(ctx,
+				      "Bad count in 3DSTATE_BINDING_TABLE_POINTERS\n");
 		if (len == 6) {
 			instr_out(ctx, 0,
 				  "3DSTATE_BINDING_TABLE_POINTERS\n");
@@ -3374,7 +3752,7 @@ decode_3d_965(struct drm_intel_decode *ctx)
 
 	case 0x7808:
 		if ((len - 1) % 4 != 0)
-			fprintf(out, "Bad count in 3DSTATE_VERTEX_BUFFERS\n");
+			decode_printf(ctx, "Bad count in 3DSTATE_VERTEX_BUFFERS\n");
 		instr_out(ctx, 0, "3DSTATE_VERTEX_BUFFERS\n");
 
 		for (i = 1; i < len;) {
@@ -3391,7 +3769,7 @@ decode_3d_965(struct drm_intel_decode *ctx)
 				  data[i] & (1 << access) ? "random" :
 				  "sequential", data[i] & 0x07ff);
 			i++;
-			instr_out(ctx, i++, "buffer address\n");
+			instr_out_addr(ctx, i++, "buffer address\n");
 			instr_out(ctx, i++, "max index\n");
 			instr_out(ctx, i++, "mbz\n");
 		}
@@ -3399,7 +3777,7 @@ decode_3d_965(struct drm_intel_decode *ctx)
 
 	case 0x7809:
 		if ((len + 1) % 2 != 0)
-			fprintf(out, "Bad count in 3DSTATE_VERTEX_ELEMENTS\n");
+			decode_printf(ctx, "Bad count in 3DSTATE_VERTEX_ELEMENTS\n");
 		instr_out(ctx, 0, "3DSTATE_VERTEX_ELEMENTS\n");
 
 		for (i = 1; i < len;) {
@@ -3432,24 +3810,24 @@ decode_3d_965(struct drm_intel_decode *ctx)
 
 	case 0x780a:
 		instr_out(ctx, 0, "3DSTATE_INDEX_BUFFER\n");
-		instr_out(ctx, 1, "beginning buffer address\n");
-		instr_out(ctx, 2, "ending buffer address\n");
+		instr_out_addr(ctx, 1, "beginning buffer address\n");
+		instr_out_addr(ctx, 2, "ending buffer address\n");
 		return len;
 
 	case 0x780f:
 		instr_out(ctx, 0, "3DSTATE_SCISSOR_POINTERS\n");
-		instr_out(ctx, 1, "scissor rect offset\n");
+		instr_out_addr(ctx, 1, "scissor rect offset\n");
 		return len;
 
 	case 0x7810:
 		instr_out(ctx, 0, "3DSTATE_VS\n");
-		instr_out(ctx, 1, "kernel pointer\n");
+		instr_out_addr(ctx, 1, "kernel pointer\n");
 		instr_out(ctx, 2,
 			  "SPF=%d, VME=%d, Sampler Count %d, "
 			  "Binding table count %d\n", (data[2] >> 31) & 1,
 			  (data[2] >> 30) & 1, (data[2] >> 27) & 7,
 			  (data[2] >> 18) & 0xff);
-		instr_out(ctx, 3, "scratch offset\n");
+		instr_out_addr(ctx, 3, "scratch offset\n");
 		instr_out(ctx, 4,
 			  "Dispatch GRF start %d, VUE read length %d, "
 			  "VUE read offset %d\n", (data[4] >> 20) & 0x1f,
@@ -3463,13 +3841,13 @@ decode_3d_965(struct drm_intel_decode *ctx)
 
 	case 0x7811:
 		instr_out(ctx, 0, "3DSTATE_GS\n");
-		instr_out(ctx, 1, "kernel pointer\n");
+		instr_out_addr(ctx, 1, "kernel pointer\n");
 		instr_out(ctx, 2,
 			  "SPF=%d, VME=%d, Sampler Count %d, "
 			  "Binding table count %d\n", (data[2] >> 31) & 1,
 			  (data[2] >> 30) & 1, (data[2] >> 27) & 7,
 			  (data[2] >> 18) & 0xff);
-		instr_out(ctx, 3, "scratch offset\n");
+		instr_out_addr(ctx, 3, "scratch offset\n");
 		instr_out(ctx, 4,
 			  "Dispatch GRF start %d, VUE read length %d, "
 			  "VUE read offset %d\n", (data[4] & 0xf),
@@ -3607,7 +3985,7 @@ decode_3d_965(struct drm_intel_decode *ctx)
 				  get_965_depthformat((data[1] >> 18) & 0x7),
 				  (data[1] & 0x0001ffff) + 1,
 				  data[1] & (1 << 27) ? "" : "not ");
-		instr_out(ctx, 2, "depth offset\n");
+		instr_out_addr(ctx, 2, "depth offset\n");
 		instr_out(ctx, 3, "%dx%d\n",
 			  ((data[3] & 0x0007ffc0) >> 6) + 1,
 			  ((data[3] & 0xfff80000) >> 19) + 1);
@@ -3628,7 +4006,7 @@ decode_3d_965(struct drm_intel_decode *ctx)
 		if (IS_GEN6(devid) || IS_GEN7(devid)) {
 			unsigned int i;
 			if (len != 4 && len != 5)
-				fprintf(out, "Bad count in PIPE_CONTROL\n");
+				decode_printf(ctx, "Bad count in PIPE_CONTROL\n");
 
 			switch ((data[1] >> 14) & 0x3) {
 			case 0:
@@ -3680,8 +4058,8 @@ decode_3d_965(struct drm_intel_decode *ctx)
 				  data[1] & (1 << 0) ? "depth cache flush, " :
 				  "");
 			if (len == 5) {
-				instr_out(ctx, 2,
-					  "destination address\n");
+				instr_out_addr(ctx, 2,
+					       "destination address\n");
 				instr_out(ctx, 3,
 					  "immediate dword low\n");
 				instr_out(ctx, 4,
@@ -3694,7 +4072,7 @@ decode_3d_965(struct drm_intel_decode *ctx)
 			return len;
 		} else {
 			if (len != 4)
-				fprintf(out, "Bad count in PIPE_CONTROL\n");
+				decode_printf(ctx, "Bad count in PIPE_CONTROL\n");
 
 			switch ((data[0] >> 14) & 0x3) {
 			case 0:
@@ -3717,7 +4095,7 @@ decode_3d_965(struct drm_intel_decode *ctx)
 				  data[0] & (1 << 13) ? "" : "no ",
 				  data[0] & (1 << 12) ? "" : "no ",
 				  data[0] & (1 << 11) ? "" : "no ");
-			instr_out(ctx, 1, "destination address\n");
+			instr_out_addr(ctx, 1, "destination address\n");
 			instr_out(ctx, 2, "immediate dword low\n");
 			instr_out(ctx, 3, "immediate dword high\n");
 			return len;
@@ -3796,8 +4174,8 @@ decode_3d_i830(struct drm_intel_decode *ctx)
 				len = (data[0] & 0xff) + 2;
 				if (len < opcode_3d->min_len ||
 				    len > opcode_3d->max_len) {
-					fprintf(out, "Bad count in %s\n",
-						opcode_3d->name);
+					decode_printf(ctx, "Bad count in %s\n",
+						      opcode_3d->name);
 				}
 			}
 
@@ -3813,6 +4191,54 @@ decode_3d_i830(struct drm_intel_decode *ctx)
 	return 1;
 }
 
+/*
+ * Fills in the context's opcode tables.  Where the lists have several
+ * entries for an opcode, the first one that applies to this generation
+ * wins, as it did when the lists were searched for every packet.
+ */
+static int
+decode_build_tables(struct drm_intel_decode *ctx)
+{
+	unsigned int i, op;
+
+	for (i = 0; i < ARRAY_SIZE(opcodes_mi); i++) {
+		op = opcodes_mi[i].opcode;
+		if (!ctx->mi_table[op])
+			ctx->mi_table[op] = &opcodes_mi[i];
+	}
+
+	for (i = 0; i < ARRAY_SIZE(opcodes_2d); i++) {
+		op = opcodes_2d[i].opcode;
+		if (!ctx->blt_table[op])
+			ctx->blt_table[op] = &opcodes_2d[i];
+	}
+
+	if (ctx->gen == 2) {
+		ctx->decode_3d_func = decode_3d_i830;
+		return 0;
+	} else if (ctx->gen == 3) {
+		ctx->decode_3d_func = decode_3d;
+		return 0;
+	}
+
+	ctx->decode_3d_func = decode_3d_965;
+	ctx->table_3d_965 = calloc(0x2000, sizeof(*ctx->table_3d_965));
+	if (!ctx->table_3d_965)
+		return -1;
+
+	for (i = 0; i < ARRAY_SIZE(opcodes_3d_965); i++) {
+		/* If it's marked as not our gen, skip. */
+		if (opcodes_3d_965[i].gen && opcodes_3d_965[i].gen != ctx->gen)
+			continue;
+
+		op = opcodes_3d_965[i].opcode & 0x1fff;
+		if (!ctx->table_3d_965[op])
+			ctx->table_3d_965[op] = &opcodes_3d_965[i];
+	}
+
+	return 0;
+}
+
 struct drm_intel_decode *
 drm_intel_decode_context_alloc(uint32_t devid)
 {
@@ -3840,12 +4266,22 @@ drm_intel_decode_context_alloc(uint32_t devid)
 		ctx->gen = 2;
 	}
 
+	if (decode_build_tables(ctx)) {
+		free(ctx);
+		return NULL;
+	}
+
 	return ctx;
 }
 
 void
 drm_intel_decode_context_free(struct drm_intel_decode *ctx)
 {
+	drm_intel_decode_clear_state_summary(ctx);
+	free(ctx->state_table);
+	free(ctx->table_3d_965);
+	free(ctx->fields);
+	free(ctx->field_is_address);
 	free(ctx);
 }
 
@@ -3863,6 +4299,30 @@ drm_intel_decode_set_batch_pointer(struct drm_intel_decode *ctx,
 	ctx->base_data = data;
 	ctx->base_hw_offset = hw_offset;
 	ctx->base_count = count;
+	ctx->ring = false;
+}
+
+/**
+ * Sets a ring buffer to decode instead of a batch buffer.
+ *
+ * \param data CPU mapping of the whole ring
+ * \param hw_offset GPU address of the start of the ring
+ * \param count size of the ring in DWORDs
+ * \param head byte offset of the first packet to decode
+ * \param tail byte offset where decoding stops, which may be below
+ *        \p head if the contents wrap around the end of the ring
+ */
+void
+drm_intel_decode_set_ring_pointer(struct drm_intel_decode *ctx,
+				  void *data, uint32_t hw_offset, int count,
+				  uint32_t head, uint32_t tail)
+{
+	ctx->base_data = data;
+	ctx->base_hw_offset = hw_offset;
+	ctx->base_count = count;
+	ctx->ring = true;
+	ctx->ring_head = head;
+	ctx->ring_tail = tail;
 }
 
 void
@@ -3878,6 +4338,279 @@ drm_intel_decode_set_output_file(struct drm_intel_decode *ctx,
 				 FILE *out)
 {
 	ctx->out = out;
+	ctx->write_func = NULL;
+	ctx->write_closure = NULL;
+}
+
+/**
+ * Sends the decode output to \p func instead of a stdio file.
+ *
+ * Output is passed along in large blocks, as set by
+ * drm_intel_decode_set_flush_policy().
+ */
+void
+drm_intel_decode_set_output_func(struct drm_intel_decode *ctx,
+				 drm_intel_decode_write_func func,
+				 void *closure)
+{
+	ctx->write_func = func;
+	ctx->write_closure = closure;
+}
+
+/**
+ * Sets how often decoded text is handed to the output.
+ *
+ * The default, DRM_INTEL_DECODE_FLUSH_BATCH, buffers output and only
+ * writes it out when the buffer fills or decoding finishes.
+ * DRM_INTEL_DECODE_FLUSH_PACKET writes and flushes after every packet,
+ * which is slow but leaves nothing behind if the caller dies mid-decode.
+ */
+void
+drm_intel_decode_set_flush_policy(struct drm_intel_decode *ctx,
+				  enum drm_intel_decode_flush_policy policy)
+{
+	ctx->flush_policy = policy;
+}
+
+/**
+ * Selects between the usual text dump and a stream of one record per
+ * packet.
+ *
+ * DRM_INTEL_DECODE_FORMAT_BINARY writes a struct drm_intel_decode_record
+ * for each packet, followed by its fields and then its addresses.
+ * DRM_INTEL_DECODE_FORMAT_JSON writes the same information as one JSON
+ * object per line.  Neither goes through printf, and the decoder's
+ * warnings about malformed packets are left out of both.
+ */
+void
+drm_intel_decode_set_output_format(struct drm_intel_decode *ctx,
+				   enum drm_intel_decode_format format)
+{
+	ctx->format = format;
+}
+
+/**
+ * Turns on counting of redundant state packets.
+ *
+ * Every gen4+ 3DSTATE and media state packet (and the other non-pipelined
+ * state such as STATE_BASE_ADDRESS) is compared against the last packet with the same
+ * opcode, and counted as redundant if it is identical.  With
+ * DRM_INTEL_DECODE_STATE_PER_BATCH the comparison starts afresh for every
+ * drm_intel_decode() call; with DRM_INTEL_DECODE_STATE_ACROSS_BATCHES the
+ * last values carry over, as they do on the GPU within a context.
+ *
+ * The counts accumulate until drm_intel_decode_clear_state_summary(), and
+ * are reported by drm_intel_decode_print_state_summary().
+ */
+void
+drm_intel_decode_set_state_tracking(struct drm_intel_decode *ctx,
+				    enum drm_intel_decode_state_tracking mode)
+{
+	ctx->state_tracking = mode;
+}
+
+/** Forgets all redundant state counts and last packet values. */
+void
+drm_intel_decode_clear_state_summary(struct drm_intel_decode *ctx)
+{
+	unsigned int i;
+
+	if (!ctx->state_table)
+		return;
+
+	for (i = 0; i < DECODE_STATE_OPCODES; i++) {
+		if (ctx->state_table[i]) {
+			free(ctx->state_table[i]->last);
+			free(ctx->state_table[i]);
+			ctx->state_table[i] = NULL;
+		}
+	}
+}
+
+static int
+compare_state_entries(const void *a, const void *b)
+{
+	const struct decode_state_entry *ea = *(const struct decode_state_entry **)a;
+	const struct decode_state_entry *eb = *(const struct decode_state_entry **)b;
+
+	if (ea->redundant_dwords != eb->redundant_dwords)
+		return ea->redundant_dwords < eb->redundant_dwords ? 1 : -1;
+	if (ea->packets != eb->packets)
+		return ea->packets < eb->packets ? 1 : -1;
+	return ea->opcode < eb->opcode ? -1 : ea->opcode > eb->opcode;
+}
+
+/**
+ * Prints the state packets seen since tracking was enabled, ranked by the
+ * number of dwords spent on re-emitting unchanged state.
+ */
+void
+drm_intel_decode_print_state_summary(struct drm_intel_decode *ctx, FILE *out)
+{
+	struct decode_state_entry **entries;
+	uint64_t packets = 0, redundant_packets = 0;
+	uint64_t dwords = 0, redundant_dwords = 0;
+	unsigned int i, n = 0;
+
+	entries = malloc(DECODE_STATE_OPCODES * sizeof(*entries));
+	if (!entries)
+		return;
+
+	if (ctx->state_table) {
+		for (i = 0; i < DECODE_STATE_OPCODES; i++) {
+			if (ctx->state_table[i])
+				entries[n++] = ctx->state_table[i];
+		}
+	}
+	qsort(entries, n, sizeof(entries[0]), compare_state_entries);
+
+	fprintf(out, "%-40s %10s %10s %10s %10s\n", "state packet",
+		"packets", "redundant", "dwords", "redundant");
+	for (i = 0; i < n; i++) {
+		const struct decode_state_entry *entry = entries[i];
+		const struct opcode_3d_965 *op = NULL;
+		char name[32];
+
+		if (ctx->table_3d_965)
+			op = ctx->table_3d_965[entry->opcode & 0x1fff];
+		if (op == NULL || op->name == NULL) {
+			snprintf(name, sizeof(name), "opcode 0x%04x",
+				 entry->opcode);
+		}
+
+		fprintf(out, "%-40s %10llu %10llu %10llu %10llu\n",
+			op && op->name ? op->name : name,
+			(unsigned long long)entry->packets,
+			(unsigned long long)entry->redundant_packets,
+			(unsigned long long)entry->dwords,
+			(unsigned long long)entry->redundant_dwords);
+
+		packets += entry->packets;
+		redundant_packets += entry->redundant_packets;
+		dwords += entry->dwords;
+		redundant_dwords += entry->redundant_dwords;
+	}
+	fprintf(out, "%-40s %10llu %10llu %10llu %10llu\n", "total",
+		(unsigned long long)packets,
+		(unsigned long long)redundant_packets,
+		(unsigned long long)dwords,
+		(unsigned long long)redundant_dwords);
+
+	free(entries);
+}
+
+/*
+ * Returns whether bits 28:16 of a gen4+ render packet header name a state
+ * packet: the common non-pipelined state (0x60xx, 0x61xx and
+ * PIPELINE_SELECT), the media state (0x70xx) and 3DSTATE (0x78xx, 0x79xx).
+ * Media objects and walkers, MEDIA_STATE_FLUSH, PIPE_CONTROL and
+ * 3DPRIMITIVE only act on the state, so repeating them isn't redundant.
+ */
+static bool
+decode_is_state(uint32_t opcode)
+{
+	switch (opcode >> 8) {
+	case 0x00:
+	case 0x01:
+	case 0x18:
+	case 0x19:
+		return true;
+	case 0x09:
+		return opcode == 0x0904;
+	case 0x10:
+		return opcode != 0x1004;
+	default:
+		return false;
+	}
+}
+
+/*
+ * Compares a gen4+ state packet against the last one with the same opcode
+ * and counts it as redundant if nothing changed.
+ */
+static void
+decode_track_state(struct drm_intel_decode *ctx, uint32_t len)
+{
+	struct decode_state_entry *entry;
+	uint32_t header = ctx->data[0];
+	uint32_t opcode = (header >> 16) & 0x1fff;
+
+	if (ctx->gen < 4 || header >> 29 != 0x3 || !decode_is_state(opcode))
+		return;
+
+	if (!ctx->state_table) {
+		ctx->state_table = calloc(DECODE_STATE_OPCODES,
+					  sizeof(*ctx->state_table));
+		if (!ctx->state_table)
+			return;
+	}
+
+	entry = ctx->state_table[opcode];
+	if (!entry) {
+		entry = calloc(1, sizeof(*entry));
+		if (!entry)
+			return;
+		entry->opcode = header >> 16;
+		ctx->state_table[opcode] = entry;
+	}
+
+	entry->packets++;
+	entry->dwords += len;
+
+	if (entry->last_len == len &&
+	    memcmp(entry->last, ctx->data, len * 4) == 0) {
+		entry->redundant_packets++;
+		entry->redundant_dwords += len;
+		return;
+	}
+
+	if (entry->last_size < len) {
+		uint32_t *last = realloc(entry->last, len * 4);
+
+		if (!last) {
+			entry->last_len = 0;
+			return;
+		}
+		entry->last = last;
+		entry->last_size = len;
+	}
+	memcpy(entry->last, ctx->data, len * 4);
+	entry->last_len = len;
+}
+
+/**
+ * Points the decoder at the packet starting \p pos dwords into the segment
+ * \p seg of \p seg_count dwords, followed by \p next_count dwords at
+ * \p next.
+ *
+ * While there is plenty of the segment left the data is used in place.
+ * Otherwise the tail of the segment is copied into the window, followed by
+ * the start of the next segment if there is one and a scratch area full of
+ * obviously undefined data.
+ */
+static void
+decode_set_window(struct drm_intel_decode *ctx,
+		  uint32_t *seg, uint32_t seg_count, uint32_t pos,
+		  uint32_t *next, uint32_t next_count)
+{
+	uint32_t avail = seg_count - pos;
+
+	if (avail > DECODE_WINDOW_DWORDS) {
+		ctx->data = seg + pos;
+		ctx->count = avail;
+		return;
+	}
+
+	if (next_count > DECODE_WINDOW_DWORDS)
+		next_count = DECODE_WINDOW_DWORDS;
+
+	memcpy(ctx->window, seg + pos, avail * 4);
+	memcpy(ctx->window + avail, next, next_count * 4);
+	memset(ctx->window + avail + next_count, 0xd0,
+	       sizeof(ctx->window) - (avail + next_count) * 4);
+
+	ctx->data = ctx->window;
+	ctx->count = avail + next_count;
 }
 
 /**
@@ -3892,32 +4625,57 @@ drm_intel_decode(struct drm_intel_decode *ctx)
 {
 	int ret;
 	unsigned int index = 0;
-	uint32_t devid;
-	int size = ctx->base_count * 4;
-	void *temp;
+	/* The input is decoded as up to two segments: the batch, or the
+	 * ring from head to its end and then from its start to tail.
+	 */
+	uint32_t *seg[2];
+	uint32_t seg_count[2], seg_hw_offset[2];
+	int num_segs, cur = 0;
+	uint32_t pos = 0;
+	bool in_window;
 
-	if (!ctx)
+	if (!ctx || (ctx->ring && ctx->base_count == 0))
 		return;
 
-	/* Put a scratch page full of obviously undefined data after
-	 * the batchbuffer.  This lets us avoid a bunch of length
-	 * checking in statically sized packets.
-	 */
-	temp = malloc(size + 4096);
-	memcpy(temp, ctx->base_data, size);
-	memset((char *)temp + size, 0xd0, 4096);
-	ctx->data = temp;
+	seg[0] = ctx->base_data;
+	seg_count[0] = ctx->base_count;
+	seg_hw_offset[0] = ctx->base_hw_offset;
+	num_segs = 1;
+	if (ctx->ring) {
+		uint32_t head = ctx->ring_head / 4 % ctx->base_count;
+		uint32_t tail = ctx->ring_tail / 4 % ctx->base_count;
+
+		seg[0] = ctx->base_data + head;
+		seg_hw_offset[0] = ctx->base_hw_offset + head * 4;
+		if (tail >= head) {
+			seg_count[0] = tail - head;
+		} else {
+			seg_count[0] = ctx->base_count - head;
+			seg[1] = ctx->base_data;
+			seg_count[1] = tail;
+			seg_hw_offset[1] = ctx->base_hw_offset;
+			num_segs = 2;
+		}
+	}
 
-	ctx->hw_offset = ctx->base_hw_offset;
-	ctx->count = ctx->base_count;
+	ctx->saved_s2_set = false;
+	ctx->saved_s4_set = true;
 
-	devid = ctx->devid;
-	head_offset = ctx->head;
-	tail_offset = ctx->tail;
-	out = ctx->out;
+	if (ctx->state_tracking == DRM_INTEL_DECODE_STATE_PER_BATCH &&
+	    ctx->state_table) {
+		unsigned int i;
 
-	saved_s2_set = 0;
-	saved_s4_set = 1;
+		for (i = 0; i < DECODE_STATE_OPCODES; i++) {
+			if (ctx->state_table[i])
+				ctx->state_table[i]->last_len = 0;
+		}
+	}
+
+	decode_set_window(ctx, seg[0], seg_count[0], 0,
+			  num_segs > 1 ? seg[1] : NULL,
+			  num_segs > 1 ? seg_count[1] : 0);
+	in_window = ctx->data == ctx->window;
+	ctx->hw_offset = seg_hw_offset[0];
 
 	while (ctx->count > 0) {
 		index = 0;
@@ -3948,22 +4706,21 @@ drm_intel_decode(struct drm_intel_decode *ctx)
 			index += decode_2d(ctx);
 			break;
 		case 0x3:
-			if (IS_9XX(devid) && !IS_GEN3(devid)) {
-				index +=
-				    decode_3d_965(ctx);
-			} else if (IS_GEN3(devid)) {
-				index += decode_3d(ctx);
-			} else {
-				index +=
-				    decode_3d_i830(ctx);
-			}
+			index += ctx->decode_3d_func(ctx);
 			break;
 		default:
 			instr_out(ctx, index, "UNKNOWN\n");
 			index++;
 			break;
 		}
-		fflush(out);
+		if (ctx->format != DRM_INTEL_DECODE_FORMAT_TEXT)
+			decode_emit_record(ctx, index);
+
+		if (ctx->state_tracking && index <= ctx->count)
+			decode_track_state(ctx, index);
+
+		if (ctx->flush_policy == DRM_INTEL_DECODE_FLUSH_PACKET)
+			decode_flush(ctx);
 
 		if (ctx->count < index)
 			break;
@@ -3971,7 +4728,32 @@ drm_intel_decode(struct drm_intel_decode *ctx)
 		ctx->count -= index;
 		ctx->data += index;
 		ctx->hw_offset += 4 * index;
+		pos += index;
+
+		if (pos >= seg_count[cur]) {
+			/* Moved on into the next segment, possibly having
+			 * decoded a packet that straddled the two.
+			 */
+			if (cur + 1 >= num_segs)
+				break;
+			pos -= seg_count[cur];
+			cur++;
+			decode_set_window(ctx, seg[cur], seg_count[cur], pos,
+					  NULL, 0);
+			in_window = ctx->data == ctx->window;
+			ctx->hw_offset = seg_hw_offset[cur] + pos * 4;
+		} else if (!in_window &&
+			   seg_count[cur] - pos <= DECODE_WINDOW_DWORDS) {
+			/* Close enough to the end that statically sized
+			 * packets could run off it.
+			 */
+			decode_set_window(ctx, seg[cur], seg_count[cur], pos,
+					  cur + 1 < num_segs ? seg[cur + 1] : NULL,
+					  cur + 1 < num_segs ?
+					  seg_count[cur + 1] : 0);
+			in_window = true;
+		}
 	}
 
-	free(temp);
+	decode_flush(ctx);
 }
@@ -0,0 +1,432 @@
+/*
+ * Copyright © 2013 Intel Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+/**
+ * @file intel_reg_sampler.c
+ *
+ * Periodic register sampling on a helper thread.
+ *
+ * The kernel only offers one register per DRM_IOCTL_I915_REG_READ, so the
+ * reads themselves can't be batched; instead the sampling is moved off the
+ * caller's thread onto one that sleeps to absolute deadlines, and the
+ * results are handed over through a single-producer, single-consumer ring
+ * that the consumer can drain without any system calls.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#ifdef HAVE_SYS_EVENTFD_H
+#include <sys/eventfd.h>
+#endif
+
+#include "intel_bufmgr.h"
+
+struct _drm_intel_reg_sampler {
+	drm_intel_bufmgr *bufmgr;
+	uint32_t *regs;
+	uint64_t period_ns;
+
+	struct drm_intel_reg_sample_ring *ring;
+	size_t ring_size;
+	uint32_t slot_mask;
+	/** Samples waiting before the consumer is woken */
+	uint32_t wakeup_level;
+
+	/** Readable when samples are waiting: an eventfd, or a pipe */
+	int wakeup_fd[2];
+
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	bool stop;
+
+	/** Counters owned by the thread, copied out under the lock */
+	drm_intel_reg_sampler_stats stats;
+};
+
+static uint64_t
+timespec_to_ns(const struct timespec *ts)
+{
+	return (uint64_t)ts->tv_sec * 1000000000ull + ts->tv_nsec;
+}
+
+static void
+ns_to_timespec(uint64_t ns, struct timespec *ts)
+{
+	ts->tv_sec = ns / 1000000000ull;
+	ts->tv_nsec = ns % 1000000000ull;
+}
+
+static uint64_t
+sampler_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return timespec_to_ns(&ts);
+}
+
+static uint64_t *
+sampler_slot(drm_intel_reg_sampler *sampler, uint32_t index)
+{
+	return (uint64_t *)((char *)(sampler->ring + 1) +
+			    (size_t)(index & sampler->slot_mask) *
+			    sampler->ring->sample_size);
+}
+
+static void
+sampler_wakeup(drm_intel_reg_sampler *sampler)
+{
+	uint64_t one = 1;
+	ssize_t ret;
+
+	ret = write(sampler->wakeup_fd[1], &one,
+		    sampler->wakeup_fd[0] == sampler->wakeup_fd[1] ?
+		    sizeof(one) : 1);
+	(void)ret;
+}
+
+/* Takes one sample into the next free slot of the ring. */
+static void
+sampler_sample(drm_intel_reg_sampler *sampler,
+	       drm_intel_reg_sampler_stats *stats)
+{
+	struct drm_intel_reg_sample_ring *ring = sampler->ring;
+	uint32_t head = ring->head;
+	uint32_t pending = head - ring->tail;
+	uint64_t *slot, start;
+	uint32_t i;
+
+	if (pending >= ring->num_slots) {
+		stats->dropped++;
+		return;
+	}
+
+	slot = sampler_slot(sampler, head);
+	start = sampler_now();
+	slot[0] = start;
+	for (i = 0; i < ring->num_regs; i++) {
+		if (drm_intel_reg_read(sampler->bufmgr, sampler->regs[i],
+				       &slot[1 + i])) {
+			slot[1 + i] = 0;
+			stats->read_errors++;
+		}
+	}
+	stats->reads += ring->num_regs;
+	stats->busy_ns += sampler_now() - start;
+	stats->samples++;
+
+	/* Make the sample visible before the consumer can see the slot. */
+	__sync_synchronize();
+	ring->head = head + 1;
+
+	/* Signal for as long as the backlog is over the level, not just
+	 * when it reaches it: a read may have drained the wakeup fd and
+	 * left samples behind.  Look at the tail only after publishing the
+	 * head, so that either we see the consumer's latest tail or it sees
+	 * our head when it checks after reading.
+	 */
+	__sync_synchronize();
+	if (head + 1 - ring->tail >= sampler->wakeup_level)
+		sampler_wakeup(sampler);
+}
+
+static void *
+sampler_thread(void *arg)
+{
+	drm_intel_reg_sampler *sampler = arg;
+	drm_intel_reg_sampler_stats stats;
+	uint64_t next = sampler_now();
+	struct timespec deadline;
+
+	memset(&stats, 0, sizeof(stats));
+
+	pthread_mutex_lock(&sampler->lock);
+	for (;;) {
+		uint64_t now;
+
+		ns_to_timespec(next, &deadline);
+		while (!sampler->stop &&
+		       pthread_cond_timedwait(&sampler->cond, &sampler->lock,
+					      &deadline) != ETIMEDOUT)
+			;
+		if (sampler->stop)
+			break;
+		pthread_mutex_unlock(&sampler->lock);
+
+		sampler_sample(sampler, &stats);
+
+		/* Keep to the original schedule, but don't try to catch up
+		 * on periods we slept through.
+		 */
+		next += sampler->period_ns;
+		now = sampler_now();
+		if (now >= next) {
+			uint64_t missed = (now - next) / sampler->period_ns + 1;
+
+			stats.missed_periods += missed;
+			next += missed * sampler->period_ns;
+		}
+
+		pthread_mutex_lock(&sampler->lock);
+		sampler->stats = stats;
+	}
+	pthread_mutex_unlock(&sampler->lock);
+
+	return NULL;
+}
+
+static int
+sampler_open_wakeup(drm_intel_reg_sampler *sampler)
+{
+#ifdef HAVE_SYS_EVENTFD_H
+	int fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+
+	if (fd >= 0) {
+		sampler->wakeup_fd[0] = sampler->wakeup_fd[1] = fd;
+		return 0;
+	}
+#endif
+	if (pipe(sampler->wakeup_fd))
+		return -errno;
+
+	fcntl(sampler->wakeup_fd[0], F_SETFL, O_NONBLOCK);
+	fcntl(sampler->wakeup_fd[1], F_SETFL, O_NONBLOCK);
+	fcntl(sampler->wakeup_fd[0], F_SETFD, FD_CLOEXEC);
+	fcntl(sampler->wakeup_fd[1], F_SETFD, FD_CLOEXEC);
+	return 0;
+}
+
+static void
+sampler_close_wakeup(drm_intel_reg_sampler *sampler)
+{
+	close(sampler->wakeup_fd[0]);
+	if (sampler->wakeup_fd[1] != sampler->wakeup_fd[0])
+		close(sampler->wakeup_fd[1]);
+}
+
+/**
+ * Starts sampling \p num_regs registers every \p period_ns nanoseconds.
+ *
+ * Samples go into a ring of \p num_slots entries, rounded up to a power of
+ * two.  If \p ring_fd is a file descriptor rather than -1, the ring is
+ * placed in that file so that other processes can map it as well;
+ * otherwise it is anonymous memory, available through
+ * drm_intel_reg_sampler_get_ring().
+ *
+ * When the consumer falls behind and the ring fills up, new samples are
+ * dropped and counted rather than overwriting unread ones.
+ *
+ * Only works with the GEM buffer manager on kernels supporting
+ * DRM_IOCTL_I915_REG_READ for the given registers.
+ */
+drm_intel_reg_sampler *
+drm_intel_reg_sampler_create(drm_intel_bufmgr *bufmgr,
+			     const uint32_t *regs, int num_regs,
+			     uint64_t period_ns, int num_slots, int ring_fd)
+{
+	drm_intel_reg_sampler *sampler;
+	pthread_condattr_t attr;
+	uint32_t slots = 1, sample_size;
+	void *ring;
+
+	if (num_regs <= 0 || period_ns == 0 || num_slots <= 0)
+		return NULL;
+
+	while (slots < (uint32_t)num_slots)
+		slots <<= 1;
+	sample_size = sizeof(uint64_t) * (1 + num_regs);
+
+	sampler = calloc(1, sizeof(*sampler));
+	if (!sampler)
+		return NULL;
+
+	sampler->bufmgr = bufmgr;
+	sampler->period_ns = period_ns;
+	sampler->slot_mask = slots - 1;
+	sampler->wakeup_level = slots / 4 ? slots / 4 : 1;
+	sampler->regs = malloc(num_regs * sizeof(*regs));
+	if (!sampler->regs)
+		goto err_free;
+	memcpy(sampler->regs, regs, num_regs * sizeof(*regs));
+
+	sampler->ring_size = sizeof(struct drm_intel_reg_sample_ring) +
+		(size_t)slots * sample_size;
+	if (ring_fd >= 0) {
+		if (ftruncate(ring_fd, sampler->ring_size))
+			goto err_regs;
+		ring = mmap(NULL, sampler->ring_size, PROT_READ | PROT_WRITE,
+			    MAP_SHARED, ring_fd, 0);
+	} else {
+		ring = mmap(NULL, sampler->ring_size, PROT_READ | PROT_WRITE,
+			    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	}
+	if (ring == MAP_FAILED)
+		goto err_regs;
+
+	sampler->ring = ring;
+	memset(sampler->ring, 0, sizeof(*sampler->ring));
+	sampler->ring->num_regs = num_regs;
+	sampler->ring->num_slots = slots;
+	sampler->ring->sample_size = sample_size;
+
+	if (sampler_open_wakeup(sampler))
+		goto err_ring;
+
+	pthread_mutex_init(&sampler->lock, NULL);
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&sampler->cond, &attr);
+	pthread_condattr_destroy(&attr);
+
+	if (pthread_create(&sampler->thread, NULL, sampler_thread, sampler)) {
+		pthread_cond_destroy(&sampler->cond);
+		pthread_mutex_destroy(&sampler->lock);
+		sampler_close_wakeup(sampler);
+		goto err_ring;
+	}
+
+	return sampler;
+
+err_ring:
+	munmap(sampler->ring, sampler->ring_size);
+err_regs:
+	free(sampler->regs);
+err_free:
+	free(sampler);
+	return NULL;
+}
+
+void
+drm_intel_reg_sampler_destroy(drm_intel_reg_sampler *sampler)
+{
+	pthread_mutex_lock(&sampler->lock);
+	sampler->stop = true;
+	pthread_cond_signal(&sampler->cond);
+	pthread_mutex_unlock(&sampler->lock);
+
+	pthread_join(sampler->thread, NULL);
+	pthread_cond_destroy(&sampler->cond);
+	pthread_mutex_destroy(&sampler->lock);
+
+	sampler_close_wakeup(sampler);
+	munmap(sampler->ring, sampler->ring_size);
+	free(sampler->regs);
+	free(sampler);
+}
+
+/**
+ * Returns the sample ring, for consumers that want to read samples in
+ * place.  See struct drm_intel_reg_sample_ring for the protocol.
+ */
+struct drm_intel_reg_sample_ring *
+drm_intel_reg_sampler_get_ring(drm_intel_reg_sampler *sampler)
+{
+	return sampler->ring;
+}
+
+/**
+ * Returns a descriptor that polls readable once a quarter of the ring is
+ * waiting to be read.  drm_intel_reg_sampler_read() clears it unless that
+ * many samples are still left unread afterwards.
+ */
+int
+drm_intel_reg_sampler_get_fd(drm_intel_reg_sampler *sampler)
+{
+	return sampler->wakeup_fd[0];
+}
+
+/**
+ * Copies out up to \p max_samples of the oldest unread samples.
+ *
+ * Each sample takes 1 + num_regs uint64_t in \p samples: the
+ * CLOCK_MONOTONIC time it was taken at in nanoseconds, then the register
+ * values in the order they were given.  Returns the number of samples
+ * copied.
+ *
+ * Only one thread may consume from a sampler at a time.
+ */
+int
+drm_intel_reg_sampler_read(drm_intel_reg_sampler *sampler,
+			   uint64_t *samples, int max_samples)
+{
+	struct drm_intel_reg_sample_ring *ring = sampler->ring;
+	uint32_t tail = ring->tail, head;
+	char buf[64];
+	int n = 0;
+
+	while (read(sampler->wakeup_fd[0], buf, sizeof(buf)) > 0)
+		;
+
+	head = ring->head;
+	/* Read the slots only after seeing the producer's head. */
+	__sync_synchronize();
+
+	while (tail != head && n < max_samples) {
+		memcpy(samples, sampler_slot(sampler, tail),
+		       ring->sample_size);
+		samples += ring->sample_size / sizeof(*samples);
+		tail++;
+		n++;
+	}
+
+	/* Finish reading the slots before handing them back. */
+	__sync_synchronize();
+	ring->tail = tail;
+
+	/* A short read leaves samples the fd no longer reports. */
+	__sync_synchronize();
+	if (ring->head - tail >= sampler->wakeup_level)
+		sampler_wakeup(sampler);
+
+	return n;
+}
+
+/** Reports how much the sampler itself has been costing. */
+void
+drm_intel_reg_sampler_get_stats(drm_intel_reg_sampler *sampler,
+				drm_intel_reg_sampler_stats *stats)
+{
+	clockid_t clock;
+	struct timespec ts;
+
+	pthread_mutex_lock(&sampler->lock);
+	*stats = sampler->stats;
+	pthread_mutex_unlock(&sampler->lock);
+
+	stats->cpu_time_ns = 0;
+	if (pthread_getcpuclockid(sampler->thread, &clock) == 0 &&
+	    clock_gettime(clock, &ts) == 0)
+		stats->cpu_time_ns = timespec_to_ns(&ts);
+}
@@ -0,0 +1,266 @@
+/*
+ * Copyright © 2013 Intel Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+/**
+ * @file intel_tiling.c
+ *
+ * Copies rectangles between linear memory and the CPU view of X or Y tiled
+ * surfaces, as laid out by gen4 and later.
+ *
+ * A 4KiB X tile is 8 rows of 512 bytes.  A 4KiB Y tile is 32 rows of 128
+ * bytes, stored as 8 columns of 16-byte wide, 32 row high OWords.  Bit 6
+ * swizzling then flips bit 6 of an address by some of its bits 9, 10 and
+ * 11.
+ *
+ * Rather than computing the address of every pixel, the copies walk each
+ * row in the largest spans that stay contiguous once tiled and swizzled,
+ * and move each span with a fixed-size memcpy where possible, which the
+ * compiler turns into vector moves:
+ *
+ * - untiled rows are contiguous;
+ * - X tile rows are 512 contiguous bytes, and since bits 9-11 come from the
+ *   row within the tile, swizzling moves whole 64-byte chunks;
+ * - Y tiles are only contiguous within an OWord.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "intel_bufmgr.h"
+#include "i915_drm.h"
+
+#define TILE_SIZE	4096
+
+/* Returns the bit 6 flip for @offset under @swizzle. */
+static inline size_t
+swizzle_bit6(size_t offset, uint32_t swizzle)
+{
+	switch (swizzle) {
+	case I915_BIT_6_SWIZZLE_9:
+		return (offset >> 3) & 64;
+	case I915_BIT_6_SWIZZLE_9_10:
+		return ((offset >> 3) ^ (offset >> 4)) & 64;
+	case I915_BIT_6_SWIZZLE_9_11:
+		return ((offset >> 3) ^ (offset >> 5)) & 64;
+	case I915_BIT_6_SWIZZLE_9_10_11:
+		return ((offset >> 3) ^ (offset >> 4) ^ (offset >> 5)) & 64;
+	default:
+		return 0;
+	}
+}
+
+/*
+ * Offset of byte @x of row @y, before swizzling, with @tile_row the size
+ * of a row of tiles.
+ */
+static inline size_t
+tiled_offset(uint32_t tiling, size_t tile_row, uint32_t x, uint32_t y)
+{
+	switch (tiling) {
+	case I915_TILING_X:
+		return (y >> 3) * tile_row + (size_t)(x >> 9) * TILE_SIZE +
+			(y & 7) * 512 + (x & 511);
+	case I915_TILING_Y:
+		return (y >> 5) * tile_row + (size_t)(x >> 7) * TILE_SIZE +
+			((x >> 4) & 7) * 512 + (y & 31) * 16 + (x & 15);
+	default:
+		return y * tile_row + x;
+	}
+}
+
+static int
+tiled_check(uint32_t tiling, uint32_t swizzle, uint32_t pitch)
+{
+	switch (swizzle) {
+	case I915_BIT_6_SWIZZLE_NONE:
+	case I915_BIT_6_SWIZZLE_9:
+	case I915_BIT_6_SWIZZLE_9_10:
+	case I915_BIT_6_SWIZZLE_9_11:
+	case I915_BIT_6_SWIZZLE_9_10_11:
+		break;
+	default:
+		/* Depends on physical addresses, or on nothing we know. */
+		return -ENODEV;
+	}
+
+	switch (tiling) {
+	case I915_TILING_NONE:
+		return 0;
+	case I915_TILING_X:
+		return pitch % 512 ? -EINVAL : 0;
+	case I915_TILING_Y:
+		return pitch % 128 ? -EINVAL : 0;
+	default:
+		return -EINVAL;
+	}
+}
+
+static inline void
+span_copy(char *tiled, char *linear, uint32_t n, bool to_tiled)
+{
+	if (to_tiled)
+		memcpy(tiled, linear, n);
+	else
+		memcpy(linear, tiled, n);
+}
+
+/* Copies one row, in spans of up to @chunk bytes that don't cross a
+ * @chunk boundary.
+ */
+static inline void
+tiled_copy_row(char *tiled, uint32_t tiling, uint32_t swizzle,
+	       size_t tile_row, uint32_t x, uint32_t y, uint32_t width,
+	       char *linear, uint32_t chunk, bool to_tiled)
+{
+	uint32_t end = x + width;
+
+	while (x < end) {
+		uint32_t n = chunk - x % chunk;
+		size_t offset = tiled_offset(tiling, tile_row, x, y);
+
+		offset ^= swizzle_bit6(offset, swizzle);
+		if (n > end - x)
+			n = end - x;
+
+		/* Whole chunks get a fixed size the compiler can inline. */
+		switch (n) {
+		case 16:
+			span_copy(tiled + offset, linear, 16, to_tiled);
+			break;
+		case 64:
+			span_copy(tiled + offset, linear, 64, to_tiled);
+			break;
+		default:
+			span_copy(tiled + offset, linear, n, to_tiled);
+			break;
+		}
+
+		x += n;
+		linear += n;
+	}
+}
+
+static inline void
+tiled_copy_rows(char *tiled, uint32_t tiling, uint32_t swizzle,
+		size_t tile_row, uint32_t x, uint32_t y,
+		uint32_t width, uint32_t height,
+		char *linear, uint32_t linear_pitch, uint32_t chunk,
+		bool to_tiled)
+{
+	uint32_t i;
+
+	for (i = 0; i < height; i++) {
+		tiled_copy_row(tiled, tiling, swizzle, tile_row, x, y + i,
+			       width, linear + (size_t)i * linear_pitch,
+			       chunk, to_tiled);
+	}
+}
+
+static int
+tiled_copy(char *tiled, uint32_t tiling, uint32_t swizzle, uint32_t pitch,
+	   uint32_t x, uint32_t y, uint32_t width, uint32_t height,
+	   char *linear, uint32_t linear_pitch, bool to_tiled)
+{
+	int ret;
+
+	ret = tiled_check(tiling, swizzle, pitch);
+	if (ret)
+		return ret;
+
+	/* Each case gets its own copy of the loops, with the layout known. */
+	switch (tiling) {
+	case I915_TILING_X:
+		if (x + width > pitch)
+			return -EINVAL;
+		if (swizzle == I915_BIT_6_SWIZZLE_NONE) {
+			tiled_copy_rows(tiled, I915_TILING_X, swizzle,
+					(size_t)pitch * 8, x, y, width, height,
+					linear, linear_pitch, 512, to_tiled);
+		} else {
+			tiled_copy_rows(tiled, I915_TILING_X, swizzle,
+					(size_t)pitch * 8, x, y, width, height,
+					linear, linear_pitch, 64, to_tiled);
+		}
+		break;
+	case I915_TILING_Y:
+		if (x + width > pitch)
+			return -EINVAL;
+		tiled_copy_rows(tiled, I915_TILING_Y, swizzle,
+				(size_t)pitch * 32, x, y, width, height,
+				linear, linear_pitch, 16, to_tiled);
+		break;
+	default:
+		/* One span per row. */
+		tiled_copy_rows(tiled, I915_TILING_NONE,
+				I915_BIT_6_SWIZZLE_NONE, pitch, x, y,
+				width, height, linear, linear_pitch,
+				width ? x + width : 1, to_tiled);
+		break;
+	}
+
+	return 0;
+}
+
+/**
+ * Copies a @width bytes by @height rows rectangle from linear memory at
+ * @src, with rows @src_pitch bytes apart, to byte @x of row @y of a
+ * surface at @dst with the given tiling, bit 6 swizzling and pitch.
+ *
+ * @dst is the CPU view of the surface: a BO mapped with drm_intel_bo_map(),
+ * not with drm_intel_gem_bo_map_gtt(), through which the hardware already
+ * does the tiling.
+ *
+ * Returns -EINVAL if the pitch isn't a whole number of tiles or the
+ * rectangle goes past it, and -ENODEV for swizzling that depends on
+ * physical addresses.
+ */
+int
+drm_intel_tiled_write_rect(void *dst, uint32_t tiling, uint32_t swizzle,
+			   uint32_t pitch, uint32_t x, uint32_t y,
+			   uint32_t width, uint32_t height,
+			   const void *src, uint32_t src_pitch)
+{
+	return tiled_copy(dst, tiling, swizzle, pitch, x, y, width, height,
+			  (char *)src, src_pitch, true);
+}
+
+/**
+ * Copies a @width bytes by @height rows rectangle at byte @x of row @y of
+ * a tiled surface at @src to linear memory at @dst, with rows @dst_pitch
+ * bytes apart.  The reverse of drm_intel_tiled_write_rect().
+ */
+int
+drm_intel_tiled_read_rect(void *dst, uint32_t dst_pitch,
+			  const void *src, uint32_t tiling, uint32_t swizzle,
+			  uint32_t pitch, uint32_t x, uint32_t y,
+			  uint32_t width, uint32_t height)
+{
+	return tiled_copy((char *)src, tiling, swizzle, pitch, x, y,
+			  width, height, dst, dst_pitch, false);
+}
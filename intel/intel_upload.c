@@ -0,0 +1,499 @@
+/*
+ * Copyright © 2013 Intel Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "intel_upload.h"
+#include "i915_drm.h"
+
+#define XY_SRC_COPY_BLT_CMD	((2 << 29) | (0x53 << 22) | 6)
+#define XY_BLT_WRITE_ALPHA	(1 << 21)
+#define XY_BLT_WRITE_RGB	(1 << 20)
+#define BR13_8888		(3 << 24)
+#define ROP_COPY		(0xcc << 16)
+#define MI_BATCH_BUFFER_END	(0x0a << 23)
+#define MI_NOOP			0
+
+/* Size of the staging ring */
+#define RING_SIZE	(1024 * 1024)
+/*
+ * Uploads are copied as 32bpp rows of UPLOAD_PITCH bytes, plus one
+ * shorter row for the remainder.
+ */
+#define UPLOAD_PITCH	4096
+#define BLIT_DWORDS	8
+
+#define BATCH_SIZE	4096
+#define BATCH_DWORDS	(BATCH_SIZE / 4)
+
+/* Submitted batches tracked before waiting for the oldest one */
+#define MAX_IN_FLIGHT	32
+
+/* A staged write, kept to be redone with pwrite if its batch fails. */
+struct upload_copy {
+	drm_intel_bo *bo;
+	uint32_t offset;
+	uint32_t start;
+	uint32_t size;
+};
+
+struct upload_batch {
+	drm_intel_bo *bo;
+	/** Ring position up to which this batch's copies read */
+	uint64_t end;
+};
+
+struct drm_intel_uploader {
+	drm_intel_bufmgr *bufmgr;
+	pthread_mutex_t lock;
+
+	drm_intel_bo *staging;
+	char *map;
+	/**
+	 * Bytes ever reserved in the ring, and bytes ever released by
+	 * retired batches.  Their difference is the space in use.
+	 */
+	uint64_t head, tail;
+
+	/** Batch collecting blits, NULL until the first one */
+	drm_intel_bo *batch;
+	uint32_t cmds[BATCH_DWORDS];
+	int used;
+	/** Number of the batch being collected, starting at 1 */
+	uint64_t batch_id;
+	/** Writes staged in the batch being collected */
+	struct upload_copy copies[BATCH_DWORDS / BLIT_DWORDS];
+	int num_copies;
+	/**
+	 * BO the uploader is writing itself: its batch being submitted, or
+	 * the target of a write being redone.  Such writes must go straight
+	 * to the kernel rather than back through the ring.
+	 */
+	drm_intel_bo *submitting;
+	/** Error redoing writes, for the next drm_intel_uploader_flush() */
+	int error;
+
+	struct upload_batch in_flight[MAX_IN_FLIGHT];
+	int first, count;
+
+	drm_intel_bufmgr_gem_upload_stats stats;
+};
+
+struct drm_intel_uploader *
+drm_intel_uploader_create(drm_intel_bufmgr *bufmgr)
+{
+	struct drm_intel_uploader *up;
+
+	up = calloc(1, sizeof(*up));
+	if (!up)
+		return NULL;
+
+	up->bufmgr = bufmgr;
+	up->batch_id = 1;
+	pthread_mutex_init(&up->lock, NULL);
+
+	up->staging = drm_intel_bo_alloc(bufmgr, "upload ring", RING_SIZE,
+					 4096);
+	if (!up->staging)
+		goto err;
+
+	/* Only the GPU's reads of parts we have handed over can race with
+	 * our writes, and the fences below keep those apart.
+	 */
+	if (drm_intel_gem_bo_map_unsynchronized(up->staging))
+		goto err_staging;
+	up->map = up->staging->virtual;
+
+	return up;
+
+err_staging:
+	drm_intel_bo_unreference(up->staging);
+err:
+	pthread_mutex_destroy(&up->lock);
+	free(up);
+	return NULL;
+}
+
+/* Releases the ring space of the oldest submitted batch. */
+static void
+uploader_retire_oldest(struct drm_intel_uploader *up)
+{
+	struct upload_batch *b = &up->in_flight[up->first];
+
+	up->tail = b->end;
+	drm_intel_bo_unreference(b->bo);
+	up->first = (up->first + 1) % MAX_IN_FLIGHT;
+	up->count--;
+}
+
+static void
+uploader_retire(struct drm_intel_uploader *up)
+{
+	while (up->count &&
+	       !drm_intel_bo_busy(up->in_flight[up->first].bo))
+		uploader_retire_oldest(up);
+}
+
+/*
+ * Redoes the writes staged in a batch that failed to execute with pwrite,
+ * straight from the staging ring.  Those callers were already told their
+ * writes succeeded.
+ */
+static void
+uploader_replay(struct drm_intel_uploader *up)
+{
+	int i, ret;
+
+	for (i = 0; i < up->num_copies; i++) {
+		struct upload_copy *copy = &up->copies[i];
+
+		up->submitting = copy->bo;
+		ret = drm_intel_bo_subdata(copy->bo, copy->offset, copy->size,
+					   up->map + copy->start);
+		up->submitting = NULL;
+		if (ret && up->error == 0)
+			up->error = ret;
+	}
+}
+
+/*
+ * Submits the blits collected so far.  Called with the lock held.
+ *
+ * Returns the execbuffer's error, if any, by which time the batch's
+ * writes have been redone without it.
+ */
+static int
+uploader_submit(struct drm_intel_uploader *up)
+{
+	struct upload_batch *b;
+	int ret;
+
+	if (up->used == 0)
+		return 0;
+
+	if (up->count == MAX_IN_FLIGHT) {
+		drm_intel_bo_wait_rendering(up->in_flight[up->first].bo);
+		uploader_retire_oldest(up);
+		up->stats.ring_waits++;
+	}
+
+	up->cmds[up->used++] = MI_BATCH_BUFFER_END;
+	if (up->used & 1)
+		up->cmds[up->used++] = MI_NOOP;
+
+	/* Make the staged data visible before the GPU is told to read it. */
+	__sync_synchronize();
+
+	up->submitting = up->batch;
+	ret = drm_intel_bo_subdata(up->batch, 0, up->used * 4, up->cmds);
+	if (ret == 0)
+		ret = drm_intel_bo_mrb_exec(up->batch, up->used * 4,
+					    NULL, 0, 0, I915_EXEC_BLT);
+	up->submitting = NULL;
+	if (ret) {
+		up->stats.ring_errors++;
+		uploader_replay(up);
+	}
+
+	b = &up->in_flight[(up->first + up->count) % MAX_IN_FLIGHT];
+	b->bo = up->batch;
+	b->end = up->head;
+	up->count++;
+
+	up->batch = NULL;
+	up->used = 0;
+	up->num_copies = 0;
+	up->batch_id++;
+	up->stats.ring_flushes++;
+
+	return ret;
+}
+
+/* Makes sure there's a batch with room for the blits of one upload. */
+static int
+uploader_get_batch(struct drm_intel_uploader *up)
+{
+	/* Two blits and the batch end. */
+	if (up->used + 2 * BLIT_DWORDS + 2 > BATCH_DWORDS)
+		uploader_submit(up);
+
+	if (up->batch == NULL) {
+		up->batch = drm_intel_bo_alloc(up->bufmgr, "upload batch",
+					       BATCH_SIZE, 4096);
+		if (up->batch == NULL)
+			return -ENOMEM;
+	}
+
+	return 0;
+}
+
+/*
+ * Reserves @size contiguous bytes of the ring, waiting for the GPU to
+ * finish with the oldest copies if needed.  Returns the ring position.
+ */
+static uint64_t
+uploader_reserve(struct drm_intel_uploader *up, unsigned long size)
+{
+	uint64_t start = up->head;
+
+	/* Copies don't wrap: skip the end of the ring if it's too short. */
+	if (start % RING_SIZE + size > RING_SIZE)
+		start += RING_SIZE - start % RING_SIZE;
+
+	if (start + size - up->tail > RING_SIZE)
+		uploader_retire(up);
+
+	while (start + size - up->tail > RING_SIZE) {
+		/* Everything in the ring belongs to the current batch. */
+		if (up->count == 0)
+			uploader_submit(up);
+		if (up->count == 0) {
+			/* Nothing in use at all. */
+			up->tail = start;
+			break;
+		}
+
+		drm_intel_bo_wait_rendering(up->in_flight[up->first].bo);
+		uploader_retire_oldest(up);
+		up->stats.ring_waits++;
+	}
+
+	up->head = start + size;
+	return start;
+}
+
+static void
+uploader_emit_blit(struct drm_intel_uploader *up,
+		   drm_intel_bo *dst, uint32_t dst_offset,
+		   drm_intel_bo *src, uint32_t src_offset,
+		   uint32_t width, uint32_t height)
+{
+	uint32_t *cs = up->cmds + up->used;
+
+	cs[0] = XY_SRC_COPY_BLT_CMD | XY_BLT_WRITE_ALPHA | XY_BLT_WRITE_RGB;
+	cs[1] = BR13_8888 | ROP_COPY | UPLOAD_PITCH;
+	cs[2] = 0;
+	cs[3] = (height << 16) | width;
+	cs[4] = dst->offset + dst_offset;
+	cs[5] = 0;
+	cs[6] = UPLOAD_PITCH;
+	cs[7] = src->offset + src_offset;
+
+	drm_intel_bo_emit_reloc(up->batch, (up->used + 4) * 4,
+				dst, dst_offset,
+				I915_GEM_DOMAIN_RENDER, I915_GEM_DOMAIN_RENDER);
+	drm_intel_bo_emit_reloc(up->batch, (up->used + 7) * 4,
+				src, src_offset,
+				I915_GEM_DOMAIN_RENDER, 0);
+
+	up->used += BLIT_DWORDS;
+}
+
+/* Copies @size bytes with whole rows, then a shorter one. */
+static void
+uploader_emit_copy(struct drm_intel_uploader *up,
+		   drm_intel_bo *dst, uint32_t dst_offset,
+		   drm_intel_bo *src, uint32_t src_offset,
+		   unsigned long size)
+{
+	unsigned long rows = size / UPLOAD_PITCH;
+	unsigned long rest = size % UPLOAD_PITCH;
+
+	if (rows)
+		uploader_emit_blit(up, dst, dst_offset, src, src_offset,
+				   UPLOAD_PITCH / 4, rows);
+	if (rest)
+		uploader_emit_blit(up, dst, dst_offset + rows * UPLOAD_PITCH,
+				   src, src_offset + rows * UPLOAD_PITCH,
+				   rest / 4, 1);
+}
+
+/**
+ * Stages a write of @size bytes at @offset in @bo, to be done by the GPU.
+ *
+ * Offset and size must be multiples of 4, and the size at most
+ * DRM_INTEL_UPLOAD_MAX.  On success, @batch_id is set to the batch the
+ * copy will be submitted with, for drm_intel_uploader_flush().
+ */
+int
+drm_intel_uploader_copy(struct drm_intel_uploader *up, drm_intel_bo *bo,
+			unsigned long offset, unsigned long size,
+			const void *data, uint64_t *batch_id)
+{
+	struct upload_copy *copy;
+	uint32_t start;
+	int ret;
+
+	if ((offset | size) & 3 || size == 0 || size > DRM_INTEL_UPLOAD_MAX)
+		return -EINVAL;
+
+	pthread_mutex_lock(&up->lock);
+
+	ret = uploader_get_batch(up);
+	if (ret == 0) {
+		start = uploader_reserve(up, size) % RING_SIZE;
+		/* Reserving may have had to submit the batch. */
+		ret = uploader_get_batch(up);
+	}
+	if (ret) {
+		pthread_mutex_unlock(&up->lock);
+		return ret;
+	}
+
+	/* The GPU reads this once: keep it out of our caches. */
+	drm_intel_memcpy_to_wc(up->map + start, data, size);
+
+	uploader_emit_copy(up, bo, offset, up->staging, start, size);
+
+	copy = &up->copies[up->num_copies++];
+	copy->bo = bo;
+	copy->offset = offset;
+	copy->start = start;
+	copy->size = size;
+
+	*batch_id = up->batch_id;
+	up->stats.ring_bytes += size;
+
+	pthread_mutex_unlock(&up->lock);
+
+	return 0;
+}
+
+/**
+ * Submits a copy of @size bytes at @offset in @bo to the start of
+ * @staging, after everything staged so far.
+ *
+ * Offset and size must be multiples of 4, and the size at most 64MiB.
+ * The caller waits for the copy by mapping @staging.  Returns an error
+ * if the copy couldn't be submitted, in which case @staging is left as
+ * it was and the caller has to read @bo some other way.
+ */
+int
+drm_intel_uploader_read(struct drm_intel_uploader *up, drm_intel_bo *bo,
+			unsigned long offset, unsigned long size,
+			drm_intel_bo *staging)
+{
+	int ret;
+
+	if ((offset | size) & 3 || size == 0 ||
+	    size / UPLOAD_PITCH > 0xffff)
+		return -EINVAL;
+
+	pthread_mutex_lock(&up->lock);
+	ret = uploader_get_batch(up);
+	if (ret == 0) {
+		uploader_emit_copy(up, staging, 0, bo, offset, size);
+		ret = uploader_submit(up);
+	}
+	if (ret == 0)
+		up->stats.readback_bytes += size;
+	pthread_mutex_unlock(&up->lock);
+
+	return ret;
+}
+
+/**
+ * Submits the batch numbered @batch_id if it hasn't been yet, or whatever
+ * is pending if @batch_id is 0.
+ *
+ * Returns an error if any staged write failed to land, however its batch
+ * was submitted.  A batch that fails to execute has its writes redone
+ * with pwrite, so this is only when that fails too.
+ */
+int
+drm_intel_uploader_flush(struct drm_intel_uploader *up, uint64_t batch_id)
+{
+	int ret;
+
+	pthread_mutex_lock(&up->lock);
+	if (batch_id == 0 || batch_id == up->batch_id)
+		uploader_submit(up);
+	ret = up->error;
+	up->error = 0;
+	pthread_mutex_unlock(&up->lock);
+
+	return ret;
+}
+
+/**
+ * Returns whether @bo is the uploader's own batch being submitted, whose
+ * execbuffer mustn't try to flush the uploader again.
+ */
+bool
+drm_intel_uploader_submitting(struct drm_intel_uploader *up,
+			      drm_intel_bo *bo)
+{
+	return up->submitting == bo;
+}
+
+/** Counts bytes uploaded without the ring. */
+void
+drm_intel_uploader_count(struct drm_intel_uploader *up,
+			 enum drm_intel_upload_path path,
+			 unsigned long size)
+{
+	pthread_mutex_lock(&up->lock);
+	switch (path) {
+	case DRM_INTEL_UPLOAD_RING:
+		up->stats.ring_bytes += size;
+		break;
+	case DRM_INTEL_UPLOAD_PWRITE:
+		up->stats.pwrite_bytes += size;
+		break;
+	case DRM_INTEL_UPLOAD_MAP:
+		up->stats.map_bytes += size;
+		break;
+	}
+	pthread_mutex_unlock(&up->lock);
+}
+
+void
+drm_intel_uploader_get_stats(struct drm_intel_uploader *up,
+			     drm_intel_bufmgr_gem_upload_stats *stats)
+{
+	pthread_mutex_lock(&up->lock);
+	*stats = up->stats;
+	pthread_mutex_unlock(&up->lock);
+}
+
+void
+drm_intel_uploader_destroy(struct drm_intel_uploader *up)
+{
+	pthread_mutex_lock(&up->lock);
+	uploader_submit(up);
+	while (up->count)
+		uploader_retire_oldest(up);
+	pthread_mutex_unlock(&up->lock);
+
+	drm_intel_bo_unmap(up->staging);
+	drm_intel_bo_unreference(up->staging);
+	pthread_mutex_destroy(&up->lock);
+	free(up);
+}
@@ -0,0 +1,77 @@
+/*
+ * Copyright © 2013 Intel Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+/**
+ * @file intel_upload.h
+ *
+ * Private interface of the streaming uploader.
+ *
+ * Small writes to buffers that may still be in use by the GPU are copied
+ * into a persistently mapped staging ring, and turned into blits on the
+ * BLT ring.  Blits are collected into a batch that is submitted before the
+ * next execbuffer, or before the CPU next looks at one of the targets.
+ *
+ * Reads go the other way, blitting into a snooped staging BO that the CPU
+ * then reads through a cached mapping.
+ */
+
+#ifndef INTEL_UPLOAD_H
+#define INTEL_UPLOAD_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "intel_bufmgr.h"
+
+/** Largest single upload that goes through the ring */
+#define DRM_INTEL_UPLOAD_MAX	(64 * 1024)
+
+enum drm_intel_upload_path {
+	DRM_INTEL_UPLOAD_RING,
+	DRM_INTEL_UPLOAD_PWRITE,
+	DRM_INTEL_UPLOAD_MAP,
+};
+
+struct drm_intel_uploader;
+
+struct drm_intel_uploader *drm_intel_uploader_create(drm_intel_bufmgr *bufmgr);
+void drm_intel_uploader_destroy(struct drm_intel_uploader *up);
+
+int drm_intel_uploader_copy(struct drm_intel_uploader *up, drm_intel_bo *bo,
+			    unsigned long offset, unsigned long size,
+			    const void *data, uint64_t *batch_id);
+int drm_intel_uploader_read(struct drm_intel_uploader *up, drm_intel_bo *bo,
+			    unsigned long offset, unsigned long size,
+			    drm_intel_bo *staging);
+int drm_intel_uploader_flush(struct drm_intel_uploader *up,
+			     uint64_t batch_id);
+bool drm_intel_uploader_submitting(struct drm_intel_uploader *up,
+				   drm_intel_bo *bo);
+
+void drm_intel_uploader_count(struct drm_intel_uploader *up,
+			      enum drm_intel_upload_path path,
+			      unsigned long size);
+void drm_intel_uploader_get_stats(struct drm_intel_uploader *up,
+				  drm_intel_bufmgr_gem_upload_stats *stats);
+
+#endif /* INTEL_UPLOAD_H */
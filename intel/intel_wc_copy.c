@@ -0,0 +1,355 @@
+/*
+ * Copyright © 2013 Intel Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+/**
+ * @file intel_wc_copy.c
+ *
+ * Copies to and from write-combined memory, such as GTT mappings.
+ *
+ * Writes are best done as whole cachelines of non-temporal stores, which
+ * fill the WC buffers without first reading the destination into the
+ * cache.  Reads from WC memory are uncached, so each one goes to memory
+ * unless it's a streaming load, which fetches a whole line into a
+ * streaming buffer that the following loads hit.
+ *
+ * The widest implementation the CPU supports is picked on first use.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#ifdef HAVE_X86_SIMD_DISPATCH
+#include <immintrin.h>
+#endif
+
+#include "intel_bufmgr.h"
+
+typedef void (*wc_copy_func)(void *dst, const void *src, size_t size);
+
+struct wc_copy_impl {
+	const char *name;
+	/** __builtin_cpu_supports() feature needed, or NULL */
+	const char *feature;
+	wc_copy_func to_wc;
+	wc_copy_func from_wc;
+};
+
+/* Below this, the setup costs more than the stores save. */
+#define WC_COPY_MIN	256
+
+static void
+copy_memcpy(void *dst, const void *src, size_t size)
+{
+	memcpy(dst, src, size);
+}
+
+/* Stores to WC memory are buffered even without non-temporal hints. */
+static void
+to_wc_memcpy(void *dst, const void *src, size_t size)
+{
+	memcpy(dst, src, size);
+	__sync_synchronize();
+}
+
+#ifdef HAVE_X86_SIMD_DISPATCH
+
+/* Copies up to the first @align boundary of @p, returning its length. */
+static size_t
+wc_copy_head(void *dst, const void *src, size_t size, const void *p,
+	     size_t align)
+{
+	size_t head = -(uintptr_t)p & (align - 1);
+
+	if (head > size)
+		head = size;
+	memcpy(dst, src, head);
+
+	return head;
+}
+
+__attribute__((target("sse2")))
+static void
+to_wc_sse2(void *dst, const void *src, size_t size)
+{
+	char *d = dst;
+	const char *s = src;
+	size_t n;
+
+	if (size < WC_COPY_MIN) {
+		memcpy(dst, src, size);
+		_mm_sfence();
+		return;
+	}
+
+	n = wc_copy_head(d, s, size, d, 16);
+	d += n;
+	s += n;
+	size -= n;
+
+	for (; size >= 64; size -= 64, s += 64, d += 64) {
+		__m128i a = _mm_loadu_si128((const __m128i *)s + 0);
+		__m128i b = _mm_loadu_si128((const __m128i *)s + 1);
+		__m128i c = _mm_loadu_si128((const __m128i *)s + 2);
+		__m128i e = _mm_loadu_si128((const __m128i *)s + 3);
+
+		_mm_stream_si128((__m128i *)d + 0, a);
+		_mm_stream_si128((__m128i *)d + 1, b);
+		_mm_stream_si128((__m128i *)d + 2, c);
+		_mm_stream_si128((__m128i *)d + 3, e);
+	}
+
+	/* The fence drains the WC buffers, with the tail's plain stores. */
+	memcpy(d, s, size);
+	_mm_sfence();
+}
+
+__attribute__((target("avx2")))
+static void
+to_wc_avx2(void *dst, const void *src, size_t size)
+{
+	char *d = dst;
+	const char *s = src;
+	size_t n;
+
+	if (size < WC_COPY_MIN) {
+		memcpy(dst, src, size);
+		_mm_sfence();
+		return;
+	}
+
+	n = wc_copy_head(d, s, size, d, 32);
+	d += n;
+	s += n;
+	size -= n;
+
+	for (; size >= 128; size -= 128, s += 128, d += 128) {
+		__m256i a = _mm256_loadu_si256((const __m256i *)s + 0);
+		__m256i b = _mm256_loadu_si256((const __m256i *)s + 1);
+		__m256i c = _mm256_loadu_si256((const __m256i *)s + 2);
+		__m256i e = _mm256_loadu_si256((const __m256i *)s + 3);
+
+		_mm256_stream_si256((__m256i *)d + 0, a);
+		_mm256_stream_si256((__m256i *)d + 1, b);
+		_mm256_stream_si256((__m256i *)d + 2, c);
+		_mm256_stream_si256((__m256i *)d + 3, e);
+	}
+	_mm256_zeroupper();
+
+	memcpy(d, s, size);
+	_mm_sfence();
+}
+
+/*
+ * Streaming loads need an aligned source, and are issued a cacheline at a
+ * time so that each line is fetched once.
+ */
+__attribute__((target("sse4.1")))
+static void
+from_wc_sse41(void *dst, const void *src, size_t size)
+{
+	char *d = dst;
+	const char *s = src;
+	size_t n;
+
+	if (size < WC_COPY_MIN) {
+		memcpy(dst, src, size);
+		return;
+	}
+
+	n = wc_copy_head(d, s, size, s, 16);
+	d += n;
+	s += n;
+	size -= n;
+
+	/* Streaming loads are weakly ordered with earlier accesses. */
+	_mm_mfence();
+
+	for (; size >= 64; size -= 64, s += 64, d += 64) {
+		__m128i a = _mm_stream_load_si128((__m128i *)s + 0);
+		__m128i b = _mm_stream_load_si128((__m128i *)s + 1);
+		__m128i c = _mm_stream_load_si128((__m128i *)s + 2);
+		__m128i e = _mm_stream_load_si128((__m128i *)s + 3);
+
+		_mm_storeu_si128((__m128i *)d + 0, a);
+		_mm_storeu_si128((__m128i *)d + 1, b);
+		_mm_storeu_si128((__m128i *)d + 2, c);
+		_mm_storeu_si128((__m128i *)d + 3, e);
+	}
+
+	memcpy(d, s, size);
+}
+
+__attribute__((target("avx2")))
+static void
+from_wc_avx2(void *dst, const void *src, size_t size)
+{
+	char *d = dst;
+	const char *s = src;
+	size_t n;
+
+	if (size < WC_COPY_MIN) {
+		memcpy(dst, src, size);
+		return;
+	}
+
+	n = wc_copy_head(d, s, size, s, 32);
+	d += n;
+	s += n;
+	size -= n;
+
+	_mm_mfence();
+
+	for (; size >= 128; size -= 128, s += 128, d += 128) {
+		__m256i a = _mm256_stream_load_si256((__m256i *)s + 0);
+		__m256i b = _mm256_stream_load_si256((__m256i *)s + 1);
+		__m256i c = _mm256_stream_load_si256((__m256i *)s + 2);
+		__m256i e = _mm256_stream_load_si256((__m256i *)s + 3);
+
+		_mm256_storeu_si256((__m256i *)d + 0, a);
+		_mm256_storeu_si256((__m256i *)d + 1, b);
+		_mm256_storeu_si256((__m256i *)d + 2, c);
+		_mm256_storeu_si256((__m256i *)d + 3, e);
+	}
+	_mm256_zeroupper();
+
+	memcpy(d, s, size);
+}
+
+#endif /* HAVE_X86_SIMD_DISPATCH */
+
+/* Best first; the last one is always available. */
+static const struct wc_copy_impl wc_copy_impls[] = {
+#ifdef HAVE_X86_SIMD_DISPATCH
+	{ "avx2", "avx2", to_wc_avx2, from_wc_avx2 },
+	{ "sse4.1", "sse4.1", to_wc_sse2, from_wc_sse41 },
+	{ "sse2", "sse2", to_wc_sse2, copy_memcpy },
+#endif
+	{ "memcpy", NULL, to_wc_memcpy, copy_memcpy },
+};
+
+#define NUM_IMPLS (sizeof(wc_copy_impls) / sizeof(wc_copy_impls[0]))
+
+static const struct wc_copy_impl *wc_copy_impl;
+
+static bool
+wc_copy_supported(const struct wc_copy_impl *impl)
+{
+	if (impl->feature == NULL)
+		return true;
+
+#ifdef HAVE_X86_SIMD_DISPATCH
+	__builtin_cpu_init();
+	if (strcmp(impl->feature, "avx2") == 0)
+		return __builtin_cpu_supports("avx2");
+	if (strcmp(impl->feature, "sse4.1") == 0)
+		return __builtin_cpu_supports("sse4.1");
+	if (strcmp(impl->feature, "sse2") == 0)
+		return __builtin_cpu_supports("sse2");
+#endif
+
+	return false;
+}
+
+/*
+ * Picking is idempotent, so threads racing through here on first use
+ * all store the same pointer.
+ */
+static const struct wc_copy_impl *
+wc_copy_get(void)
+{
+	const struct wc_copy_impl *impl = wc_copy_impl;
+	unsigned int i;
+
+	if (impl)
+		return impl;
+
+	for (i = 0; i < NUM_IMPLS; i++) {
+		if (wc_copy_supported(&wc_copy_impls[i]))
+			break;
+	}
+	impl = &wc_copy_impls[i];
+	wc_copy_impl = impl;
+
+	return impl;
+}
+
+/**
+ * Copies @size bytes from ordinary memory to write-combined memory, such
+ * as a BO mapped with drm_intel_gem_bo_map_gtt().
+ *
+ * The copy is complete and visible to other agents on return.
+ */
+void
+drm_intel_memcpy_to_wc(void *dst, const void *src, size_t size)
+{
+	wc_copy_get()->to_wc(dst, src, size);
+}
+
+/**
+ * Copies @size bytes from write-combined or uncached memory, such as a BO
+ * mapped with drm_intel_gem_bo_map_gtt(), to ordinary memory.
+ */
+void
+drm_intel_memcpy_from_wc(void *dst, const void *src, size_t size)
+{
+	wc_copy_get()->from_wc(dst, src, size);
+}
+
+/** Returns the name of the copy implementation in use. */
+const char *
+drm_intel_wc_copy_get_impl(void)
+{
+	return wc_copy_get()->name;
+}
+
+/**
+ * Overrides the copy implementation picked for this CPU, by name: one of
+ * "avx2", "sse4.1", "sse2" or "memcpy".  Meant for benchmarking.
+ *
+ * Returns -EINVAL for an unknown name, or -ENODEV if the CPU lacks the
+ * instructions needed.
+ */
+int
+drm_intel_wc_copy_set_impl(const char *name)
+{
+	unsigned int i;
+
+	for (i = 0; i < NUM_IMPLS; i++) {
+		if (strcmp(wc_copy_impls[i].name, name) != 0)
+			continue;
+
+		if (!wc_copy_supported(&wc_copy_impls[i]))
+			return -ENODEV;
+
+		wc_copy_impl = &wc_copy_impls[i];
+		return 0;
+	}
+
+	return -EINVAL;
+}
@@ -0,0 +1,393 @@
+/*
+ * Copyright © 2013 Intel Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+/*
+ * Decodes many batch files or i915_error_state dumps at once, one file per
+ * worker thread, writing each decode next to its input as <file>.txt (or
+ * into the directory given with -o).  -f json or -f binary produce the
+ * decoder's per-packet records instead, in <file>.json or <file>.bin.
+ *
+ * With -s, each text output ends with a ranked summary of the state
+ * packets that were re-emitted unchanged, counted across all the batches
+ * in the file.
+ *
+ * Raw batch files get their chipset from -d, or from the file name the
+ * same way test_decode does.  Error state dumps carry their own PCI ID.
+ */
+
+#define _GNU_SOURCE
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <libgen.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <err.h>
+
+#include "config.h"
+#include "intel_bufmgr.h"
+#include "decode_util.h"
+
+#define HW_OFFSET 0x12300000
+
+struct job_queue {
+	pthread_mutex_t lock;
+	char **files;
+	int num_files;
+	int next;
+	int failed;
+};
+
+static uint32_t forced_devid;
+static const char *outdir;
+static enum drm_intel_decode_format format = DRM_INTEL_DECODE_FORMAT_TEXT;
+static const char *suffix = "txt";
+static bool state_summary;
+
+static void
+usage(void)
+{
+	fprintf(stderr, "usage:\n");
+	fprintf(stderr, "  parallel_decode [-j threads] [-d devid] [-o outdir] "
+		"[-f text|json|binary] [-s] <file>...\n");
+	exit(1);
+}
+
+static char *
+output_filename(const char *filename)
+{
+	char *copy, *name;
+
+	if (outdir == NULL) {
+		if (asprintf(&name, "%s.%s", filename, suffix) < 0)
+			return NULL;
+		return name;
+	}
+
+	copy = strdup(filename);
+	if (copy == NULL)
+		return NULL;
+	if (asprintf(&name, "%s/%s.%s", outdir, basename(copy), suffix) < 0)
+		name = NULL;
+	free(copy);
+	return name;
+}
+
+static int
+is_error_state(const char *data, size_t size)
+{
+	return memmem(data, size, "PCI ID:", 7) != NULL;
+}
+
+static void
+decode_buffer(struct drm_intel_decode *ctx, FILE *out,
+	      uint32_t *data, uint32_t gtt_offset, int count)
+{
+	drm_intel_decode_set_batch_pointer(ctx, data, gtt_offset, count);
+	drm_intel_decode_set_output_file(ctx, out);
+	drm_intel_decode_set_output_format(ctx, format);
+	if (state_summary) {
+		drm_intel_decode_set_state_tracking(ctx,
+						    DRM_INTEL_DECODE_STATE_ACROSS_BATCHES);
+	}
+	drm_intel_decode(ctx);
+}
+
+/*
+ * Walks the text of an error state dump, decoding every buffer listed in
+ * it.  Buffers start at a "--- gtt_offset = 0x..." header and are followed
+ * by "offset :  dword" lines.
+ */
+static int
+decode_error_state(const char *filename, const char *text, size_t size,
+		   FILE *out)
+{
+	struct drm_intel_decode *ctx = NULL;
+	uint32_t devid = forced_devid, gtt_offset = 0;
+	uint32_t *data = NULL;
+	int count = 0, alloc = 0;
+	const char *line = text, *end = text + size;
+
+	while (line < end) {
+		const char *nl = memchr(line, '\n', end - line);
+		size_t len = nl ? (size_t)(nl - line) : (size_t)(end - line);
+		char buf[256];
+		const char *hdr;
+		uint32_t offset, value;
+
+		if (len >= sizeof(buf))
+			len = sizeof(buf) - 1;
+		memcpy(buf, line, len);
+		buf[len] = '\0';
+		line = nl ? nl + 1 : end;
+
+		if (devid == 0 && sscanf(buf, "PCI ID: 0x%x", &value) == 1) {
+			devid = value;
+			continue;
+		}
+
+		hdr = strstr(buf, " --- gtt_offset = 0x");
+		if (hdr != NULL) {
+			if (ctx && count)
+				decode_buffer(ctx, out, data, gtt_offset, count);
+			count = 0;
+
+			if (devid == 0) {
+				fprintf(stderr, "%s: no PCI ID before first "
+					"buffer\n", filename);
+				free(data);
+				return -1;
+			}
+			if (ctx == NULL)
+				ctx = drm_intel_decode_context_alloc(devid);
+			if (ctx == NULL) {
+				fprintf(stderr, "%s: unsupported PCI ID "
+					"0x%04x\n", filename, devid);
+				free(data);
+				return -1;
+			}
+
+			sscanf(hdr, " --- gtt_offset = 0x%x", &gtt_offset);
+			if (format == DRM_INTEL_DECODE_FORMAT_TEXT)
+				fprintf(out, "%s\n", buf);
+			continue;
+		}
+
+		if (ctx && sscanf(buf, "%08x :  %08x", &offset, &value) == 2) {
+			if (count == alloc) {
+				uint32_t *tmp;
+
+				alloc = alloc ? alloc * 2 : 1024;
+				tmp = realloc(data, alloc * sizeof(*data));
+				if (tmp == NULL) {
+					free(data);
+					drm_intel_decode_context_free(ctx);
+					return -1;
+				}
+				data = tmp;
+			}
+			data[count++] = value;
+		}
+	}
+
+	if (ctx && count)
+		decode_buffer(ctx, out, data, gtt_offset, count);
+
+	free(data);
+	if (ctx) {
+		if (state_summary)
+			drm_intel_decode_print_state_summary(ctx, out);
+		drm_intel_decode_context_free(ctx);
+	}
+	return 0;
+}
+
+static int
+decode_batch(const char *filename, void *data, size_t size, FILE *out)
+{
+	struct drm_intel_decode *ctx;
+	uint32_t devid = forced_devid;
+
+	if (devid == 0)
+		devid = decode_infer_devid(filename);
+	if (devid == 0) {
+		fprintf(stderr, "%s: couldn't guess chipset id, use -d\n",
+			filename);
+		return -1;
+	}
+
+	ctx = drm_intel_decode_context_alloc(devid);
+	if (ctx == NULL) {
+		fprintf(stderr, "%s: unsupported PCI ID 0x%04x\n",
+			filename, devid);
+		return -1;
+	}
+
+	decode_buffer(ctx, out, data, HW_OFFSET, size / 4);
+	if (state_summary)
+		drm_intel_decode_print_state_summary(ctx, out);
+	drm_intel_decode_context_free(ctx);
+	return 0;
+}
+
+static int
+decode_file(const char *filename)
+{
+	struct stat st;
+	char *out_name;
+	FILE *out;
+	void *ptr;
+	int fd, ret;
+
+	fd = open(filename, O_RDONLY);
+	if (fd == -1) {
+		warn("couldn't open `%s'", filename);
+		return -1;
+	}
+
+	if (fstat(fd, &st) || st.st_size == 0) {
+		warnx("couldn't stat `%s' or it is empty", filename);
+		close(fd);
+		return -1;
+	}
+
+	/* Map privately so the decoder's view can't change underneath it. */
+	ptr = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (ptr == MAP_FAILED) {
+		warn("couldn't map `%s'", filename);
+		return -1;
+	}
+
+	out_name = output_filename(filename);
+	out = out_name ? fopen(out_name, "w") : NULL;
+	if (out == NULL) {
+		warn("couldn't create output for `%s'", filename);
+		free(out_name);
+		munmap(ptr, st.st_size);
+		return -1;
+	}
+
+	if (is_error_state(ptr, st.st_size))
+		ret = decode_error_state(filename, ptr, st.st_size, out);
+	else
+		ret = decode_batch(filename, ptr, st.st_size, out);
+
+	if (fclose(out))
+		ret = -1;
+	free(out_name);
+	munmap(ptr, st.st_size);
+
+	return ret;
+}
+
+static void *
+worker(void *arg)
+{
+	struct job_queue *queue = arg;
+
+	for (;;) {
+		int i;
+
+		pthread_mutex_lock(&queue->lock);
+		i = queue->next++;
+		pthread_mutex_unlock(&queue->lock);
+
+		if (i >= queue->num_files)
+			break;
+
+		if (decode_file(queue->files[i])) {
+			pthread_mutex_lock(&queue->lock);
+			queue->failed++;
+			pthread_mutex_unlock(&queue->lock);
+		}
+	}
+
+	return NULL;
+}
+
+int
+main(int argc, char **argv)
+{
+	struct job_queue queue;
+	pthread_t *threads;
+	long num_threads;
+	int i, c;
+
+	num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+
+	while ((c = getopt(argc, argv, "j:d:o:f:s")) != -1) {
+		switch (c) {
+		case 'j':
+			num_threads = strtol(optarg, NULL, 0);
+			break;
+		case 'd':
+			forced_devid = strtoul(optarg, NULL, 0);
+			break;
+		case 'o':
+			outdir = optarg;
+			break;
+		case 'f':
+			if (strcmp(optarg, "json") == 0) {
+				format = DRM_INTEL_DECODE_FORMAT_JSON;
+				suffix = "json";
+			} else if (strcmp(optarg, "binary") == 0) {
+				format = DRM_INTEL_DECODE_FORMAT_BINARY;
+				suffix = "bin";
+			} else if (strcmp(optarg, "text") != 0) {
+				usage();
+			}
+			break;
+		case 's':
+			state_summary = true;
+			break;
+		default:
+			usage();
+		}
+	}
+
+	if (optind >= argc)
+		usage();
+	if (state_summary && format != DRM_INTEL_DECODE_FORMAT_TEXT) {
+		fprintf(stderr, "-s only works with text output\n");
+		exit(1);
+	}
+
+	memset(&queue, 0, sizeof(queue));
+	pthread_mutex_init(&queue.lock, NULL);
+	queue.files = argv + optind;
+	queue.num_files = argc - optind;
+
+	if (num_threads < 1)
+		num_threads = 1;
+	if (num_threads > queue.num_files)
+		num_threads = queue.num_files;
+
+	threads = calloc(num_threads, sizeof(*threads));
+	if (threads == NULL)
+		errx(1, "out of memory");
+
+	for (i = 0; i < num_threads; i++) {
+		if (pthread_create(&threads[i], NULL, worker, &queue))
+			errx(1, "couldn't create decode thread");
+	}
+	for (i = 0; i < num_threads; i++)
+		pthread_join(threads[i], NULL);
+
+	free(threads);
+	pthread_mutex_destroy(&queue.lock);
+
+	if (queue.failed) {
+		fprintf(stderr, "%d of %d files failed to decode\n",
+			queue.failed, queue.num_files);
+		return 1;
+	}
+
+	return 0;
+}
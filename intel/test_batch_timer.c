@@ -0,0 +1,333 @@
+/*
+ * Copyright © 2013 Intel Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+/*
+ * Checks the batch timer's bookkeeping without a GPU: the stamps are
+ * submitted, polled and read back through fake ops, and the test decides
+ * when each slot retires and what it measured.
+ */
+
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+
+#include "config.h"
+#include "intel_batch_timer.h"
+#include "i915_drm.h"
+
+#define MAX_SLOTS	128
+
+struct fake_slot {
+	struct drm_intel_batch_timer_slot *slot;
+	bool busy;
+	uint32_t stamps[2];
+	int submits;
+};
+
+struct fake_gpu {
+	struct fake_slot slots[MAX_SLOTS];
+	int num_slots;
+	/** Fail the next submission of a closing stamp */
+	bool fail_end;
+	/** Stamps given to the next opening and closing submissions */
+	uint32_t next_stamps[2];
+};
+
+static int failures;
+
+static void
+check(int cond, const char *what)
+{
+	if (!cond) {
+		fprintf(stderr, "FAIL %s\n", what);
+		failures++;
+	}
+}
+
+static struct fake_slot *
+fake_lookup(struct fake_gpu *gpu, struct drm_intel_batch_timer_slot *slot)
+{
+	int i;
+
+	for (i = 0; i < gpu->num_slots; i++) {
+		if (gpu->slots[i].slot == slot)
+			return &gpu->slots[i];
+	}
+
+	gpu->slots[i].slot = slot;
+	gpu->num_slots++;
+	return &gpu->slots[i];
+}
+
+static int
+fake_submit(void *data, struct drm_intel_batch_timer_slot *slot,
+	    unsigned int ring, uint32_t ctx_id, bool end)
+{
+	struct fake_gpu *gpu = data;
+	struct fake_slot *fake = fake_lookup(gpu, slot);
+
+	if (end && gpu->fail_end) {
+		gpu->fail_end = false;
+		return -EIO;
+	}
+
+	fake->busy = true;
+	fake->stamps[end] = gpu->next_stamps[end];
+	fake->submits++;
+	return 0;
+}
+
+static bool
+fake_busy(void *data, struct drm_intel_batch_timer_slot *slot)
+{
+	return fake_lookup(data, slot)->busy;
+}
+
+static int
+fake_read(void *data, struct drm_intel_batch_timer_slot *slot,
+	  uint32_t stamps[2])
+{
+	struct fake_slot *fake = fake_lookup(data, slot);
+
+	fake->busy = false;
+	memcpy(stamps, fake->stamps, sizeof(fake->stamps));
+	return 0;
+}
+
+static const struct drm_intel_batch_timer_ops fake_ops = {
+	.submit = fake_submit,
+	.busy = fake_busy,
+	.read = fake_read,
+};
+
+/* Submits one timed batch whose stamps read start and end. */
+static struct drm_intel_batch_timer_slot *
+timed_batch(struct drm_intel_batch_timer *timer, struct fake_gpu *gpu,
+	    unsigned int ring, uint32_t ctx_id, uint32_t start, uint32_t end,
+	    bool submitted)
+{
+	struct drm_intel_batch_timer_slot *slot;
+
+	gpu->next_stamps[0] = start;
+	gpu->next_stamps[1] = end;
+	slot = drm_intel_batch_timer_begin(timer, ring, ctx_id);
+	drm_intel_batch_timer_end(timer, slot, submitted);
+
+	return slot;
+}
+
+static void
+retire(struct fake_gpu *gpu, struct drm_intel_batch_timer_slot *slot)
+{
+	fake_lookup(gpu, slot)->busy = false;
+}
+
+static void
+test_basic(void)
+{
+	struct fake_gpu gpu;
+	struct drm_intel_batch_timer *timer;
+	struct drm_intel_batch_timer_slot *slot;
+	drm_intel_batch_timing timing;
+
+	memset(&gpu, 0, sizeof(gpu));
+	timer = drm_intel_batch_timer_create_with_ops(&fake_ops, &gpu, NULL);
+	check(timer != NULL, "timer creation");
+	if (timer == NULL)
+		return;
+
+	slot = timed_batch(timer, &gpu, I915_EXEC_BLT, 5, 100, 110, true);
+	check(slot != NULL && fake_lookup(&gpu, slot)->submits == 2,
+	      "both stamps submitted");
+
+	check(drm_intel_batch_timer_get(timer, &timing, 1) == 0,
+	      "no timing while the closing stamp is busy");
+
+	retire(&gpu, slot);
+	check(drm_intel_batch_timer_get(timer, &timing, 1) == 1 &&
+	      timing.seqno == 1 && timing.ring == I915_EXEC_BLT &&
+	      timing.ctx_id == 5 && timing.gpu_time_ns == 10 * 80,
+	      "timing of a retired batch");
+	check(drm_intel_batch_timer_get(timer, &timing, 1) == 0,
+	      "timings are handed out once");
+
+	/* The 32-bit register wraps between the stamps. */
+	slot = timed_batch(timer, &gpu, I915_EXEC_RENDER, 0,
+			   0xfffffff0, 0x10, true);
+	retire(&gpu, slot);
+	check(drm_intel_batch_timer_get(timer, &timing, 1) == 1 &&
+	      timing.seqno == 2 && timing.gpu_time_ns == 0x20 * 80,
+	      "timestamp wraparound");
+
+	drm_intel_batch_timer_destroy(timer);
+}
+
+static void
+test_order(void)
+{
+	struct fake_gpu gpu;
+	struct drm_intel_batch_timer *timer;
+	struct drm_intel_batch_timer_slot *first, *second;
+	drm_intel_batch_timing timings[2];
+
+	memset(&gpu, 0, sizeof(gpu));
+	timer = drm_intel_batch_timer_create_with_ops(&fake_ops, &gpu, NULL);
+	if (timer == NULL)
+		return;
+
+	first = timed_batch(timer, &gpu, I915_EXEC_RENDER, 0, 0, 1, true);
+	second = timed_batch(timer, &gpu, I915_EXEC_BSD, 0, 0, 2, true);
+
+	/* Retirement stops at the oldest slot still in flight. */
+	retire(&gpu, second);
+	check(drm_intel_batch_timer_get(timer, timings, 2) == 0,
+	      "later batch held back by an earlier busy one");
+
+	retire(&gpu, first);
+	check(drm_intel_batch_timer_get(timer, timings, 2) == 2 &&
+	      timings[0].seqno == 1 && timings[0].ring == I915_EXEC_RENDER &&
+	      timings[1].seqno == 2 && timings[1].ring == I915_EXEC_BSD,
+	      "timings retired oldest first");
+
+	drm_intel_batch_timer_destroy(timer);
+}
+
+static void
+test_failed_submission(void)
+{
+	struct fake_gpu gpu;
+	struct drm_intel_batch_timer *timer;
+	struct drm_intel_batch_timer_slot *slot;
+	drm_intel_batch_timing timing;
+
+	memset(&gpu, 0, sizeof(gpu));
+	timer = drm_intel_batch_timer_create_with_ops(&fake_ops, &gpu, NULL);
+	if (timer == NULL)
+		return;
+
+	/* A batch that failed to submit is not timed or numbered... */
+	slot = timed_batch(timer, &gpu, I915_EXEC_RENDER, 0, 0, 1, false);
+	retire(&gpu, slot);
+	check(drm_intel_batch_timer_get(timer, &timing, 1) == 0,
+	      "failed batch untimed");
+
+	/* ...and neither is one whose closing stamp failed. */
+	gpu.fail_end = true;
+	slot = timed_batch(timer, &gpu, I915_EXEC_RENDER, 0, 0, 1, true);
+	retire(&gpu, slot);
+	check(drm_intel_batch_timer_get(timer, &timing, 1) == 0,
+	      "batch without a closing stamp untimed");
+
+	slot = timed_batch(timer, &gpu, I915_EXEC_RENDER, 0, 0, 1, true);
+	retire(&gpu, slot);
+	check(drm_intel_batch_timer_get(timer, &timing, 1) == 1 &&
+	      timing.seqno == 1, "numbering skips untimed batches");
+
+	drm_intel_batch_timer_destroy(timer);
+}
+
+static void
+test_exhaustion(void)
+{
+	struct fake_gpu gpu;
+	struct drm_intel_batch_timer *timer;
+	struct drm_intel_batch_timer_slot *slots[MAX_SLOTS], *slot;
+	drm_intel_batch_timing timing;
+	int i, n;
+
+	memset(&gpu, 0, sizeof(gpu));
+	timer = drm_intel_batch_timer_create_with_ops(&fake_ops, &gpu, NULL);
+	if (timer == NULL)
+		return;
+
+	/* With every slot in flight, further batches go untimed. */
+	for (n = 0; n < MAX_SLOTS; n++) {
+		slots[n] = timed_batch(timer, &gpu, I915_EXEC_RENDER, 0,
+				       0, 1, true);
+		if (slots[n] == NULL)
+			break;
+	}
+	check(n > 0 && n < MAX_SLOTS, "slots run out");
+
+	retire(&gpu, slots[0]);
+	slot = timed_batch(timer, &gpu, I915_EXEC_RENDER, 0, 0, 1, true);
+	check(slot == slots[0], "retired slot reused");
+
+	for (i = 1; i < n; i++)
+		retire(&gpu, slots[i]);
+	retire(&gpu, slot);
+	for (i = 0; drm_intel_batch_timer_get(timer, &timing, 1) == 1; i++)
+		check(timing.seqno == (uint64_t)i + 1, "seqnos in order");
+	check(i == n + 1, "every timed batch reported");
+
+	drm_intel_batch_timer_destroy(timer);
+}
+
+static void
+test_overflow(void)
+{
+	struct fake_gpu gpu;
+	struct drm_intel_batch_timer *timer;
+	struct drm_intel_batch_timer_slot *slot;
+	drm_intel_batch_timing timing;
+	int i, n;
+
+	memset(&gpu, 0, sizeof(gpu));
+	timer = drm_intel_batch_timer_create_with_ops(&fake_ops, &gpu, NULL);
+	if (timer == NULL)
+		return;
+
+	/* Uncollected timings are kept up to a limit, dropping the oldest. */
+	for (i = 0; i < 1000; i++) {
+		slot = timed_batch(timer, &gpu, I915_EXEC_RENDER, 0, 0, 1, true);
+		retire(&gpu, slot);
+	}
+
+	check(drm_intel_batch_timer_get(timer, &timing, 1) == 1,
+	      "timings kept");
+	n = 1;
+	while (drm_intel_batch_timer_get(timer, &timing, 1) == 1)
+		n++;
+	check(n < 1000 && timing.seqno == 1000, "oldest timings dropped");
+
+	drm_intel_batch_timer_destroy(timer);
+}
+
+int
+main(void)
+{
+	test_basic();
+	test_order();
+	test_failed_submission();
+	test_exhaustion();
+	test_overflow();
+
+	if (failures) {
+		fprintf(stderr, "%d failures\n", failures);
+		return 1;
+	}
+
+	return 0;
+}
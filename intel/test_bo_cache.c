@@ -0,0 +1,347 @@
+/*
+ * Copyright © 2013 Intel Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+/*
+ * Checks the per-thread BO caches: freed BOs are reused by the thread that
+ * freed them, age out like those of the shared cache, and a busy BO at the
+ * head of a thread's cache doesn't stop an idle one being taken from the
+ * shared cache.  Their reuse counts can be read while they are in use,
+ * and trimming the cache empties them.  Also checks that the cache reaper
+ * frees aged BOs.
+ * Skipped without an i915 device, or with INTEL_TEST_DEVICE naming one
+ * that isn't there.
+ */
+
+#define _GNU_SOURCE
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+
+#include "config.h"
+#include "intel_bufmgr.h"
+#include "i915_drm.h"
+
+#define SKIP		77
+
+#define MI_BATCH_BUFFER_END	(0xA << 23)
+
+#define BO_SIZE		4096
+/* Too large for the thread caches */
+#define LARGE_BO_SIZE	(1024 * 1024)
+
+#define REAPER_AGE_MS	100
+
+#define STATS_THREADS	4
+#define STATS_ALLOCS	10000
+
+static int failures;
+
+static void
+check(int cond, const char *what)
+{
+	if (!cond) {
+		fprintf(stderr, "FAIL %s\n", what);
+		failures++;
+	}
+}
+
+static uint64_t
+cache_hits(drm_intel_bufmgr *bufmgr)
+{
+	drm_intel_bufmgr_gem_cache_stats stats;
+
+	drm_intel_bufmgr_gem_get_cache_stats(bufmgr, &stats);
+	return stats.tiling[I915_TILING_NONE].hits;
+}
+
+static uint64_t
+cache_misses(drm_intel_bufmgr *bufmgr)
+{
+	drm_intel_bufmgr_gem_cache_stats stats;
+
+	drm_intel_bufmgr_gem_get_cache_stats(bufmgr, &stats);
+	return stats.tiling[I915_TILING_NONE].misses;
+}
+
+static uint64_t
+cache_uses(drm_intel_bufmgr *bufmgr)
+{
+	drm_intel_bufmgr_gem_cache_stats stats;
+
+	drm_intel_bufmgr_gem_get_cache_stats(bufmgr, &stats);
+	return stats.tiling[I915_TILING_NONE].hits +
+		stats.tiling[I915_TILING_NONE].retiled +
+		stats.tiling[I915_TILING_NONE].misses;
+}
+
+static void
+test_reuse(drm_intel_bufmgr *bufmgr)
+{
+	drm_intel_bo *bo;
+	uint64_t hits;
+	int handle;
+
+	bo = drm_intel_bo_alloc(bufmgr, "reuse", BO_SIZE, 4096);
+	check(bo != NULL, "allocation");
+	if (bo == NULL)
+		return;
+	handle = bo->handle;
+	drm_intel_bo_unreference(bo);
+
+	hits = cache_hits(bufmgr);
+	bo = drm_intel_bo_alloc(bufmgr, "reuse", BO_SIZE, 4096);
+	check(bo != NULL && bo->handle == handle &&
+	      cache_hits(bufmgr) == hits + 1,
+	      "freed BO reused from the thread cache");
+	drm_intel_bo_unreference(bo);
+}
+
+static void
+test_aging(drm_intel_bufmgr *bufmgr)
+{
+	drm_intel_bo *old, *young, *bo[2];
+	uint64_t misses;
+
+	old = drm_intel_bo_alloc(bufmgr, "old", BO_SIZE, 4096);
+	young = drm_intel_bo_alloc(bufmgr, "young", BO_SIZE, 4096);
+	check(old != NULL && young != NULL, "allocation");
+	if (old == NULL || young == NULL)
+		return;
+
+	/* Freeing a BO pushes out the ones cached for longer than the
+	 * shared cache keeps them.
+	 */
+	drm_intel_bo_unreference(old);
+	sleep(3);
+	drm_intel_bo_unreference(young);
+
+	misses = cache_misses(bufmgr);
+	bo[0] = drm_intel_bo_alloc(bufmgr, "aged", BO_SIZE, 4096);
+	bo[1] = drm_intel_bo_alloc(bufmgr, "aged", BO_SIZE, 4096);
+	check(bo[0] != NULL && bo[1] != NULL &&
+	      cache_misses(bufmgr) == misses + 1,
+	      "aged BO dropped from the thread cache");
+	drm_intel_bo_unreference(bo[0]);
+	drm_intel_bo_unreference(bo[1]);
+}
+
+static void *
+free_in_thread(void *data)
+{
+	/* The thread's cache goes back to the shared one as it exits. */
+	drm_intel_bo_unreference(data);
+	return NULL;
+}
+
+static void
+test_busy_fallback(drm_intel_bufmgr *bufmgr)
+{
+	drm_intel_bo *batch, *busy, *idle, *bo;
+	uint32_t cmd[2] = { MI_BATCH_BUFFER_END, 0 };
+	pthread_t thread;
+	uint64_t misses;
+
+	batch = drm_intel_bo_alloc(bufmgr, "batch", 4096, 4096);
+	busy = drm_intel_bo_alloc(bufmgr, "busy", BO_SIZE, 4096);
+	idle = drm_intel_bo_alloc(bufmgr, "idle", BO_SIZE, 4096);
+	check(batch != NULL && busy != NULL && idle != NULL, "allocation");
+	if (batch == NULL || busy == NULL || idle == NULL)
+		return;
+
+	/* Put an idle BO in the shared cache... */
+	if (pthread_create(&thread, NULL, free_in_thread, idle)) {
+		free_in_thread(idle);
+	} else {
+		pthread_join(thread, NULL);
+	}
+
+	/* ...and a busy one in this thread's cache. */
+	drm_intel_bo_subdata(batch, 0, sizeof(cmd), cmd);
+	drm_intel_bo_emit_reloc(batch, 4, busy, 0,
+				I915_GEM_DOMAIN_RENDER, I915_GEM_DOMAIN_RENDER);
+	check(drm_intel_bo_exec(batch, sizeof(cmd), NULL, 0, 0) == 0,
+	      "batch submission");
+	drm_intel_bo_unreference(busy);
+
+	misses = cache_misses(bufmgr);
+	bo = drm_intel_bo_alloc(bufmgr, "fallback", BO_SIZE, 4096);
+	check(bo != NULL && cache_misses(bufmgr) == misses,
+	      "shared cache used while the thread cache is busy");
+	drm_intel_bo_unreference(bo);
+	drm_intel_bo_unreference(batch);
+}
+
+static void
+test_reaper_aging(int fd)
+{
+	drm_intel_bufmgr *bufmgr;
+	drm_intel_bo *bo;
+	uint64_t hits, misses;
+
+	bufmgr = drm_intel_bufmgr_gem_init(fd, 4096);
+	if (bufmgr == NULL)
+		return;
+	drm_intel_bufmgr_gem_enable_reuse(bufmgr);
+	check(drm_intel_bufmgr_gem_enable_cache_reaper(bufmgr,
+						       REAPER_AGE_MS) == 0,
+	      "reaper start");
+
+	bo = drm_intel_bo_alloc(bufmgr, "reaped", LARGE_BO_SIZE, 4096);
+	check(bo != NULL, "allocation");
+	if (bo == NULL)
+		goto out;
+	drm_intel_bo_unreference(bo);
+
+	hits = cache_hits(bufmgr);
+	bo = drm_intel_bo_alloc(bufmgr, "reaped", LARGE_BO_SIZE, 4096);
+	check(bo != NULL && cache_hits(bufmgr) == hits + 1,
+	      "young BO reused");
+	drm_intel_bo_unreference(bo);
+
+	usleep(REAPER_AGE_MS * 1000 * 5);
+
+	misses = cache_misses(bufmgr);
+	bo = drm_intel_bo_alloc(bufmgr, "reaped", LARGE_BO_SIZE, 4096);
+	check(bo != NULL && cache_misses(bufmgr) == misses + 1,
+	      "aged BO freed by the reaper");
+	drm_intel_bo_unreference(bo);
+
+out:
+	drm_intel_bufmgr_destroy(bufmgr);
+}
+
+static void
+test_trim(drm_intel_bufmgr *bufmgr)
+{
+	drm_intel_bo *small, *large;
+	uint64_t misses;
+
+	small = drm_intel_bo_alloc(bufmgr, "small", BO_SIZE, 4096);
+	large = drm_intel_bo_alloc(bufmgr, "large", LARGE_BO_SIZE, 4096);
+	check(small != NULL && large != NULL, "allocation");
+	if (small == NULL || large == NULL)
+		return;
+
+	/* One goes to this thread's cache, the other to the shared one;
+	 * memory pressure empties both.
+	 */
+	drm_intel_bo_unreference(small);
+	drm_intel_bo_unreference(large);
+	drm_intel_bufmgr_gem_trim_cache(bufmgr);
+
+	misses = cache_misses(bufmgr);
+	small = drm_intel_bo_alloc(bufmgr, "small", BO_SIZE, 4096);
+	large = drm_intel_bo_alloc(bufmgr, "large", LARGE_BO_SIZE, 4096);
+	check(small != NULL && large != NULL &&
+	      cache_misses(bufmgr) == misses + 2,
+	      "trimming empties the thread and shared caches");
+	drm_intel_bo_unreference(small);
+	drm_intel_bo_unreference(large);
+}
+
+static void *
+alloc_in_thread(void *data)
+{
+	drm_intel_bufmgr *bufmgr = data;
+	drm_intel_bo *bo;
+	int i;
+
+	for (i = 0; i < STATS_ALLOCS; i++) {
+		bo = drm_intel_bo_alloc(bufmgr, "stats", BO_SIZE, 4096);
+		if (bo == NULL)
+			break;
+		drm_intel_bo_unreference(bo);
+	}
+
+	return NULL;
+}
+
+static void
+test_stats(drm_intel_bufmgr *bufmgr)
+{
+	pthread_t threads[STATS_THREADS];
+	uint64_t start, last, uses;
+	int i, n;
+
+	/* The counts of the thread caches are read while they change, and
+	 * must add up once the threads are done.
+	 */
+	start = last = cache_uses(bufmgr);
+	for (n = 0; n < STATS_THREADS; n++) {
+		if (pthread_create(&threads[n], NULL, alloc_in_thread, bufmgr))
+			break;
+	}
+
+	for (i = 0; i < STATS_ALLOCS; i++) {
+		uses = cache_uses(bufmgr);
+		check(uses >= last, "cache counts never go back");
+		last = uses;
+	}
+
+	for (i = 0; i < n; i++)
+		pthread_join(threads[i], NULL);
+	check(cache_uses(bufmgr) == start + (uint64_t)n * STATS_ALLOCS,
+	      "every allocation counted once");
+}
+
+int
+main(void)
+{
+	const char *device = getenv("INTEL_TEST_DEVICE");
+	drm_intel_bufmgr *bufmgr;
+	int fd;
+
+	fd = open(device ? device : "/dev/dri/card0", O_RDWR);
+	if (fd < 0)
+		return SKIP;
+
+	bufmgr = drm_intel_bufmgr_gem_init(fd, 4096);
+	if (bufmgr == NULL) {
+		close(fd);
+		return SKIP;
+	}
+	drm_intel_bufmgr_gem_enable_reuse(bufmgr);
+	drm_intel_bufmgr_gem_enable_thread_cache(bufmgr);
+
+	test_reuse(bufmgr);
+	test_aging(bufmgr);
+	test_busy_fallback(bufmgr);
+	test_stats(bufmgr);
+	test_trim(bufmgr);
+	test_reaper_aging(fd);
+
+	drm_intel_bufmgr_destroy(bufmgr);
+	close(fd);
+
+	if (failures) {
+		fprintf(stderr, "%d failures\n", failures);
+		return 1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,118 @@
+/*
+ * Copyright © 2013 Intel Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+/*
+ * Checks that dropping an extra reference to a BO leaves it alive, and
+ * that dropping the last one frees it into the BO cache.  Skipped without
+ * an i915 device, or with INTEL_TEST_DEVICE naming one that isn't there.
+ */
+
+#define _GNU_SOURCE
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "config.h"
+#include "intel_bufmgr.h"
+
+#define SKIP		77
+
+static int failures;
+
+static void
+check(int cond, const char *what)
+{
+	if (!cond) {
+		fprintf(stderr, "FAIL %s\n", what);
+		failures++;
+	}
+}
+
+int
+main(void)
+{
+	const char *device = getenv("INTEL_TEST_DEVICE");
+	drm_intel_bufmgr *bufmgr;
+	drm_intel_bo *bo, *other, *again[2];
+	uint32_t data = 0xdeadbeef, readback = 0;
+	int handle;
+	int fd;
+
+	fd = open(device ? device : "/dev/dri/card0", O_RDWR);
+	if (fd < 0)
+		return SKIP;
+
+	bufmgr = drm_intel_bufmgr_gem_init(fd, 4096);
+	if (bufmgr == NULL) {
+		close(fd);
+		return SKIP;
+	}
+	drm_intel_bufmgr_gem_enable_reuse(bufmgr);
+
+	bo = drm_intel_bo_alloc(bufmgr, "test", 4096, 4096);
+	check(bo != NULL, "allocation");
+	if (bo == NULL)
+		return 1;
+	handle = bo->handle;
+
+	/* An extra reference taken and dropped leaves the BO alive... */
+	drm_intel_bo_reference(bo);
+	drm_intel_bo_unreference(bo);
+
+	check(drm_intel_bo_subdata(bo, 0, sizeof(data), &data) == 0 &&
+	      drm_intel_bo_get_subdata(bo, 0, sizeof(readback),
+				       &readback) == 0 &&
+	      readback == data, "BO usable after dropping an extra reference");
+
+	/* ...and out of the cache, so a new BO can't be handed the same one. */
+	other = drm_intel_bo_alloc(bufmgr, "other", 4096, 4096);
+	check(other != NULL && other->handle != handle,
+	      "live BO not reallocated");
+	drm_intel_bo_unreference(other);
+
+	/* Dropping the last reference frees it into the cache, next to the
+	 * other one.
+	 */
+	drm_intel_bo_unreference(bo);
+	again[0] = drm_intel_bo_alloc(bufmgr, "again", 4096, 4096);
+	again[1] = drm_intel_bo_alloc(bufmgr, "again", 4096, 4096);
+	check(again[0] != NULL && again[1] != NULL &&
+	      (again[0]->handle == handle || again[1]->handle == handle),
+	      "freed BO reused from the cache");
+	drm_intel_bo_unreference(again[0]);
+	drm_intel_bo_unreference(again[1]);
+
+	drm_intel_bufmgr_destroy(bufmgr);
+	close(fd);
+
+	if (failures) {
+		fprintf(stderr, "%d failures\n", failures);
+		return 1;
+	}
+
+	return 0;
+}
@@ -26,19 +26,22 @@
 #include <string.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <stdint.h>
 #include <unistd.h>
-#include <fcntl.h>
-#include <sys/types.h>
-#include <sys/stat.h>
-#include <sys/mman.h>
 #include <err.h>
 
 #include "config.h"
 #include "intel_bufmgr.h"
-#include "intel_chipset.h"
+#include "decode_util.h"
 
 #define HW_OFFSET 0x12300000
 
+struct output {
+	char *data;
+	size_t size;
+	size_t alloc;
+};
+
 static void
 usage(void)
 {
@@ -49,40 +52,165 @@ usage(void)
 }
 
 static void
-read_file(const char *filename, void **ptr, size_t *size)
+dump_batch(struct drm_intel_decode *ctx, const char *batch_filename)
 {
-	int fd, ret;
-	struct stat st;
+	void *batch_ptr;
+	size_t batch_size;
 
-	fd = open(filename, O_RDONLY);
-	if (fd == -1)
-		errx(1, "couldn't open `%s'", filename);
+	decode_read_file(batch_filename, &batch_ptr, &batch_size);
 
-	ret = fstat(fd, &st);
-	if (ret)
-		errx(1, "couldn't stat `%s'", filename);
+	drm_intel_decode_set_batch_pointer(ctx, batch_ptr, HW_OFFSET,
+					   batch_size / 4);
+	drm_intel_decode_set_output_file(ctx, stdout);
 
-	*size = st.st_size;
-	*ptr = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
-	if (*ptr == MAP_FAILED)
-		errx(1, "couldn't map `%s'", filename);
+	drm_intel_decode(ctx);
+}
+
+static void
+append_output(void *closure, const char *data, size_t size)
+{
+	struct output *out = closure;
 
-	close(fd);
+	if (out->size + size > out->alloc) {
+		out->alloc = (out->size + size) * 2;
+		out->data = realloc(out->data, out->alloc + 1);
+		if (out->data == NULL)
+			errx(1, "out of memory");
+	}
+	memcpy(out->data + out->size, data, size);
+	out->size += size;
+	out->data[out->size] = '\0';
 }
 
 static void
-dump_batch(struct drm_intel_decode *ctx, const char *batch_filename)
+decode_records(struct drm_intel_decode *ctx, enum drm_intel_decode_format format,
+	       struct output *out)
 {
-	void *batch_ptr;
-	size_t batch_size;
+	memset(out, 0, sizeof(*out));
+	drm_intel_decode_set_output_format(ctx, format);
+	drm_intel_decode_set_output_func(ctx, append_output, out);
+	drm_intel_decode(ctx);
+	drm_intel_decode_set_output_format(ctx, DRM_INTEL_DECODE_FORMAT_TEXT);
+}
 
-	read_file(batch_filename, &batch_ptr, &batch_size);
+static void
+record_mismatch(const char *batch_filename, const char *format,
+		unsigned int n, const char *what)
+{
+	fprintf(stderr, "%s: %s record %u: %s\n", batch_filename, format, n,
+		what);
+	exit(1);
+}
 
-	drm_intel_decode_set_batch_pointer(ctx, batch_ptr, HW_OFFSET,
-					   batch_size / 4);
-	drm_intel_decode_set_output_file(ctx, stdout);
+/*
+ * Checks the binary and JSON records of the batch against each other and
+ * against the batch itself: the packets must follow one another from the
+ * start of the batch, and every field must hold the dword it names.
+ */
+static void
+check_records(struct drm_intel_decode *ctx, const char *batch_filename,
+	      const uint32_t *batch, uint32_t count)
+{
+	struct output bin, json;
+	const char *p, *line;
+	uint32_t offset = HW_OFFSET;
+	unsigned int n = 0;
+
+	decode_records(ctx, DRM_INTEL_DECODE_FORMAT_BINARY, &bin);
+	decode_records(ctx, DRM_INTEL_DECODE_FORMAT_JSON, &json);
+
+	p = bin.data;
+	line = json.data;
+	while (p < bin.data + bin.size) {
+		struct drm_intel_decode_record rec;
+		const struct drm_intel_decode_field *fields;
+		unsigned int offset_j, type_j, opcode_j, gen_j, length_j;
+		uint32_t i, start;
+		int len;
+
+		if ((size_t)(bin.data + bin.size - p) < sizeof(rec))
+			record_mismatch(batch_filename, "binary", n, "truncated");
+		memcpy(&rec, p, sizeof(rec));
+		if (rec.size != sizeof(rec) +
+		    rec.num_fields * sizeof(*fields) +
+		    rec.num_addresses * sizeof(uint32_t) ||
+		    rec.size > (size_t)(bin.data + bin.size - p))
+			record_mismatch(batch_filename, "binary", n, "bad size");
+		if (rec.offset != offset || rec.length == 0)
+			record_mismatch(batch_filename, "binary", n,
+					"not following the previous packet");
+		if (rec.num_addresses > rec.num_fields)
+			record_mismatch(batch_filename, "binary", n,
+					"more addresses than fields");
+
+		start = (rec.offset - HW_OFFSET) / 4;
+		if (start < count &&
+		    (rec.type != batch[start] >> 29 ||
+		     rec.opcode != (rec.type == 0 ? (batch[start] >> 23) & 0x3f :
+				    rec.type == 2 ? (batch[start] >> 22) & 0x7f :
+				    batch[start] >> 16)))
+			record_mismatch(batch_filename, "binary", n,
+					"header doesn't match the batch");
+
+		fields = (const void *)(p + sizeof(rec));
+		for (i = 0; i < rec.num_fields; i++) {
+			if (fields[i].index >= rec.length)
+				record_mismatch(batch_filename, "binary", n,
+						"field outside the packet");
+			if (start + fields[i].index < count &&
+			    fields[i].value != batch[start + fields[i].index])
+				record_mismatch(batch_filename, "binary", n,
+						"field doesn't match the batch");
+		}
+
+		if (line == NULL || *line == '\0')
+			record_mismatch(batch_filename, "JSON", n, "missing");
+		if (sscanf(line, "{\"offset\":%u,\"type\":%u,\"opcode\":%u,"
+			   "\"gen\":%u,\"length\":%u,\"fields\":[%n",
+			   &offset_j, &type_j, &opcode_j, &gen_j, &length_j,
+			   &len) != 5)
+			record_mismatch(batch_filename, "JSON", n, "unparsable");
+		if (offset_j != rec.offset || type_j != rec.type ||
+		    opcode_j != rec.opcode || gen_j != rec.gen ||
+		    length_j != rec.length)
+			record_mismatch(batch_filename, "JSON", n,
+					"header differs from binary");
+		line += len;
+		for (i = 0; i < rec.num_fields; i++) {
+			unsigned int index_j, value_j;
+
+			if (i && *line == ',')
+				line++;
+			if (sscanf(line, "[%u,%u]%n",
+				   &index_j, &value_j, &len) != 2)
+				record_mismatch(batch_filename, "JSON", n,
+						"missing field");
+			if (index_j != fields[i].index ||
+			    value_j != fields[i].value)
+				record_mismatch(batch_filename, "JSON", n,
+						"field differs from binary");
+			line += len;
+		}
+		if (strncmp(line, "],\"addresses\":[", 15) != 0)
+			record_mismatch(batch_filename, "JSON", n,
+					"extra fields");
+
+		line = strchr(line, '\n');
+		if (line)
+			line++;
+		offset += rec.length * 4;
+		p += rec.size;
+		n++;
+	}
 
-	drm_intel_decode(ctx);
+	if (n == 0 || offset < HW_OFFSET + count * 4)
+		record_mismatch(batch_filename, "binary", n,
+				"batch not covered");
+	if (line != NULL && *line != '\0')
+		record_mismatch(batch_filename, "JSON", n, "extra record");
+
+	free(bin.data);
+	free(json.data);
 }
 
 static void
@@ -98,8 +226,8 @@ compare_batch(struct drm_intel_decode *ctx, const char *batch_filename)
 	sprintf(ref_filename, "%s%s", batch_filename, ref_suffix);
 
 	/* Read the batch and reference. */
-	read_file(batch_filename, &batch_ptr, &batch_size);
-	read_file(ref_filename, &ref_ptr, &ref_size);
+	decode_read_file(batch_filename, &batch_ptr, &batch_size);
+	decode_read_file(ref_filename, &ref_ptr, &ref_size);
 
 	/* Set up our decode output in memory, because I don't want to
 	 * figure out how to output to a file in a safe and sane way
@@ -129,45 +257,88 @@ compare_batch(struct drm_intel_decode *ctx, const char *batch_filename)
 	fclose(out);
 	free(ref_filename);
 	free(ptr);
+
+	check_records(ctx, batch_filename, batch_ptr, batch_size / 4);
 }
 
-static uint16_t
-infer_devid(const char *batch_filename)
+/*
+ * Decodes a small gen6 batch with state tracking on: of its three
+ * 3DSTATE_DRAWING_RECTANGLE packets only the second repeats the first, and
+ * the repeated MEDIA_OBJECT and PIPE_CONTROL packets aren't state at all.
+ */
+static void
+check_state_tracking(void)
 {
-	struct {
-		const char *name;
-		uint16_t devid;
-	} chipsets[] = {
-		{ "830",  0x3577},
-		{ "855",  0x3582},
-		{ "945",  0x2772},
-		{ "gen4", 0x2a02 },
-		{ "gm45", 0x2a42 },
-		{ "gen5", PCI_CHIP_ILD_G },
-		{ "gen6", PCI_CHIP_SANDYBRIDGE_GT2 },
-		{ "gen7", PCI_CHIP_IVYBRIDGE_GT2 },
-		{ NULL, 0 },
+	static const uint32_t batch[] = {
+		0x79000002, 0x00000000, 0x00ff00ff, 0x00000000,
+		0x79000002, 0x00000000, 0x00ff00ff, 0x00000000,
+		0x79000002, 0x00000000, 0x00ff00ff, 0x00010001,
+		0x71000004, 0x00000000, 0x00000000, 0x00000000,
+		0x00000000, 0x00000000,
+		0x71000004, 0x00000000, 0x00000000, 0x00000000,
+		0x00000000, 0x00000000,
+		0x7a000002, 0x00000000, 0x00000000, 0x00000000,
+		0x7a000002, 0x00000000, 0x00000000, 0x00000000,
+		0x05000000, 0x00000000,
 	};
-	int i;
-
-	for (i = 0; chipsets[i].name != NULL; i++) {
-		if (strstr(batch_filename, chipsets[i].name))
-			return chipsets[i].devid;
+	struct drm_intel_decode *ctx;
+	struct output text;
+	unsigned long long packets, redundant, dwords, redundant_dwords;
+	char line[256];
+	FILE *summary;
+	int found = 0;
+
+	ctx = drm_intel_decode_context_alloc(decode_infer_devid("gen6"));
+	summary = tmpfile();
+	if (ctx == NULL || summary == NULL)
+		errx(1, "couldn't set up the state tracking check");
+
+	drm_intel_decode_set_batch_pointer(ctx, (uint32_t *)batch, HW_OFFSET,
+					   sizeof(batch) / 4);
+	drm_intel_decode_set_state_tracking(ctx,
+					    DRM_INTEL_DECODE_STATE_PER_BATCH);
+	decode_records(ctx, DRM_INTEL_DECODE_FORMAT_TEXT, &text);
+	drm_intel_decode_print_state_summary(ctx, summary);
+
+	rewind(summary);
+	while (fgets(line, sizeof(line), summary)) {
+		if (sscanf(line, "total %llu %llu %llu %llu", &packets,
+			   &redundant, &dwords, &redundant_dwords) == 4)
+			found = 1;
+	}
+	if (!found || packets != 3 || redundant != 1 ||
+	    dwords != 12 || redundant_dwords != 4) {
+		fprintf(stderr, "Wrong redundant state summary:\n");
+		rewind(summary);
+		while (fgets(line, sizeof(line), summary))
+			fputs(line, stderr);
+		exit(1);
 	}
 
+	fclose(summary);
+	free(text.data);
+	drm_intel_decode_context_free(ctx);
+}
+
+static uint32_t
+infer_devid(const char *batch_filename)
+{
+	uint32_t devid = decode_infer_devid(batch_filename);
+
+	if (devid != 0)
+		return devid;
+
 	fprintf(stderr, "Couldn't guess chipset id from batch filename `%s'.\n",
 		batch_filename);
 	fprintf(stderr, "Must be contain one of:\n");
-	for (i = 0; chipsets[i].name != NULL; i++) {
-		fprintf(stderr, "  %s\n", chipsets[i].name);
-	}
+	decode_print_chipsets(stderr);
 	exit(1);
 }
 
 int
 main(int argc, char **argv)
 {
-	uint16_t devid;
+	uint32_t devid;
 	struct drm_intel_decode *ctx;
 
 	if (argc < 2)
@@ -185,6 +356,7 @@ main(int argc, char **argv)
 			usage();
 	} else {
 		compare_batch(ctx, argv[1]);
+		check_state_tracking();
 	}
 
 	drm_intel_decode_context_free(ctx);
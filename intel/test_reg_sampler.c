@@ -0,0 +1,133 @@
+/*
+ * Copyright © 2013 Intel Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+/*
+ * Checks that the register sampler's wakeup fd stays readable while a
+ * consumer reading a few samples at a time leaves a backlog behind, with
+ * the ring full and the sampler no longer adding to it.  Skipped without
+ * an i915 device, or with INTEL_TEST_DEVICE naming one that isn't there.
+ */
+
+#define _GNU_SOURCE
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+
+#include "config.h"
+#include "intel_bufmgr.h"
+
+#define SKIP		77
+
+/* Render ring timestamp; the sampler doesn't mind if it can't be read */
+#define TIMESTAMP	0x2358
+
+#define SLOTS		16
+#define PERIOD_NS	100000
+
+static int failures;
+
+static void
+check(int cond, const char *what)
+{
+	if (!cond) {
+		fprintf(stderr, "FAIL %s\n", what);
+		failures++;
+	}
+}
+
+static int
+readable(int fd, int timeout_ms)
+{
+	struct pollfd pfd;
+
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+	pfd.revents = 0;
+
+	return poll(&pfd, 1, timeout_ms) == 1 && (pfd.revents & POLLIN);
+}
+
+static void
+test_chunked_read(drm_intel_bufmgr *bufmgr)
+{
+	const uint32_t reg = TIMESTAMP;
+	drm_intel_reg_sampler *sampler;
+	uint64_t samples[2 * 2];
+	int fd, i;
+
+	sampler = drm_intel_reg_sampler_create(bufmgr, &reg, 1, PERIOD_NS,
+					       SLOTS, -1);
+	check(sampler != NULL, "sampler creation");
+	if (sampler == NULL)
+		return;
+	fd = drm_intel_reg_sampler_get_fd(sampler);
+
+	check(readable(fd, 1000), "wakeup once samples are waiting");
+
+	/* Let the ring fill up, so that no new sample signals the fd. */
+	usleep(SLOTS * PERIOD_NS / 1000 * 10);
+
+	/* Every read but the last few leaves a quarter of the ring or more. */
+	for (i = 0; i < SLOTS / 2 - 2; i++) {
+		check(drm_intel_reg_sampler_read(sampler, samples, 2) == 2,
+		      "chunk read");
+		check(readable(fd, 0), "wakeup kept while samples remain");
+	}
+
+	drm_intel_reg_sampler_destroy(sampler);
+}
+
+int
+main(void)
+{
+	const char *device = getenv("INTEL_TEST_DEVICE");
+	drm_intel_bufmgr *bufmgr;
+	int fd;
+
+	fd = open(device ? device : "/dev/dri/card0", O_RDWR);
+	if (fd < 0)
+		return SKIP;
+
+	bufmgr = drm_intel_bufmgr_gem_init(fd, 4096);
+	if (bufmgr == NULL) {
+		close(fd);
+		return SKIP;
+	}
+
+	test_chunked_read(bufmgr);
+
+	drm_intel_bufmgr_destroy(bufmgr);
+	close(fd);
+
+	if (failures) {
+		fprintf(stderr, "%d failures\n", failures);
+		return 1;
+	}
+
+	return 0;
+}
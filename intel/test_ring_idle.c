@@ -0,0 +1,179 @@
+/*
+ * Copyright © 2013 Intel Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+/*
+ * Checks that a BO used on one ring and then another isn't taken to be
+ * idle because its batch on the second ring was seen to complete, while
+ * the first ring may still be running.  Skipped without an i915 device
+ * with a blitter ring, or with INTEL_TEST_DEVICE naming one that isn't
+ * there.
+ */
+
+#define _GNU_SOURCE
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "config.h"
+#include "xf86drm.h"
+#include "intel_bufmgr.h"
+#include "i915_drm.h"
+
+#define SKIP		77
+
+#define MI_NOOP			0
+#define MI_BATCH_BUFFER_END	(0xA << 23)
+
+/* Long enough for the render ring to still be busy once the blitter idles */
+#define RENDER_BATCH_SIZE	(1024 * 1024)
+#define RENDER_BATCHES		16
+
+static int failures;
+
+static void
+check(int cond, const char *what)
+{
+	if (!cond) {
+		fprintf(stderr, "FAIL %s\n", what);
+		failures++;
+	}
+}
+
+static int
+has_blt(int fd)
+{
+	struct drm_i915_getparam gp;
+	int value = 0;
+
+	memset(&gp, 0, sizeof(gp));
+	gp.param = I915_PARAM_HAS_BLT;
+	gp.value = &value;
+	if (drmIoctl(fd, DRM_IOCTL_I915_GETPARAM, &gp))
+		return 0;
+
+	return value;
+}
+
+static int
+kernel_busy(int fd, drm_intel_bo *bo)
+{
+	struct drm_i915_gem_busy busy;
+
+	memset(&busy, 0, sizeof(busy));
+	busy.handle = bo->handle;
+	if (drmIoctl(fd, DRM_IOCTL_I915_GEM_BUSY, &busy))
+		return 1;
+
+	return busy.busy;
+}
+
+/*
+ * Fills @batch with @size bytes of commands to run, ending in a
+ * relocation to @target just past MI_BATCH_BUFFER_END.
+ */
+static int
+batch_init(drm_intel_bo *batch, int size, drm_intel_bo *target)
+{
+	uint32_t *cmd;
+	int n = size / 4;
+
+	if (drm_intel_bo_map(batch, 1))
+		return -1;
+	cmd = batch->virtual;
+	memset(cmd, MI_NOOP, size);
+	cmd[n - 2] = MI_BATCH_BUFFER_END;
+	drm_intel_bo_unmap(batch);
+
+	return drm_intel_bo_emit_reloc(batch, (n - 1) * 4, target, 0,
+				       I915_GEM_DOMAIN_RENDER, 0);
+}
+
+int
+main(void)
+{
+	const char *device = getenv("INTEL_TEST_DEVICE");
+	drm_intel_bufmgr *bufmgr;
+	drm_intel_bo *target, *render, *blt;
+	int busy, i, fd;
+
+	fd = open(device ? device : "/dev/dri/card0", O_RDWR);
+	if (fd < 0)
+		return SKIP;
+
+	bufmgr = drm_intel_bufmgr_gem_init(fd, 4096);
+	if (bufmgr == NULL || !has_blt(fd)) {
+		if (bufmgr)
+			drm_intel_bufmgr_destroy(bufmgr);
+		close(fd);
+		return SKIP;
+	}
+
+	target = drm_intel_bo_alloc(bufmgr, "target", 4096, 4096);
+	render = drm_intel_bo_alloc(bufmgr, "render", RENDER_BATCH_SIZE, 4096);
+	blt = drm_intel_bo_alloc(bufmgr, "blt", 4096, 4096);
+	if (target == NULL || render == NULL || blt == NULL ||
+	    batch_init(render, RENDER_BATCH_SIZE, target) ||
+	    batch_init(blt, 4096, target)) {
+		fprintf(stderr, "FAIL setup\n");
+		return 1;
+	}
+
+	/* Keep the render ring busy with the target... */
+	for (i = 0; i < RENDER_BATCHES; i++)
+		check(drm_intel_bo_mrb_exec(render, RENDER_BATCH_SIZE, NULL, 0, 0,
+					    I915_EXEC_RENDER) == 0,
+		      "render execbuffer");
+
+	/* ...use it on the blitter, and see that batch complete. */
+	check(drm_intel_bo_mrb_exec(blt, 4096, NULL, 0, 0,
+				    I915_EXEC_BLT) == 0, "blitter execbuffer");
+	while (drm_intel_bo_busy(blt))
+		;
+
+	/* The render ring only ever goes from busy to idle, so whatever we
+	 * were told, the kernel mustn't think otherwise after it.
+	 */
+	busy = drm_intel_bo_busy(target);
+	check(busy || !kernel_busy(fd, target),
+	      "BO used on two rings not idle before both are");
+
+	drm_intel_bo_wait_rendering(render);
+	check(!drm_intel_bo_busy(target), "BO idle once both rings are");
+
+	drm_intel_bo_unreference(target);
+	drm_intel_bo_unreference(render);
+	drm_intel_bo_unreference(blt);
+	drm_intel_bufmgr_destroy(bufmgr);
+	close(fd);
+
+	if (failures) {
+		fprintf(stderr, "%d failures\n", failures);
+		return 1;
+	}
+
+	return 0;
+}
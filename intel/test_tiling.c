@@ -0,0 +1,317 @@
+/*
+ * Copyright © 2013 Intel Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+/*
+ * Checks drm_intel_tiled_write_rect() and drm_intel_tiled_read_rect()
+ * against a byte at a time reference, over random rectangles for every
+ * tiling and CPU-visible swizzle mode.  With -b, measures their throughput
+ * instead.  Neither needs a GPU.
+ */
+
+#define _GNU_SOURCE
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <err.h>
+
+#include "config.h"
+#include "intel_bufmgr.h"
+#include "i915_drm.h"
+
+#define ROWS		128
+#define RECTS		200
+
+static const struct {
+	uint32_t tiling;
+	const char *name;
+	uint32_t pitches[3];
+} tilings[] = {
+	{ I915_TILING_NONE, "linear", { 100, 640, 4096 } },
+	{ I915_TILING_X, "X", { 512, 1536, 4096 } },
+	{ I915_TILING_Y, "Y", { 128, 384, 2048 } },
+};
+
+static const struct {
+	uint32_t swizzle;
+	const char *name;
+} swizzles[] = {
+	{ I915_BIT_6_SWIZZLE_NONE, "none" },
+	{ I915_BIT_6_SWIZZLE_9, "9" },
+	{ I915_BIT_6_SWIZZLE_9_10, "9_10" },
+	{ I915_BIT_6_SWIZZLE_9_11, "9_11" },
+	{ I915_BIT_6_SWIZZLE_9_10_11, "9_10_11" },
+};
+
+#define ARRAY_SIZE(a) (sizeof(a) / sizeof((a)[0]))
+
+static int failures;
+
+/* Address of byte x of row y, worked out one bit at a time. */
+static size_t
+reference_address(uint32_t tiling, uint32_t swizzle, uint32_t pitch,
+		  uint32_t x, uint32_t y)
+{
+	size_t addr;
+	int bit6;
+
+	switch (tiling) {
+	case I915_TILING_X:
+		addr = ((size_t)(y / 8) * (pitch / 512) + x / 512) * 4096;
+		addr += (y % 8) * 512 + x % 512;
+		break;
+	case I915_TILING_Y:
+		addr = ((size_t)(y / 32) * (pitch / 128) + x / 128) * 4096;
+		addr += (x % 128) / 16 * 16 * 32 + (y % 32) * 16 + x % 16;
+		break;
+	default:
+		return (size_t)y * pitch + x;
+	}
+
+	bit6 = 0;
+	switch (swizzle) {
+	case I915_BIT_6_SWIZZLE_9:
+		bit6 = (addr >> 9) & 1;
+		break;
+	case I915_BIT_6_SWIZZLE_9_10:
+		bit6 = ((addr >> 9) & 1) ^ ((addr >> 10) & 1);
+		break;
+	case I915_BIT_6_SWIZZLE_9_11:
+		bit6 = ((addr >> 9) & 1) ^ ((addr >> 11) & 1);
+		break;
+	case I915_BIT_6_SWIZZLE_9_10_11:
+		bit6 = ((addr >> 9) & 1) ^ ((addr >> 10) & 1) ^
+			((addr >> 11) & 1);
+		break;
+	}
+
+	return addr ^ (bit6 << 6);
+}
+
+static void
+check_rect(uint32_t tiling, uint32_t swizzle, uint32_t pitch,
+	   uint32_t x, uint32_t y, uint32_t width, uint32_t height,
+	   const char *tiling_name, const char *swizzle_name)
+{
+	size_t size = (size_t)pitch * ROWS;
+	uint32_t linear_pitch = width + 3;
+	uint8_t *tiled = malloc(size);
+	uint8_t *expected = malloc(size);
+	uint8_t *linear = malloc((size_t)linear_pitch * height + 1);
+	uint8_t *readback = malloc((size_t)linear_pitch * height + 1);
+	uint32_t i, j;
+	int ret;
+
+	if (!tiled || !expected || !linear || !readback)
+		errx(1, "out of memory");
+
+	for (j = 0; j < height; j++) {
+		for (i = 0; i < linear_pitch; i++)
+			linear[j * linear_pitch + i] = rand();
+	}
+
+	memset(tiled, 0xaa, size);
+	memset(expected, 0xaa, size);
+	for (j = 0; j < height; j++) {
+		for (i = 0; i < width; i++) {
+			size_t addr = reference_address(tiling, swizzle, pitch,
+							x + i, y + j);
+			expected[addr] = linear[j * linear_pitch + i];
+		}
+	}
+
+	ret = drm_intel_tiled_write_rect(tiled, tiling, swizzle, pitch,
+					 x, y, width, height,
+					 linear, linear_pitch);
+	if (ret || memcmp(tiled, expected, size) != 0) {
+		fprintf(stderr, "FAIL write %s tiling, swizzle %s, pitch %u, "
+			"%ux%u at %u,%u: %d\n", tiling_name, swizzle_name,
+			pitch, width, height, x, y, ret);
+		failures++;
+	}
+
+	memset(readback, 0, (size_t)linear_pitch * height);
+	ret = drm_intel_tiled_read_rect(readback, linear_pitch, tiled,
+					tiling, swizzle, pitch,
+					x, y, width, height);
+	for (j = 0; j < height && ret == 0; j++) {
+		if (memcmp(readback + j * linear_pitch,
+			   linear + j * linear_pitch, width) != 0)
+			ret = -1;
+	}
+	if (ret) {
+		fprintf(stderr, "FAIL read %s tiling, swizzle %s, pitch %u, "
+			"%ux%u at %u,%u: %d\n", tiling_name, swizzle_name,
+			pitch, width, height, x, y, ret);
+		failures++;
+	}
+
+	free(tiled);
+	free(expected);
+	free(linear);
+	free(readback);
+}
+
+static void
+check_errors(void)
+{
+	uint8_t buf[4096] = { 0 };
+
+	if (drm_intel_tiled_write_rect(buf, I915_TILING_X,
+				       I915_BIT_6_SWIZZLE_NONE, 256,
+				       0, 0, 1, 1, buf, 1) != -EINVAL ||
+	    drm_intel_tiled_write_rect(buf, I915_TILING_Y,
+				       I915_BIT_6_SWIZZLE_NONE, 128,
+				       64, 0, 65, 1, buf, 65) != -EINVAL ||
+	    drm_intel_tiled_write_rect(buf, I915_TILING_X,
+				       I915_BIT_6_SWIZZLE_9_17, 512,
+				       0, 0, 1, 1, buf, 1) != -ENODEV ||
+	    drm_intel_tiled_read_rect(buf, 1, buf, I915_TILING_Y,
+				      I915_BIT_6_SWIZZLE_UNKNOWN, 128,
+				      0, 0, 1, 1) != -ENODEV) {
+		fprintf(stderr, "FAIL invalid layouts not rejected\n");
+		failures++;
+	}
+}
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void
+bench(void)
+{
+	const uint32_t pitch = 4096, height = 1024;
+	const int iterations = 100;
+	size_t size = (size_t)pitch * height;
+	uint8_t *tiled = malloc(size);
+	uint8_t *linear = malloc(size);
+	unsigned int t, s;
+	int i;
+
+	if (!tiled || !linear)
+		errx(1, "out of memory");
+	memset(linear, 1, size);
+	memset(tiled, 2, size);
+
+	for (t = 0; t < ARRAY_SIZE(tilings); t++) {
+		for (s = 0; s < ARRAY_SIZE(swizzles); s++) {
+			double start, write, read;
+
+			if (tilings[t].tiling == I915_TILING_NONE && s > 0)
+				break;
+
+			start = now();
+			for (i = 0; i < iterations; i++)
+				drm_intel_tiled_write_rect(tiled,
+							   tilings[t].tiling,
+							   swizzles[s].swizzle,
+							   pitch, 0, 0,
+							   pitch, height,
+							   linear, pitch);
+			write = now() - start;
+
+			start = now();
+			for (i = 0; i < iterations; i++)
+				drm_intel_tiled_read_rect(linear, pitch, tiled,
+							  tilings[t].tiling,
+							  swizzles[s].swizzle,
+							  pitch, 0, 0,
+							  pitch, height);
+			read = now() - start;
+
+			printf("%-6s swizzle %-8s tile %8.1f MB/s   "
+			       "untile %8.1f MB/s\n",
+			       tilings[t].name, swizzles[s].name,
+			       size * iterations / write / 1e6,
+			       size * iterations / read / 1e6);
+		}
+	}
+
+	free(tiled);
+	free(linear);
+}
+
+int
+main(int argc, char **argv)
+{
+	unsigned int t, s, p;
+	int c, i;
+
+	while ((c = getopt(argc, argv, "b")) != -1) {
+		switch (c) {
+		case 'b':
+			bench();
+			return 0;
+		default:
+			fprintf(stderr, "usage: test_tiling [-b]\n");
+			return 1;
+		}
+	}
+
+	srand(1);
+	check_errors();
+
+	for (t = 0; t < ARRAY_SIZE(tilings); t++) {
+		for (s = 0; s < ARRAY_SIZE(swizzles); s++) {
+			for (p = 0; p < ARRAY_SIZE(tilings[t].pitches); p++) {
+				uint32_t pitch = tilings[t].pitches[p];
+
+				/* The whole surface, then random parts. */
+				check_rect(tilings[t].tiling,
+					   swizzles[s].swizzle, pitch,
+					   0, 0, pitch, ROWS,
+					   tilings[t].name, swizzles[s].name);
+
+				for (i = 0; i < RECTS; i++) {
+					uint32_t x = rand() % pitch;
+					uint32_t y = rand() % ROWS;
+					uint32_t w = rand() % (pitch - x) + 1;
+					uint32_t h = rand() % (ROWS - y) + 1;
+
+					check_rect(tilings[t].tiling,
+						   swizzles[s].swizzle, pitch,
+						   x, y, w, h,
+						   tilings[t].name,
+						   swizzles[s].name);
+				}
+			}
+		}
+	}
+
+	if (failures) {
+		fprintf(stderr, "%d failures\n", failures);
+		return 1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,155 @@
+/*
+ * Copyright © 2013 Intel Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+/*
+ * Measures the bandwidth of drm_intel_memcpy_to_wc() and
+ * drm_intel_memcpy_from_wc() with each implementation the CPU supports.
+ * Copies are between two ordinary allocations, so no GPU is needed; the
+ * results show the cost of the copy loops themselves and of bypassing
+ * the cache, not the WC speedup.  Every copy is also checked.
+ */
+
+#define _GNU_SOURCE
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <time.h>
+#include <err.h>
+
+#include "config.h"
+#include "intel_bufmgr.h"
+
+static const char *impls[] = { "memcpy", "sse2", "sse4.1", "avx2" };
+
+static void
+usage(void)
+{
+	fprintf(stderr, "usage:\n");
+	fprintf(stderr, "  wc_copy_bench [-s size] [-t total] [-o misalign]\n");
+	exit(1);
+}
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double
+bench_copy(void (*copy)(void *, const void *, size_t),
+	   char *dst, const char *src, size_t size, int iterations)
+{
+	double start;
+	int i;
+
+	/* Warm up, and make sure the copy is right. */
+	memset(dst, 0, size);
+	copy(dst, src, size);
+	if (memcmp(dst, src, size) != 0)
+		errx(1, "%s copy of %zu bytes is wrong",
+		     drm_intel_wc_copy_get_impl(), size);
+
+	start = now();
+	for (i = 0; i < iterations; i++)
+		copy(dst, src, size);
+
+	return (double)size * iterations / (now() - start) / 1e6;
+}
+
+int
+main(int argc, char **argv)
+{
+	size_t size = 256 * 1024;
+	size_t total = 1024 * 1024 * 1024;
+	size_t misalign = 0;
+	char *src, *dst;
+	void *ptr;
+	unsigned int i;
+	int iterations;
+	int c;
+
+	while ((c = getopt(argc, argv, "s:t:o:")) != -1) {
+		switch (c) {
+		case 's':
+			size = strtoul(optarg, NULL, 0);
+			break;
+		case 't':
+			total = strtoul(optarg, NULL, 0);
+			break;
+		case 'o':
+			misalign = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			usage();
+		}
+	}
+
+	if (size == 0 || misalign >= 4096)
+		usage();
+
+	iterations = total / size;
+	if (iterations < 1)
+		iterations = 1;
+
+	if (posix_memalign(&ptr, 4096, size + misalign))
+		errx(1, "couldn't allocate %zu bytes", size + misalign);
+	src = ptr;
+	if (posix_memalign(&ptr, 4096, size + misalign))
+		errx(1, "couldn't allocate %zu bytes", size + misalign);
+	dst = ptr;
+
+	for (i = 0; i < size + misalign; i++)
+		src[i] = i * 7 + (i >> 12);
+
+	printf("%zu bytes, misaligned by %zu, default %s\n",
+	       size, misalign, drm_intel_wc_copy_get_impl());
+
+	for (i = 0; i < sizeof(impls) / sizeof(impls[0]); i++) {
+		double to_wc, from_wc;
+
+		if (drm_intel_wc_copy_set_impl(impls[i]) != 0) {
+			printf("%-8s unsupported\n", impls[i]);
+			continue;
+		}
+
+		to_wc = bench_copy(drm_intel_memcpy_to_wc,
+				   dst + misalign, src + misalign,
+				   size, iterations);
+		from_wc = bench_copy(drm_intel_memcpy_from_wc,
+				     dst + misalign, src + misalign,
+				     size, iterations);
+
+		printf("%-8s to_wc %8.1f MB/s   from_wc %8.1f MB/s\n",
+		       impls[i], to_wc, from_wc);
+	}
+
+	free(src);
+	free(dst);
+
+	return 0;
+}